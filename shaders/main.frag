@@ -2,11 +2,14 @@
 
 in vec3 Normal;
 in vec3 WorldPos;
+in vec3 ObjColor;
+flat in uint PickID;
 
-out vec4 FragColor;
+layout (location = 0) out vec4 FragColor;
+// Only backed by a texture in single-pass pick mode (fb_scene_t), otherwise the write is discarded
+layout (location = 1) out uint ObjectID;
 
 uniform vec3 lightpos;
-uniform vec3 objcolor;
 uniform vec3 lightcolor;
 uniform vec3 viewpos;
 uniform float ambientstrength;
@@ -31,6 +34,7 @@ void main()
 	vec3 specular = specularstrength * spec * lightcolor;
 
 // output
-	vec3 result = objcolor * (ambient + diffuse + specular);
+	vec3 result = ObjColor * (ambient + diffuse + specular);
 	FragColor = vec4(result, 1.0f);
+	ObjectID = PickID;
 }
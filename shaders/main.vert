@@ -3,17 +3,74 @@
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 
-uniform mat4 model;
-uniform mat4 view;
+struct instance_t
+{
+	mat3x4 model;
+	vec4 color;
+};
+
+// Every object by dense index, kept up to date by instance_buffer_t::Sync() - layout must match instance_data_t
+layout (std430, binding = 0) readonly buffer InstanceBlock
+{
+	instance_t Instances[];
+};
+
+// Dense index of the object each instance draws - this frame's visible list
+layout (std430, binding = 1) readonly buffer VisibleBlock
+{
+	uint Visible[];
+};
+
+uniform bool instanced;
+uniform int highlight;
+uniform bool selected;
+uniform mat3x4 model;
+uniform mat3x4 view;
 uniform mat4 projection;
+uniform vec3 objcolor;
+uniform uint pickid;
 
 out vec3 Normal;
 out vec3 WorldPos;
+out vec3 ObjColor;
+flat out uint PickID;
 
 void main()
 {
-	gl_Position = vec4(aPos, 1.0) * model * view * projection;
-	WorldPos = vec3(vec4(aPos, 1.0) * model);
+	mat3x4 m = model;
+	int objindex = 0;
+	ObjColor = objcolor;
+	PickID = pickid;
+	bool isselected = selected;
+	if (instanced)
+	{
+		// Each mesh is its own draw in the multi-draw, starting at its run of the visible list
+		int instance = gl_BaseInstance + gl_InstanceID;
+		instance_t inst = Instances[Visible[instance]];
+		m = inst.model;
+		objindex = instance;
+		ObjColor = inst.color.rgb;
+		isselected = inst.color.a > 0.5;
+		// Same packing as pick.frag: PICK_TYPE_GEOMETRY in the top 4 bits, instance ID + 1 below
+		PickID = (1u << 28) | uint(instance + 1);
+	}
+
+	// Marquee selection is tinted blue, and hover still applies on top of it
+	if (isselected)
+	{
+		ObjColor = mix(ObjColor, vec3(0.3, 0.55, 1.0), 0.5);
+	}
+
+	// Hovered object is washed toward white rather than recolored, so it stays recognizable
+	if (objindex == highlight)
+	{
+		ObjColor = mix(ObjColor, vec3(1.0), 0.35);
+	}
+
+	// Model and view are affine (mat3x4): each one maps a point to a vec3, and w is restored before the next
+	WorldPos = vec4(aPos, 1.0) * m;
+	vec3 ViewPos = vec4(WorldPos, 1.0) * view;
+	gl_Position = vec4(ViewPos, 1.0) * projection;
 	// Right now, just cast model to mat3 - implement inverse transpose on CPU if non-uniform scaling/shear support becomes necessary
-	Normal = aNormal * mat3(model);
+	Normal = aNormal * mat3(m);
 }
@@ -1,11 +1,14 @@
 #version 460 core
 
-out vec2 FragColor;
+flat in int InstanceID;
 
-uniform float index;
-uniform float type;
+// Packed as (type << 28) | id - see PICK_TYPE_SHIFT and PICK_ID_MASK in picking.h
+out uint FragColor;
+
+uniform uint type;
 
 void main()
 {
-	FragColor = vec2(index, type);
+	// Offset by one so a cleared texel (0) always means "nothing here"
+	FragColor = (type << 28) | (uint(InstanceID + 1) & 0x0FFFFFFFu);
 }
@@ -2,11 +2,31 @@
 
 layout (location = 0) in vec3 apos;
 
-uniform mat4 model;
-uniform mat4 view;
+struct instance_t
+{
+	mat3x4 model;
+	vec4 color;
+};
+
+// Same buffers the main pass draws from - layout must match instance_data_t
+layout (std430, binding = 0) readonly buffer InstanceBlock
+{
+	instance_t Instances[];
+};
+
+layout (std430, binding = 1) readonly buffer VisibleBlock
+{
+	uint Visible[];
+};
+
+uniform mat3x4 view;
 uniform mat4 projection;
 
+flat out int InstanceID;
+
 void main()
 {
-	gl_Position = vec4(apos, 1.0) * model * view * projection;
+	InstanceID = gl_BaseInstance + gl_InstanceID;
+	vec3 WorldPos = vec4(apos, 1.0) * Instances[Visible[InstanceID]].model;
+	gl_Position = vec4(vec4(WorldPos, 1.0) * view, 1.0) * projection;
 }
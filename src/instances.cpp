@@ -0,0 +1,228 @@
+#include "instances.h"
+
+#include <stdlib.h>
+
+
+static int CompareRangeFirst(const void *a, const void *b)
+{
+	uint32_t fa = ((const geometry_range_t*)a)->First;
+	uint32_t fb = ((const geometry_range_t*)b)->First;
+
+	return (fa > fb) - (fa < fb);
+}
+
+
+int instance_buffer_t::Init()
+{
+	if (SSBO != 0)
+	{
+		printf("System: attempt to reinitialize existing instance buffer. Call Release() first\n");
+		return -1;
+	}
+
+	glGenBuffers(1, &SSBO);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, INSTANCE_INITIAL_CAPACITY * sizeof(instance_data_t), 0x0, GL_DYNAMIC_DRAW);
+
+	glGenBuffers(1, &ListSSBO);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ListSSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, INSTANCE_INITIAL_CAPACITY * sizeof(uint32_t), 0x0, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	Capacity = INSTANCE_INITIAL_CAPACITY;
+	ListCapacity = INSTANCE_INITIAL_CAPACITY;
+	Count = 0;
+
+	return 0;
+}
+
+
+void instance_buffer_t::Release()
+{
+	if (SSBO != 0)
+	{
+		glDeleteBuffers(1, &SSBO);
+	}
+	if (ListSSBO != 0)
+	{
+		glDeleteBuffers(1, &ListSSBO);
+	}
+
+	Slot.Release();
+	InstanceOf.Release();
+	MeshFirst.Release();
+	MeshInstances.Release();
+	Data.Release();
+
+	SSBO = 0;
+	ListSSBO = 0;
+	Capacity = 0;
+	ListCapacity = 0;
+	Count = 0;
+}
+
+
+// Bring the mirror up to date with the store's change journal: sort and merge the journaled ranges, rebuild
+// those objects' instance data, and send each merged range with one glBufferSubData. Empties the journal
+void instance_buffer_t::Sync(geometry_state_t *State, const chunked_array_t<uint8_t> &Selected)
+{
+	UploadBytes = 0;
+	UploadRanges = 0;
+
+	if (Data.Reserve(State->Count) != 0)
+	{
+		// The journal is left as it is, so the copy is tried again next frame
+		printf("System: instance mirror failed to grow\n");
+		return;
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, SSBO);
+
+	// Reallocating throws the old contents away, so everything goes up again. Like the CPU side, the buffer
+	// grows to the packed array's capacity rather than the exact count
+	if (State->Count > Capacity)
+	{
+		Capacity = Data.Capacity;
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)Capacity * sizeof(instance_data_t), 0x0, GL_DYNAMIC_DRAW);
+		State->ClearChanges();
+		State->MarkChanged(0, State->Count);
+	}
+
+	// Out of frame scratch: fall back to one range over everything
+	uint32_t n = State->JournalCount;
+	geometry_range_t all = { 0, State->Count };
+	geometry_range_t *ranges = FrameScratch.PushArray<geometry_range_t>(n);
+	if (!ranges)
+	{
+		ranges = &all;
+		n = (n > 0) ? 1 : 0;
+	}
+	else
+	{
+		memcpy(ranges, State->Journal.Data, n * sizeof(geometry_range_t));
+		qsort(ranges, n, sizeof(geometry_range_t), CompareRangeFirst);
+	}
+
+	uint32_t i = 0;
+	while (i < n)
+	{
+		uint32_t first = ranges[i].First;
+		uint32_t end = first + ranges[i].Length;
+		for (i++; i < n && ranges[i].First <= end + INSTANCE_MERGE_GAP; i++)
+		{
+			uint32_t next = ranges[i].First + ranges[i].Length;
+			end = (next > end) ? next : end;
+		}
+
+		// Ranges journaled before a free can reach past the objects that are left
+		end = (end < State->Count) ? end : State->Count;
+		if (first >= end)
+		{
+			continue;
+		}
+
+		for (uint32_t s = first; s < end; s++)
+		{
+			const uMATH::vec3f_t &color = State->Color[s];
+			Data[s].Model = State->Model[s];
+			Data[s].Color = { color.x, color.y, color.z, Selected[State->Ids[s]] ? 1.0f : 0.0f };
+		}
+
+		uint64_t bytes = (uint64_t)(end - first) * sizeof(instance_data_t);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, (GLintptr)first * sizeof(instance_data_t), (GLsizeiptr)bytes, &Data[first]);
+		UploadBytes += bytes;
+		UploadRanges++;
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	State->ClearChanges();
+}
+
+
+// Take the listed slots (the visible list from culling) as this frame's instances, grouped by mesh with a
+// counting sort so each mesh is one run. The list only goes to the GPU when it differs from the last one, so
+// a still camera over a settled scene sends nothing
+void instance_buffer_t::Upload(const geometry_state_t &State, const uint32_t *List, uint32_t ListCount, uint32_t Meshes)
+{
+	Meshes = (Meshes > 0) ? Meshes : 1;
+	if (Slot.Reserve(ListCount) != 0 || InstanceOf.Reserve(State.Count) != 0 || MeshFirst.Reserve(Meshes) != 0 ||
+		MeshInstances.Reserve(Meshes) != 0)
+	{
+		printf("System: instance buffer failed to grow\n");
+		Count = 0;
+		return;
+	}
+
+	for (uint32_t m = 0; m < Meshes; m++)
+	{
+		MeshInstances[m] = 0;
+	}
+	for (uint32_t v = 0; v < ListCount; v++)
+	{
+		uint32_t m = State.Mesh[List[v]];
+		MeshInstances[(m < Meshes) ? m : MESH_CUBE]++;
+	}
+
+	uint32_t first = 0;
+	for (uint32_t m = 0; m < Meshes; m++)
+	{
+		MeshFirst[m] = first;
+		first += MeshInstances[m];
+	}
+
+	bool ListChanged = ListCount != Count;
+
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		InstanceOf[i] = INSTANCE_NONE;
+	}
+
+	// MeshFirst doubles as each run's write cursor, and is wound back once every instance is placed
+	for (uint32_t v = 0; v < ListCount; v++)
+	{
+		uint32_t i = List[v];
+		uint32_t m = State.Mesh[i];
+		uint32_t n = MeshFirst[(m < Meshes) ? m : MESH_CUBE]++;
+		ListChanged |= Slot[n] != i;
+
+		Slot[n] = i;
+		InstanceOf[i] = n;
+	}
+	for (uint32_t m = 0; m < Meshes; m++)
+	{
+		MeshFirst[m] -= MeshInstances[m];
+	}
+	Count = ListCount;
+
+	// A free moves a different object into the freed index without the list itself changing
+	bool Changed = ListChanged || State.Revision != StateRevision;
+	StateRevision = State.Revision;
+	if (Changed)
+	{
+		Revision++;
+	}
+
+	if (!ListChanged || Count == 0)
+	{
+		return;
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ListSSBO);
+	if (Count > ListCapacity)
+	{
+		ListCapacity = Slot.Capacity;
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)ListCapacity * sizeof(uint32_t), 0x0, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, Count * sizeof(uint32_t), Slot.Data);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	UploadBytes += (uint64_t)Count * sizeof(uint32_t);
+	UploadRanges++;
+}
+
+
+void instance_buffer_t::Bind()
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_SSBO_BINDING, SSBO);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_LIST_BINDING, ListSSBO);
+}
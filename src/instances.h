@@ -0,0 +1,71 @@
+#ifndef MBOX_INSTANCES_H
+#define MBOX_INSTANCES_H
+
+
+#include "../vendor/glad/glad.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util/u_math.h"
+#include "util/u_mem.h"
+#include "meshes.h"
+
+
+#define INSTANCE_SSBO_BINDING 0
+#define INSTANCE_LIST_BINDING 1
+#define INSTANCE_NONE 0xFFFFFFFF
+// Objects (and visible list entries) the GPU buffers start with room for. They are reallocated larger whenever
+// an upload outgrows them
+#define INSTANCE_INITIAL_CAPACITY GEOMETRY_CHUNK_SIZE
+// Journaled ranges this close together are sent as one transfer - re-sending a few unchanged objects costs
+// less than another call
+#define INSTANCE_MERGE_GAP 32
+
+
+// Mirrors the std430 layout of InstanceBlock in the shaders - any change here has to be made there as well.
+// Color.w is 1 for objects in the marquee selection and 0 otherwise
+struct instance_data_t
+{
+	uMATH::aff3f_t Model;
+	uMATH::vec4f_t Color;
+};
+
+
+// GPU mirror of every object's instance data, indexed by dense index, plus the list of objects that survived
+// culling this frame. The mirror is only written where the store's change journal says something changed;
+// the visible list is the only per-frame upload, at 4 bytes an object, and only when it differs from the last.
+// Instance N draws object Slot[N], and InstanceOf maps the other way (INSTANCE_NONE for culled objects).
+// Instances are grouped by mesh, so mesh M is drawn by the run [MeshFirst[M], MeshFirst[M] + MeshInstances[M]).
+// Revision is bumped whenever that mapping changes, so pick results drawn against an older layout can be
+// recognized
+struct instance_buffer_t
+{
+	uint32_t SSBO;
+	uint32_t Capacity;
+	uint32_t ListSSBO;
+	uint32_t ListCapacity;
+	uint32_t Count;
+	uint32_t Revision;
+	uint32_t StateRevision;
+	packed_array_t<uint32_t> Slot;
+	chunked_array_t<uint32_t> InstanceOf;
+	packed_array_t<uint32_t> MeshFirst;
+	packed_array_t<uint32_t> MeshInstances;
+	// CPU side of the mirror - transfers are copied out of here
+	packed_array_t<instance_data_t> Data;
+
+	// Sent to the GPU by the last Sync() and Upload()
+	uint64_t UploadBytes;
+	uint32_t UploadRanges;
+
+	int Init();
+	void Release();
+	// Selected is indexed by object ID
+	void Sync(geometry_state_t *State, const chunked_array_t<uint8_t> &Selected);
+	// Meshes is how many meshes the registry holds - objects naming any other ID are grouped with the cube
+	void Upload(const geometry_state_t &State, const uint32_t *List, uint32_t ListCount, uint32_t Meshes);
+	void Bind();
+};
+
+
+#endif
@@ -10,6 +10,7 @@
 #include "window.h"
 #include "util/u_math.h"
 #include "util/u_mem.h"
+#include "util/u_phys.h"
 
 
 #define SCREEN_X_DIM_DEFAULT 1000.0f
@@ -19,6 +20,15 @@
 void FrameResizeCallback(GLFWwindow* Window, int width, int height);
 void MousePosCallback(GLFWwindow* Window, double mx, double my);
 void ProcessInput(GLFWwindow* Window);
+void IssuePickReads(window_handler_t* WinHND, uint32_t FBO, GLenum Attachment, uint32_t X, uint32_t Y);
+void ResolvePick(window_handler_t* WinHND, const pick_result_t& Result);
+void ApplyPick(window_handler_t* WinHND, uint32_t Tag, uint32_t Slot);
+void CPUPick(window_handler_t* WinHND);
+void MarqueeSelect(window_handler_t* WinHND);
+void ClearSelection(window_handler_t* WinHND);
+void PruneSelection(window_handler_t* WinHND);
+void UndoEdit(window_handler_t* WinHND);
+void RedoEdit(window_handler_t* WinHND);
 void GenerateInterfaceElements(window_handler_t* WinHND, bool* HelpWindow, bool* DemoWindow);
 
 #ifdef DEBUG
@@ -35,9 +45,15 @@ MessageCallback(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei
 uint8_t NKeyWasDown;
 uint8_t RKeyWasDown;
 uint8_t PKeyWasDown;
+uint8_t ZKeyWasDown;
+uint8_t YKeyWasDown;
 uint8_t LMouseWasDown;
 uint8_t RMouseWasDown;
 
+unsigned int instanced_uni;
+unsigned int highlight_uni;
+unsigned int selected_uni;
+unsigned int pickid_uni;
 unsigned int model_uni;
 unsigned int view_uni;
 unsigned int viewpos_uni;
@@ -79,6 +95,14 @@ int main(void)
 		return -1;
 	}
 
+	// The only OS allocation the program makes - everything below is carved out of this reservation
+
+	if (InitProgramMemory() != 0)
+	{
+		printf("System: Could not reserve program memory\n");
+		return -1;
+	}
+
 	window_handler_t* WinHND = InitWindowHandler(SCREEN_X_DIM_DEFAULT, SCREEN_Y_DIM_DEFAULT);
 	if (!WinHND)
 	{
@@ -113,50 +137,7 @@ int main(void)
 		return -1;
 	}
 
-	// Initialize mesh data and positions
-
-	float CubeMesh[] = {
-		-0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
-		0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
-		0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
-		0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
-		-0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
-		-0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,
-
-		-0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,
-		0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,
-		-0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,
-		-0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,
-
-		-0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,
-		-0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,
-		-0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,
-		-0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,
-		-0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,
-		-0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,
-
-		0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,
-		0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,
-		0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,
-		0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,
-		0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,
-		0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,
-
-		-0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,
-		0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,
-		0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,
-		0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,
-		-0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,
-		-0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,
-
-		-0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,
-		0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,
-		-0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,
-		-0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f };
+	// Initialize positions
 
 	uMATH::vec3f_t cubePositions[] = {
 		uMATH::vec3f_t{ 0.0f,  0.0f,  0.0f},
@@ -171,7 +152,7 @@ int main(void)
 		uMATH::vec3f_t{-1.3f,  1.0f, -1.5f}
 	};
 
-	// Initialize Core VBO, VAO, Render passes
+	// Initialize mesh registry, Render passes
 
 #ifdef DEBUG
 	glEnable(GL_DEBUG_OUTPUT);
@@ -179,22 +160,15 @@ int main(void)
 	glDebugMessageCallback(MessageCallback, 0);
 #endif
 
-	unsigned int VBO;
-	glGenBuffers(1, &VBO);
-	unsigned int VAO;
-	glGenVertexArrays(1, &VAO);
-
-	glBindVertexArray(VAO);
-	glBindBuffer(GL_ARRAY_BUFFER, VBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(CubeMesh), CubeMesh, GL_STATIC_DRAW);
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 6*sizeof(float), (void*)(3 * sizeof(float)));
-	glEnableVertexAttribArray(1);
-	glBindVertexArray(0);
+	int success = WinHND->Meshes.Init();
+	if (success != 0)
+	{
+		printf("System: Failed to initialize mesh registry\n");
+		return -1;
+	}
 
 	shader_info_t MainPassParams = {};
-	int success = MainPassParams.Init("../shaders/main.vert",0,0,0,"../shaders/main.frag",0);
+	success = MainPassParams.Init("../shaders/main.vert",0,0,0,"../shaders/main.frag",0);
 	if (success != 0)
 	{
 		printf("System: Failed to initialize main pass shader parameters\n");
@@ -207,6 +181,10 @@ int main(void)
 		return -1;
 	}
 
+	instanced_uni = glGetUniformLocation(WinHND->MainShader.ID, "instanced");
+	highlight_uni = glGetUniformLocation(WinHND->MainShader.ID, "highlight");
+	selected_uni = glGetUniformLocation(WinHND->MainShader.ID, "selected");
+	pickid_uni = glGetUniformLocation(WinHND->MainShader.ID, "pickid");
 	model_uni = glGetUniformLocation(WinHND->MainShader.ID, "model");
 	view_uni = glGetUniformLocation(WinHND->MainShader.ID, "view");
 	viewpos_uni = glGetUniformLocation(WinHND->MainShader.ID, "viewpos");
@@ -216,13 +194,43 @@ int main(void)
 	lightcolor_uni = glGetUniformLocation(WinHND->MainShader.ID, "lightcolor");
 	ambistrgth_uni = glGetUniformLocation(WinHND->MainShader.ID, "ambientstrength");
 
-	success = WinHND->PickPass.Init(WinHND->Width, WinHND->Height);
+	success = WinHND->Instances.Init();
+	if (success != 0)
+	{
+		printf("System: Failed to initialize instance buffer\n");
+		return -1;
+	}
+
+	// The main thread solves islands alongside the workers, so it keeps a core of its own
+	uint32_t Cores = HardwareThreadCount();
+	success = WinHND->Workers.Init(Cores > 1 ? Cores - 1 : 0);
+	if (success != 0)
+	{
+		printf("System: Failed to initialize worker threads\n");
+		return -1;
+	}
+
+	success = WinHND->Undo.Init(UNDO_RING_SIZE);
+	if (success != 0)
+	{
+		printf("System: Failed to initialize undo history\n");
+		return -1;
+	}
+
+	success = WinHND->PickPass.Init(PICK_REGION_DIM, PICK_REGION_DIM);
 	if (success != 0)
 	{
 		printf("System: Failed to initialize pick pass framebuffer\n");
 		return -1;
 	}
 
+	success = WinHND->PickReads.Init();
+	if (success != 0)
+	{
+		printf("System: Failed to initialize pick readback buffers\n");
+		return -1;
+	}
+
 	shader_info_t PickPassParams = {};
 	success = PickPassParams.Init("../shaders/pick.vert",0,0,0,"../shaders/pick.frag",0);
 	if (success != 0)
@@ -237,42 +245,42 @@ int main(void)
 		return -1;
 	}
 
-	unsigned int pickingmodel_uni = glGetUniformLocation(WinHND->PickShader.ID, "model");
 	unsigned int pickingview_uni = glGetUniformLocation(WinHND->PickShader.ID, "view");
 	unsigned int pickingprojection_uni = glGetUniformLocation(WinHND->PickShader.ID, "projection");
-	unsigned int pickingindex_uni = glGetUniformLocation(WinHND->PickShader.ID, "index");
 	unsigned int pickingtype_uni = glGetUniformLocation(WinHND->PickShader.ID, "type");
 
 	// Initialize first-frame data
 
-	uMATH::mat4f_t GeometryModel = {};
-	geometry_create_info_t CreateInfo;
+	geometry_create_info_t CreateInfo = {};
 	CreateInfo.Scale = 1.0f;
 	CreateInfo.Intensity = 0.5f;
 	CreateInfo.Color = { 1.0f, 0.5f, 0.31f };
+	CreateInfo.RotationAxis = { 1.0f, 0.3f, 0.5f };
 
 	for (int i = 0; i < 10; i++)
 	{
-		float angle = 20.0f * i;
-		uMATH::vec3f_t rVec = { 1.0f, 0.3f, 0.5f };
-		SetTransform(&GeometryModel);
-
-		uMATH::Scale(&GeometryModel, CreateInfo.Scale);
-		uMATH::MatrixRotate(&GeometryModel, angle, rVec);
-		uMATH::Translate(&GeometryModel, cubePositions[i]);
-
-		CreateInfo.Model = GeometryModel;
+		CreateInfo.RotationAngle = 20.0f * i;
+		CreateInfo.SetRotationFromAxisAngle();
+		CreateInfo.Position = cubePositions[i];
+		CreateInfo.Mesh = i % MESH_PRIMITIVE_COUNT;
 		WinHND->GeometryObjects.Alloc(CreateInfo);
 	}
 
+	// Only the transform components were filled in above - build every model matrix in one batch
+	WinHND->GeometryObjects.ComposeModels(0, WinHND->GeometryObjects.Count);
+
 	uMATH::SetFrustumHFOV(&WinHND->Projection, 45.0f, SCREEN_X_DIM_DEFAULT / SCREEN_Y_DIM_DEFAULT, 0.1f, 100.0f);
 
-	uMATH::mat4f_t Model = {};
+	uMATH::aff3f_t Model = {};
 	uMATH::vec3f_t LightPosition = { 1.2f, 1.0f, 2.0f };
 	float lightScale = 0.2f;
 
 	float CurrFrameTime = 0;
 
+	// Anything the arena asks of the OS from here on is growth past the startup commit
+	WinHND->Stats.StartupOSCalls = ProgramArena.OSReserveCount + ProgramArena.OSCommitCount;
+	WinHND->Stats.OSCalls = WinHND->Stats.StartupOSCalls;
+
 	glEnable(GL_DEPTH_TEST);
 	int RenderMode = GL_TRIANGLES;
 	glPolygonMode(GL_FRONT_AND_BACK,GL_FILL);
@@ -283,6 +291,22 @@ int main(void)
 	bool DemoWindow = false;
 	while (!glfwWindowShouldClose(Window))
 	{
+		// Everything pushed to frame scratch two frames ago is dead by now
+
+		FrameScratch.BeginFrame();
+
+#ifdef DEBUG
+		// Steady-state frames must never reach the OS. A commit is only expected while the scene grows past
+		// anything it held before, so report every one, with the object count that needed it
+		uint32_t OSCalls = ProgramArena.OSReserveCount + ProgramArena.OSCommitCount;
+		if (OSCalls > WinHND->Stats.OSCalls)
+		{
+			printf("System: arena went back to the OS %u times last frame (%u since startup, %u objects, %.0f MB committed)\n",
+				OSCalls - WinHND->Stats.OSCalls, OSCalls - WinHND->Stats.StartupOSCalls, WinHND->GeometryObjects.Count,
+				ProgramArena.Committed / 1048576.0);
+			WinHND->Stats.OSCalls = OSCalls;
+		}
+#endif
 
 		// Handle user input
 
@@ -300,36 +324,138 @@ int main(void)
 
 		//Render passes
 
-		// Mouse Picking Pass
+		// Only one of the two pick targets exists at a time - swap them over when the UI changes mode
+		if (WinHND->PickMethod == PICK_METHOD_SINGLE_PASS && WinHND->ScenePass.FBO == 0)
+		{
+			WinHND->PickPass.Release();
+			WinHND->ScenePass.Init(WinHND->Width, WinHND->Height);
+		}
+		else if (WinHND->PickMethod != PICK_METHOD_SINGLE_PASS && WinHND->PickPass.FBO == 0)
+		{
+			WinHND->ScenePass.Release();
+			WinHND->PickPass.Init(PICK_REGION_DIM, PICK_REGION_DIM);
+		}
+
+		// Rigid-body simulation - as many fixed steps as the time since last frame covers. Poses are written
+		// straight back into the object store, so everything below already sees them
 
-		glBindVertexArray(VAO);
+		if (WinHND->Simulate)
+		{
+			float SimStart = glfwGetTime();
+			WinHND->Stats.SimSteps = WinHND->Rigid.Advance(&WinHND->GeometryObjects, &WinHND->Overlaps, &WinHND->Workers, WinHND->DeltaTime);
+			if (WinHND->Stats.SimSteps > 0)
+			{
+				WinHND->Stats.Record(&WinHND->Stats.SimTime, glfwGetTime() - SimStart);
+			}
+		}
 
-		WinHND->PickPass.Bind_W();
+		// Children follow whatever moved their parents this frame - the simulation above or an edit. This reads the
+		// store's change journal, so it has to run before the instance upload clears it
 
-		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-		WinHND->PickShader.Use();
+		float HierStart = glfwGetTime();
+		WinHND->Hierarchy.Update(&WinHND->GeometryObjects);
+		WinHND->Stats.HierarchyUpdated = WinHND->Hierarchy.Updated;
+		WinHND->Stats.Record(&WinHND->Stats.HierarchyTime, glfwGetTime() - HierStart);
 
-		glUniformMatrix4fv(pickingprojection_uni, 1, GL_FALSE, &WinHND->Projection.m[0][0]);
-		glUniformMatrix4fv(pickingview_uni, 1, GL_FALSE, &WinHND->View.m[0][0]);
+		// The grid follows the same journal. While it answers picks or the edited object's neighbour query, keep it
+		// in step before the upload clears the journal, or its next query has to look at every object. The BVH
+		// refits from the models instead, so CPUPick brings it up to date only when it is asked
 
-		for (unsigned int i = 0; i < WinHND->GeometryObjects.Position; i++)
+		if (WinHND->PickMethod == PICK_METHOD_CPU_GRID || WinHND->ActiveSelection)
 		{
-			if (WinHND->GeometryObjects.Visible[i] == VIS_STATUS_FREED)
-			{
-				continue;
-			}
+			WinHND->Grid.Update(WinHND->GeometryObjects);
+		}
+
+		// Frustum culling - everything below (instance buffer, pick pass, per-object loop) only sees the visible list
+
+		float CullStart = glfwGetTime();
+		uMATH::frustum_t Frustum;
+		uMATH::ExtractFrustumPlanes(WinHND->Projection * uMATH::ToM4(WinHND->View), &Frustum);
+		WinHND->VisibleCount = 0;
+		WinHND->VisibleList = FrameScratch.PushArray<uint32_t>(WinHND->GeometryObjects.Count);
+		if (WinHND->VisibleList)
+		{
+			WinHND->VisibleCount = WinHND->GeometryObjects.CullFrustum(Frustum, WinHND->VisibleList);
+		}
+		WinHND->Stats.Record(&WinHND->Stats.CullTime, glfwGetTime() - CullStart);
+		WinHND->Stats.Visible = WinHND->VisibleCount;
+		WinHND->Stats.Culled = WinHND->GeometryObjects.Count - WinHND->VisibleCount;
+
+		// Overlap detection between every pair of live objects, visible or not. Every simulation step already ran
+		// it, so a frame that stepped keeps the last step's pairs, and one where nothing changed costs nothing
+
+		if (!WinHND->Simulate || WinHND->Stats.SimSteps == 0)
+		{
+			float OverlapStart = glfwGetTime();
+			WinHND->Overlaps.Update(WinHND->GeometryObjects);
+			WinHND->Stats.Record(&WinHND->Stats.OverlapTime, glfwGetTime() - OverlapStart);
+		}
+
+		// The selection holds handles, so objects freed since it was made simply drop out of it
+
+		if (WinHND->SelectionCount > 0 && WinHND->SelectionRevision != WinHND->GeometryObjects.Revision)
+		{
+			PruneSelection(WinHND);
+		}
+
+		// Both the pick pass and the instanced object pass draw from the instance mirror through this frame's
+		// visible list. Only objects the change journal names are copied into the mirror
+
+		WinHND->Selected.Reserve(WinHND->GeometryObjects.IdCount);
+		WinHND->Instances.Sync(&WinHND->GeometryObjects, WinHND->Selected);
+		WinHND->Instances.Upload(WinHND->GeometryObjects, WinHND->VisibleList, WinHND->VisibleCount, WinHND->Meshes.Count);
+		WinHND->Stats.UploadBytes = WinHND->Instances.UploadBytes;
+		WinHND->Stats.UploadRanges = WinHND->Instances.UploadRanges;
+		WinHND->Instances.Bind();
+
+		WinHND->Meshes.Bind();
+
+		// CPU picking answers requests right here with a ray cast, so no pick pass or readback is needed at all
+
+		bool CPUPickMethod = WinHND->PickMethod == PICK_METHOD_CPU_BVH || WinHND->PickMethod == PICK_METHOD_CPU_SIMD
+			|| WinHND->PickMethod == PICK_METHOD_CPU_GRID;
+		if (CPUPickMethod && WinHND->PickRequest.Flags)
+		{
+			CPUPick(WinHND);
+		}
+
+		// Mouse Picking Pass - only runs on frames where input asked for a pick, and only covers the few pixels
+		// under the cursor: the projection is narrowed so that region fills the whole (tiny) pick target
+
+		bool PickPassRan = false;
+		if (WinHND->PickMethod == PICK_METHOD_PASS && WinHND->PickRequest.Flags)
+		{
+			uMATH::mat4f_t PickProjection = {};
+			uMATH::SetPickRegion(&PickProjection, WinHND->PickRequest.X + 0.5f, WinHND->PickRequest.Y + 0.5f,
+				PICK_REGION_DIM, PICK_REGION_DIM, WinHND->Width, WinHND->Height);
+			PickProjection = PickProjection * WinHND->Projection;
 
-			glUniform1f(pickingindex_uni, float(i + 1));
-			glUniform1f(pickingtype_uni, float(1));
+			WinHND->PickPass.Bind_W();
+			glViewport(0, 0, PICK_REGION_DIM, PICK_REGION_DIM);
 
-			glUniformMatrix4fv(pickingmodel_uni, 1, GL_FALSE, &WinHND->GeometryObjects.Model[i].m[0][0]);
-			glDrawArrays(RenderMode, 0, 36);
+			WinHND->PickPass.Clear();
+			WinHND->PickShader.Use();
+
+			glUniformMatrix4fv(pickingprojection_uni, 1, GL_FALSE, &PickProjection.m[0][0]);
+			glUniformMatrix3x4fv(pickingview_uni, 1, GL_FALSE, &WinHND->View.m[0][0]);
+			glUniform1ui(pickingtype_uni, PICK_TYPE_GEOMETRY);
+
+			WinHND->Meshes.DrawInstanced(RenderMode, WinHND->Instances.MeshFirst.Data, WinHND->Instances.MeshInstances.Data);
+
+			glViewport(0, 0, WinHND->Width, WinHND->Height);
+			WinHND->PickPass.Unbind_W();
+
+			IssuePickReads(WinHND, WinHND->PickPass.FBO, GL_COLOR_ATTACHMENT0, PICK_REGION_DIM / 2, PICK_REGION_DIM / 2);
+			PickPassRan = true;
 		}
 
-		WinHND->PickPass.Unbind_W();
+		// Object Geometry Pass - in single-pass mode, this also writes the pick IDs the pass above would have
 
-		// Object Geometry Pass
+		if (WinHND->PickMethod == PICK_METHOD_SINGLE_PASS)
+		{
+			WinHND->ScenePass.Bind_W();
+			WinHND->ScenePass.Clear(0.1f, 0.1f, 0.1f);
+		}
 
 		WinHND->MainShader.Use();
 
@@ -339,27 +465,57 @@ int main(void)
 
 		glUniformMatrix4fv(projection_uni, 1, GL_FALSE, &WinHND->Projection.m[0][0]);
 
-		glUniformMatrix4fv(view_uni, 1, GL_FALSE, &WinHND->View.m[0][0]);
+		glUniformMatrix3x4fv(view_uni, 1, GL_FALSE, &WinHND->View.m[0][0]);
 		glUniform3f(viewpos_uni, WinHND->Camera.Position.x, WinHND->Camera.Position.y, WinHND->Camera.Position.z);
 
-		for (unsigned int i = 0; i < WinHND->GeometryObjects.Position; i++)
+		int RenderPath = WinHND->InstancedRender ? RPATH_INSTANCED : RPATH_PER_OBJECT;
+		float ObjectPassStart = glfwGetTime();
+		WinHND->Stats.DrawCalls = 0;
+		WinHND->Stats.DrawnMeshes = 0;
+
+		if (RenderPath == RPATH_INSTANCED)
 		{
-			if (WinHND->GeometryObjects.Visible[i] == VIS_STATUS_FREED)
+			int HoverInstance = -1;
+			if (WinHND->HoverSlot < WinHND->GeometryObjects.Count)
 			{
-				continue;
+				HoverInstance = (int)WinHND->Instances.InstanceOf[WinHND->HoverSlot];
 			}
 
-			glUniformMatrix4fv(model_uni, 1, GL_FALSE, &WinHND->GeometryObjects.Model[i].m[0][0]);
-			glUniform3fv(objcolor_uni, 1, &WinHND->GeometryObjects.Color[i].x);
-			glDrawArrays(RenderMode, 0, 36);
+			glUniform1i(instanced_uni, 1);
+			glUniform1i(highlight_uni, HoverInstance);
+			// Every mesh's run of instances goes out in the one multi-draw
+			WinHND->Stats.DrawnMeshes = WinHND->Meshes.DrawInstanced(RenderMode, WinHND->Instances.MeshFirst.Data, WinHND->Instances.MeshInstances.Data);
+			glUniform1i(instanced_uni, 0);
+			WinHND->Stats.DrawCalls++;
+		}
+		else
+		{
+			for (unsigned int v = 0; v < WinHND->VisibleCount; v++)
+			{
+				uint32_t i = WinHND->VisibleList[v];
+
+				glUniform1i(highlight_uni, (i == WinHND->HoverSlot) ? 0 : -1);
+				glUniform1i(selected_uni, WinHND->Selected[WinHND->GeometryObjects.Ids[i]]);
+				glUniform1ui(pickid_uni, (PICK_TYPE_GEOMETRY << PICK_TYPE_SHIFT) | (WinHND->Instances.InstanceOf[i] + 1));
+				glUniformMatrix3x4fv(model_uni, 1, GL_FALSE, &WinHND->GeometryObjects.Model[i].m[0][0]);
+				glUniform3fv(objcolor_uni, 1, &WinHND->GeometryObjects.Color[i].x);
+				WinHND->Meshes.Draw(RenderMode, WinHND->GeometryObjects.Mesh[i]);
+				WinHND->Stats.DrawCalls++;
+			}
 		}
 
+		WinHND->Stats.Record(&WinHND->Stats.ObjectPassTime[RenderPath], glfwGetTime() - ObjectPassStart);
+
+		glUniform1i(highlight_uni, -1);
+		glUniform1i(selected_uni, 0);
+		glUniform1ui(pickid_uni, 0);
+
 		if (WinHND->ActiveSelection)
 		{
-			WinHND->Active.ComposeModelM4();
-			glUniformMatrix4fv(model_uni, 1, GL_FALSE, &WinHND->Active.Model.m[0][0]);
+			WinHND->Active.ComposeModel();
+			glUniformMatrix3x4fv(model_uni, 1, GL_FALSE, &WinHND->Active.Model.m[0][0]);
 			glUniform3fv(objcolor_uni, 1, &WinHND->Active.Color.x);
-			glDrawArrays(RenderMode, 0, 36);
+			WinHND->Meshes.Draw(RenderMode, WinHND->Active.Mesh);
 		}
 
 		// Light Geometry Pass
@@ -369,12 +525,22 @@ int main(void)
 		SetTransform(&Model);
 		uMATH::Scale(&Model, lightScale);
 		uMATH::Translate(&Model, LightPosition);
-		glUniformMatrix4fv(model_uni, 1, GL_FALSE, &Model.m[0][0]);
-		glDrawArrays(RenderMode, 0, 36);
+		glUniformMatrix3x4fv(model_uni, 1, GL_FALSE, &Model.m[0][0]);
+		WinHND->Meshes.Draw(RenderMode, MESH_CUBE);
 
 		glBindVertexArray(0);
 		glUseProgram(0);
 
+		if (WinHND->PickMethod == PICK_METHOD_SINGLE_PASS)
+		{
+			WinHND->ScenePass.Unbind_W();
+			if (WinHND->PickRequest.Flags)
+			{
+				IssuePickReads(WinHND, WinHND->ScenePass.FBO, GL_COLOR_ATTACHMENT1, WinHND->PickRequest.X, WinHND->PickRequest.Y);
+			}
+			WinHND->ScenePass.Blit();
+		}
+
 		// Blit, parse inter-frame data
 
 		ImGui::Render();
@@ -387,17 +553,38 @@ int main(void)
 		CurrFrameTime = glfwGetTime();
 		WinHND->DeltaTime = CurrFrameTime - WinHND->PrevFrameTime;
 		WinHND->PrevFrameTime = CurrFrameTime;
+		WinHND->Stats.Record(&WinHND->Stats.FrameTime[RenderPath], WinHND->DeltaTime);
+		WinHND->Stats.CountFrame(CurrFrameTime, PickPassRan);
 	}
 
 	// Free resources and exit - not technically necessary when this is the end of the program, but future-proofs for mutlithreading or other integrations
 
+	WinHND->Workers.Release();
+	WinHND->Instances.Release();
+	WinHND->Meshes.Release();
+	WinHND->Rigid.Release();
+	WinHND->Overlaps.Release();
+	WinHND->Hierarchy.Release();
+	WinHND->Grid.Release();
+	WinHND->Bvh.Release();
+	WinHND->SelectionList.Release();
+	WinHND->Selected.Release();
+	WinHND->GeometryObjects.Release();
+	WinHND->PickReads.Release();
+	for (uint32_t i = 0; i < PICK_QUERY_RING_SIZE; i++)
+	{
+		WinHND->PickLayout[i].Release();
+	}
+	WinHND->PickPass.Release();
+	WinHND->ScenePass.Release();
+
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
 
 	glfwTerminate();
-	free(WinHND);
 	WinHND = 0x0;
+	ReleaseProgramMemory();
 
 	return 0;
 }
@@ -412,8 +599,12 @@ void FrameResizeCallback(GLFWwindow *Window, int width, int height)
 
 	// Also resize camera frustum and attached framebuffers
 	uMATH::SetFrustumHFOV(&WinHND->Projection, 45.0f, width / height, 0.1f, 100.0f);
-	WinHND->PickPass.Release();
-	WinHND->PickPass.Init(width, height);
+	// The separate pick pass renders into a fixed-size region target, only the single-pass target tracks the window
+	if (WinHND->PickMethod == PICK_METHOD_SINGLE_PASS)
+	{
+		WinHND->ScenePass.Release();
+		WinHND->ScenePass.Init(width, height);
+	}
 
 	glViewport(0,0,width,height);
 }
@@ -423,6 +614,13 @@ void ProcessInput(GLFWwindow *Window)
 {
 	window_handler_t* WinHND = (window_handler_t*)glfwGetWindowUserPointer(Window);
 
+	// Apply any pick results the GPU has finished since last frame, before input can queue new ones
+	pick_result_t PickResult;
+	while (WinHND->PickReads.Poll(&PickResult))
+	{
+		ResolvePick(WinHND, PickResult);
+	}
+
 	// Check if the UI should be pulling focus
 	if (WinHND->ImIO.WantCaptureKeyboard)
 	{
@@ -456,6 +654,10 @@ void ProcessInput(GLFWwindow *Window)
 		if (PKeyWasDown || WinHND->ReloadShaders)
 		{
 			WinHND->MainShader.Rebuild();
+			instanced_uni = glGetUniformLocation(WinHND->MainShader.ID, "instanced");
+			highlight_uni = glGetUniformLocation(WinHND->MainShader.ID, "highlight");
+			selected_uni = glGetUniformLocation(WinHND->MainShader.ID, "selected");
+			pickid_uni = glGetUniformLocation(WinHND->MainShader.ID, "pickid");
 			model_uni = glGetUniformLocation(WinHND->MainShader.ID, "model");
 			view_uni = glGetUniformLocation(WinHND->MainShader.ID, "view");
 			viewpos_uni = glGetUniformLocation(WinHND->MainShader.ID, "viewpos");
@@ -480,42 +682,111 @@ void ProcessInput(GLFWwindow *Window)
 			uMATH::vec3f_t p = { 0.0f,0.0f,4.5f };
 			WinHND->Active.Model = WinHND->View;
 			uMATH::Translate(&WinHND->Active.Model, p);
-			WinHND->Active.Model = uMATH::InverseM4(WinHND->Active.Model);
-			WinHND->Active.DecomposeModelM4();
+			// View is rigid, so the cheap transpose inverse is exact here
+			WinHND->Active.Model = uMATH::InverseRigidAF(WinHND->Active.Model);
+			WinHND->Active.DecomposeModel();
 			WinHND->Active.New = false;
 			WinHND->ActiveSelection = true;
+			WinHND->ActiveHandle = GEOMETRY_HANDLE_NONE;
 		}
 		NKeyWasDown = 0;
 	}
 
+	// Ctrl+Z / Ctrl+Y, acted on when the letter is released like the other shortcuts
+	bool CtrlDown = glfwGetKey(Window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS || glfwGetKey(Window, GLFW_KEY_RIGHT_CONTROL) == GLFW_PRESS;
+	if (glfwGetKey(Window, GLFW_KEY_Z) == GLFW_PRESS && CtrlDown)
+	{
+		ZKeyWasDown = 1;
+	}
+	if (glfwGetKey(Window, GLFW_KEY_Z) == GLFW_RELEASE)
+	{
+		if (ZKeyWasDown)
+		{
+			UndoEdit(WinHND);
+		}
+		ZKeyWasDown = 0;
+	}
+	if (glfwGetKey(Window, GLFW_KEY_Y) == GLFW_PRESS && CtrlDown)
+	{
+		YKeyWasDown = 1;
+	}
+	if (glfwGetKey(Window, GLFW_KEY_Y) == GLFW_RELEASE)
+	{
+		if (YKeyWasDown)
+		{
+			RedoEdit(WinHND);
+		}
+		YKeyWasDown = 0;
+	}
+
 	// Have to separately check if the UI should be pulling mouse button inputs, as they aren't tracked by WantCaptureKeyboard
+	// A click or drag the UI takes over is abandoned, so its release can't select or marquee later
 	if (WinHND->ImIO.WantCaptureMouse)
 	{
+		WinHND->HoverSlot = INSTANCE_NONE;
+		LMouseWasDown = 0;
+		WinHND->Marquee = false;
 		return;
 	}
 
+	// Picks are only requested here - the render loop runs the pick pass (if any) and issues the readbacks
+	pick_request_t* Req = &WinHND->PickRequest;
+	uint32_t PickX = (uint32_t)WinHND->PrevMouseX;
+	uint32_t PickY = (uint32_t)(WinHND->Height - WinHND->PrevMouseY);
+	bool PickInBounds = WinHND->PrevMouseX >= 0.0 && WinHND->PrevMouseY >= 0.0 && PickX < (uint32_t)WinHND->Width && PickY < (uint32_t)WinHND->Height;
+
+	// Hover only needs a new pick when the cursor, camera, or object set changed since the last one
+	bool HoverStale = PickX != Req->HoverX || PickY != Req->HoverY || WinHND->GeometryObjects.Revision != Req->HoverRevision
+		|| memcmp(&WinHND->View, &Req->HoverView, sizeof(uMATH::aff3f_t)) != 0;
+
+	if (PickInBounds && !RMouseWasDown && HoverStale)
+	{
+		Req->Flags |= PICK_REQUEST_HOVER;
+		Req->X = PickX;
+		Req->Y = PickY;
+		Req->HoverX = PickX;
+		Req->HoverY = PickY;
+		Req->HoverRevision = WinHND->GeometryObjects.Revision;
+		Req->HoverView = WinHND->View;
+	}
+
 	if (glfwGetMouseButton(Window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS)
 	{
+		if (!LMouseWasDown)
+		{
+			WinHND->MarqueeStartX = WinHND->PrevMouseX;
+			WinHND->MarqueeStartY = WinHND->PrevMouseY;
+		}
 		LMouseWasDown = 1;
+
+		if (fabs(WinHND->PrevMouseX - WinHND->MarqueeStartX) > MARQUEE_MIN_DRAG || fabs(WinHND->PrevMouseY - WinHND->MarqueeStartY) > MARQUEE_MIN_DRAG)
+		{
+			WinHND->Marquee = true;
+		}
 	}
 	if (glfwGetMouseButton(Window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_RELEASE)
 	{
-		if(LMouseWasDown)
+		if (LMouseWasDown && WinHND->Marquee)
 		{
-			texel_info_t res = WinHND->PickPass.GetInfo((uint32_t)WinHND->PrevMouseX, (uint32_t)(WinHND->Height - WinHND->PrevMouseY));
-			if (WinHND->ActiveSelection && WinHND->Active.Deleted != true)
+			MarqueeSelect(WinHND);
+			WinHND->Marquee = false;
+		}
+		else if(LMouseWasDown)
+		{
+			ClearSelection(WinHND);
+
+			// Selection is applied by ResolvePick() once the readback lands, usually a frame or two later
+			if (PickInBounds)
 			{
-				WinHND->Active.ComposeModelM4();
-				WinHND->GeometryObjects.Alloc(WinHND->Active);
-				WinHND->ActiveSelection = false;
+				Req->Flags |= PICK_REQUEST_SELECT;
+				Req->X = PickX;
+				Req->Y = PickY;
 			}
-			if (res.ID > 0)
+			else
 			{
-				WinHND->Active.Model = WinHND->GeometryObjects.Model[(int)res.ID - 1];
-				WinHND->Active.Color = WinHND->GeometryObjects.Color[(int)res.ID - 1];
-				WinHND->Active.DecomposeModelM4();
-				WinHND->GeometryObjects.Free((int)res.ID - 1);
-				WinHND->ActiveSelection = true;
+				pick_result_t res = {};
+				res.Tag = PICK_QUERY_SELECT;
+				ResolvePick(WinHND, res);
 			}
 		}
 		LMouseWasDown = 0;
@@ -541,6 +812,329 @@ void ProcessInput(GLFWwindow *Window)
 }
 
 
+// Queue readbacks for this frame's pick requests from a target that has just been drawn
+void IssuePickReads(window_handler_t *WinHND, uint32_t FBO, GLenum Attachment, uint32_t X, uint32_t Y)
+{
+	pick_request_t* Req = &WinHND->PickRequest;
+
+	if (Req->Flags & PICK_REQUEST_SELECT)
+	{
+		// If the ring is full, fall back to a blocking read rather than dropping the click
+		uint32_t entry;
+		if (WinHND->PickReads.Issue(FBO, Attachment, X, Y, PICK_QUERY_SELECT, WinHND->Instances.Revision, &entry))
+		{
+			// Snapshot which object each instance drew, for ResolvePick()
+			instance_buffer_t* Inst = &WinHND->Instances;
+			WinHND->PickLayoutCount[entry] = 0;
+			if (WinHND->PickLayout[entry].Reserve(Inst->Count) == 0)
+			{
+				for (uint32_t n = 0; n < Inst->Count; n++)
+				{
+					WinHND->PickLayout[entry][n] = WinHND->GeometryObjects.Handle(Inst->Slot[n]);
+				}
+				WinHND->PickLayoutCount[entry] = Inst->Count;
+			}
+		}
+		else
+		{
+			pick_result_t res = {};
+			res.Info = ReadPickTexel(FBO, Attachment, X, Y);
+			res.Tag = PICK_QUERY_SELECT;
+			res.Revision = WinHND->Instances.Revision;
+			res.Entry = PICK_QUERY_RING_SIZE;
+			ResolvePick(WinHND, res);
+		}
+	}
+
+	// Hover never takes the last ring entry, so a click can always be queued. When it has to be skipped,
+	// invalidate the cursor position it was requested for so it gets asked for again next frame
+	if (Req->Flags & PICK_REQUEST_HOVER)
+	{
+		bool issued = false;
+		if (WinHND->PickReads.InFlight < PICK_QUERY_RING_SIZE - 1)
+		{
+			uint32_t entry;
+			issued = WinHND->PickReads.Issue(FBO, Attachment, X, Y, PICK_QUERY_HOVER, WinHND->Instances.Revision, &entry);
+		}
+		if (!issued)
+		{
+			Req->HoverX = 0xFFFFFFFF;
+		}
+	}
+
+	Req->Flags = 0;
+}
+
+
+void ResolvePick(window_handler_t *WinHND, const pick_result_t &Result)
+{
+	// Instance IDs are only meaningful against the layout they were drawn with. Upload() rebuilds that
+	// layout every frame, and it changes whenever objects are allocated, freed, or move in or out of view.
+	// Clicks go through the handles snapshotted when they were issued, so they still land on whatever was under
+	// the cursor - unless it has since been freed. Hover is asked again often enough to just drop stale results
+	uint32_t slot = INSTANCE_NONE;
+	if (Result.Info.Type == PICK_TYPE_GEOMETRY && Result.Info.ID > 0)
+	{
+		uint32_t instance = Result.Info.ID - 1;
+		if (Result.Entry < PICK_QUERY_RING_SIZE && Result.Tag == PICK_QUERY_SELECT)
+		{
+			uint32_t picked;
+			if (instance < WinHND->PickLayoutCount[Result.Entry] &&
+				WinHND->GeometryObjects.Resolve(WinHND->PickLayout[Result.Entry][instance], &picked))
+			{
+				slot = picked;
+			}
+		}
+		else if (Result.Revision == WinHND->Instances.Revision && instance < WinHND->Instances.Count)
+		{
+			slot = WinHND->Instances.Slot[instance];
+		}
+	}
+
+	ApplyPick(WinHND, Result.Tag, slot);
+}
+
+
+// Answer this frame's pick requests on the CPU. Hover and select always share the cursor position,
+// so a single ray serves both
+void CPUPick(window_handler_t *WinHND)
+{
+	pick_request_t* Req = &WinHND->PickRequest;
+	geometry_state_t* State = &WinHND->GeometryObjects;
+	float Start = glfwGetTime();
+
+	uMATH::vec3f_t Direction = uPHYS::CastWorldRay(Req->X + 0.5f, Req->Y + 0.5f, *WinHND);
+	uint32_t Slot;
+	float Distance;
+	bool Hit;
+
+	if (WinHND->PickMethod == PICK_METHOD_CPU_BVH)
+	{
+		WinHND->Bvh.Update(*State);
+		Hit = WinHND->Bvh.Raycast(*State, WinHND->Camera.Position, Direction, &Slot, &Distance);
+	}
+	else if (WinHND->PickMethod == PICK_METHOD_CPU_GRID)
+	{
+		WinHND->Grid.Update(*State);
+		Hit = WinHND->Grid.Raycast(*State, WinHND->Camera.Position, Direction, &Slot, &Distance);
+	}
+	else
+	{
+		// One SIMD sweep per chunk, keeping the closest hit across all of them
+		Hit = false;
+		Distance = FLT_MAX;
+		for (uint32_t c = 0; c < State->PosX.ChunkCount; c++)
+		{
+			uint32_t slots = State->ChunkSlots(c);
+			if (slots == 0)
+			{
+				break;
+			}
+
+			uPHYS::obb_soa_t Boxes;
+			Boxes.PosX = State->PosX.Chunks[c];
+			Boxes.PosY = State->PosY.Chunks[c];
+			Boxes.PosZ = State->PosZ.Chunks[c];
+			Boxes.RotX = State->RotX.Chunks[c];
+			Boxes.RotY = State->RotY.Chunks[c];
+			Boxes.RotZ = State->RotZ.Chunks[c];
+			Boxes.RotW = State->RotW.Chunks[c];
+			Boxes.Scale = State->Scale.Chunks[c];
+
+			uint32_t ChunkSlot;
+			float ChunkDistance;
+			if (uPHYS::RaycastOBBs(Boxes, slots, WinHND->Camera.Position, Direction, &ChunkSlot, &ChunkDistance) && ChunkDistance < Distance)
+			{
+				Hit = true;
+				Slot = (c << GEOMETRY_CHUNK_SHIFT) + ChunkSlot;
+				Distance = ChunkDistance;
+			}
+		}
+	}
+
+	if (!Hit)
+	{
+		Slot = INSTANCE_NONE;
+	}
+
+	WinHND->Stats.Record(&WinHND->Stats.CPUPickTime, glfwGetTime() - Start);
+
+	if (Req->Flags & PICK_REQUEST_HOVER)
+	{
+		ApplyPick(WinHND, PICK_QUERY_HOVER, Slot);
+	}
+	if (Req->Flags & PICK_REQUEST_SELECT)
+	{
+		ApplyPick(WinHND, PICK_QUERY_SELECT, Slot);
+	}
+
+	Req->Flags = 0;
+}
+
+
+// Select everything the marquee rectangle touches, straight from the BVH - there is no pick pass or readback
+// involved, so the result is ready before the button release has finished being handled
+void MarqueeSelect(window_handler_t *WinHND)
+{
+	geometry_state_t* State = &WinHND->GeometryObjects;
+	float Start = glfwGetTime();
+
+	// Put an object that is being edited back into the scene first, so it can be selected too
+	ApplyPick(WinHND, PICK_QUERY_SELECT, INSTANCE_NONE);
+
+	// Same pixel coordinates as a pick request (origin at the bottom left), at least one pixel across
+	float x0 = (float)fmin(WinHND->MarqueeStartX, WinHND->PrevMouseX);
+	float x1 = (float)fmax(WinHND->MarqueeStartX, WinHND->PrevMouseX);
+	float y0 = WinHND->Height - (float)fmax(WinHND->MarqueeStartY, WinHND->PrevMouseY);
+	float y1 = WinHND->Height - (float)fmin(WinHND->MarqueeStartY, WinHND->PrevMouseY);
+	x1 = fmaxf(x1, x0 + 1.0f);
+	y1 = fmaxf(y1, y0 + 1.0f);
+
+	uMATH::frustum_t Region;
+	uPHYS::BuildRegionFrustum(x0, y0, x1, y1, *WinHND, &Region);
+
+	ClearSelection(WinHND);
+	if (WinHND->SelectionList.Reserve(State->Count) != 0 || WinHND->Selected.Reserve(State->IdCount) != 0)
+	{
+		return;
+	}
+
+	// The query hands back slots - keep handles to them instead, so later frees can't redirect the selection.
+	// Committing an object patches it back into the tree here
+	float UpdateStart = glfwGetTime();
+	WinHND->Bvh.Update(*State);
+	WinHND->Stats.SelectUpdateTime = glfwGetTime() - UpdateStart;
+	WinHND->SelectionCount = WinHND->Bvh.QueryFrustum(*State, Region, WinHND->SelectionList.Data);
+	for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+	{
+		uint32_t slot = WinHND->SelectionList[i];
+		WinHND->SelectionList[i] = State->Handle(slot);
+		WinHND->Selected[State->Ids[slot]] = 1;
+		State->MarkChanged(slot, 1);
+	}
+	WinHND->SelectionRevision = State->Revision;
+
+	WinHND->Stats.SelectTime = glfwGetTime() - Start;
+}
+
+
+void ClearSelection(window_handler_t *WinHND)
+{
+	for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+	{
+		WinHND->Selected[WinHND->SelectionList[i] & GEOMETRY_HANDLE_INDEX_MASK] = 0;
+
+		// The selection tint lives in the mirrored instance data
+		uint32_t slot;
+		if (WinHND->GeometryObjects.Resolve(WinHND->SelectionList[i], &slot))
+		{
+			WinHND->GeometryObjects.MarkChanged(slot, 1);
+		}
+	}
+
+	WinHND->SelectionCount = 0;
+}
+
+
+// Drop handles to objects freed since the selection was made, keeping the order of the rest
+void PruneSelection(window_handler_t *WinHND)
+{
+	const geometry_state_t &State = WinHND->GeometryObjects;
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+	{
+		geometry_handle_t handle = WinHND->SelectionList[i];
+		uint32_t slot;
+		if (State.Resolve(handle, &slot))
+		{
+			WinHND->SelectionList[n++] = handle;
+		}
+		else
+		{
+			WinHND->Selected[handle & GEOMETRY_HANDLE_INDEX_MASK] = 0;
+		}
+	}
+
+	WinHND->SelectionCount = n;
+	WinHND->SelectionRevision = State.Revision;
+}
+
+
+// An object being edited is out of the store, so undo first abandons the edit and puts back the object it was
+// picked from. Otherwise it undoes the newest step
+void UndoEdit(window_handler_t *WinHND)
+{
+	if (WinHND->ActiveSelection)
+	{
+		WinHND->Undo.Cancel(&WinHND->GeometryObjects);
+		WinHND->ActiveSelection = false;
+	}
+	else
+	{
+		WinHND->Undo.Undo(&WinHND->GeometryObjects);
+	}
+	WinHND->HoverSlot = INSTANCE_NONE;
+}
+
+
+// Nothing can be redone while an edit is open - it would have been discarded by the edit's own record
+void RedoEdit(window_handler_t *WinHND)
+{
+	if (WinHND->ActiveSelection)
+	{
+		return;
+	}
+
+	WinHND->Undo.Redo(&WinHND->GeometryObjects);
+	WinHND->HoverSlot = INSTANCE_NONE;
+}
+
+
+// Act on a pick that has been resolved to an object slot (or INSTANCE_NONE), however it was obtained
+void ApplyPick(window_handler_t *WinHND, uint32_t Tag, uint32_t Slot)
+{
+	if (Tag == PICK_QUERY_HOVER)
+	{
+		WinHND->HoverSlot = Slot;
+		return;
+	}
+
+	// Picking an object out of the store and committing it back are one undo step, so undoing an edit restores
+	// the object as it was before it was picked
+	if (WinHND->ActiveSelection && WinHND->Active.Deleted != true)
+	{
+		WinHND->Active.ComposeModel();
+		// A picked object goes back under its own handle, which keeps it in the hierarchy
+		geometry_handle_t Committed = GEOMETRY_HANDLE_NONE;
+		if (WinHND->ActiveHandle != GEOMETRY_HANDLE_NONE)
+		{
+			Committed = WinHND->GeometryObjects.Restore(WinHND->ActiveHandle, WinHND->Active);
+		}
+		if (Committed == GEOMETRY_HANDLE_NONE)
+		{
+			Committed = WinHND->GeometryObjects.Alloc(WinHND->Active);
+		}
+		if (Committed != GEOMETRY_HANDLE_NONE)
+		{
+			WinHND->Undo.RecordCreate(WinHND->GeometryObjects, &Committed, 1);
+		}
+		WinHND->Undo.EndStep();
+		WinHND->ActiveSelection = false;
+	}
+	if (Slot != INSTANCE_NONE)
+	{
+		geometry_handle_t Picked = WinHND->GeometryObjects.Handle(Slot);
+		WinHND->Undo.RecordDelete(WinHND->GeometryObjects, &Picked, 1);
+		WinHND->GeometryObjects.GetCreateInfo(Slot, &WinHND->Active);
+		WinHND->GeometryObjects.Free(Slot);
+		WinHND->ActiveSelection = true;
+		WinHND->ActiveHandle = Picked;
+	}
+	WinHND->HoverSlot = INSTANCE_NONE;
+}
+
+
 void MousePosCallback(GLFWwindow *Window, double mx, double my)
 {
 	window_handler_t* WinHND = (window_handler_t*)glfwGetWindowUserPointer(Window);
@@ -573,6 +1167,16 @@ void MousePosCallback(GLFWwindow *Window, double mx, double my)
 
 void GenerateInterfaceElements(window_handler_t *WinHND, bool *HelpWindow, bool *DemoWindow)
 {
+	// Marquee outline goes on top of everything, including the UI windows, while the drag is in progress
+	if (WinHND->Marquee)
+	{
+		ImVec2 lo = { (float)fmin(WinHND->MarqueeStartX, WinHND->PrevMouseX), (float)fmin(WinHND->MarqueeStartY, WinHND->PrevMouseY) };
+		ImVec2 hi = { (float)fmax(WinHND->MarqueeStartX, WinHND->PrevMouseX), (float)fmax(WinHND->MarqueeStartY, WinHND->PrevMouseY) };
+		ImDrawList* Marquee = ImGui::GetForegroundDrawList();
+		Marquee->AddRectFilled(lo, hi, IM_COL32(77, 140, 255, 40));
+		Marquee->AddRect(lo, hi, IM_COL32(77, 140, 255, 200));
+	}
+
 	if(WinHND->ActiveSelection)
 	{
 		ImGui::Begin("Object Parameters");
@@ -581,10 +1185,16 @@ void GenerateInterfaceElements(window_handler_t *WinHND, bool *HelpWindow, bool
 		ImGui::SliderFloat("Scale", &WinHND->Active.Scale, 0.1f, 2.5f);
 		ImGui::Text("");
 		ImGui::Text("Rotation");
-		ImGui::SliderFloat("Angle", &WinHND->Active.RotationAngle, 0.0f, 180.0f);
-		ImGui::SliderFloat("rX", &WinHND->Active.RotationAxis.x, 0.0f, 1.0f);
-		ImGui::SliderFloat("rY", &WinHND->Active.RotationAxis.y, 0.0f, 1.0f);
-		ImGui::SliderFloat("rZ", &WinHND->Active.RotationAxis.z, 0.0f, 1.0f);
+		// Only rebuild the quaternion when the user actually moves a slider, so an untouched rotation is kept exactly
+		bool RotationEdited = false;
+		RotationEdited |= ImGui::SliderFloat("Angle", &WinHND->Active.RotationAngle, 0.0f, 180.0f);
+		RotationEdited |= ImGui::SliderFloat("rX", &WinHND->Active.RotationAxis.x, 0.0f, 1.0f);
+		RotationEdited |= ImGui::SliderFloat("rY", &WinHND->Active.RotationAxis.y, 0.0f, 1.0f);
+		RotationEdited |= ImGui::SliderFloat("rZ", &WinHND->Active.RotationAxis.z, 0.0f, 1.0f);
+		if (RotationEdited)
+		{
+			WinHND->Active.SetRotationFromAxisAngle();
+		}
 		ImGui::Text("");
 		ImGui::Text("Position");
 		ImGui::SliderFloat("X", &WinHND->Active.Position.x, -15.0f, 15.0f);
@@ -593,10 +1203,41 @@ void GenerateInterfaceElements(window_handler_t *WinHND, bool *HelpWindow, bool
 		ImGui::Text("");
 		ImGui::ColorEdit3("Color", (float*)&WinHND->Active.Color);
 		ImGui::Text("");
+		if (ImGui::BeginCombo("Mesh", WinHND->Meshes.Name(WinHND->Active.Mesh)))
+		{
+			for (uint32_t m = 0; m < WinHND->Meshes.Count; m++)
+			{
+				if (ImGui::Selectable(WinHND->Meshes.Name(m), m == WinHND->Active.Mesh))
+				{
+					WinHND->Active.Mesh = m;
+				}
+			}
+			ImGui::EndCombo();
+		}
+		ImGui::Text("");
+		ImGui::Checkbox("Dynamic (falls and collides while simulating)", &WinHND->Active.Dynamic);
+		ImGui::Text("");
+
+		// The edited object is out of the store until it is committed, so ask the grid about its current bounds
+		uMATH::vec3f_t NearMin, NearMax;
+		uMATH::vec3f_t NearPad = { NEIGHBOUR_RADIUS, NEIGHBOUR_RADIUS, NEIGHBOUR_RADIUS };
+		WinHND->Active.ComposeModel();
+		uPHYS::ComputeOBBBounds(WinHND->Active.Model, &NearMin, &NearMax);
+		WinHND->Grid.Update(WinHND->GeometryObjects);
+		WinHND->NeighbourCount = 0;
+		WinHND->NeighbourList = FrameScratch.PushArray<uint32_t>(WinHND->GeometryObjects.Count);
+		if (WinHND->NeighbourList)
+		{
+			WinHND->NeighbourCount = WinHND->Grid.QueryAABB(NearMin - NearPad, NearMax + NearPad, WinHND->NeighbourList);
+		}
+		ImGui::Text("Objects within %.1f: %u", NEIGHBOUR_RADIUS, WinHND->NeighbourCount);
+		ImGui::Text("");
 		if (ImGui::Button("Delete Object"))
 		{
+			// The pick already recorded the object's removal - closing the step makes that the whole edit
 			WinHND->Active.Deleted = true;
 			WinHND->ActiveSelection = false;
+			WinHND->Undo.EndStep();
 		}
 
 		ImGui::End();
@@ -639,6 +1280,16 @@ void GenerateInterfaceElements(window_handler_t *WinHND, bool *HelpWindow, bool
 			WinHND->Active.New = true;
 		}
 		ImGui::SameLine();
+		if (ImGui::Button("Undo (ctrl+z)"))
+		{
+			UndoEdit(WinHND);
+		}
+		ImGui::SameLine();
+		if (ImGui::Button("Redo (ctrl+y)"))
+		{
+			RedoEdit(WinHND);
+		}
+		ImGui::SameLine();
 		if (ImGui::Button("Reload Shaders (p)"))
 		{
 			WinHND->ReloadShaders = true;
@@ -665,6 +1316,169 @@ void GenerateInterfaceElements(window_handler_t *WinHND, bool *HelpWindow, bool
 		ImGui::SameLine();
 		ImGui::Text("Inter-Frame time: %.3f ms/frame (%.1f FPS)", WinHND->DeltaTime, 1.0f / WinHND->DeltaTime);
 
+		ImGui::Text("");
+		ImGui::Checkbox("Instanced rendering", &WinHND->InstancedRender);
+		ImGui::SameLine();
+		ImGui::Text("Draw calls: %u (%u of %u meshes in the multi-draw)", WinHND->Stats.DrawCalls, WinHND->Stats.DrawnMeshes,
+			WinHND->Meshes.Count);
+		ImGui::Text("Picking:");
+		ImGui::SameLine();
+		ImGui::RadioButton("Pick pass", &WinHND->PickMethod, PICK_METHOD_PASS);
+		ImGui::SameLine();
+		ImGui::RadioButton("Single-pass", &WinHND->PickMethod, PICK_METHOD_SINGLE_PASS);
+		ImGui::SameLine();
+		ImGui::RadioButton("CPU BVH", &WinHND->PickMethod, PICK_METHOD_CPU_BVH);
+		ImGui::SameLine();
+		ImGui::RadioButton("CPU SIMD", &WinHND->PickMethod, PICK_METHOD_CPU_SIMD);
+		ImGui::SameLine();
+		ImGui::RadioButton("CPU grid", &WinHND->PickMethod, PICK_METHOD_CPU_GRID);
+		ImGui::Text("Per-object: %.3f ms object pass, %.3f ms/frame",
+			WinHND->Stats.ObjectPassTime[RPATH_PER_OBJECT] * 1000.0f, WinHND->Stats.FrameTime[RPATH_PER_OBJECT] * 1000.0f);
+		ImGui::Text("Instanced:  %.3f ms object pass, %.3f ms/frame",
+			WinHND->Stats.ObjectPassTime[RPATH_INSTANCED] * 1000.0f, WinHND->Stats.FrameTime[RPATH_INSTANCED] * 1000.0f);
+		ImGui::Text("Pick passes: %u of %u frames last second (%llu total)", WinHND->Stats.PickPassesLastSecond,
+			WinHND->Stats.FramesLastSecond, (unsigned long long)WinHND->Stats.PickPassesTotal);
+		ImGui::Text("Visible: %u, culled: %u (%.3f ms cull)", WinHND->Stats.Visible, WinHND->Stats.Culled,
+			WinHND->Stats.CullTime * 1000.0f);
+		ImGui::Text("CPU pick: %.3f ms (BVH: %u nodes, grid: %.2f cell size, %u oversize)", WinHND->Stats.CPUPickTime * 1000.0f,
+			WinHND->Bvh.NodeCount, WinHND->Grid.CellSize, WinHND->Grid.OversizeCount);
+		ImGui::Text("Overlapping pairs: %u of %u candidates (%.3f ms)", WinHND->Overlaps.PairCount, WinHND->Overlaps.CandidateCount,
+			WinHND->Stats.OverlapTime * 1000.0f);
+		ImGui::Checkbox("Simulate", &WinHND->Simulate);
+		ImGui::SameLine();
+		if (ImGui::Button("Make all dynamic"))
+		{
+			// Without a handle list the edit couldn't be recorded, and older history would no longer undo correctly
+			geometry_state_t* State = &WinHND->GeometryObjects;
+			geometry_handle_t* All = FrameScratch.PushArray<geometry_handle_t>(State->Count);
+			if (!All)
+			{
+				printf("System: no scratch memory to record the edit, nothing changed\n");
+			}
+			else
+			{
+				for (uint32_t i = 0; i < State->Count; i++)
+				{
+					All[i] = State->Handle(i);
+				}
+
+				// A failed BeginEdit() has cleared the history, so the edit can still go ahead - it just can't be undone
+				bool Recorded = WinHND->Undo.BeginEdit(*State, All, State->Count, UNDO_FIELD_DYNAMIC) == 0;
+				for (uint32_t i = 0; i < State->Count; i++)
+				{
+					State->Dynamic[i] = 1;
+				}
+				if (Recorded)
+				{
+					WinHND->Undo.FinishEdit(*State);
+				}
+				WinHND->Undo.EndStep();
+			}
+		}
+		ImGui::SameLine();
+		ImGui::Text("%u contacts in %u islands, %u steps (%.3f ms, %u workers)", WinHND->Rigid.ContactCount[WinHND->Rigid.Current],
+			WinHND->Rigid.IslandCount, WinHND->Stats.SimSteps, WinHND->Stats.SimTime * 1000.0f, WinHND->Workers.WorkerCount);
+		ImGui::Text("Memory: %.2f MB arena (%.2f MB peak, %.0f MB committed), %.2f MB heap in use (%llu allocations), %u OS calls since startup",
+			ProgramArena.Used / 1048576.0, ProgramArena.Peak / 1048576.0, ProgramArena.Committed / 1048576.0, ProgramHeap.Live / 1048576.0,
+			(unsigned long long)ProgramHeap.AllocCount,
+			ProgramArena.OSReserveCount + ProgramArena.OSCommitCount - WinHND->Stats.StartupOSCalls);
+		ImGui::Text("GPU uploads: %.1f KB in %u transfers this frame (%.1f KB for a full re-upload)", WinHND->Stats.UploadBytes / 1024.0,
+			WinHND->Stats.UploadRanges, (WinHND->GeometryObjects.Count * sizeof(instance_data_t)) / 1024.0);
+		ImGui::Text("Hierarchy: %u linked objects, %u updated (%.3f ms)", WinHND->Hierarchy.Count,
+			WinHND->Stats.HierarchyUpdated, WinHND->Stats.HierarchyTime * 1000.0f);
+		ImGui::Text("Undo history: %.2f of %.0f MB", WinHND->Undo.Used() / 1048576.0, UNDO_RING_SIZE / 1048576.0);
+		ImGui::Text("Scratch high-water: %.2f of %.0f MB per frame, %.2f of %.0f MB per job", FrameScratch.HighWater() / 1048576.0,
+			MEM_FRAME_SCRATCH_SIZE / 1048576.0, WinHND->Workers.ScratchHighWater() / 1048576.0, MEM_THREAD_SCRATCH_SIZE / 1048576.0);
+
+		if (WinHND->SelectionCount > 0)
+		{
+			geometry_state_t* State = &WinHND->GeometryObjects;
+
+			ImGui::Text("");
+			ImGui::Text("Selected: %u objects (%.3f ms marquee, %.3f ms of it updating the BVH)", WinHND->SelectionCount,
+				WinHND->Stats.SelectTime * 1000.0f, WinHND->Stats.SelectUpdateTime * 1000.0f);
+			ImGui::SameLine();
+			if (ImGui::Button("Make dynamic"))
+			{
+				bool Recorded = WinHND->Undo.BeginEdit(*State, WinHND->SelectionList.Data, WinHND->SelectionCount, UNDO_FIELD_DYNAMIC) == 0;
+				for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+				{
+					uint32_t slot;
+					if (State->Resolve(WinHND->SelectionList[i], &slot))
+					{
+						State->Dynamic[slot] = 1;
+					}
+				}
+				if (Recorded)
+				{
+					WinHND->Undo.FinishEdit(*State);
+				}
+				WinHND->Undo.EndStep();
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Delete selected"))
+			{
+				WinHND->Undo.RecordDelete(*State, WinHND->SelectionList.Data, WinHND->SelectionCount);
+				WinHND->Undo.EndStep();
+				for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+				{
+					uint32_t slot;
+					if (State->Resolve(WinHND->SelectionList[i], &slot))
+					{
+						State->Free(slot);
+					}
+				}
+				ClearSelection(WinHND);
+			}
+
+			// The first selected object becomes the parent of the rest, keeping everything where it is now
+			if (ImGui::Button("Parent to first") && WinHND->SelectionCount > 1)
+			{
+				for (uint32_t i = 1; i < WinHND->SelectionCount; i++)
+				{
+					WinHND->Hierarchy.SetParent(*State, WinHND->SelectionList[i], WinHND->SelectionList[0]);
+				}
+			}
+			ImGui::SameLine();
+			if (ImGui::Button("Unparent"))
+			{
+				for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+				{
+					WinHND->Hierarchy.SetParent(*State, WinHND->SelectionList[i], GEOMETRY_HANDLE_NONE);
+				}
+			}
+
+			// Starts from zero every frame, so each drag step moves the selection by however far it was dragged.
+			// The whole drag is one undo record: positions are taken when it starts and again when it ends. If the
+			// record can't be started, the drag still moves things and FinishEdit() has nothing to finish
+			uMATH::vec3f_t Move = { 0.0f, 0.0f, 0.0f };
+			bool Moved = ImGui::DragFloat3("Move selected", &Move.x, 0.02f);
+			if (ImGui::IsItemActivated())
+			{
+				WinHND->Undo.BeginEdit(*State, WinHND->SelectionList.Data, WinHND->SelectionCount, UNDO_FIELD_POSITION);
+			}
+			if (Moved)
+			{
+				for (uint32_t i = 0; i < WinHND->SelectionCount; i++)
+				{
+					uint32_t slot;
+					if (!State->Resolve(WinHND->SelectionList[i], &slot))
+					{
+						continue;
+					}
+					State->PosX[slot] += Move.x;
+					State->PosY[slot] += Move.y;
+					State->PosZ[slot] += Move.z;
+					State->ComposeModels(slot, 1);
+				}
+			}
+			if (ImGui::IsItemDeactivated())
+			{
+				WinHND->Undo.FinishEdit(*State);
+				WinHND->Undo.EndStep();
+			}
+		}
+
 		ImGui::End();
 	}
 }
@@ -0,0 +1,389 @@
+#include "meshes.h"
+
+#include <math.h>
+#include <string.h>
+
+
+// One quad per face, corners in the order the triangles below walk them - the same faces and winding the
+// original 36-vertex cube used
+static const mesh_vertex_t CubeVertices[24] = {
+	{ { -0.5f, -0.5f, -0.5f }, {  0.0f,  0.0f, -1.0f } },
+	{ {  0.5f, -0.5f, -0.5f }, {  0.0f,  0.0f, -1.0f } },
+	{ {  0.5f,  0.5f, -0.5f }, {  0.0f,  0.0f, -1.0f } },
+	{ { -0.5f,  0.5f, -0.5f }, {  0.0f,  0.0f, -1.0f } },
+
+	{ { -0.5f, -0.5f,  0.5f }, {  0.0f,  0.0f,  1.0f } },
+	{ {  0.5f, -0.5f,  0.5f }, {  0.0f,  0.0f,  1.0f } },
+	{ {  0.5f,  0.5f,  0.5f }, {  0.0f,  0.0f,  1.0f } },
+	{ { -0.5f,  0.5f,  0.5f }, {  0.0f,  0.0f,  1.0f } },
+
+	{ { -0.5f,  0.5f,  0.5f }, { -1.0f,  0.0f,  0.0f } },
+	{ { -0.5f,  0.5f, -0.5f }, { -1.0f,  0.0f,  0.0f } },
+	{ { -0.5f, -0.5f, -0.5f }, { -1.0f,  0.0f,  0.0f } },
+	{ { -0.5f, -0.5f,  0.5f }, { -1.0f,  0.0f,  0.0f } },
+
+	{ {  0.5f,  0.5f,  0.5f }, {  1.0f,  0.0f,  0.0f } },
+	{ {  0.5f,  0.5f, -0.5f }, {  1.0f,  0.0f,  0.0f } },
+	{ {  0.5f, -0.5f, -0.5f }, {  1.0f,  0.0f,  0.0f } },
+	{ {  0.5f, -0.5f,  0.5f }, {  1.0f,  0.0f,  0.0f } },
+
+	{ { -0.5f, -0.5f, -0.5f }, {  0.0f, -1.0f,  0.0f } },
+	{ {  0.5f, -0.5f, -0.5f }, {  0.0f, -1.0f,  0.0f } },
+	{ {  0.5f, -0.5f,  0.5f }, {  0.0f, -1.0f,  0.0f } },
+	{ { -0.5f, -0.5f,  0.5f }, {  0.0f, -1.0f,  0.0f } },
+
+	{ { -0.5f,  0.5f, -0.5f }, {  0.0f,  1.0f,  0.0f } },
+	{ {  0.5f,  0.5f, -0.5f }, {  0.0f,  1.0f,  0.0f } },
+	{ {  0.5f,  0.5f,  0.5f }, {  0.0f,  1.0f,  0.0f } },
+	{ { -0.5f,  0.5f,  0.5f }, {  0.0f,  1.0f,  0.0f } }
+};
+
+
+int mesh_registry_t::Init()
+{
+	if (VAO != 0)
+	{
+		printf("System: attempt to reinitialize existing mesh registry. Call Release() first\n");
+		return -1;
+	}
+
+	glGenVertexArrays(1, &VAO);
+	glGenBuffers(1, &VBO);
+	glGenBuffers(1, &IBO);
+	glGenBuffers(1, &IndirectBuffer);
+
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)MESH_INITIAL_VERTICES * sizeof(mesh_vertex_t), 0x0, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, IBO);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)MESH_INITIAL_INDICES * sizeof(uint32_t), 0x0, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	VertexCapacity = MESH_INITIAL_VERTICES;
+	IndexCapacity = MESH_INITIAL_INDICES;
+	CommandCapacity = 0;
+	VertexCount = 0;
+	IndexCount = 0;
+	Count = 0;
+	SetLayout();
+
+	// IDs are fixed by the order these go in - see MESH_CUBE and friends
+	if (AddCube() != MESH_CUBE || AddSphere() != MESH_SPHERE || AddCylinder() != MESH_CYLINDER)
+	{
+		printf("System: Failed to create primitive meshes\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void mesh_registry_t::Release()
+{
+	if (VAO != 0)
+	{
+		glDeleteVertexArrays(1, &VAO);
+		glDeleteBuffers(1, &VBO);
+		glDeleteBuffers(1, &IBO);
+		glDeleteBuffers(1, &IndirectBuffer);
+	}
+
+	Meshes.Release();
+	Commands.Release();
+
+	VAO = 0;
+	VBO = 0;
+	IBO = 0;
+	IndirectBuffer = 0;
+	VertexCapacity = 0;
+	IndexCapacity = 0;
+	CommandCapacity = 0;
+	VertexCount = 0;
+	IndexCount = 0;
+	Count = 0;
+}
+
+
+// Point the VAO at the current buffers. Has to be redone whenever Reserve() replaces them
+void mesh_registry_t::SetLayout()
+{
+	glBindVertexArray(VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, VBO);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex_t), (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex_t), (void*)sizeof(uMATH::vec3f_t));
+	glEnableVertexAttribArray(1);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, IBO);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Replace a buffer with a larger one holding the same first Used bytes. The copy stays on the GPU
+static uint32_t GrowBuffer(uint32_t Buffer, uint64_t Used, uint64_t Size)
+{
+	uint32_t res;
+	glGenBuffers(1, &res);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, res);
+	glBufferData(GL_COPY_WRITE_BUFFER, (GLsizeiptr)Size, 0x0, GL_STATIC_DRAW);
+	glBindBuffer(GL_COPY_READ_BUFFER, Buffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, (GLsizeiptr)Used);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glDeleteBuffers(1, &Buffer);
+
+	return res;
+}
+
+
+// Make room for this many more vertices and indices, growing either buffer by at least half again
+int mesh_registry_t::Reserve(uint32_t Vertices, uint32_t Indices)
+{
+	if (Vertices > 0xFFFFFFFF - VertexCount || Indices > 0xFFFFFFFF - IndexCount)
+	{
+		printf("System: mesh buffers cannot grow any further\n");
+		return -1;
+	}
+
+	bool grown = false;
+	if (VertexCount + Vertices > VertexCapacity)
+	{
+		uint64_t cap = (uint64_t)VertexCapacity + (VertexCapacity / 2);
+		cap = (cap > VertexCount + Vertices) ? cap : VertexCount + Vertices;
+		cap = (cap < 0xFFFFFFFF) ? cap : 0xFFFFFFFF;
+		VBO = GrowBuffer(VBO, (uint64_t)VertexCount * sizeof(mesh_vertex_t), cap * sizeof(mesh_vertex_t));
+		VertexCapacity = (uint32_t)cap;
+		grown = true;
+	}
+	if (IndexCount + Indices > IndexCapacity)
+	{
+		uint64_t cap = (uint64_t)IndexCapacity + (IndexCapacity / 2);
+		cap = (cap > IndexCount + Indices) ? cap : IndexCount + Indices;
+		cap = (cap < 0xFFFFFFFF) ? cap : 0xFFFFFFFF;
+		IBO = GrowBuffer(IBO, (uint64_t)IndexCount * sizeof(uint32_t), cap * sizeof(uint32_t));
+		IndexCapacity = (uint32_t)cap;
+		grown = true;
+	}
+
+	if (grown)
+	{
+		SetLayout();
+	}
+
+	return 0;
+}
+
+
+// Copy a mesh into the end of the shared buffers. Indices count from the mesh's own first vertex. Returns the
+// new mesh's ID, or MESH_NONE if it could not be added
+uint32_t mesh_registry_t::Add(const char *Name, const mesh_vertex_t *Vertices, uint32_t AddedVertices, const uint32_t *Indices,
+	uint32_t AddedIndices)
+{
+	if (AddedVertices == 0 || AddedIndices == 0)
+	{
+		printf("System: attempt to add an empty mesh\n");
+		return MESH_NONE;
+	}
+	if (Meshes.Reserve(Count + 1) != 0 || Reserve(AddedVertices, AddedIndices) != 0)
+	{
+		printf("System: mesh registry failed to grow\n");
+		return MESH_NONE;
+	}
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, VBO);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)VertexCount * sizeof(mesh_vertex_t), (GLsizeiptr)AddedVertices * sizeof(mesh_vertex_t), Vertices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, IBO);
+	glBufferSubData(GL_COPY_WRITE_BUFFER, (GLintptr)IndexCount * sizeof(uint32_t), (GLsizeiptr)AddedIndices * sizeof(uint32_t), Indices);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	mesh_t *mesh = &Meshes[Count];
+	mesh->FirstIndex = IndexCount;
+	mesh->IndexCount = AddedIndices;
+	mesh->BaseVertex = VertexCount;
+	mesh->VertexCount = AddedVertices;
+	strncpy(mesh->Name, Name, MESH_NAME_MAX - 1);
+	mesh->Name[MESH_NAME_MAX - 1] = 0;
+
+	VertexCount += AddedVertices;
+	IndexCount += AddedIndices;
+	return Count++;
+}
+
+
+const char *mesh_registry_t::Name(uint32_t Mesh) const
+{
+	return (Mesh < Count) ? Meshes[Mesh].Name : "(missing)";
+}
+
+
+void mesh_registry_t::Bind()
+{
+	glBindVertexArray(VAO);
+}
+
+
+// One object's worth of a mesh. IDs the registry doesn't know draw as the cube
+void mesh_registry_t::Draw(GLenum Mode, uint32_t Mesh)
+{
+	const mesh_t &mesh = Meshes[(Mesh < Count) ? Mesh : MESH_CUBE];
+	glDrawElementsBaseVertex(Mode, mesh.IndexCount, GL_UNSIGNED_INT, (void*)((uint64_t)mesh.FirstIndex * sizeof(uint32_t)),
+		(GLint)mesh.BaseVertex);
+}
+
+
+// Draw runs of instances, one run per mesh: mesh M draws instances [First[M], First[M] + Instances[M]). The
+// shaders see each instance's position in the whole list as gl_BaseInstance + gl_InstanceID. Every non-empty
+// run goes into a single glMultiDrawElementsIndirect. Returns how many meshes were drawn
+uint32_t mesh_registry_t::DrawInstanced(GLenum Mode, const uint32_t *First, const uint32_t *Instances)
+{
+	if (Commands.Reserve(Count) != 0)
+	{
+		printf("System: mesh draw list failed to grow\n");
+		return 0;
+	}
+
+	uint32_t n = 0;
+	for (uint32_t m = 0; m < Count; m++)
+	{
+		if (Instances[m] == 0)
+		{
+			continue;
+		}
+
+		Commands[n].Count = Meshes[m].IndexCount;
+		Commands[n].InstanceCount = Instances[m];
+		Commands[n].FirstIndex = Meshes[m].FirstIndex;
+		Commands[n].BaseVertex = (int32_t)Meshes[m].BaseVertex;
+		Commands[n].BaseInstance = First[m];
+		n++;
+	}
+
+	if (n == 0)
+	{
+		return 0;
+	}
+
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, IndirectBuffer);
+	if (Commands.Capacity > CommandCapacity)
+	{
+		CommandCapacity = Commands.Capacity;
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, (GLsizeiptr)CommandCapacity * sizeof(mesh_draw_command_t), 0x0, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, (GLsizeiptr)n * sizeof(mesh_draw_command_t), Commands.Data);
+	glMultiDrawElementsIndirect(Mode, GL_UNSIGNED_INT, 0x0, n, 0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+	return n;
+}
+
+
+uint32_t mesh_registry_t::AddCube()
+{
+	uint32_t indices[36];
+	for (uint32_t f = 0; f < 6; f++)
+	{
+		uint32_t *face = indices + (6 * f);
+		face[0] = 4 * f;
+		face[1] = 4 * f + 1;
+		face[2] = 4 * f + 2;
+		face[3] = 4 * f + 2;
+		face[4] = 4 * f + 3;
+		face[5] = 4 * f;
+	}
+
+	return Add("Cube", CubeVertices, 24, indices, 36);
+}
+
+
+// Latitude/longitude sphere of radius 0.5. The seam and pole vertices are duplicated so every ring is a plain
+// grid row
+uint32_t mesh_registry_t::AddSphere()
+{
+	const uint32_t rows = MESH_SPHERE_RINGS + 1;
+	const uint32_t cols = MESH_SPHERE_SEGMENTS + 1;
+	mesh_vertex_t vertices[rows * cols];
+	uint32_t indices[6 * MESH_SPHERE_RINGS * MESH_SPHERE_SEGMENTS];
+
+	for (uint32_t r = 0; r < rows; r++)
+	{
+		float phi = 180.0f * RADIAN * r / MESH_SPHERE_RINGS;
+		for (uint32_t s = 0; s < cols; s++)
+		{
+			float theta = 360.0f * RADIAN * s / MESH_SPHERE_SEGMENTS;
+			uMATH::vec3f_t n = { sinf(phi) * cosf(theta), cosf(phi), sinf(phi) * sinf(theta) };
+			vertices[r * cols + s] = { { 0.5f * n.x, 0.5f * n.y, 0.5f * n.z }, n };
+		}
+	}
+
+	uint32_t *out = indices;
+	for (uint32_t r = 0; r < MESH_SPHERE_RINGS; r++)
+	{
+		for (uint32_t s = 0; s < MESH_SPHERE_SEGMENTS; s++)
+		{
+			uint32_t a = r * cols + s;
+			uint32_t b = a + cols;
+			out[0] = a;
+			out[1] = a + 1;
+			out[2] = b + 1;
+			out[3] = b + 1;
+			out[4] = b;
+			out[5] = a;
+			out += 6;
+		}
+	}
+
+	return Add("Sphere", vertices, rows * cols, indices, 6 * MESH_SPHERE_RINGS * MESH_SPHERE_SEGMENTS);
+}
+
+
+// Capped cylinder of radius 0.5 and height 1 along Y. The side and each cap get their own vertices, so the
+// edges stay hard
+uint32_t mesh_registry_t::AddCylinder()
+{
+	const uint32_t ring = MESH_CYLINDER_SEGMENTS + 1;
+	mesh_vertex_t vertices[4 * ring + 2];
+	uint32_t indices[12 * MESH_CYLINDER_SEGMENTS];
+
+	mesh_vertex_t *side = vertices;
+	mesh_vertex_t *top = vertices + 2 * ring;
+	mesh_vertex_t *bottom = top + ring;
+	uint32_t topcenter = 4 * ring;
+	uint32_t bottomcenter = topcenter + 1;
+
+	for (uint32_t s = 0; s < ring; s++)
+	{
+		float theta = 360.0f * RADIAN * s / MESH_CYLINDER_SEGMENTS;
+		float x = cosf(theta);
+		float z = sinf(theta);
+		side[2 * s] = { { 0.5f * x, 0.5f, 0.5f * z }, { x, 0.0f, z } };
+		side[2 * s + 1] = { { 0.5f * x, -0.5f, 0.5f * z }, { x, 0.0f, z } };
+		top[s] = { { 0.5f * x, 0.5f, 0.5f * z }, { 0.0f, 1.0f, 0.0f } };
+		bottom[s] = { { 0.5f * x, -0.5f, 0.5f * z }, { 0.0f, -1.0f, 0.0f } };
+	}
+	vertices[topcenter] = { { 0.0f, 0.5f, 0.0f }, { 0.0f, 1.0f, 0.0f } };
+	vertices[bottomcenter] = { { 0.0f, -0.5f, 0.0f }, { 0.0f, -1.0f, 0.0f } };
+
+	uint32_t *out = indices;
+	for (uint32_t s = 0; s < MESH_CYLINDER_SEGMENTS; s++)
+	{
+		uint32_t a = 2 * s;
+		out[0] = a;
+		out[1] = a + 2;
+		out[2] = a + 3;
+		out[3] = a + 3;
+		out[4] = a + 1;
+		out[5] = a;
+
+		uint32_t t = 2 * ring + s;
+		uint32_t b = 3 * ring + s;
+		out[6] = topcenter;
+		out[7] = t + 1;
+		out[8] = t;
+		out[9] = bottomcenter;
+		out[10] = b;
+		out[11] = b + 1;
+		out += 12;
+	}
+
+	return Add("Cylinder", vertices, 4 * ring + 2, indices, 12 * MESH_CYLINDER_SEGMENTS);
+}
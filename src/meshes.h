@@ -0,0 +1,102 @@
+#ifndef MBOX_MESHES_H
+#define MBOX_MESHES_H
+
+
+#include "../vendor/glad/glad.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util/u_math.h"
+#include "util/u_mem.h"
+
+
+// Built-in primitives, registered by Init() in this order. Every one fits the unit cube (+-0.5 on each axis),
+// so the cube's bounding sphere and box stay conservative for culling, picking and collision whatever an object draws
+#define MESH_CUBE 0
+#define MESH_SPHERE 1
+#define MESH_CYLINDER 2
+#define MESH_PRIMITIVE_COUNT 3
+#define MESH_NONE 0xFFFFFFFF
+
+#define MESH_SPHERE_RINGS 16
+#define MESH_SPHERE_SEGMENTS 32
+#define MESH_CYLINDER_SEGMENTS 32
+
+// Room the shared buffers start with. They are reallocated larger (and the old contents copied over on the GPU)
+// whenever a mesh doesn't fit
+#define MESH_INITIAL_VERTICES (64 * 1024)
+#define MESH_INITIAL_INDICES (192 * 1024)
+#define MESH_NAME_MAX 32
+
+
+// Vertex layout of the shared buffer - attribute 0 is position, attribute 1 the normal
+struct mesh_vertex_t
+{
+	uMATH::vec3f_t Pos;
+	uMATH::vec3f_t Normal;
+};
+
+
+// Where one mesh sits in the shared buffers. Indices are relative to BaseVertex
+struct mesh_t
+{
+	uint32_t FirstIndex;
+	uint32_t IndexCount;
+	uint32_t BaseVertex;
+	uint32_t VertexCount;
+	char Name[MESH_NAME_MAX];
+};
+
+
+// Mirrors the DrawElementsIndirectCommand layout glMultiDrawElementsIndirect reads
+struct mesh_draw_command_t
+{
+	uint32_t Count;
+	uint32_t InstanceCount;
+	uint32_t FirstIndex;
+	int32_t BaseVertex;
+	uint32_t BaseInstance;
+};
+
+
+// Every mesh objects can draw, sub-allocated from one vertex buffer and one index buffer behind a single VAO, so
+// switching meshes never rebinds anything. Objects refer to meshes by ID - the index Add() returned. Meshes are
+// never removed, so an ID stays valid for the registry's whole life. DrawInstanced() takes the instance list
+// grouped by mesh and issues every group in one multi-draw
+struct mesh_registry_t
+{
+	uint32_t VAO;
+	uint32_t VBO;
+	uint32_t IBO;
+	uint32_t IndirectBuffer;
+	uint32_t VertexCapacity;
+	uint32_t IndexCapacity;
+	uint32_t CommandCapacity;
+	uint32_t VertexCount;
+	uint32_t IndexCount;
+
+	packed_array_t<mesh_t> Meshes;
+	uint32_t Count;
+
+	// Working space for DrawInstanced(), kept between frames
+	packed_array_t<mesh_draw_command_t> Commands;
+
+	int Init();
+	void Release();
+	uint32_t Add(const char *Name, const mesh_vertex_t *Vertices, uint32_t AddedVertices, const uint32_t *Indices, uint32_t AddedIndices);
+	const char *Name(uint32_t Mesh) const;
+	void Bind();
+	void Draw(GLenum Mode, uint32_t Mesh);
+	uint32_t DrawInstanced(GLenum Mode, const uint32_t *First, const uint32_t *Instances);
+
+	private:
+
+	int Reserve(uint32_t Vertices, uint32_t Indices);
+	void SetLayout();
+	uint32_t AddCube();
+	uint32_t AddSphere();
+	uint32_t AddCylinder();
+};
+
+
+#endif
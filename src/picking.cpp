@@ -9,13 +9,18 @@ int fb_mpick_t::Init(uint32_t Width, uint32_t Height)
 		return -1;
 	}
 
+	this->Width = Width;
+	this->Height = Height;
+
 	glGenFramebuffers(1, &FBO);
 	glBindFramebuffer(GL_FRAMEBUFFER, FBO);
 
 	// Index Buffer
 	glGenTextures(1, &IndexTex);
 	glBindTexture(GL_TEXTURE_2D, IndexTex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, Width, Height, 0, GL_RG, GL_FLOAT, 0x0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, Width, Height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, 0x0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, IndexTex, 0);
 
 	// Depth Buffer
@@ -61,6 +66,8 @@ void fb_mpick_t::Release()
 	}
 
 	FBO = 0;
+	IndexTex = 0;
+	DepthTex = 0;
 }
 
 // Write to framebuffer
@@ -76,17 +83,283 @@ void fb_mpick_t::Unbind_W()
 }
 
 
+// Integer attachments can't be cleared through glClearColor - must be bound for writing first
+void fb_mpick_t::Clear()
+{
+	const GLuint ClearID[4] = { 0, 0, 0, 0 };
+	glClearBufferuiv(GL_COLOR, 0, ClearID);
+	glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+
+texel_info_t ReadPickTexel(uint32_t FBO, GLenum Attachment, uint32_t X, uint32_t Y)
+{
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
+	glReadBuffer(Attachment);
+
+	uint32_t Texel = 0;
+	glReadPixels(X, Y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, &Texel);
+
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	return UnpackTexel(Texel);
+}
+
+
 // Read from framebuffer
 texel_info_t fb_mpick_t::GetInfo(uint32_t X, uint32_t Y)
+{
+	return ReadPickTexel(FBO, GL_COLOR_ATTACHMENT0, X, Y);
+}
+
+
+int fb_scene_t::Init(uint32_t Width, uint32_t Height)
+{
+	if (FBO != 0)
+	{
+		printf("System: attempt to reinitialize existing framebuffer. Call Release() first\n");
+		return -1;
+	}
+
+	this->Width = Width;
+	this->Height = Height;
+
+	glGenFramebuffers(1, &FBO);
+	glBindFramebuffer(GL_FRAMEBUFFER, FBO);
+
+	// Color Buffer
+	glGenTextures(1, &ColorTex);
+	glBindTexture(GL_TEXTURE_2D, ColorTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, Width, Height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0x0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ColorTex, 0);
+
+	// Index Buffer
+	glGenTextures(1, &IndexTex);
+	glBindTexture(GL_TEXTURE_2D, IndexTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, Width, Height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, 0x0);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, IndexTex, 0);
+
+	// Depth Buffer
+	glGenTextures(1, &DepthTex);
+	glBindTexture(GL_TEXTURE_2D, DepthTex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, Width, Height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, 0x0);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, DepthTex, 0);
+
+	const GLenum DrawBuffers[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+	glReadBuffer(GL_NONE);
+	glDrawBuffers(2, DrawBuffers);
+
+	GLenum Status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+	if (Status != GL_FRAMEBUFFER_COMPLETE)
+	{
+		printf("System: Framebuffer (scene) gen error: 0x%x\n", Status);
+		return -1;
+	}
+
+	// Unbind
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	return 0;
+}
+
+
+void fb_scene_t::Release()
+{
+	if (FBO != 0)
+	{
+		glDeleteFramebuffers(1, &FBO);
+	}
+
+	if (ColorTex != 0)
+	{
+		glDeleteTextures(1, &ColorTex);
+	}
+
+	if (IndexTex != 0)
+	{
+		glDeleteTextures(1, &IndexTex);
+	}
+
+	if (DepthTex != 0)
+	{
+		glDeleteTextures(1, &DepthTex);
+	}
+
+	FBO = 0;
+	ColorTex = 0;
+	IndexTex = 0;
+	DepthTex = 0;
+}
+
+
+void fb_scene_t::Bind_W()
+{
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, FBO);
+}
+
+
+void fb_scene_t::Unbind_W()
+{
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+
+// Attachments have different component types, so each has to be cleared on its own
+void fb_scene_t::Clear(float R, float G, float B)
+{
+	const GLfloat ClearColor[4] = { R, G, B, 1.0f };
+	const GLuint ClearID[4] = { 0, 0, 0, 0 };
+	glClearBufferfv(GL_COLOR, 0, ClearColor);
+	glClearBufferuiv(GL_COLOR, 1, ClearID);
+	glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+
+// Present shaded color to the default framebuffer. Depth is not carried over - nothing drawn
+// after this point (UI) depth tests against the scene
+void fb_scene_t::Blit()
 {
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, FBO);
 	glReadBuffer(GL_COLOR_ATTACHMENT0);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
-	texel_info_t res;
-	glReadPixels(X, Y, 1, 1, GL_RG, GL_FLOAT, &res);
+	glBlitFramebuffer(0, 0, Width, Height, 0, 0, Width, Height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
 
 	glReadBuffer(GL_NONE);
 	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+
+texel_info_t fb_scene_t::GetInfo(uint32_t X, uint32_t Y)
+{
+	return ReadPickTexel(FBO, GL_COLOR_ATTACHMENT1, X, Y);
+}
+
+
+int pick_readback_t::Init()
+{
+	if (Queries[0].PBO != 0)
+	{
+		printf("System: attempt to reinitialize existing pick readback. Call Release() first\n");
+		return -1;
+	}
+
+	for (int i = 0; i < PICK_QUERY_RING_SIZE; i++)
+	{
+		glGenBuffers(1, &Queries[i].PBO);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, Queries[i].PBO);
+		glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(uint32_t), 0x0, GL_STREAM_READ);
+		Queries[i].Fence = 0x0;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	Head = 0;
+	InFlight = 0;
+
+	return 0;
+}
+
+
+void pick_readback_t::Release()
+{
+	for (int i = 0; i < PICK_QUERY_RING_SIZE; i++)
+	{
+		if (Queries[i].Fence)
+		{
+			glDeleteSync(Queries[i].Fence);
+		}
+		if (Queries[i].PBO != 0)
+		{
+			glDeleteBuffers(1, &Queries[i].PBO);
+		}
+
+		Queries[i].Fence = 0x0;
+		Queries[i].PBO = 0;
+	}
+
+	Head = 0;
+	InFlight = 0;
+}
+
+
+// With a buffer bound to GL_PIXEL_PACK_BUFFER, glReadPixels only records the copy - the CPU does not wait for it
+bool pick_readback_t::Issue(uint32_t ReadFBO, GLenum Attachment, uint32_t X, uint32_t Y, uint32_t Tag, uint32_t Revision, uint32_t *Entry)
+{
+	if (InFlight == PICK_QUERY_RING_SIZE)
+	{
+		return false;
+	}
+
+	*Entry = (Head + InFlight) % PICK_QUERY_RING_SIZE;
+	pick_query_t *q = &Queries[*Entry];
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, ReadFBO);
+	glReadBuffer(Attachment);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, q->PBO);
+
+	glReadPixels(X, Y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, 0x0);
+	q->Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	q->Tag = Tag;
+	q->Revision = Revision;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	glReadBuffer(GL_NONE);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+	InFlight++;
+
+	return true;
+}
+
+
+bool pick_readback_t::Poll(pick_result_t *Result)
+{
+	if (InFlight == 0)
+	{
+		return false;
+	}
+
+	pick_query_t *q = &Queries[Head];
+
+	// Zero timeout turns this into a status check. Fences signal in submission order, so if the oldest
+	// query is not done, none of the newer ones are either
+	GLenum Status = glClientWaitSync(q->Fence, 0, 0);
+	if (Status == GL_TIMEOUT_EXPIRED)
+	{
+		return false;
+	}
+	if (Status == GL_WAIT_FAILED)
+	{
+		printf("System: pick readback fence failed, dropping query\n");
+		Result->Info = {};
+	}
+
+	else
+	{
+		uint32_t Texel = 0;
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, q->PBO);
+		glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, sizeof(uint32_t), &Texel);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		Result->Info = UnpackTexel(Texel);
+	}
+
+	Result->Tag = q->Tag;
+	Result->Revision = q->Revision;
+	Result->Entry = Head;
+
+	glDeleteSync(q->Fence);
+	q->Fence = 0x0;
+
+	Head = (Head + 1) % PICK_QUERY_RING_SIZE;
+	InFlight--;
 
-	return res;
+	return true;
 }
\ No newline at end of file
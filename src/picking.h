@@ -6,11 +6,95 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "util/u_math.h"
+
+
+#define PICK_QUERY_RING_SIZE 4
+#define PICK_QUERY_SELECT 0
+#define PICK_QUERY_HOVER 1
+#define PICK_REQUEST_SELECT (1 << PICK_QUERY_SELECT)
+#define PICK_REQUEST_HOVER (1 << PICK_QUERY_HOVER)
+
+// Side length in pixels of the region the separate pick pass renders - see uMATH::SetPickRegion()
+#define PICK_REGION_DIM 1
+
+// Pick texels are a single GL_R32UI value: object type in the top 4 bits, ID in the low 28.
+// Keep in sync with pick.frag
+#define PICK_TYPE_SHIFT 28
+#define PICK_ID_MASK 0x0FFFFFFF
+#define PICK_TYPE_NONE 0
+#define PICK_TYPE_GEOMETRY 1
+
 
 struct texel_info_t
 {
-	float ID;
-	float Type;
+	uint32_t ID;
+	uint32_t Type;
+};
+
+
+inline texel_info_t UnpackTexel(uint32_t Texel)
+{
+	texel_info_t res;
+	res.ID = Texel & PICK_ID_MASK;
+	res.Type = Texel >> PICK_TYPE_SHIFT;
+
+	return res;
+}
+
+
+// Blocking read of a single pick texel from any framebuffer with a GL_R32UI pick attachment
+texel_info_t ReadPickTexel(uint32_t FBO, GLenum Attachment, uint32_t X, uint32_t Y);
+
+
+// Entry is the ring entry the result was read through, PICK_QUERY_RING_SIZE for blocking reads
+struct pick_result_t
+{
+	texel_info_t Info;
+	uint32_t Tag;
+	uint32_t Revision;
+	uint32_t Entry;
+};
+
+
+// Picks wanted by input this frame, at window pixel (X, Y). The pick pass is skipped entirely while Flags is 0.
+// The Hover* fields hold what the last hover pick was taken against, hover is only re-queried once they change
+struct pick_request_t
+{
+	uint32_t Flags;
+	uint32_t X;
+	uint32_t Y;
+
+	uint32_t HoverX;
+	uint32_t HoverY;
+	uint32_t HoverRevision;
+	uMATH::aff3f_t HoverView;
+};
+
+
+// A single in-flight readback. Revision records which instance layout the pick texture was drawn with,
+// so results that arrive after the scene has changed can be recognized as stale
+struct pick_query_t
+{
+	uint32_t PBO;
+	GLsync Fence;
+	uint32_t Tag;
+	uint32_t Revision;
+};
+
+
+// Non-blocking readback of pick texels. Issue() queues a copy into a pixel buffer object and fences it,
+// Poll() hands back finished results oldest-first without ever waiting on the GPU
+struct pick_readback_t
+{
+	pick_query_t Queries[PICK_QUERY_RING_SIZE];
+	uint32_t Head;
+	uint32_t InFlight;
+
+	int Init();
+	void Release();
+	bool Issue(uint32_t ReadFBO, GLenum Attachment, uint32_t X, uint32_t Y, uint32_t Tag, uint32_t Revision, uint32_t *Entry);
+	bool Poll(pick_result_t *Result);
 };
 
 
@@ -19,6 +103,8 @@ struct fb_mpick_t
 	uint32_t FBO;
 	uint32_t IndexTex;
 	uint32_t DepthTex;
+	uint32_t Width;
+	uint32_t Height;
 
 	texel_info_t Info;
 
@@ -26,6 +112,28 @@ struct fb_mpick_t
 	void Release();
 	void Bind_W();
 	void Unbind_W();
+	void Clear();
+	texel_info_t GetInfo(uint32_t X, uint32_t Y);
+};
+
+
+// Offscreen target for single-pass picking: the main pass writes shaded color to attachment 0 and pick
+// texels to attachment 1 in the same draw, then the color is blitted to the default framebuffer
+struct fb_scene_t
+{
+	uint32_t FBO;
+	uint32_t ColorTex;
+	uint32_t IndexTex;
+	uint32_t DepthTex;
+	uint32_t Width;
+	uint32_t Height;
+
+	int Init(uint32_t WindowWidth, uint32_t WindowHeight);
+	void Release();
+	void Bind_W();
+	void Unbind_W();
+	void Clear(float R, float G, float B);
+	void Blit();
 	texel_info_t GetInfo(uint32_t X, uint32_t Y);
 };
 
@@ -1,4 +1,5 @@
 #include "shader.h"
+#include "util/u_mem.h"
 
 
 int shader_info_t::Init(const char *V,const char *TC,const char *TE,const char *G,const char *F,const char *C)
@@ -86,17 +87,17 @@ uint32_t shader_program_t::Build(const char* InFilePath, int ShaderType)
 		return -1;
 	}
 
-	FileSrc = (char*)malloc(srclen + 1);
+	// Source is only needed until it has been compiled - frame scratch takes it back on its own
+	FileSrc = (char*)FrameScratch.Push(srclen + 1, 1);
 	if (FileSrc == 0x0)
 	{
-		printf("malloc error: shader source\n");
+		printf("alloc error: shader source\n");
 		fclose(SFile);
 		return -1;
 	}
 	if ((fread(FileSrc, 1, srclen, SFile)) != srclen)
 	{
 		printf("read error: shader source %s\n", InFilePath);
-		free(FileSrc);
 		FileSrc = 0x0;
 		fclose(SFile);
 		return -1;
@@ -117,12 +118,10 @@ uint32_t shader_program_t::Build(const char* InFilePath, int ShaderType)
 		glGetShaderInfoLog(Shader, 512, NULL, InfoLog);
 		printf("GL: Failed to compile shader %s\n", InFilePath);
 		printf("%s\n", InfoLog);
-		free(FileSrc);
 		FileSrc = 0x0;
 		return -1;
 	}
 
-	free(FileSrc);
 	FileSrc = 0x0;
 
 	return Shader;
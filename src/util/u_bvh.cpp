@@ -0,0 +1,693 @@
+#include "u_bvh.h"
+#include "u_phys.h"
+
+#include <float.h>
+
+
+namespace uPHYS
+{
+
+
+static float SurfaceArea(const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max)
+{
+	uMATH::vec3f_t e = Max - Min;
+	return 2.0f * ((e.x * e.y) + (e.y * e.z) + (e.z * e.x));
+}
+
+
+// Plain compares rather than fminf/fmaxf, which are library calls unless the compiler may assume no NaNs. With
+// a NaN on either side these return B, so passing the running value as B keeps it
+static float MinF(float A, float B)
+{
+	return (A < B) ? A : B;
+}
+
+
+static float MaxF(float A, float B)
+{
+	return (A > B) ? A : B;
+}
+
+
+static void GrowBounds(uMATH::vec3f_t *Min, uMATH::vec3f_t *Max, const uMATH::vec3f_t &PMin, const uMATH::vec3f_t &PMax)
+{
+	Min->x = MinF(PMin.x, Min->x);
+	Min->y = MinF(PMin.y, Min->y);
+	Min->z = MinF(PMin.z, Min->z);
+	Max->x = MaxF(PMax.x, Max->x);
+	Max->y = MaxF(PMax.y, Max->y);
+	Max->z = MaxF(PMax.z, Max->z);
+}
+
+
+// Entry distance of the ray into the box, or FLT_MAX on a miss. InvDir is 1 / Direction per component
+static float IntersectAABB(const uMATH::vec3f_t &Origin, const uMATH::vec3f_t &InvDir, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max)
+{
+	float tx1 = (Min.x - Origin.x) * InvDir.x;
+	float tx2 = (Max.x - Origin.x) * InvDir.x;
+	float tmin = MinF(tx1, tx2);
+	float tmax = MaxF(tx1, tx2);
+
+	float ty1 = (Min.y - Origin.y) * InvDir.y;
+	float ty2 = (Max.y - Origin.y) * InvDir.y;
+	tmin = MaxF(MinF(ty1, ty2), tmin);
+	tmax = MinF(MaxF(ty1, ty2), tmax);
+
+	float tz1 = (Min.z - Origin.z) * InvDir.z;
+	float tz2 = (Max.z - Origin.z) * InvDir.z;
+	tmin = MaxF(MinF(tz1, tz2), tmin);
+	tmax = MinF(MaxF(tz1, tz2), tmax);
+
+	if (tmax >= tmin && tmax > 0.0f)
+	{
+		return tmin;
+	}
+
+	return FLT_MAX;
+}
+
+
+// -1 when the box is entirely outside the frustum, 1 when entirely inside, 0 when it straddles a plane
+static int ClassifyAABB(const uMATH::frustum_t &Frustum, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max)
+{
+	uMATH::vec3f_t c = uMATH::Scalar(Min + Max, 0.5f);
+	uMATH::vec3f_t e = uMATH::Scalar(Max - Min, 0.5f);
+	int res = 1;
+
+	for (int p = 0; p < 6; p++)
+	{
+		const uMATH::vec4f_t &pl = Frustum.Planes[p];
+		float s = (pl.x * c.x) + (pl.y * c.y) + (pl.z * c.z) + pl.w;
+		float r = (e.x * fabsf(pl.x)) + (e.y * fabsf(pl.y)) + (e.z * fabsf(pl.z));
+
+		if (s + r < 0.0f)
+		{
+			return -1;
+		}
+		if (s - r < 0.0f)
+		{
+			res = 0;
+		}
+	}
+
+	return res;
+}
+
+
+static bool EmptyLeaf(const bvh_node_t &Node)
+{
+	return Node.Count == 0 && Node.First == BVH_NONE;
+}
+
+
+// Surface area a node gains by taking in a box. An emptied leaf costs nothing to reuse
+static float GrowthCost(const bvh_node_t &Node, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max)
+{
+	if (EmptyLeaf(Node))
+	{
+		return -1.0f;
+	}
+
+	uMATH::vec3f_t gmin = Node.Min;
+	uMATH::vec3f_t gmax = Node.Max;
+	GrowBounds(&gmin, &gmax, Min, Max);
+	return SurfaceArea(gmin, gmax) - SurfaceArea(Node.Min, Node.Max);
+}
+
+
+void bvh_t::ComputePrimBounds(const geometry_state_t &State, uint32_t Slot)
+{
+	ComputeOBBBounds(State.Model[Slot], &PrimMin[Slot], &PrimMax[Slot]);
+}
+
+
+int bvh_t::Build(const geometry_state_t &State)
+{
+	uint32_t live = State.Count;
+	if (Prims.Reserve(live) != 0 || PrimHandles.Reserve(live) != 0 || Nodes.Reserve((2 * live) + 1) != 0 || PrimMin.Reserve(live) != 0 ||
+		PrimMax.Reserve(live) != 0)
+	{
+		printf("System: BVH failed to allocate\n");
+		Built = false;
+		PrimCount = 0;
+		LiveCount = 0;
+		NodeCount = 0;
+		return -1;
+	}
+
+	for (uint32_t i = 0; i < live; i++)
+	{
+		ComputePrimBounds(State, i);
+		Prims[i] = i;
+		PrimHandles[i] = State.Handle(i);
+	}
+	PrimCount = live;
+	LiveCount = live;
+	Changed = 0;
+
+	NodeCount = 1;
+	Nodes[0].First = (live > 0) ? 0 : BVH_NONE;
+	Nodes[0].Count = PrimCount;
+	Nodes[0].Min = { 0.0f, 0.0f, 0.0f };
+	Nodes[0].Max = { 0.0f, 0.0f, 0.0f };
+
+	Revision = State.Revision;
+	TransformRevision = State.TransformRevision;
+	Built = true;
+
+	if (PrimCount > 0)
+	{
+		Subdivide(0, 0);
+	}
+
+	return 0;
+}
+
+
+// Binned SAH: bucket primitive centroids into BVH_BIN_COUNT bins along each axis, evaluate every
+// plane between bins, and split at the cheapest one if it beats leaving the node as a leaf
+void bvh_t::Subdivide(uint32_t NodeIndex, uint32_t Depth)
+{
+	bvh_node_t *node = &Nodes[NodeIndex];
+
+	node->Min = { FLT_MAX, FLT_MAX, FLT_MAX };
+	node->Max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	uMATH::vec3f_t cmin = node->Min;
+	uMATH::vec3f_t cmax = node->Max;
+
+	for (uint32_t i = node->First; i < node->First + node->Count; i++)
+	{
+		uint32_t p = Prims[i];
+		GrowBounds(&node->Min, &node->Max, PrimMin[p], PrimMax[p]);
+
+		uMATH::vec3f_t c = uMATH::Scalar(PrimMin[p] + PrimMax[p], 0.5f);
+		GrowBounds(&cmin, &cmax, c, c);
+	}
+
+	if (node->Count <= BVH_LEAF_SIZE || Depth >= BVH_MAX_DEPTH)
+	{
+		return;
+	}
+
+	float bestcost = FLT_MAX;
+	int bestaxis = -1;
+	int bestsplit = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float lo = (&cmin.x)[axis];
+		float hi = (&cmax.x)[axis];
+		if (hi - lo < 0.0001f)
+		{
+			continue;
+		}
+
+		uMATH::vec3f_t binmin[BVH_BIN_COUNT];
+		uMATH::vec3f_t binmax[BVH_BIN_COUNT];
+		uint32_t bincount[BVH_BIN_COUNT] = {};
+		for (int b = 0; b < BVH_BIN_COUNT; b++)
+		{
+			binmin[b] = { FLT_MAX, FLT_MAX, FLT_MAX };
+			binmax[b] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		}
+
+		float scale = BVH_BIN_COUNT / (hi - lo);
+		for (uint32_t i = node->First; i < node->First + node->Count; i++)
+		{
+			uint32_t p = Prims[i];
+			float c = ((&PrimMin[p].x)[axis] + (&PrimMax[p].x)[axis]) * 0.5f;
+			int b = (int)((c - lo) * scale);
+			b = (b < BVH_BIN_COUNT) ? b : BVH_BIN_COUNT - 1;
+
+			bincount[b]++;
+			GrowBounds(&binmin[b], &binmax[b], PrimMin[p], PrimMax[p]);
+		}
+
+		// Sweep from the left collecting prefix areas, then from the right to finish each plane's cost
+		float leftarea[BVH_BIN_COUNT - 1];
+		uint32_t leftcount[BVH_BIN_COUNT - 1];
+		uMATH::vec3f_t lmin = { FLT_MAX, FLT_MAX, FLT_MAX };
+		uMATH::vec3f_t lmax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		uint32_t lsum = 0;
+		for (int b = 0; b < BVH_BIN_COUNT - 1; b++)
+		{
+			lsum += bincount[b];
+			if (bincount[b] > 0)
+			{
+				GrowBounds(&lmin, &lmax, binmin[b], binmax[b]);
+			}
+			leftcount[b] = lsum;
+			leftarea[b] = (lsum > 0) ? SurfaceArea(lmin, lmax) : 0.0f;
+		}
+
+		uMATH::vec3f_t rmin = { FLT_MAX, FLT_MAX, FLT_MAX };
+		uMATH::vec3f_t rmax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		uint32_t rsum = 0;
+		for (int b = BVH_BIN_COUNT - 1; b > 0; b--)
+		{
+			rsum += bincount[b];
+			if (bincount[b] > 0)
+			{
+				GrowBounds(&rmin, &rmax, binmin[b], binmax[b]);
+			}
+
+			if (rsum == 0 || leftcount[b - 1] == 0)
+			{
+				continue;
+			}
+
+			float cost = (leftcount[b - 1] * leftarea[b - 1]) + (rsum * SurfaceArea(rmin, rmax));
+			if (cost < bestcost)
+			{
+				bestcost = cost;
+				bestaxis = axis;
+				bestsplit = b;
+			}
+		}
+	}
+
+	// Splitting has to beat testing every primitive in this node directly
+	if (bestaxis < 0 || bestcost >= node->Count * SurfaceArea(node->Min, node->Max))
+	{
+		return;
+	}
+
+	float lo = (&cmin.x)[bestaxis];
+	float scale = BVH_BIN_COUNT / ((&cmax.x)[bestaxis] - lo);
+
+	uint32_t i = node->First;
+	uint32_t j = node->First + node->Count;
+	while (i < j)
+	{
+		uint32_t p = Prims[i];
+		float c = ((&PrimMin[p].x)[bestaxis] + (&PrimMax[p].x)[bestaxis]) * 0.5f;
+		int b = (int)((c - lo) * scale);
+		b = (b < BVH_BIN_COUNT) ? b : BVH_BIN_COUNT - 1;
+
+		if (b < bestsplit)
+		{
+			i++;
+		}
+		else
+		{
+			j--;
+			Prims[i] = Prims[j];
+			Prims[j] = p;
+		}
+	}
+
+	uint32_t leftcount = i - node->First;
+	if (leftcount == 0 || leftcount == node->Count)
+	{
+		return;
+	}
+
+	uint32_t left = NodeCount;
+	NodeCount += 2;
+
+	Nodes[left].First = node->First;
+	Nodes[left].Count = leftcount;
+	Nodes[left + 1].First = i;
+	Nodes[left + 1].Count = node->Count - leftcount;
+
+	node->First = left;
+	node->Count = 0;
+
+	Subdivide(left, Depth + 1);
+	Subdivide(left + 1, Depth + 1);
+}
+
+
+// Children are always allocated after their parent, so a reverse sweep over the node array visits
+// every child before the node that contains it
+void bvh_t::Refit(const geometry_state_t &State)
+{
+	if (PrimMin.Reserve(State.Count) != 0 || PrimMax.Reserve(State.Count) != 0)
+	{
+		printf("System: BVH failed to allocate\n");
+		return;
+	}
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		ComputePrimBounds(State, i);
+	}
+
+	for (uint32_t n = NodeCount; n > 0; n--)
+	{
+		bvh_node_t *node = &Nodes[n - 1];
+
+		if (EmptyLeaf(*node))
+		{
+			node->Min = { FLT_MAX, FLT_MAX, FLT_MAX };
+			node->Max = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+		}
+		else if (node->Count > 0)
+		{
+			node->Min = PrimMin[Prims[node->First]];
+			node->Max = PrimMax[Prims[node->First]];
+			for (uint32_t i = node->First + 1; i < node->First + node->Count; i++)
+			{
+				GrowBounds(&node->Min, &node->Max, PrimMin[Prims[i]], PrimMax[Prims[i]]);
+			}
+		}
+		else
+		{
+			node->Min = Nodes[node->First].Min;
+			node->Max = Nodes[node->First].Max;
+			GrowBounds(&node->Min, &node->Max, Nodes[node->First + 1].Min, Nodes[node->First + 1].Max);
+		}
+	}
+
+	TransformRevision = State.TransformRevision;
+}
+
+
+// Put a new object's slot (bounds already computed) in the tree. Descends towards whichever child grows least,
+// widening boxes on the way. The leaf it ends at takes the object directly while it is small or can't go any
+// deeper - its run moves to the end of Prims with room for one more - otherwise it is split into the old leaf and
+// a new one. Returns -1 if storage ran out
+int bvh_t::Insert(uint32_t Slot, geometry_handle_t Handle)
+{
+	const uMATH::vec3f_t &pmin = PrimMin[Slot];
+	const uMATH::vec3f_t &pmax = PrimMax[Slot];
+
+	uint32_t n = 0;
+	uint32_t depth = 0;
+	while (Nodes[n].Count == 0 && Nodes[n].First != BVH_NONE)
+	{
+		GrowBounds(&Nodes[n].Min, &Nodes[n].Max, pmin, pmax);
+		uint32_t a = Nodes[n].First;
+		n = (GrowthCost(Nodes[a + 1], pmin, pmax) < GrowthCost(Nodes[a], pmin, pmax)) ? a + 1 : a;
+		depth++;
+	}
+
+	uint32_t count = Nodes[n].Count;
+	if (Prims.Reserve(PrimCount + count + 1) != 0 || PrimHandles.Reserve(PrimCount + count + 1) != 0)
+	{
+		return -1;
+	}
+
+	if (EmptyLeaf(Nodes[n]))
+	{
+		Nodes[n].First = PrimCount;
+		Nodes[n].Count = 1;
+		Nodes[n].Min = pmin;
+		Nodes[n].Max = pmax;
+	}
+	else if (count < BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH)
+	{
+		uint32_t first = Nodes[n].First;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			Prims[PrimCount] = Prims[first + i];
+			PrimHandles[PrimCount] = PrimHandles[first + i];
+			PrimCount++;
+		}
+		Nodes[n].First = PrimCount - count;
+		Nodes[n].Count = count + 1;
+		GrowBounds(&Nodes[n].Min, &Nodes[n].Max, pmin, pmax);
+	}
+	else
+	{
+		if (Nodes.Reserve(NodeCount + 2) != 0)
+		{
+			return -1;
+		}
+
+		uint32_t a = NodeCount;
+		NodeCount += 2;
+		Nodes[a] = Nodes[n];
+		Nodes[a + 1].Min = pmin;
+		Nodes[a + 1].Max = pmax;
+		Nodes[a + 1].First = PrimCount;
+		Nodes[a + 1].Count = 1;
+
+		Nodes[n].First = a;
+		Nodes[n].Count = 0;
+		GrowBounds(&Nodes[n].Min, &Nodes[n].Max, pmin, pmax);
+	}
+
+	Prims[PrimCount] = Slot;
+	PrimHandles[PrimCount] = Handle;
+	PrimCount++;
+	LiveCount++;
+	return 0;
+}
+
+
+// Follow allocs and frees since the last update without rebuilding. Every entry is looked up by handle: a live
+// object takes its current slot (a free's swap-and-pop moves the last object into the freed slot), a dead one is
+// swapped out of its leaf. Slots no leaf holds afterwards are new objects and get inserted. Returns -1 when the
+// tree should be rebuilt instead - too much changed, or an insert failed
+int bvh_t::Patch(const geometry_state_t &State)
+{
+	uint32_t limit = State.Count / BVH_REBUILD_DIVISOR;
+	if (Covered.Reserve(State.Count) != 0 || PrimMin.Reserve(State.Count) != 0 || PrimMax.Reserve(State.Count) != 0)
+	{
+		return -1;
+	}
+	for (uint32_t c = 0; c < Covered.ChunkCount; c++)
+	{
+		memset(Covered.Chunks[c], 0, GEOMETRY_CHUNK_SIZE);
+	}
+
+	for (uint32_t n = 0; n < NodeCount; n++)
+	{
+		bvh_node_t *node = &Nodes[n];
+		if (node->Count == 0)
+		{
+			continue;
+		}
+
+		uint32_t i = node->First;
+		while (i < node->First + node->Count)
+		{
+			uint32_t slot;
+			if (State.Resolve(PrimHandles[i], &slot))
+			{
+				Prims[i] = slot;
+				Covered[slot] = 1;
+				i++;
+				continue;
+			}
+
+			uint32_t last = node->First + node->Count - 1;
+			Prims[i] = Prims[last];
+			PrimHandles[i] = PrimHandles[last];
+			node->Count--;
+			LiveCount--;
+			Changed++;
+		}
+		if (node->Count == 0)
+		{
+			node->First = BVH_NONE;
+		}
+
+		if (Changed > limit)
+		{
+			return -1;
+		}
+	}
+
+	for (uint32_t s = 0; s < State.Count; s++)
+	{
+		if (Covered[s])
+		{
+			continue;
+		}
+
+		ComputePrimBounds(State, s);
+		Changed++;
+		if (Changed > limit || Insert(s, State.Handle(s)) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+// Bring the tree up to date with State: patched and refit if the object set changed, only refit if just
+// transforms did, and rebuilt when patching gives up. Returns which happened
+int bvh_t::Update(const geometry_state_t &State)
+{
+	if (Built && Revision != State.Revision && Patch(State) == 0)
+	{
+		Revision = State.Revision;
+		Refit(State);
+		return BVH_UPDATE_REFIT;
+	}
+	if (!Built || Revision != State.Revision)
+	{
+		Build(State);
+		return BVH_UPDATE_BUILD;
+	}
+	if (TransformRevision != State.TransformRevision)
+	{
+		Refit(State);
+		return BVH_UPDATE_REFIT;
+	}
+
+	return BVH_UPDATE_NONE;
+}
+
+
+// Closest hit along a unit-length ray. Nodes are visited near child first, and any node that starts
+// beyond the best hit so far is skipped, so only a handful of leaves are ever tested
+bool bvh_t::Raycast(const geometry_state_t &State, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Slot, float *Distance) const
+{
+	*Slot = BVH_NONE;
+	*Distance = FLT_MAX;
+
+	if (LiveCount == 0)
+	{
+		return false;
+	}
+
+	uMATH::vec3f_t invdir = { 1.0f / Direction.x, 1.0f / Direction.y, 1.0f / Direction.z };
+	uMATH::vec3f_t boxmin = { -0.5f, -0.5f, -0.5f };
+	uMATH::vec3f_t boxmax = { 0.5f, 0.5f, 0.5f };
+
+	uint32_t stack[BVH_STACK_SIZE];
+	uint32_t top = 0;
+
+	if (IntersectAABB(Origin, invdir, Nodes[0].Min, Nodes[0].Max) == FLT_MAX)
+	{
+		return false;
+	}
+	stack[top++] = 0;
+
+	while (top > 0)
+	{
+		const bvh_node_t *node = &Nodes[stack[--top]];
+		if (EmptyLeaf(*node))
+		{
+			continue;
+		}
+
+		if (node->Count > 0)
+		{
+			for (uint32_t i = node->First; i < node->First + node->Count; i++)
+			{
+				float d;
+				uint32_t p = Prims[i];
+				if (CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, State.Model[p], &d) && d < *Distance)
+				{
+					*Distance = d;
+					*Slot = p;
+				}
+			}
+			continue;
+		}
+
+		uint32_t nearchild = node->First;
+		uint32_t farchild = node->First + 1;
+		float tnear = IntersectAABB(Origin, invdir, Nodes[nearchild].Min, Nodes[nearchild].Max);
+		float tfar = IntersectAABB(Origin, invdir, Nodes[farchild].Min, Nodes[farchild].Max);
+		if (tfar < tnear)
+		{
+			float t = tnear;
+			tnear = tfar;
+			tfar = t;
+			uint32_t n = nearchild;
+			nearchild = farchild;
+			farchild = n;
+		}
+
+		// Far child goes on the stack first so the near one is popped next
+		if (tfar < *Distance)
+		{
+			stack[top++] = farchild;
+		}
+		if (tnear < *Distance)
+		{
+			stack[top++] = nearchild;
+		}
+	}
+
+	return *Slot != BVH_NONE;
+}
+
+
+// Write the slot of every object whose OBB touches Frustum to Slots (room for every live object) and
+// return how many there were. Once a node is entirely inside, its whole subtree is taken without further tests
+uint32_t bvh_t::QueryFrustum(const geometry_state_t &State, const uMATH::frustum_t &Frustum, uint32_t *Slots) const
+{
+	if (LiveCount == 0)
+	{
+		return 0;
+	}
+
+	uint32_t stack[BVH_STACK_SIZE];
+	bool inside[BVH_STACK_SIZE];
+	uint32_t top = 0;
+	uint32_t n = 0;
+
+	stack[top] = 0;
+	inside[top] = false;
+	top++;
+
+	while (top > 0)
+	{
+		top--;
+		const bvh_node_t *node = &Nodes[stack[top]];
+		bool contained = inside[top];
+		if (EmptyLeaf(*node))
+		{
+			continue;
+		}
+
+		if (!contained)
+		{
+			int c = ClassifyAABB(Frustum, node->Min, node->Max);
+			if (c < 0)
+			{
+				continue;
+			}
+			contained = c > 0;
+		}
+
+		if (node->Count > 0)
+		{
+			for (uint32_t i = node->First; i < node->First + node->Count; i++)
+			{
+				uint32_t p = Prims[i];
+				if (contained || CheckFrustumOBB(Frustum, State.Model[p]))
+				{
+					Slots[n] = p;
+					n++;
+				}
+			}
+			continue;
+		}
+
+		stack[top] = node->First;
+		inside[top] = contained;
+		top++;
+		stack[top] = node->First + 1;
+		inside[top] = contained;
+		top++;
+	}
+
+	return n;
+}
+
+
+void bvh_t::Release()
+{
+	Nodes.Release();
+	Prims.Release();
+	PrimHandles.Release();
+	PrimMin.Release();
+	PrimMax.Release();
+	Covered.Release();
+	NodeCount = 0;
+	PrimCount = 0;
+	LiveCount = 0;
+	Changed = 0;
+	Built = false;
+}
+
+
+}
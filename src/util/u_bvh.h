@@ -0,0 +1,97 @@
+#ifndef MBOX_BVH_H
+#define MBOX_BVH_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_math.h"
+#include "u_mem.h"
+
+
+#define BVH_LEAF_SIZE 2
+// Nodes this deep become leaves however many primitives they hold, which bounds recursion during the build
+// and the traversal stacks: a depth-first walk never holds more than one pending sibling per level
+#define BVH_MAX_DEPTH 64
+#define BVH_STACK_SIZE (BVH_MAX_DEPTH + 2)
+#define BVH_BIN_COUNT 8
+#define BVH_NONE 0xFFFFFFFF
+
+// Objects allocated or freed since the last build are patched into the tree, until they add up to more than
+// 1 / BVH_REBUILD_DIVISOR of the objects in it - past that the tree is rebuilt
+#define BVH_REBUILD_DIVISOR 4
+
+#define BVH_UPDATE_NONE 0
+#define BVH_UPDATE_BUILD 1
+#define BVH_UPDATE_REFIT 2
+
+
+namespace uPHYS
+{
+
+
+// Interior nodes have Count == 0 and their children at First and First + 1. Leaves reference
+// Count entries of bvh_t::Prims starting at First. A leaf whose objects were all freed has Count == 0 and
+// First == BVH_NONE
+struct bvh_node_t
+{
+	uMATH::vec3f_t Min;
+	uMATH::vec3f_t Max;
+	uint32_t First;
+	uint32_t Count;
+};
+
+
+// Bounding volume hierarchy over every live object in a geometry_state_t, for CPU ray queries.
+// Built with binned SAH and refit in place when objects only move. When objects are allocated or freed, leaves
+// follow their objects by handle: a freed object leaves its leaf, the object a free moved into its slot is
+// renamed in place, and new objects are inserted under the node that grows least. Only once enough of the set has
+// changed is the tree built again
+struct bvh_t
+{
+	// A binary tree over N leaves never needs more than 2N - 1 nodes, plus two per inserted object
+	packed_array_t<bvh_node_t> Nodes;
+	uint32_t NodeCount;
+
+	// Object slots, reordered during the build so every leaf covers a contiguous run, and the handle of the
+	// object each entry refers to. Entries past the end of a shrunken leaf are unused
+	packed_array_t<uint32_t> Prims;
+	packed_array_t<geometry_handle_t> PrimHandles;
+	uint32_t PrimCount;
+
+	// Objects in the tree, and how many were inserted or removed since the last build
+	uint32_t LiveCount;
+	uint32_t Changed;
+
+	// World-space AABB of each slot's OBB, indexed by slot
+	chunked_array_t<uMATH::vec3f_t> PrimMin;
+	chunked_array_t<uMATH::vec3f_t> PrimMax;
+
+	// Per slot, whether some leaf already holds it - used while patching the tree
+	chunked_array_t<uint8_t> Covered;
+
+	// geometry_state_t revisions the tree was last built/refit against
+	uint32_t Revision;
+	uint32_t TransformRevision;
+	bool Built;
+
+	int Build(const geometry_state_t &State);
+	void Refit(const geometry_state_t &State);
+	int Update(const geometry_state_t &State);
+	bool Raycast(const geometry_state_t &State, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Slot, float *Distance) const;
+	uint32_t QueryFrustum(const geometry_state_t &State, const uMATH::frustum_t &Frustum, uint32_t *Slots) const;
+	void Release();
+
+	private:
+
+	void ComputePrimBounds(const geometry_state_t &State, uint32_t Slot);
+	void Subdivide(uint32_t NodeIndex, uint32_t Depth);
+	int Patch(const geometry_state_t &State);
+	int Insert(uint32_t Slot, geometry_handle_t Handle);
+};
+
+
+}
+
+
+#endif
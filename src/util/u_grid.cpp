@@ -0,0 +1,617 @@
+#include "u_grid.h"
+#include "u_phys.h"
+
+#include <float.h>
+#include <string.h>
+
+
+namespace uPHYS
+{
+
+
+// Mask is the bucket count minus one, which is always a power of two
+static uint32_t HashCell(int32_t X, int32_t Y, int32_t Z, uint32_t Mask)
+{
+	uint32_t h = ((uint32_t)X * 73856093u) ^ ((uint32_t)Y * 19349663u) ^ ((uint32_t)Z * 83492791u);
+	return h & Mask;
+}
+
+
+static bool OverlapAABB(const uMATH::vec3f_t &AMin, const uMATH::vec3f_t &AMax, const uMATH::vec3f_t &BMin, const uMATH::vec3f_t &BMax)
+{
+	return AMin.x <= BMax.x && AMax.x >= BMin.x &&
+		AMin.y <= BMax.y && AMax.y >= BMin.y &&
+		AMin.z <= BMax.z && AMax.z >= BMin.z;
+}
+
+
+void grid_t::CellOf(const uMATH::vec3f_t &P, int32_t *Out) const
+{
+	Out[0] = (int32_t)floorf(P.x * InvCellSize);
+	Out[1] = (int32_t)floorf(P.y * InvCellSize);
+	Out[2] = (int32_t)floorf(P.z * InvCellSize);
+}
+
+
+uint32_t grid_t::NextStamp()
+{
+	QueryStamp++;
+	if (QueryStamp == 0)
+	{
+		for (uint32_t c = 0; c < Stamp.ChunkCount; c++)
+		{
+			memset(Stamp.Chunks[c], 0, GEOMETRY_CHUNK_SIZE * sizeof(uint32_t));
+		}
+		QueryStamp = 1;
+	}
+
+	return QueryStamp;
+}
+
+
+// Add at least Count entries to the free list, lowest indices on top
+int grid_t::GrowEntries(uint32_t Count)
+{
+	if (Entries.Reserve(EntryCount + Count) != 0 || FreeEntries.Reserve(Entries.Capacity) != 0)
+	{
+		return -1;
+	}
+
+	for (uint32_t e = Entries.Capacity; e > EntryCount; e--)
+	{
+		FreeEntries[FreeCount] = e - 1;
+		FreeCount++;
+	}
+	EntryCount = Entries.Capacity;
+
+	return 0;
+}
+
+
+// Start over from every live object in State. A Size of GRID_CELL_AUTO picks twice the mean AABB extent,
+// which keeps a typical object within 2 cells per axis and so within GRID_MAX_CELLS cells overall
+int grid_t::Build(const geometry_state_t &State, float Size)
+{
+	Built = false;
+
+	uint32_t buckets = GRID_MIN_BUCKETS;
+	while (buckets < 2 * State.Count && buckets < (1u << 31))
+	{
+		buckets <<= 1;
+	}
+	if (Buckets.Reserve(buckets) != 0)
+	{
+		printf("System: grid failed to allocate\n");
+		return -1;
+	}
+	BucketCount = buckets;
+
+	if (Size <= 0.0f)
+	{
+		float sum = 0.0f;
+		for (uint32_t i = 0; i < State.Count; i++)
+		{
+			uMATH::vec3f_t bmin, bmax;
+			ComputeOBBBounds(State.Model[i], &bmin, &bmax);
+			sum += fmaxf(bmax.x - bmin.x, fmaxf(bmax.y - bmin.y, bmax.z - bmin.z));
+		}
+
+		Size = (State.Count > 0) ? 2.0f * (sum / State.Count) : 1.0f;
+	}
+
+	CellSize = fmaxf(Size, 0.01f);
+	InvCellSize = 1.0f / CellSize;
+
+	for (uint32_t b = 0; b < BucketCount; b++)
+	{
+		Buckets[b] = GRID_NONE;
+	}
+	// Every entry is free again. Keep the storage - a rebuild usually needs about as many
+	FreeCount = 0;
+	uint32_t entries = EntryCount;
+	EntryCount = 0;
+	GrowEntries(entries);
+
+	for (uint32_t c = 0; c < Placed.ChunkCount; c++)
+	{
+		memset(Placed.Chunks[c], GRID_PLACED_NONE, GEOMETRY_CHUNK_SIZE);
+	}
+	OversizeCount = 0;
+	ObjectCount = 0;
+	GridMin = { FLT_MAX, FLT_MAX, FLT_MAX };
+	GridMax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		uMATH::vec3f_t bmin, bmax;
+		ComputeOBBBounds(State.Model[i], &bmin, &bmax);
+		Insert(i, bmin, bmax);
+	}
+
+	SlotCount = State.Count;
+	Revision = State.Revision;
+	TransformRevision = State.TransformRevision;
+	ChangeStamp = State.ChangeStamp;
+	Built = true;
+	return 0;
+}
+
+
+void grid_t::Sync(const geometry_state_t &State, uint32_t Slot)
+{
+	uMATH::vec3f_t bmin, bmax;
+	ComputeOBBBounds(State.Model[Slot], &bmin, &bmax);
+	Move(Slot, bmin, bmax);
+}
+
+
+// Bring the grid up to date with State. Only slots the store's change journal names are looked at, as long as
+// nothing changed between the last sync and the journal last being cleared - otherwise every slot is. Either way each slot costs
+// O(1): slots past the end of the store are removed, and the rest only touch the grid if their object crossed
+// a cell boundary or a different object was moved into them by a free
+int grid_t::Update(const geometry_state_t &State)
+{
+	// Past half a bucket per object the chains get long - start over with twice as many
+	if (!Built || State.Count > BucketCount / 2)
+	{
+		if (Build(State, CellSize) != 0)
+		{
+			return GRID_UPDATE_NONE;
+		}
+		return GRID_UPDATE_BUILD;
+	}
+	// In step with the store, so from here on the journal holds everything that changes
+	if (Revision == State.Revision && TransformRevision == State.TransformRevision)
+	{
+		ChangeStamp = State.ChangeStamp;
+		return GRID_UPDATE_NONE;
+	}
+
+	if (ChangeStamp >= State.ClearedStamp)
+	{
+		// Ranges journaled before a free can reach past the objects that are left
+		for (uint32_t r = 0; r < State.JournalCount; r++)
+		{
+			const geometry_range_t &range = State.Journal[r];
+			uint32_t end = (range.First + range.Length < State.Count) ? range.First + range.Length : State.Count;
+			for (uint32_t i = range.First; i < end; i++)
+			{
+				Sync(State, i);
+			}
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < State.Count; i++)
+		{
+			Sync(State, i);
+		}
+	}
+	for (uint32_t i = State.Count; i < SlotCount; i++)
+	{
+		Remove(i);
+	}
+
+	SlotCount = State.Count;
+
+	Revision = State.Revision;
+	TransformRevision = State.TransformRevision;
+	ChangeStamp = State.ChangeStamp;
+	return GRID_UPDATE_SYNC;
+}
+
+
+void grid_t::Insert(uint32_t Slot, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max)
+{
+	if (Placed.Reserve(Slot + 1) != 0 || SlotEntries.Reserve(Slot + 1) != 0 || Range.Reserve(Slot + 1) != 0 ||
+		BoundsMin.Reserve(Slot + 1) != 0 || BoundsMax.Reserve(Slot + 1) != 0 || OversizeIndex.Reserve(Slot + 1) != 0 ||
+		Stamp.Reserve(Slot + 1) != 0 || Oversize.Reserve(OversizeCount + 1) != 0)
+	{
+		printf("System: grid failed to allocate\n");
+		return;
+	}
+
+	if (Placed[Slot] != GRID_PLACED_NONE)
+	{
+		Remove(Slot);
+	}
+
+	int32_t *cmin = Range[Slot].Min;
+	int32_t *cmax = Range[Slot].Max;
+	CellOf(Min, cmin);
+	CellOf(Max, cmax);
+	BoundsMin[Slot] = Min;
+	BoundsMax[Slot] = Max;
+	ObjectCount++;
+
+	// Compare per axis first - the product of three huge spans can overflow
+	uint32_t sx = (uint32_t)(cmax[0] - cmin[0]) + 1;
+	uint32_t sy = (uint32_t)(cmax[1] - cmin[1]) + 1;
+	uint32_t sz = (uint32_t)(cmax[2] - cmin[2]) + 1;
+	bool oversize = sx > GRID_MAX_CELLS || sy > GRID_MAX_CELLS || sz > GRID_MAX_CELLS || sx * sy * sz > GRID_MAX_CELLS;
+	if (!oversize && FreeCount < sx * sy * sz && GrowEntries(sx * sy * sz) != 0)
+	{
+		oversize = true;
+	}
+	if (oversize)
+	{
+		Placed[Slot] = GRID_PLACED_OVERSIZE;
+		OversizeIndex[Slot] = OversizeCount;
+		Oversize[OversizeCount] = Slot;
+		OversizeCount++;
+		return;
+	}
+
+	Placed[Slot] = GRID_PLACED_CELLS;
+	SlotEntries[Slot] = GRID_NONE;
+
+	for (int32_t z = cmin[2]; z <= cmax[2]; z++)
+	{
+		for (int32_t y = cmin[1]; y <= cmax[1]; y++)
+		{
+			for (int32_t x = cmin[0]; x <= cmax[0]; x++)
+			{
+				FreeCount--;
+				uint32_t e = FreeEntries[FreeCount];
+				uint32_t b = HashCell(x, y, z, BucketCount - 1);
+
+				Entries[e].X = x;
+				Entries[e].Y = y;
+				Entries[e].Z = z;
+				Entries[e].Slot = Slot;
+				Entries[e].Prev = GRID_NONE;
+				Entries[e].Next = Buckets[b];
+				if (Buckets[b] != GRID_NONE)
+				{
+					Entries[Buckets[b]].Prev = e;
+				}
+				Buckets[b] = e;
+
+				Entries[e].SlotNext = SlotEntries[Slot];
+				SlotEntries[Slot] = e;
+			}
+		}
+	}
+
+	GridMin.x = fminf(GridMin.x, Min.x);
+	GridMin.y = fminf(GridMin.y, Min.y);
+	GridMin.z = fminf(GridMin.z, Min.z);
+	GridMax.x = fmaxf(GridMax.x, Max.x);
+	GridMax.y = fmaxf(GridMax.y, Max.y);
+	GridMax.z = fmaxf(GridMax.z, Max.z);
+}
+
+
+void grid_t::Remove(uint32_t Slot)
+{
+	if (Slot >= (Placed.ChunkCount << GEOMETRY_CHUNK_SHIFT) || Placed[Slot] == GRID_PLACED_NONE)
+	{
+		return;
+	}
+
+	if (Placed[Slot] == GRID_PLACED_OVERSIZE)
+	{
+		uint32_t last = Oversize[OversizeCount - 1];
+		Oversize[OversizeIndex[Slot]] = last;
+		OversizeIndex[last] = OversizeIndex[Slot];
+		OversizeCount--;
+	}
+	else
+	{
+		uint32_t e = SlotEntries[Slot];
+		while (e != GRID_NONE)
+		{
+			grid_entry_t *entry = &Entries[e];
+
+			if (entry->Prev != GRID_NONE)
+			{
+				Entries[entry->Prev].Next = entry->Next;
+			}
+			else
+			{
+				Buckets[HashCell(entry->X, entry->Y, entry->Z, BucketCount - 1)] = entry->Next;
+			}
+			if (entry->Next != GRID_NONE)
+			{
+				Entries[entry->Next].Prev = entry->Prev;
+			}
+
+			FreeEntries[FreeCount] = e;
+			FreeCount++;
+			e = entry->SlotNext;
+		}
+	}
+
+	Placed[Slot] = GRID_PLACED_NONE;
+	ObjectCount--;
+}
+
+
+// New bounds for a slot. Only re-links entries if the covered cell range changed
+void grid_t::Move(uint32_t Slot, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max)
+{
+	if (Slot < (Placed.ChunkCount << GEOMETRY_CHUNK_SHIFT) && Placed[Slot] == GRID_PLACED_CELLS)
+	{
+		int32_t cmin[3], cmax[3];
+		CellOf(Min, cmin);
+		CellOf(Max, cmax);
+
+		const grid_range_t &r = Range[Slot];
+		if (cmin[0] == r.Min[0] && cmin[1] == r.Min[1] && cmin[2] == r.Min[2] &&
+			cmax[0] == r.Max[0] && cmax[1] == r.Max[1] && cmax[2] == r.Max[2])
+		{
+			BoundsMin[Slot] = Min;
+			BoundsMax[Slot] = Max;
+			return;
+		}
+	}
+
+	Insert(Slot, Min, Max);
+}
+
+
+void grid_t::VisitCell(int32_t X, int32_t Y, int32_t Z, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max, uint32_t Mark, uint32_t *Slots, uint32_t *Count)
+{
+	for (uint32_t e = Buckets[HashCell(X, Y, Z, BucketCount - 1)]; e != GRID_NONE; e = Entries[e].Next)
+	{
+		const grid_entry_t *entry = &Entries[e];
+		uint32_t s = entry->Slot;
+
+		// Other cells can hash to the same bucket
+		if (entry->X != X || entry->Y != Y || entry->Z != Z || Stamp[s] == Mark)
+		{
+			continue;
+		}
+
+		Stamp[s] = Mark;
+		if (OverlapAABB(BoundsMin[s], BoundsMax[s], Min, Max))
+		{
+			Slots[*Count] = s;
+			(*Count)++;
+		}
+	}
+}
+
+
+// Write the slot of every object whose AABB overlaps [Min, Max] to Slots (room for every live object)
+// and return how many there were
+uint32_t grid_t::QueryAABB(const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max, uint32_t *Slots)
+{
+	uint32_t n = 0;
+	if (!Built || ObjectCount == 0)
+	{
+		return 0;
+	}
+
+	uint32_t mark = NextStamp();
+
+	for (uint32_t i = 0; i < OversizeCount; i++)
+	{
+		uint32_t s = Oversize[i];
+		Stamp[s] = mark;
+		if (OverlapAABB(BoundsMin[s], BoundsMax[s], Min, Max))
+		{
+			Slots[n++] = s;
+		}
+	}
+
+	// Nothing placed in cells lies outside GridMin/GridMax, so clamp the region to it
+	uMATH::vec3f_t qmin = { fmaxf(Min.x, GridMin.x), fmaxf(Min.y, GridMin.y), fmaxf(Min.z, GridMin.z) };
+	uMATH::vec3f_t qmax = { fminf(Max.x, GridMax.x), fminf(Max.y, GridMax.y), fminf(Max.z, GridMax.z) };
+	if (qmin.x > qmax.x || qmin.y > qmax.y || qmin.z > qmax.z)
+	{
+		return n;
+	}
+
+	int32_t cmin[3], cmax[3];
+	CellOf(qmin, cmin);
+	CellOf(qmax, cmax);
+
+	// A region covering more cells than there are entries is cheaper to answer by scanning the objects
+	uint64_t cells = (uint64_t)(cmax[0] - cmin[0] + 1) * (uint64_t)(cmax[1] - cmin[1] + 1) * (uint64_t)(cmax[2] - cmin[2] + 1);
+	if (cells > EntryCount - FreeCount)
+	{
+		uint32_t slots = Placed.ChunkCount << GEOMETRY_CHUNK_SHIFT;
+		for (uint32_t s = 0; s < slots; s++)
+		{
+			if (Placed[s] == GRID_PLACED_CELLS && OverlapAABB(BoundsMin[s], BoundsMax[s], Min, Max))
+			{
+				Slots[n++] = s;
+			}
+		}
+		return n;
+	}
+
+	for (int32_t z = cmin[2]; z <= cmax[2]; z++)
+	{
+		for (int32_t y = cmin[1]; y <= cmax[1]; y++)
+		{
+			for (int32_t x = cmin[0]; x <= cmax[0]; x++)
+			{
+				VisitCell(x, y, z, Min, Max, mark, Slots, &n);
+			}
+		}
+	}
+
+	return n;
+}
+
+
+// Every other object whose AABB comes within Radius of Slot's AABB
+uint32_t grid_t::QueryNeighbours(uint32_t Slot, float Radius, uint32_t *Slots)
+{
+	if (!Built || Slot >= (Placed.ChunkCount << GEOMETRY_CHUNK_SHIFT) || Placed[Slot] == GRID_PLACED_NONE)
+	{
+		return 0;
+	}
+
+	uMATH::vec3f_t r = { Radius, Radius, Radius };
+	uint32_t n = QueryAABB(BoundsMin[Slot] - r, BoundsMax[Slot] + r, Slots);
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if (Slots[i] == Slot)
+		{
+			Slots[i] = Slots[n - 1];
+			n--;
+			break;
+		}
+	}
+
+	return n;
+}
+
+
+// Closest hit along a unit-length ray, walking cells front to back with a 3D DDA. Objects are tested
+// once each, and the walk stops as soon as the best hit lies within the cell just visited, since every
+// object reaching closer than that is registered in a cell already walked
+bool grid_t::Raycast(const geometry_state_t &State, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Slot, float *Distance)
+{
+	*Slot = GRID_NONE;
+	*Distance = FLT_MAX;
+
+	if (!Built || ObjectCount == 0)
+	{
+		return false;
+	}
+
+	uMATH::vec3f_t boxmin = { -0.5f, -0.5f, -0.5f };
+	uMATH::vec3f_t boxmax = { 0.5f, 0.5f, 0.5f };
+	uint32_t mark = NextStamp();
+
+	for (uint32_t i = 0; i < OversizeCount; i++)
+	{
+		float d;
+		uint32_t s = Oversize[i];
+		if (CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, State.Model[s], &d) && d < *Distance)
+		{
+			*Distance = d;
+			*Slot = s;
+		}
+	}
+
+	if (ObjectCount == OversizeCount)
+	{
+		return *Slot != GRID_NONE;
+	}
+
+	// Clip the ray to the occupied bounds - every cell outside them is empty
+	float o[3] = { Origin.x, Origin.y, Origin.z };
+	float dir[3] = { Direction.x, Direction.y, Direction.z };
+	float lo[3] = { GridMin.x, GridMin.y, GridMin.z };
+	float hi[3] = { GridMax.x, GridMax.y, GridMax.z };
+	float tenter = 0.0f;
+	float texit = FLT_MAX;
+
+	for (int a = 0; a < 3; a++)
+	{
+		if (fabsf(dir[a]) < 1e-8f)
+		{
+			if (o[a] < lo[a] || o[a] > hi[a])
+			{
+				return *Slot != GRID_NONE;
+			}
+			continue;
+		}
+
+		float t1 = (lo[a] - o[a]) / dir[a];
+		float t2 = (hi[a] - o[a]) / dir[a];
+		tenter = fmaxf(tenter, fminf(t1, t2));
+		texit = fminf(texit, fmaxf(t1, t2));
+	}
+
+	if (tenter > texit || tenter >= *Distance)
+	{
+		return *Slot != GRID_NONE;
+	}
+
+	int32_t cell[3];
+	int32_t step[3];
+	float tnext[3];
+	float tdelta[3];
+	uMATH::vec3f_t start = Origin + uMATH::Scalar(Direction, tenter);
+	CellOf(start, cell);
+
+	for (int a = 0; a < 3; a++)
+	{
+		if (fabsf(dir[a]) < 1e-8f)
+		{
+			step[a] = 0;
+			tnext[a] = FLT_MAX;
+			tdelta[a] = FLT_MAX;
+			continue;
+		}
+
+		step[a] = (dir[a] > 0.0f) ? 1 : -1;
+		tdelta[a] = CellSize / fabsf(dir[a]);
+		float edge = (float)(cell[a] + ((step[a] > 0) ? 1 : 0)) * CellSize;
+		tnext[a] = (edge - o[a]) / dir[a];
+	}
+
+	// Walks never cross more cells than the occupied bounds span, plus slack for rounding at the edges
+	int32_t gmin[3], gmax[3];
+	CellOf(GridMin, gmin);
+	CellOf(GridMax, gmax);
+	uint32_t maxsteps = (uint32_t)((gmax[0] - gmin[0]) + (gmax[1] - gmin[1]) + (gmax[2] - gmin[2])) + 4;
+
+	for (uint32_t n = 0; n < maxsteps; n++)
+	{
+		float cellexit = fminf(tnext[0], fminf(tnext[1], tnext[2]));
+
+		for (uint32_t e = Buckets[HashCell(cell[0], cell[1], cell[2], BucketCount - 1)]; e != GRID_NONE; e = Entries[e].Next)
+		{
+			const grid_entry_t *entry = &Entries[e];
+			uint32_t s = entry->Slot;
+			if (entry->X != cell[0] || entry->Y != cell[1] || entry->Z != cell[2] || Stamp[s] == mark)
+			{
+				continue;
+			}
+
+			Stamp[s] = mark;
+			float d;
+			if (CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, State.Model[s], &d) && d < *Distance)
+			{
+				*Distance = d;
+				*Slot = s;
+			}
+		}
+
+		if (*Distance <= cellexit || cellexit > texit)
+		{
+			break;
+		}
+
+		int a = (tnext[0] < tnext[1]) ? ((tnext[0] < tnext[2]) ? 0 : 2) : ((tnext[1] < tnext[2]) ? 1 : 2);
+		cell[a] += step[a];
+		tnext[a] += tdelta[a];
+	}
+
+	return *Slot != GRID_NONE;
+}
+
+
+void grid_t::Release()
+{
+	Buckets.Release();
+	Entries.Release();
+	FreeEntries.Release();
+	Placed.Release();
+	SlotEntries.Release();
+	Range.Release();
+	BoundsMin.Release();
+	BoundsMax.Release();
+	Oversize.Release();
+	OversizeIndex.Release();
+	Stamp.Release();
+
+	BucketCount = 0;
+	EntryCount = 0;
+	FreeCount = 0;
+	OversizeCount = 0;
+	ObjectCount = 0;
+	SlotCount = 0;
+	Built = false;
+}
+
+
+}
@@ -0,0 +1,128 @@
+#ifndef MBOX_GRID_H
+#define MBOX_GRID_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_math.h"
+#include "u_mem.h"
+
+
+// Fewest hash buckets a build allocates. Builds pick a power of two at least twice the live object count
+#define GRID_MIN_BUCKETS 64
+// Objects covering more cells than this go on a separate list that every query checks directly
+#define GRID_MAX_CELLS 8
+#define GRID_NONE 0xFFFFFFFF
+
+// Pass as the cell size to have one picked from the objects in the grid
+#define GRID_CELL_AUTO 0.0f
+
+#define GRID_PLACED_NONE 0
+#define GRID_PLACED_CELLS 1
+#define GRID_PLACED_OVERSIZE 2
+
+#define GRID_UPDATE_NONE 0
+#define GRID_UPDATE_BUILD 1
+#define GRID_UPDATE_SYNC 2
+
+
+namespace uPHYS
+{
+
+
+// One object's membership in one cell. Entries of a bucket form a doubly linked list so any entry can be
+// unlinked in constant time, and the entries of one slot are chained through SlotNext
+struct grid_entry_t
+{
+	int32_t X;
+	int32_t Y;
+	int32_t Z;
+	uint32_t Slot;
+	uint32_t Prev;
+	uint32_t Next;
+	uint32_t SlotNext;
+};
+
+
+// Cell range covered by one slot, inclusive
+struct grid_range_t
+{
+	int32_t Min[3];
+	int32_t Max[3];
+};
+
+
+// Uniform spatial hash over the world AABBs of every live object in a geometry_state_t. Each object is
+// registered in every cell its AABB covers, so moving one object only touches its own cells: nothing
+// happens until it crosses a cell boundary, and then it costs at most 2 * GRID_MAX_CELLS entry updates
+struct grid_t
+{
+	float CellSize;
+	float InvCellSize;
+
+	packed_array_t<uint32_t> Buckets;
+	uint32_t BucketCount;
+
+	// Entries are allocated as cells fill up and recycled through FreeEntries, never given back before Release()
+	packed_array_t<grid_entry_t> Entries;
+	packed_array_t<uint32_t> FreeEntries;
+	uint32_t EntryCount;
+	uint32_t FreeCount;
+
+	// Per slot: where it is placed, its first entry, the cell range and AABB it was placed with
+	chunked_array_t<uint8_t> Placed;
+	chunked_array_t<uint32_t> SlotEntries;
+	chunked_array_t<grid_range_t> Range;
+	chunked_array_t<uMATH::vec3f_t> BoundsMin;
+	chunked_array_t<uMATH::vec3f_t> BoundsMax;
+
+	// Objects too large for the cells, removed by swapping with the last one
+	packed_array_t<uint32_t> Oversize;
+	chunked_array_t<uint32_t> OversizeIndex;
+	uint32_t OversizeCount;
+
+	// Everything placed in cells lies inside these bounds. They only grow until the next Build()
+	uMATH::vec3f_t GridMin;
+	uMATH::vec3f_t GridMax;
+	uint32_t ObjectCount;
+
+	// Store size at the last sync - slots at or above it that are still placed have been freed since
+	uint32_t SlotCount;
+
+	// Objects can sit in several cells - queries mark what they have already visited
+	chunked_array_t<uint32_t> Stamp;
+	uint32_t QueryStamp;
+
+	// geometry_state_t revisions and change stamp the grid was last synced against
+	uint32_t Revision;
+	uint32_t TransformRevision;
+	uint32_t ChangeStamp;
+	bool Built;
+
+	int Build(const geometry_state_t &State, float Size);
+	int Update(const geometry_state_t &State);
+	void Release();
+
+	void Insert(uint32_t Slot, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max);
+	void Remove(uint32_t Slot);
+	void Move(uint32_t Slot, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max);
+
+	uint32_t QueryAABB(const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max, uint32_t *Slots);
+	uint32_t QueryNeighbours(uint32_t Slot, float Radius, uint32_t *Slots);
+	bool Raycast(const geometry_state_t &State, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Slot, float *Distance);
+
+	private:
+
+	void Sync(const geometry_state_t &State, uint32_t Slot);
+	void CellOf(const uMATH::vec3f_t &P, int32_t *Out) const;
+	uint32_t NextStamp();
+	int GrowEntries(uint32_t Count);
+	void VisitCell(int32_t X, int32_t Y, int32_t Z, const uMATH::vec3f_t &Min, const uMATH::vec3f_t &Max, uint32_t Mark, uint32_t *Slots, uint32_t *Count);
+};
+
+
+}
+
+
+#endif
@@ -0,0 +1,475 @@
+#include "u_hier.h"
+
+
+static hier_transform_t ReadWorld(const geometry_state_t &State, uint32_t Index)
+{
+	hier_transform_t res;
+	res.Pos = { State.PosX[Index], State.PosY[Index], State.PosZ[Index] };
+	res.Scale = State.Scale[Index];
+	res.Rot = { State.RotX[Index], State.RotY[Index], State.RotZ[Index], State.RotW[Index] };
+
+	return res;
+}
+
+
+// Store a world transform back into the object's components and rebuild its model matrix
+static void WriteWorld(geometry_state_t *State, uint32_t Index, const hier_transform_t &World)
+{
+	State->PosX[Index] = World.Pos.x;
+	State->PosY[Index] = World.Pos.y;
+	State->PosZ[Index] = World.Pos.z;
+	State->RotX[Index] = World.Rot.x;
+	State->RotY[Index] = World.Rot.y;
+	State->RotZ[Index] = World.Rot.z;
+	State->RotW[Index] = World.Rot.w;
+	State->Scale[Index] = World.Scale;
+	State->BoundRadius[Index] = World.Scale * MESH_CUBE_RADIUS;
+	uMATH::ComposeAF(World.Pos, World.Rot, World.Scale, &State->Model[Index]);
+	State->MarkChanged(Index, 1);
+}
+
+
+// Child's world transform from its parent's and its own local one: scale, then rotate, then translate
+static hier_transform_t ToWorld(const hier_transform_t &Parent, const hier_transform_t &Local)
+{
+	hier_transform_t res;
+	res.Scale = Parent.Scale * Local.Scale;
+	res.Rot = uMATH::Normalize(Parent.Rot * Local.Rot);
+	res.Pos = Parent.Pos + uMATH::Rotate(Parent.Rot, uMATH::Scalar(Local.Pos, Parent.Scale));
+
+	return res;
+}
+
+
+// Inverse of ToWorld() - the local transform that puts a child at World under Parent
+static hier_transform_t ToLocal(const hier_transform_t &Parent, const hier_transform_t &World)
+{
+	uMATH::quatf_t inv = uMATH::Conjugate(Parent.Rot);
+
+	hier_transform_t res;
+	res.Scale = World.Scale / Parent.Scale;
+	res.Rot = uMATH::Normalize(inv * World.Rot);
+	res.Pos = uMATH::Scalar(uMATH::Rotate(inv, World.Pos - Parent.Pos), 1.0f / Parent.Scale);
+
+	return res;
+}
+
+
+// Attach Child to NewParent, keeping the child where it is in the world, or detach it when NewParent is
+// GEOMETRY_HANDLE_NONE. Fails if it would make an object its own ancestor
+int hierarchy_t::SetParent(const geometry_state_t &State, geometry_handle_t Child, geometry_handle_t NewParent)
+{
+	uint32_t c;
+	uint32_t p = 0;
+	if (!State.Resolve(Child, &c) || (NewParent != GEOMETRY_HANDLE_NONE && !State.Resolve(NewParent, &p)) || Child == NewParent)
+	{
+		printf("System: invalid objects for parenting\n");
+		return -1;
+	}
+	if (LinkOf.Reserve(State.IdCount) != 0 || ChildCount.Reserve(State.IdCount) != 0)
+	{
+		printf("System: hierarchy failed to grow\n");
+		return -1;
+	}
+
+	// Parenting under one of its own descendants would make a cycle, so walk up from the new parent. An object
+	// with no children has no descendants, which keeps building a deep chain from the top down linear
+	uint32_t cid = Child & GEOMETRY_HANDLE_INDEX_MASK;
+	if (NewParent != GEOMETRY_HANDLE_NONE && ChildCount[cid] > 0)
+	{
+		geometry_handle_t h = NewParent;
+		for (uint32_t steps = 0; steps <= LinkCount; steps++)
+		{
+			if (h == Child)
+			{
+				printf("System: an object cannot be parented under its own descendant\n");
+				return -1;
+			}
+
+			uint32_t l = LinkOf[h & GEOMETRY_HANDLE_INDEX_MASK];
+			if (l == 0 || Links[l - 1].Child != h)
+			{
+				break;
+			}
+			h = Links[l - 1].Parent;
+		}
+	}
+
+	// An object has at most one parent. A link under this ID for an older object is dead as well
+	if (LinkOf[cid] != 0)
+	{
+		RemoveLink(LinkOf[cid] - 1);
+	}
+	Built = false;
+
+	if (NewParent == GEOMETRY_HANDLE_NONE)
+	{
+		return 0;
+	}
+
+	if (Links.Reserve(LinkCount + 1) != 0)
+	{
+		printf("System: hierarchy failed to grow\n");
+		return -1;
+	}
+
+	hier_link_t &link = Links[LinkCount];
+	link.Child = Child;
+	link.Parent = NewParent;
+	link.Local = ToLocal(ReadWorld(State, p), ReadWorld(State, c));
+	link.Active = 0;
+	LinkCount++;
+
+	LinkOf[cid] = LinkCount;
+	ChildCount[NewParent & GEOMETRY_HANDLE_INDEX_MASK]++;
+	return 0;
+}
+
+
+// Swap-remove a link, keeping the per-ID lookups pointing at the right entries
+void hierarchy_t::RemoveLink(uint32_t Index)
+{
+	uint32_t cid = Links[Index].Child & GEOMETRY_HANDLE_INDEX_MASK;
+	uint32_t pid = Links[Index].Parent & GEOMETRY_HANDLE_INDEX_MASK;
+	if (LinkOf[cid] == Index + 1)
+	{
+		LinkOf[cid] = 0;
+	}
+	if (ChildCount[pid] > 0)
+	{
+		ChildCount[pid]--;
+	}
+
+	uint32_t last = LinkCount - 1;
+	if (Index != last)
+	{
+		Links[Index] = Links[last];
+		uint32_t moved = Links[Index].Child & GEOMETRY_HANDLE_INDEX_MASK;
+		if (LinkOf[moved] == last + 1)
+		{
+			LinkOf[moved] = Index + 1;
+		}
+	}
+
+	LinkCount--;
+	Built = false;
+}
+
+
+// Whether any link has gained or lost one of its objects since the layout was built
+bool hierarchy_t::LinksChanged(const geometry_state_t &State) const
+{
+	for (uint32_t i = 0; i < LinkCount; i++)
+	{
+		uint32_t c, p;
+		uint32_t active = (State.Resolve(Links[i].Child, &c) && State.Resolve(Links[i].Parent, &p)) ? 1 : 0;
+		if (active != Links[i].Active)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+// Lay out every object in a live link depth first. Children are grouped by parent with a counting sort, then an
+// explicit stack walks down from the roots, so depth costs nothing beyond the stack entries. Objects caught in a
+// cycle are never reached from a root and stay out of the layout
+int hierarchy_t::Rebuild(const geometry_state_t &State)
+{
+	for (uint32_t k = 0; k < Count; k++)
+	{
+		PositionOf[Node[k] & GEOMETRY_HANDLE_INDEX_MASK] = 0;
+	}
+	Count = 0;
+	Built = false;
+
+	if (LinkOf.Reserve(State.IdCount) != 0 || ChildCount.Reserve(State.IdCount) != 0 || PositionOf.Reserve(State.IdCount) != 0)
+	{
+		printf("System: hierarchy failed to grow\n");
+		return -1;
+	}
+
+	// A freed object can come back under the same handle, but not once its ID belongs to another object
+	for (uint32_t i = LinkCount; i > 0; i--)
+	{
+		uint32_t d;
+		const hier_link_t &l = Links[i - 1];
+		bool childgone = !State.Resolve(l.Child, &d) && State.IdLive(l.Child & GEOMETRY_HANDLE_INDEX_MASK);
+		bool parentgone = !State.Resolve(l.Parent, &d) && State.IdLive(l.Parent & GEOMETRY_HANDLE_INDEX_MASK);
+		if (childgone || parentgone)
+		{
+			RemoveLink(i - 1);
+		}
+	}
+
+	uint32_t m = 2 * LinkCount;
+	if (Scratch.Reserve((7 * m) + 1) != 0)
+	{
+		printf("System: hierarchy failed to grow\n");
+		return -1;
+	}
+	uint32_t *handle = Scratch.Data;
+	uint32_t *parent = handle + m;
+	uint32_t *link = parent + m;
+	uint32_t *position = link + m;
+	uint32_t *list = position + m;
+	uint32_t *stack = list + m;
+	uint32_t *start = stack + m;
+
+	// Number every object in a live link, using PositionOf as the ID to number map for now
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < LinkCount; i++)
+	{
+		hier_link_t &l = Links[i];
+		uint32_t d;
+		l.Active = (State.Resolve(l.Child, &d) && State.Resolve(l.Parent, &d)) ? 1 : 0;
+		if (!l.Active)
+		{
+			continue;
+		}
+
+		geometry_handle_t pair[2] = { l.Parent, l.Child };
+		uint32_t t[2];
+		for (uint32_t e = 0; e < 2; e++)
+		{
+			uint32_t id = pair[e] & GEOMETRY_HANDLE_INDEX_MASK;
+			if (PositionOf[id] == 0)
+			{
+				handle[n] = pair[e];
+				parent[n] = HIER_NONE;
+				link[n] = HIER_NONE;
+				position[n] = HIER_NONE;
+				n++;
+				PositionOf[id] = n;
+			}
+			t[e] = PositionOf[id] - 1;
+		}
+
+		parent[t[1]] = t[0];
+		link[t[1]] = i;
+	}
+
+	// Children of each object, grouped by a counting sort on the parent
+	for (uint32_t t = 0; t <= n; t++)
+	{
+		start[t] = 0;
+	}
+	for (uint32_t t = 0; t < n; t++)
+	{
+		if (parent[t] != HIER_NONE)
+		{
+			start[parent[t] + 1]++;
+		}
+	}
+	for (uint32_t t = 0; t < n; t++)
+	{
+		start[t + 1] += start[t];
+	}
+	for (uint32_t t = 0; t < n; t++)
+	{
+		stack[t] = start[t];
+	}
+	for (uint32_t t = 0; t < n; t++)
+	{
+		if (parent[t] != HIER_NONE)
+		{
+			list[stack[parent[t]]++] = t;
+		}
+	}
+
+	if (Node.Reserve(n) != 0 || Dense.Reserve(n) != 0 || Parent.Reserve(n) != 0 || Size.Reserve(n) != 0 || Link.Reserve(n) != 0 ||
+		Local.Reserve(n) != 0 || World.Reserve(n) != 0 || Dirty.Reserve(n) != 0)
+	{
+		for (uint32_t t = 0; t < n; t++)
+		{
+			PositionOf[handle[t] & GEOMETRY_HANDLE_INDEX_MASK] = 0;
+		}
+		printf("System: hierarchy failed to grow\n");
+		return -1;
+	}
+
+	// Depth first from every root. Each object is pushed exactly once, so the stack never holds more than n
+	uint32_t top = 0;
+	for (uint32_t t = n; t > 0; t--)
+	{
+		if (parent[t - 1] == HIER_NONE)
+		{
+			stack[top++] = t - 1;
+		}
+	}
+
+	uint32_t k = 0;
+	while (top > 0)
+	{
+		uint32_t t = stack[--top];
+		position[t] = k;
+		Node[k] = handle[t];
+		Parent[k] = (parent[t] == HIER_NONE) ? HIER_NONE : position[parent[t]];
+		Link[k] = link[t];
+		k++;
+
+		for (uint32_t c = start[t + 1]; c > start[t]; c--)
+		{
+			stack[top++] = list[c - 1];
+		}
+	}
+	Count = k;
+
+	for (uint32_t t = 0; t < n; t++)
+	{
+		PositionOf[handle[t] & GEOMETRY_HANDLE_INDEX_MASK] = (position[t] == HIER_NONE) ? 0 : position[t] + 1;
+	}
+
+	// Subtree sizes, children before parents
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Size[i] = 1;
+	}
+	for (uint32_t i = Count; i > 1; i--)
+	{
+		if (Parent[i - 1] != HIER_NONE)
+		{
+			Size[Parent[i - 1]] += Size[i - 1];
+		}
+	}
+
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		State.Resolve(Node[i], &Dense[i]);
+		World[i] = ReadWorld(State, Dense[i]);
+		Local[i] = (Link[i] == HIER_NONE) ? hier_transform_t{ { 0.0f, 0.0f, 0.0f }, 1.0f, { 0.0f, 0.0f, 0.0f, 1.0f } } : Links[Link[i]].Local;
+		Dirty[i] = 0;
+	}
+
+	Built = true;
+	return 0;
+}
+
+
+// Move every child whose parent moved. Reads the store's change journal, so it has to run before whatever
+// clears it (the instance buffer's Sync). An object that moved by itself keeps its new place, even if its
+// parent moved too, and its local transform is re-derived from it; everything below it follows. Returns -1
+// if the layout could not be built
+int hierarchy_t::Update(geometry_state_t *State)
+{
+	Updated = 0;
+	if (PositionOf.Reserve(State->IdCount) != 0)
+	{
+		printf("System: hierarchy failed to grow\n");
+		return -1;
+	}
+
+	if (!Built || (State->Revision != Revision && LinksChanged(*State)))
+	{
+		if (Rebuild(*State) != 0)
+		{
+			return -1;
+		}
+	}
+	else if (State->Revision != Revision)
+	{
+		// Same objects, but a free may have moved some of them to other dense indices
+		for (uint32_t k = 0; k < Count; k++)
+		{
+			State->Resolve(Node[k], &Dense[k]);
+		}
+	}
+	Revision = State->Revision;
+
+	if (Count == 0)
+	{
+		return 0;
+	}
+
+	uint32_t marked = 0;
+	for (uint32_t r = 0; r < State->JournalCount; r++)
+	{
+		const geometry_range_t &range = State->Journal[r];
+		uint32_t end = (range.First + range.Length < State->Count) ? range.First + range.Length : State->Count;
+		for (uint32_t d = range.First; d < end; d++)
+		{
+			uint32_t p = PositionOf[State->Ids[d]];
+			if (p != 0)
+			{
+				Dirty[p - 1] = 1;
+				marked++;
+			}
+		}
+	}
+
+	// Nothing in the layout moved - the usual frame
+	if (marked == 0)
+	{
+		return 0;
+	}
+
+	// One pass in layout order. A dirty node takes its whole subtree with it, and the pass resumes after it
+	for (uint32_t k = 0; k < Count;)
+	{
+		if (!Dirty[k])
+		{
+			k++;
+			continue;
+		}
+
+		World[k] = ReadWorld(*State, Dense[k]);
+		if (Parent[k] != HIER_NONE)
+		{
+			Local[k] = ToLocal(World[Parent[k]], World[k]);
+			Links[Link[k]].Local = Local[k];
+		}
+		Dirty[k] = 0;
+
+		// A child that was journaled itself keeps its own new place, same as k, and only its local transform changes
+		uint32_t end = k + Size[k];
+		for (uint32_t j = k + 1; j < end; j++)
+		{
+			if (Dirty[j])
+			{
+				World[j] = ReadWorld(*State, Dense[j]);
+				Local[j] = ToLocal(World[Parent[j]], World[j]);
+				Links[Link[j]].Local = Local[j];
+				Dirty[j] = 0;
+				continue;
+			}
+
+			World[j] = ToWorld(World[Parent[j]], Local[j]);
+			WriteWorld(State, Dense[j], World[j]);
+		}
+
+		Updated += end - k;
+		k = end;
+	}
+
+	if (Updated > 0)
+	{
+		State->TransformRevision++;
+	}
+
+	return 0;
+}
+
+
+void hierarchy_t::Release()
+{
+	Links.Release();
+	LinkOf.Release();
+	ChildCount.Release();
+	Node.Release();
+	Dense.Release();
+	Parent.Release();
+	Size.Release();
+	Link.Release();
+	Local.Release();
+	World.Release();
+	Dirty.Release();
+	PositionOf.Release();
+	Scratch.Release();
+
+	LinkCount = 0;
+	Count = 0;
+	Updated = 0;
+	Built = false;
+}
@@ -0,0 +1,90 @@
+#ifndef MBOX_HIER_H
+#define MBOX_HIER_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_math.h"
+#include "u_mem.h"
+
+
+#define HIER_NONE 0xFFFFFFFF
+
+
+// Position, rotation and uniform scale - the same components geometry_state_t stores per object
+struct hier_transform_t
+{
+	uMATH::vec3f_t Pos;
+	float Scale;
+	uMATH::quatf_t Rot;
+};
+
+
+// Child is attached to Parent. Local is the child's transform in its parent's space - what it keeps when the
+// parent moves. Active is whether both objects were live at the last layout build
+struct hier_link_t
+{
+	geometry_handle_t Child;
+	geometry_handle_t Parent;
+	hier_transform_t Local;
+	uint32_t Active;
+};
+
+
+// Parent/child relationships between objects in a geometry_state_t. Object transforms in the store stay in world
+// space, so culling, picking and the simulation never have to know about the hierarchy - this only moves children
+// when their parents move.
+// Every object that is part of a live link is laid out depth first, so parents come before their children and
+// each subtree is one contiguous run of Size entries. Update() finds the objects the store's change journal names,
+// and for each one recomputes its whole run in a single forward pass over flat arrays, skipping clean subtrees
+// entirely. Links survive their objects being freed, so undo (which revives objects under their old handles)
+// brings the relationship back too; they are only dropped once an object's ID has been handed to something else
+struct hierarchy_t
+{
+	packed_array_t<hier_link_t> Links;
+	uint32_t LinkCount;
+
+	// Per object ID: the link naming it as the child, plus one (0 for none), and how many links name it as the
+	// parent
+	chunked_array_t<uint32_t> LinkOf;
+	chunked_array_t<uint32_t> ChildCount;
+
+	// Layout, in depth-first order. Parent is a layout position (HIER_NONE for roots), Link the index of the
+	// node's own link, and World the transform last written to the store
+	packed_array_t<geometry_handle_t> Node;
+	packed_array_t<uint32_t> Dense;
+	packed_array_t<uint32_t> Parent;
+	packed_array_t<uint32_t> Size;
+	packed_array_t<uint32_t> Link;
+	packed_array_t<hier_transform_t> Local;
+	packed_array_t<hier_transform_t> World;
+	packed_array_t<uint8_t> Dirty;
+	uint32_t Count;
+
+	// Per object ID: layout position plus one, 0 for objects outside the layout
+	chunked_array_t<uint32_t> PositionOf;
+
+	// Working space for Rebuild(), kept between builds
+	packed_array_t<uint32_t> Scratch;
+
+	// geometry_state_t revision Dense was last brought up to date against
+	uint32_t Revision;
+	bool Built;
+
+	// Nodes recomputed by the last Update()
+	uint32_t Updated;
+
+	int SetParent(const geometry_state_t &State, geometry_handle_t Child, geometry_handle_t NewParent);
+	int Update(geometry_state_t *State);
+	void Release();
+
+	private:
+
+	void RemoveLink(uint32_t Index);
+	bool LinksChanged(const geometry_state_t &State) const;
+	int Rebuild(const geometry_state_t &State);
+};
+
+
+#endif
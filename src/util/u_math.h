@@ -1,9 +1,21 @@
 #ifndef MBOX_UMATH_H
 #define MBOX_UMATH_H
 
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 
+// SIMD backend is chosen at compile time: AVX when the compiler targets it (-mavx, /arch:AVX), otherwise SSE2,
+// which every x64 target has. Define UMATH_NO_SIMD to force the scalar path
+#if !defined(UMATH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define UMATH_SIMD_SSE 1
+#include <emmintrin.h>
+#if defined(__AVX__)
+#define UMATH_SIMD_AVX 1
+#include <immintrin.h>
+#endif
+#endif
+
 
 #define VEC3_F -1000
 #define VEC4_F -1001
@@ -68,60 +80,185 @@ struct vec4f_t
 };
 
 
+// Rotation quaternion, (x, y, z) vector part and w scalar part. Functions taking a quatf_t expect unit length
+// unless stated otherwise
+struct quatf_t
+{
+	float x, y, z, w;
+};
+
+
 struct mat4f_t
 {
 	float m[4][4];
 
-	void operator *=(const mat4f_t &s)
-	{
-		m[0][0] = (m[0][0] * s.m[0][0]) + (m[0][1] * s.m[1][0]) + (m[0][2] * s.m[2][0]) + (m[0][3] * s.m[3][0]);
-		m[0][1] = (m[0][0] * s.m[0][1]) + (m[0][1] * s.m[1][1]) + (m[0][2] * s.m[2][1]) + (m[0][3] * s.m[3][1]);
-		m[0][2] = (m[0][0] * s.m[0][2]) + (m[0][1] * s.m[1][2]) + (m[0][2] * s.m[2][2]) + (m[0][3] * s.m[3][2]);
-		m[0][3] = (m[0][0] * s.m[0][3]) + (m[0][1] * s.m[1][3]) + (m[0][2] * s.m[2][3]) + (m[0][3] * s.m[3][3]);
+	void operator *=(const mat4f_t &s);
+	mat4f_t operator *(const mat4f_t &s) const;
+};
 
-		m[1][0] = (m[1][0] * s.m[0][0]) + (m[1][1] * s.m[1][0]) + (m[1][2] * s.m[2][0]) + (m[1][3] * s.m[3][0]);
-		m[1][1] = (m[1][0] * s.m[0][1]) + (m[1][1] * s.m[1][1]) + (m[1][2] * s.m[2][1]) + (m[1][3] * s.m[3][1]);
-		m[1][2] = (m[1][0] * s.m[0][2]) + (m[1][1] * s.m[1][2]) + (m[1][2] * s.m[2][2]) + (m[1][3] * s.m[3][2]);
-		m[1][3] = (m[1][0] * s.m[0][3]) + (m[1][1] * s.m[1][3]) + (m[1][2] * s.m[2][3]) + (m[1][3] * s.m[3][3]);
 
-		m[2][0] = (m[2][0] * s.m[0][0]) + (m[2][1] * s.m[1][0]) + (m[2][2] * s.m[2][0]) + (m[2][3] * s.m[3][0]);
-		m[2][1] = (m[2][0] * s.m[0][1]) + (m[2][1] * s.m[1][1]) + (m[2][2] * s.m[2][1]) + (m[2][3] * s.m[3][1]);
-		m[2][2] = (m[2][0] * s.m[0][2]) + (m[2][1] * s.m[1][2]) + (m[2][2] * s.m[2][2]) + (m[2][3] * s.m[3][2]);
-		m[2][3] = (m[2][0] * s.m[0][3]) + (m[2][1] * s.m[1][3]) + (m[2][2] * s.m[2][3]) + (m[2][3] * s.m[3][3]);
+// Affine transform: the top three rows of a mat4f_t, with an implied (0, 0, 0, 1) bottom row. Same row-major
+// layout and m[i][3] translation, so it uploads as a GLSL mat3x4 with GL_FALSE just like mat4f_t does as mat4
+struct aff3f_t
+{
+	float m[3][4];
+
+	void operator *=(const aff3f_t &s);
+	aff3f_t operator *(const aff3f_t &s) const;
+};
+
+
+// Parallel arrays of per-object transform components, read by the batch kernels. Rotation is a unit quaternion
+struct transform_soa_t
+{
+	const float *PosX;
+	const float *PosY;
+	const float *PosZ;
+	const float *RotX;
+	const float *RotY;
+	const float *RotZ;
+	const float *RotW;
+	const float *Scale;
+};
+
+
+// Bounding spheres as parallel arrays, read by the culling kernel
+struct sphere_soa_t
+{
+	const float *X;
+	const float *Y;
+	const float *Z;
+	const float *Radius;
+};
 
-		m[3][0] = (m[3][0] * s.m[0][0]) + (m[3][1] * s.m[1][0]) + (m[3][2] * s.m[2][0]) + (m[3][3] * s.m[3][0]);
-		m[3][1] = (m[3][0] * s.m[0][1]) + (m[3][1] * s.m[1][1]) + (m[3][2] * s.m[2][1]) + (m[3][3] * s.m[3][1]);
-		m[3][2] = (m[3][0] * s.m[0][2]) + (m[3][1] * s.m[1][2]) + (m[3][2] * s.m[2][2]) + (m[3][3] * s.m[3][2]);
-		m[3][3] = (m[3][0] * s.m[0][3]) + (m[3][1] * s.m[1][3]) + (m[3][2] * s.m[2][3]) + (m[3][3] * s.m[3][3]);
+
+// Six planes as (normal, distance) with normals pointing inward - a point p is inside a plane when
+// Dot(normal, p) + distance >= 0. Order is left, right, bottom, top, near, far
+struct frustum_t
+{
+	vec4f_t Planes[6];
+};
+
+
+//-------------------------------SIMD KERNELS-----------------------------
+
+
+// Every kernel below computes each output element with the same multiplies and the same left-to-right
+// add order as the scalar expansion, so all three backends agree bit-for-bit (no FMA contraction)
+
+
+inline void MultiplyM4(const mat4f_t &a, const mat4f_t &b, mat4f_t *out)
+{
+#if UMATH_SIMD_AVX
+	// Two result rows per register: each 128-bit lane broadcasts its own row's coefficients
+	__m256 b0 = _mm256_broadcast_ps((const __m128*)&b.m[0][0]);
+	__m256 b1 = _mm256_broadcast_ps((const __m128*)&b.m[1][0]);
+	__m256 b2 = _mm256_broadcast_ps((const __m128*)&b.m[2][0]);
+	__m256 b3 = _mm256_broadcast_ps((const __m128*)&b.m[3][0]);
+
+	for (int i = 0; i < 4; i += 2)
+	{
+		__m256 a01 = _mm256_loadu_ps(&a.m[i][0]);
+
+		__m256 r = _mm256_mul_ps(_mm256_permute_ps(a01, 0x00), b0);
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(a01, 0x55), b1));
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(a01, 0xAA), b2));
+		r = _mm256_add_ps(r, _mm256_mul_ps(_mm256_permute_ps(a01, 0xFF), b3));
+
+		_mm256_storeu_ps(&out->m[i][0], r);
 	}
+#elif UMATH_SIMD_SSE
+	// Each result row is a linear combination of b's rows, weighted by the matching row of a
+	__m128 b0 = _mm_loadu_ps(&b.m[0][0]);
+	__m128 b1 = _mm_loadu_ps(&b.m[1][0]);
+	__m128 b2 = _mm_loadu_ps(&b.m[2][0]);
+	__m128 b3 = _mm_loadu_ps(&b.m[3][0]);
+
+	for (int i = 0; i < 4; i++)
+	{
+		__m128 r = _mm_mul_ps(_mm_set1_ps(a.m[i][0]), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.m[i][1]), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.m[i][2]), b2));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.m[i][3]), b3));
 
-	mat4f_t operator *(const mat4f_t &s) const
+		_mm_storeu_ps(&out->m[i][0], r);
+	}
+#else
+	for (int i = 0; i < 4; i++)
 	{
-		mat4f_t res;
+		for (int j = 0; j < 4; j++)
+		{
+			out->m[i][j] = (a.m[i][0] * b.m[0][j]) + (a.m[i][1] * b.m[1][j]) + (a.m[i][2] * b.m[2][j]) + (a.m[i][3] * b.m[3][j]);
+		}
+	}
+#endif
+}
 
-		res.m[0][0] = (m[0][0] * s.m[0][0]) + (m[0][1] * s.m[1][0]) + (m[0][2] * s.m[2][0]) + (m[0][3] * s.m[3][0]);
-		res.m[0][1] = (m[0][0] * s.m[0][1]) + (m[0][1] * s.m[1][1]) + (m[0][2] * s.m[2][1]) + (m[0][3] * s.m[3][1]);
-		res.m[0][2] = (m[0][0] * s.m[0][2]) + (m[0][1] * s.m[1][2]) + (m[0][2] * s.m[2][2]) + (m[0][3] * s.m[3][2]);
-		res.m[0][3] = (m[0][0] * s.m[0][3]) + (m[0][1] * s.m[1][3]) + (m[0][2] * s.m[2][3]) + (m[0][3] * s.m[3][3]);
 
-		res.m[1][0] = (m[1][0] * s.m[0][0]) + (m[1][1] * s.m[1][0]) + (m[1][2] * s.m[2][0]) + (m[1][3] * s.m[3][0]);
-		res.m[1][1] = (m[1][0] * s.m[0][1]) + (m[1][1] * s.m[1][1]) + (m[1][2] * s.m[2][1]) + (m[1][3] * s.m[3][1]);
-		res.m[1][2] = (m[1][0] * s.m[0][2]) + (m[1][1] * s.m[1][2]) + (m[1][2] * s.m[2][2]) + (m[1][3] * s.m[3][2]);
-		res.m[1][3] = (m[1][0] * s.m[0][3]) + (m[1][1] * s.m[1][3]) + (m[1][2] * s.m[2][3]) + (m[1][3] * s.m[3][3]);
+// Result is written through a temporary so the matrix can safely be multiplied into itself
+inline void mat4f_t::operator *=(const mat4f_t &s)
+{
+	mat4f_t res;
+	MultiplyM4(*this, s, &res);
+	*this = res;
+}
 
-		res.m[2][0] = (m[2][0] * s.m[0][0]) + (m[2][1] * s.m[1][0]) + (m[2][2] * s.m[2][0]) + (m[2][3] * s.m[3][0]);
-		res.m[2][1] = (m[2][0] * s.m[0][1]) + (m[2][1] * s.m[1][1]) + (m[2][2] * s.m[2][1]) + (m[2][3] * s.m[3][1]);
-		res.m[2][2] = (m[2][0] * s.m[0][2]) + (m[2][1] * s.m[1][2]) + (m[2][2] * s.m[2][2]) + (m[2][3] * s.m[3][2]);
-		res.m[2][3] = (m[2][0] * s.m[0][3]) + (m[2][1] * s.m[1][3]) + (m[2][2] * s.m[2][3]) + (m[2][3] * s.m[3][3]);
 
-		res.m[3][0] = (m[3][0] * s.m[0][0]) + (m[3][1] * s.m[1][0]) + (m[3][2] * s.m[2][0]) + (m[3][3] * s.m[3][0]);
-		res.m[3][1] = (m[3][0] * s.m[0][1]) + (m[3][1] * s.m[1][1]) + (m[3][2] * s.m[2][1]) + (m[3][3] * s.m[3][1]);
-		res.m[3][2] = (m[3][0] * s.m[0][2]) + (m[3][1] * s.m[1][2]) + (m[3][2] * s.m[2][2]) + (m[3][3] * s.m[3][2]);
-		res.m[3][3] = (m[3][0] * s.m[0][3]) + (m[3][1] * s.m[1][3]) + (m[3][2] * s.m[2][3]) + (m[3][3] * s.m[3][3]);
+inline mat4f_t mat4f_t::operator *(const mat4f_t &s) const
+{
+	mat4f_t res;
+	MultiplyM4(*this, s, &res);
 
-		return res;
+	return res;
+}
+
+
+// Same row combination as MultiplyM4, except b's implied bottom row only contributes a's translation
+inline void MultiplyAF(const aff3f_t &a, const aff3f_t &b, aff3f_t *out)
+{
+#if UMATH_SIMD_SSE
+	__m128 b0 = _mm_loadu_ps(&b.m[0][0]);
+	__m128 b1 = _mm_loadu_ps(&b.m[1][0]);
+	__m128 b2 = _mm_loadu_ps(&b.m[2][0]);
+	__m128 b3 = _mm_setr_ps(0.0f, 0.0f, 0.0f, 1.0f);
+
+	for (int i = 0; i < 3; i++)
+	{
+		__m128 r = _mm_mul_ps(_mm_set1_ps(a.m[i][0]), b0);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.m[i][1]), b1));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.m[i][2]), b2));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_set1_ps(a.m[i][3]), b3));
+
+		_mm_storeu_ps(&out->m[i][0], r);
 	}
-};
+#else
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			float w = (j == 3) ? 1.0f : 0.0f;
+			out->m[i][j] = (a.m[i][0] * b.m[0][j]) + (a.m[i][1] * b.m[1][j]) + (a.m[i][2] * b.m[2][j]) + (a.m[i][3] * w);
+		}
+	}
+#endif
+}
+
+
+inline void aff3f_t::operator *=(const aff3f_t &s)
+{
+	aff3f_t res;
+	MultiplyAF(*this, s, &res);
+	*this = res;
+}
+
+
+inline aff3f_t aff3f_t::operator *(const aff3f_t &s) const
+{
+	aff3f_t res;
+	MultiplyAF(*this, s, &res);
+
+	return res;
+}
 
 
 //-----------------------------------FUNCTIONS---------------------------------------
@@ -251,6 +388,19 @@ inline void SetFrustumHFOV(mat4f_t *t, float fov, float aratio, float near, floa
 }
 
 
+// Narrows a projection to a W x H pixel window centered on (X, Y), so that window fills the whole viewport.
+// Pre-multiply the regular projection with the result: Pick * Projection
+inline void SetPickRegion(mat4f_t *t, float X, float Y, float W, float H, float ViewWidth, float ViewHeight)
+{
+	SetTransform(t);
+
+	t->m[0][0] = ViewWidth / W;
+	t->m[1][1] = ViewHeight / H;
+	t->m[0][3] = (ViewWidth - (2.0f * X)) / W;
+	t->m[1][3] = (ViewHeight - (2.0f * Y)) / H;
+}
+
+
 inline void EulerRotate(mat4f_t *t, float theta, int axis)
 {
 	if(axis == R_AXIS_Z)
@@ -303,84 +453,346 @@ inline void MatrixRotate(mat4f_t* t, float d, const vec3f_t& r)
 }
 
 
-inline void ExtractRotationM4(const mat4f_t& t, float* theta, vec3f_t* axis)
+inline void Scale(mat4f_t *t, float s)
 {
-	// /!\ This function uses a pure rotation matrix as input (scale must be stripped out beforehand)
-	float trace = t.m[0][0] + t.m[1][1] + t.m[2][2];
-	float cosT = (trace - 1.0f) / 2.0f;
+	t->m[0][0] *= s;
+	t->m[1][1] *= s;
+	t->m[2][2] *= s;
+}
 
-	if (cosT > 1.0f) cosT = 1.0f;
-	if (cosT < -1.0f) cosT = -1.0f;
 
-	// Return angle in degrees rather than radians, as Rotate() takes angle in degrees and converts to rad
-	*theta = acosf(cosT) / RADIAN;
+inline void Translate(mat4f_t *t, const vec3f_t &s)
+{
+	t->m[0][3] += s.x;
+	t->m[1][3] += s.y;
+	t->m[2][3] += s.z;
+}
+
+
+//---------------------------------QUATERNIONS---------------------------------
+
+
+// Hamilton product - applying the result rotates by b first, then a
+inline quatf_t operator*(const quatf_t &a, const quatf_t &b)
+{
+	quatf_t r;
+	r.x = (a.w * b.x) + (a.x * b.w) + (a.y * b.z) - (a.z * b.y);
+	r.y = (a.w * b.y) - (a.x * b.z) + (a.y * b.w) + (a.z * b.x);
+	r.z = (a.w * b.z) + (a.x * b.y) - (a.y * b.x) + (a.z * b.w);
+	r.w = (a.w * b.w) - (a.x * b.x) - (a.y * b.y) - (a.z * b.z);
 
-	// Check for degenerate cases (theta ~= 0 and theta ~=180)
-	if (*theta < 0.1f)
+	return r;
+}
+
+
+inline float Dot(const quatf_t &a, const quatf_t &b)
+{
+	return (a.x * b.x) + (a.y * b.y) + (a.z * b.z) + (a.w * b.w);
+}
+
+
+// Same fallback convention as the vec3f_t version: a degenerate input returns identity
+inline quatf_t Normalize(const quatf_t &q)
+{
+	float len = sqrtf(Dot(q, q));
+	if (len < 0.0001f)
 	{
-		axis->x = 0.0f;
-		axis->y = 0.0f;
-		axis->z = 1.0f;
-		*theta = 0.0f;
+		return quatf_t{ 0.0f, 0.0f, 0.0f, 1.0f };
 	}
-	else if (*theta > 179.9f)
-	{
-		axis->x = sqrtf((t.m[0][0] + 1.0f) / 2.0f);
-		axis->y = sqrtf((t.m[1][1] + 1.0f) / 2.0f);
-		axis->z = sqrtf((t.m[2][2] + 1.0f) / 2.0f);
 
-		if (t.m[0][1] < 0) axis->y = -axis->y;
-		//if (t.m[0][2] < 0) axis->z = -axis->z;
+	float inv = 1.0f / len;
+	return quatf_t{ q.x * inv, q.y * inv, q.z * inv, q.w * inv };
+}
+
+
+// Inverse rotation, for unit quaternions
+inline quatf_t Conjugate(const quatf_t &q)
+{
+	return quatf_t{ -q.x, -q.y, -q.z, q.w };
+}
+
+
+// Rotate v by q without building a matrix - the expanded form of q * v * Conjugate(q)
+inline vec3f_t Rotate(const quatf_t &q, const vec3f_t &v)
+{
+	vec3f_t u = { q.x, q.y, q.z };
+	vec3f_t t = Scalar(Cross(u, v), 2.0f);
+
+	return v + Scalar(t, q.w) + Cross(u, t);
+}
+
+
+// Angle in degrees, to match MatrixRotate(). Axis is normalized here
+inline quatf_t QuatFromAxisAngle(float d, const vec3f_t &axis)
+{
+	vec3f_t n = Normalize(axis);
+	float half = d * RADIAN * 0.5f;
+	float s = sinf(half);
+
+	return quatf_t{ n.x * s, n.y * s, n.z * s, cosf(half) };
+}
+
 
-		*axis = Normalize(*axis);
-		*theta = 180.0f;
+// Inverse of QuatFromAxisAngle() for display/editing. Picks the representation with angle in [0, 180]
+inline void QuatToAxisAngle(const quatf_t &q, float *d, vec3f_t *axis)
+{
+	quatf_t n = Normalize(q);
+	if (n.w < 0.0f)
+	{
+		n = quatf_t{ -n.x, -n.y, -n.z, -n.w };
 	}
-	// Normal case
-	else
+	if (n.w > 1.0f)
 	{
-		axis->x = (t.m[2][1] - t.m[1][2]);
-		axis->y = (t.m[0][2] - t.m[2][0]);
-		axis->z = (t.m[1][0] - t.m[0][1]);
+		n.w = 1.0f;
+	}
+
+	*d = 2.0f * acosf(n.w) / RADIAN;
 
-		*axis = Normalize(*axis);
+	float s = sqrtf(1.0f - (n.w * n.w));
+	if (s < 0.0001f)
+	{
+		*axis = { 0.0f, 0.0f, 1.0f };
+		*d = 0.0f;
+		return;
 	}
+
+	*axis = { n.x / s, n.y / s, n.z / s };
 }
 
 
-inline void Scale(mat4f_t *t, float s)
+// Normalized linear interpolation - cheap and stable, but not constant angular velocity. Takes the short arc
+inline quatf_t Nlerp(const quatf_t &a, const quatf_t &b, float t)
 {
-	t->m[0][0] *= s;
-	t->m[1][1] *= s;
-	t->m[2][2] *= s;
+	float sign = (Dot(a, b) < 0.0f) ? -1.0f : 1.0f;
+	float ta = 1.0f - t;
+	float tb = t * sign;
+
+	return Normalize(quatf_t{ (a.x * ta) + (b.x * tb), (a.y * ta) + (b.y * tb), (a.z * ta) + (b.z * tb), (a.w * ta) + (b.w * tb) });
 }
 
 
-inline void Translate(mat4f_t *t, const vec3f_t &s)
+// Spherical interpolation, constant angular velocity. Falls back to Nlerp when the inputs are nearly parallel
+inline quatf_t Slerp(const quatf_t &a, const quatf_t &b, float t)
 {
-	t->m[0][3] += s.x;
-	t->m[1][3] += s.y;
-	t->m[2][3] += s.z;
+	float cosT = Dot(a, b);
+	quatf_t e = b;
+	if (cosT < 0.0f)
+	{
+		cosT = -cosT;
+		e = quatf_t{ -b.x, -b.y, -b.z, -b.w };
+	}
+	if (cosT > 0.9995f)
+	{
+		return Nlerp(a, e, t);
+	}
+
+	float theta = acosf(cosT);
+	float invsin = 1.0f / sinf(theta);
+	float ta = sinf((1.0f - t) * theta) * invsin;
+	float tb = sinf(t * theta) * invsin;
+
+	return quatf_t{ (a.x * ta) + (e.x * tb), (a.y * ta) + (e.y * tb), (a.z * ta) + (e.z * tb), (a.w * ta) + (e.w * tb) };
+}
+
+
+// Writes the rotation into the upper 3x3 of t, leaving translation and the last row alone - same contract
+// as MatrixRotate()
+inline void QuatToM4(mat4f_t *t, const quatf_t &q)
+{
+	float x2 = q.x + q.x;
+	float y2 = q.y + q.y;
+	float z2 = q.z + q.z;
+	float xx = q.x * x2;
+	float yy = q.y * y2;
+	float zz = q.z * z2;
+	float xy = q.x * y2;
+	float xz = q.x * z2;
+	float yz = q.y * z2;
+	float wx = q.w * x2;
+	float wy = q.w * y2;
+	float wz = q.w * z2;
+
+	t->m[0][0] = 1.0f - (yy + zz);
+	t->m[0][1] = xy - wz;
+	t->m[0][2] = xz + wy;
+
+	t->m[1][0] = xy + wz;
+	t->m[1][1] = 1.0f - (xx + zz);
+	t->m[1][2] = yz - wx;
+
+	t->m[2][0] = xz - wy;
+	t->m[2][1] = yz + wx;
+	t->m[2][2] = 1.0f - (xx + yy);
+}
+
+
+// Shepperd's method on the 3x3 part of t, which must be a pure rotation (scale stripped beforehand).
+// Only used when decomposing arbitrary matrices - stored objects keep their quaternion and never come through here
+inline quatf_t QuatFromAF(const aff3f_t &t)
+{
+	quatf_t q;
+	float trace = t.m[0][0] + t.m[1][1] + t.m[2][2];
+
+	if (trace > 0.0f)
+	{
+		float s = sqrtf(trace + 1.0f) * 2.0f;
+		q.w = 0.25f * s;
+		q.x = (t.m[2][1] - t.m[1][2]) / s;
+		q.y = (t.m[0][2] - t.m[2][0]) / s;
+		q.z = (t.m[1][0] - t.m[0][1]) / s;
+	}
+	else if (t.m[0][0] > t.m[1][1] && t.m[0][0] > t.m[2][2])
+	{
+		float s = sqrtf(1.0f + t.m[0][0] - t.m[1][1] - t.m[2][2]) * 2.0f;
+		q.w = (t.m[2][1] - t.m[1][2]) / s;
+		q.x = 0.25f * s;
+		q.y = (t.m[0][1] + t.m[1][0]) / s;
+		q.z = (t.m[0][2] + t.m[2][0]) / s;
+	}
+	else if (t.m[1][1] > t.m[2][2])
+	{
+		float s = sqrtf(1.0f + t.m[1][1] - t.m[0][0] - t.m[2][2]) * 2.0f;
+		q.w = (t.m[0][2] - t.m[2][0]) / s;
+		q.x = (t.m[0][1] + t.m[1][0]) / s;
+		q.y = 0.25f * s;
+		q.z = (t.m[1][2] + t.m[2][1]) / s;
+	}
+	else
+	{
+		float s = sqrtf(1.0f + t.m[2][2] - t.m[0][0] - t.m[1][1]) * 2.0f;
+		q.w = (t.m[1][0] - t.m[0][1]) / s;
+		q.x = (t.m[0][2] + t.m[2][0]) / s;
+		q.y = (t.m[1][2] + t.m[2][1]) / s;
+		q.z = 0.25f * s;
+	}
+
+	return Normalize(q);
 }
 
 
+// Transforms v as a column vector (m * v), the same convention the shaders use for mat4f_t uploads
 inline vec4f_t MultiplyV4_M4(const vec4f_t &v, const mat4f_t &m)
 {
 	vec4f_t res;
 
-	res.x = (v.x * m.m[0][0]) + (v.x * m.m[1][0]) + (v.x * m.m[2][0]) + (v.x * m.m[3][0]);
-	res.y = (v.y * m.m[0][1]) + (v.y * m.m[1][1]) + (v.y * m.m[2][1]) + (v.y * m.m[3][1]);
-	res.z = (v.z * m.m[0][2]) + (v.z * m.m[1][2]) + (v.z * m.m[2][2]) + (v.z * m.m[3][2]);
-	res.w = (v.w * m.m[0][3]) + (v.w * m.m[1][3]) + (v.w * m.m[2][3]) + (v.w * m.m[3][3]);
+#if UMATH_SIMD_SSE
+	__m128 vv = _mm_loadu_ps(&v.x);
+	__m128 r0 = _mm_mul_ps(_mm_loadu_ps(&m.m[0][0]), vv);
+	__m128 r1 = _mm_mul_ps(_mm_loadu_ps(&m.m[1][0]), vv);
+	__m128 r2 = _mm_mul_ps(_mm_loadu_ps(&m.m[2][0]), vv);
+	__m128 r3 = _mm_mul_ps(_mm_loadu_ps(&m.m[3][0]), vv);
+
+	// Transpose the per-row products so a vertical add sums each row in x, y, z, w order
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	__m128 r = _mm_add_ps(_mm_add_ps(_mm_add_ps(r0, r1), r2), r3);
+
+	_mm_storeu_ps(&res.x, r);
+#else
+	res.x = (m.m[0][0] * v.x) + (m.m[0][1] * v.y) + (m.m[0][2] * v.z) + (m.m[0][3] * v.w);
+	res.y = (m.m[1][0] * v.x) + (m.m[1][1] * v.y) + (m.m[1][2] * v.z) + (m.m[1][3] * v.w);
+	res.z = (m.m[2][0] * v.x) + (m.m[2][1] * v.y) + (m.m[2][2] * v.z) + (m.m[2][3] * v.w);
+	res.w = (m.m[3][0] * v.x) + (m.m[3][1] * v.y) + (m.m[3][2] * v.z) + (m.m[3][3] * v.w);
+#endif
 
 	return res;
 }
 
 
+#if UMATH_SIMD_SSE
+
+#define UMATH_SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps((a), (b), (x) | ((y) << 2) | ((z) << 4) | ((w) << 6))
+#define UMATH_SWIZZLE(a, x, y, z, w) UMATH_SHUFFLE(a, a, x, y, z, w)
+
+
+// 2x2 helpers for the block inverse below. Each register holds a row-major 2x2 block as (m00, m01, m10, m11),
+// and adj() is the adjugate
+
+// a * b
+inline __m128 SSE_Mat2Mul(__m128 a, __m128 b)
+{
+	return _mm_add_ps(_mm_mul_ps(a, UMATH_SWIZZLE(b, 0, 3, 0, 3)), _mm_mul_ps(UMATH_SWIZZLE(a, 1, 0, 3, 2), UMATH_SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+
+// adj(a) * b
+inline __m128 SSE_Mat2AdjMul(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(UMATH_SWIZZLE(a, 3, 3, 0, 0), b), _mm_mul_ps(UMATH_SWIZZLE(a, 1, 1, 2, 2), UMATH_SWIZZLE(b, 2, 3, 0, 1)));
+}
+
+
+// a * adj(b)
+inline __m128 SSE_Mat2MulAdj(__m128 a, __m128 b)
+{
+	return _mm_sub_ps(_mm_mul_ps(a, UMATH_SWIZZLE(b, 3, 0, 3, 0)), _mm_mul_ps(UMATH_SWIZZLE(a, 1, 0, 3, 2), UMATH_SWIZZLE(b, 2, 1, 2, 1)));
+}
+
+#endif
+
+
 // Current implementaion returns an identity matrix if inversion fails (when determinant ~= 0)
 // a more robust future version would also implement some kind of flagging mechanism so 
 // the calling code can see when a matrix is not invertible 
 inline mat4f_t InverseM4(const mat4f_t& m)
 {
+	mat4f_t res;
+
+#if UMATH_SIMD_SSE
+	// Block inverse: treat m as 2x2 blocks [A B; C D] and build the inverse from 2x2 determinants
+	// and adjugates, which maps onto 4-wide registers far better than 16 separate cofactors
+	__m128 r0 = _mm_loadu_ps(&m.m[0][0]);
+	__m128 r1 = _mm_loadu_ps(&m.m[1][0]);
+	__m128 r2 = _mm_loadu_ps(&m.m[2][0]);
+	__m128 r3 = _mm_loadu_ps(&m.m[3][0]);
+
+	__m128 A = _mm_movelh_ps(r0, r1);
+	__m128 B = _mm_movehl_ps(r1, r0);
+	__m128 C = _mm_movelh_ps(r2, r3);
+	__m128 D = _mm_movehl_ps(r3, r2);
+
+	// (|A|, |B|, |C|, |D|)
+	__m128 detsub = _mm_sub_ps(
+		_mm_mul_ps(UMATH_SHUFFLE(r0, r2, 0, 2, 0, 2), UMATH_SHUFFLE(r1, r3, 1, 3, 1, 3)),
+		_mm_mul_ps(UMATH_SHUFFLE(r0, r2, 1, 3, 1, 3), UMATH_SHUFFLE(r1, r3, 0, 2, 0, 2)));
+	__m128 detA = UMATH_SWIZZLE(detsub, 0, 0, 0, 0);
+	__m128 detB = UMATH_SWIZZLE(detsub, 1, 1, 1, 1);
+	__m128 detC = UMATH_SWIZZLE(detsub, 2, 2, 2, 2);
+	__m128 detD = UMATH_SWIZZLE(detsub, 3, 3, 3, 3);
+
+	__m128 DC = SSE_Mat2AdjMul(D, C);
+	__m128 AB = SSE_Mat2AdjMul(A, B);
+
+	// Adjugates of the four result blocks, before scaling by 1/|m|
+	__m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), SSE_Mat2Mul(B, DC));
+	__m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), SSE_Mat2Mul(C, AB));
+	__m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), SSE_Mat2MulAdj(D, AB));
+	__m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), SSE_Mat2MulAdj(A, DC));
+
+	// |m| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+	__m128 tr = _mm_mul_ps(AB, UMATH_SWIZZLE(DC, 0, 2, 1, 3));
+	tr = _mm_add_ps(tr, UMATH_SWIZZLE(tr, 2, 3, 0, 1));
+	tr = _mm_add_ps(tr, UMATH_SWIZZLE(tr, 1, 0, 3, 2));
+	__m128 detM = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC)), tr);
+
+	float det = _mm_cvtss_f32(detM);
+	if (fabsf(det) < 0.0001f)
+	{
+		SetTransform(&res);
+		return res;
+	}
+
+	// Sign pattern applies the final adjugate of each block
+	__m128 rdet = _mm_div_ps(_mm_setr_ps(1.0f, -1.0f, -1.0f, 1.0f), detM);
+	X = _mm_mul_ps(X, rdet);
+	Y = _mm_mul_ps(Y, rdet);
+	Z = _mm_mul_ps(Z, rdet);
+	W = _mm_mul_ps(W, rdet);
+
+	_mm_storeu_ps(&res.m[0][0], UMATH_SHUFFLE(X, Y, 3, 1, 3, 1));
+	_mm_storeu_ps(&res.m[1][0], UMATH_SHUFFLE(X, Y, 2, 0, 2, 0));
+	_mm_storeu_ps(&res.m[2][0], UMATH_SHUFFLE(Z, W, 3, 1, 3, 1));
+	_mm_storeu_ps(&res.m[3][0], UMATH_SHUFFLE(Z, W, 2, 0, 2, 0));
+#else
 	float s0 = m.m[0][0] * m.m[1][1] - m.m[1][0] * m.m[0][1];
 	float s1 = m.m[0][0] * m.m[1][2] - m.m[1][0] * m.m[0][2];
 	float s2 = m.m[0][0] * m.m[1][3] - m.m[1][0] * m.m[0][3];
@@ -395,10 +807,8 @@ inline mat4f_t InverseM4(const mat4f_t& m)
 	float c1 = m.m[2][0] * m.m[3][2] - m.m[3][0] * m.m[2][2];
 	float c0 = m.m[2][0] * m.m[3][1] - m.m[3][0] * m.m[2][1];
 
-	mat4f_t res;
-
 	float det = s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
-	if (det < 0.0001f && det > -0.9999f)
+	if (fabsf(det) < 0.0001f)
 	{
 		SetTransform(&res);
 		return res;
@@ -425,10 +835,372 @@ inline mat4f_t InverseM4(const mat4f_t& m)
 	res.m[3][1] = (m.m[0][0] * c3 - m.m[0][1] * c1 + m.m[0][2] * c0) * invdet;
 	res.m[3][2] = (-m.m[3][0] * s3 + m.m[3][1] * s1 - m.m[3][2] * s0) * invdet;
 	res.m[3][3] = (m.m[2][0] * s3 - m.m[2][1] * s1 + m.m[2][2] * s0) * invdet;
+#endif
 
 	return res;
 }
 
+
+//------------------------------------AFFINE-----------------------------------
+
+
+inline void SetTransform(aff3f_t *t)
+{
+	memset(t->m, 0, sizeof(float) * 12);
+	t->m[0][0] = 1;
+	t->m[1][1] = 1;
+	t->m[2][2] = 1;
+}
+
+
+inline void Scale(aff3f_t *t, float s)
+{
+	t->m[0][0] *= s;
+	t->m[1][1] *= s;
+	t->m[2][2] *= s;
+}
+
+
+inline void Translate(aff3f_t *t, const vec3f_t &s)
+{
+	t->m[0][3] += s.x;
+	t->m[1][3] += s.y;
+	t->m[2][3] += s.z;
+}
+
+
+// Same basis as the mat4f_t version, but the translation is folded in as -R * position directly
+// instead of concatenating a separate translation matrix
+inline void SetCameraView(aff3f_t *t, const vec3f_t &position, const vec3f_t &target, const vec3f_t &upAxis)
+{
+	vec3f_t direction = Normalize(position - target);
+	vec3f_t right = Normalize(Cross(upAxis, direction));
+	vec3f_t up = Normalize(Cross(direction, right));
+
+	t->m[0][0] = right.x;
+	t->m[0][1] = right.y;
+	t->m[0][2] = right.z;
+	t->m[0][3] = -Dot(right, position);
+
+	t->m[1][0] = up.x;
+	t->m[1][1] = up.y;
+	t->m[1][2] = up.z;
+	t->m[1][3] = -Dot(up, position);
+
+	t->m[2][0] = direction.x;
+	t->m[2][1] = direction.y;
+	t->m[2][2] = direction.z;
+	t->m[2][3] = -Dot(direction, position);
+}
+
+
+inline vec3f_t TransformPoint(const aff3f_t &t, const vec3f_t &p)
+{
+	vec3f_t r;
+	r.x = (t.m[0][0] * p.x) + (t.m[0][1] * p.y) + (t.m[0][2] * p.z) + t.m[0][3];
+	r.y = (t.m[1][0] * p.x) + (t.m[1][1] * p.y) + (t.m[1][2] * p.z) + t.m[1][3];
+	r.z = (t.m[2][0] * p.x) + (t.m[2][1] * p.y) + (t.m[2][2] * p.z) + t.m[2][3];
+
+	return r;
+}
+
+
+// Ignores translation - for vectors and ray directions
+inline vec3f_t TransformDirection(const aff3f_t &t, const vec3f_t &d)
+{
+	vec3f_t r;
+	r.x = (t.m[0][0] * d.x) + (t.m[0][1] * d.y) + (t.m[0][2] * d.z);
+	r.y = (t.m[1][0] * d.x) + (t.m[1][1] * d.y) + (t.m[1][2] * d.z);
+	r.z = (t.m[2][0] * d.x) + (t.m[2][1] * d.y) + (t.m[2][2] * d.z);
+
+	return r;
+}
+
+
+// Only valid when the 3x3 part is a pure rotation (camera views, unscaled objects): the inverse is
+// the transposed rotation and the translation rotated back and negated. No determinant, no division
+inline aff3f_t InverseRigidAF(const aff3f_t &t)
+{
+	aff3f_t res;
+
+	for (int i = 0; i < 3; i++)
+	{
+		res.m[i][0] = t.m[0][i];
+		res.m[i][1] = t.m[1][i];
+		res.m[i][2] = t.m[2][i];
+		res.m[i][3] = -((t.m[0][i] * t.m[0][3]) + (t.m[1][i] * t.m[1][3]) + (t.m[2][i] * t.m[2][3]));
+	}
+
+	return res;
+}
+
+
+// General affine inverse for scaled/sheared transforms: 3x3 inverse from the cross products of the
+// columns, then the translation carried through it. Same identity fallback as InverseM4
+inline aff3f_t InverseAF(const aff3f_t &t)
+{
+	aff3f_t res;
+
+	vec3f_t c0 = { t.m[0][0], t.m[1][0], t.m[2][0] };
+	vec3f_t c1 = { t.m[0][1], t.m[1][1], t.m[2][1] };
+	vec3f_t c2 = { t.m[0][2], t.m[1][2], t.m[2][2] };
+
+	// Rows of the inverse are the cross products of the column pairs, over the determinant
+	vec3f_t r0 = Cross(c1, c2);
+	vec3f_t r1 = Cross(c2, c0);
+	vec3f_t r2 = Cross(c0, c1);
+
+	float det = Dot(c0, r0);
+	if (fabsf(det) < 0.0001f)
+	{
+		SetTransform(&res);
+		return res;
+	}
+
+	float invdet = 1.0f / det;
+	r0 = Scalar(r0, invdet);
+	r1 = Scalar(r1, invdet);
+	r2 = Scalar(r2, invdet);
+
+	vec3f_t p = { t.m[0][3], t.m[1][3], t.m[2][3] };
+
+	res.m[0][0] = r0.x;
+	res.m[0][1] = r0.y;
+	res.m[0][2] = r0.z;
+	res.m[0][3] = -Dot(r0, p);
+
+	res.m[1][0] = r1.x;
+	res.m[1][1] = r1.y;
+	res.m[1][2] = r1.z;
+	res.m[1][3] = -Dot(r1, p);
+
+	res.m[2][0] = r2.x;
+	res.m[2][1] = r2.y;
+	res.m[2][2] = r2.z;
+	res.m[2][3] = -Dot(r2, p);
+
+	return res;
+}
+
+
+// Widens to a full matrix, for combining with projections
+inline mat4f_t ToM4(const aff3f_t &t)
+{
+	mat4f_t res;
+	memcpy(res.m, t.m, sizeof(float) * 12);
+	res.m[3][0] = 0.0f;
+	res.m[3][1] = 0.0f;
+	res.m[3][2] = 0.0f;
+	res.m[3][3] = 1.0f;
+
+	return res;
+}
+
+
+//------------------------------------BATCH------------------------------------
+
+
+// Model transform from scale, then rotation, then translation. Scalar reference for ComposeModelsAF - every
+// element is built with the same operations in the same order as a SIMD lane there
+inline void ComposeAF(const vec3f_t &Position, const quatf_t &Rotation, float Scale, aff3f_t *Out)
+{
+	float x2 = Rotation.x + Rotation.x;
+	float y2 = Rotation.y + Rotation.y;
+	float z2 = Rotation.z + Rotation.z;
+	float xx = Rotation.x * x2;
+	float yy = Rotation.y * y2;
+	float zz = Rotation.z * z2;
+	float xy = Rotation.x * y2;
+	float xz = Rotation.x * z2;
+	float yz = Rotation.y * z2;
+	float wx = Rotation.w * x2;
+	float wy = Rotation.w * y2;
+	float wz = Rotation.w * z2;
+
+	Out->m[0][0] = (1.0f - (yy + zz)) * Scale;
+	Out->m[0][1] = (xy - wz) * Scale;
+	Out->m[0][2] = (xz + wy) * Scale;
+	Out->m[0][3] = Position.x;
+
+	Out->m[1][0] = (xy + wz) * Scale;
+	Out->m[1][1] = (1.0f - (xx + zz)) * Scale;
+	Out->m[1][2] = (yz - wx) * Scale;
+	Out->m[1][3] = Position.y;
+
+	Out->m[2][0] = (xz - wy) * Scale;
+	Out->m[2][1] = (yz + wx) * Scale;
+	Out->m[2][2] = (1.0f - (xx + yy)) * Scale;
+	Out->m[2][3] = Position.z;
+}
+
+
+// Builds Count model transforms from SoA components in one pass - no trig and no branches per object.
+// The SIMD path handles four objects per iteration, one object per lane, and transposes on store
+// to get back to row-major rows
+inline void ComposeModelsAF(const transform_soa_t &In, aff3f_t *Out, uint32_t Count)
+{
+	uint32_t i = 0;
+
+#if UMATH_SIMD_SSE
+	const __m128 one = _mm_set1_ps(1.0f);
+
+	for (; i + 4 <= Count; i += 4)
+	{
+		__m128 qx = _mm_loadu_ps(&In.RotX[i]);
+		__m128 qy = _mm_loadu_ps(&In.RotY[i]);
+		__m128 qz = _mm_loadu_ps(&In.RotZ[i]);
+		__m128 qw = _mm_loadu_ps(&In.RotW[i]);
+		__m128 sc = _mm_loadu_ps(&In.Scale[i]);
+
+		__m128 x2 = _mm_add_ps(qx, qx);
+		__m128 y2 = _mm_add_ps(qy, qy);
+		__m128 z2 = _mm_add_ps(qz, qz);
+		__m128 xx = _mm_mul_ps(qx, x2);
+		__m128 yy = _mm_mul_ps(qy, y2);
+		__m128 zz = _mm_mul_ps(qz, z2);
+		__m128 xy = _mm_mul_ps(qx, y2);
+		__m128 xz = _mm_mul_ps(qx, z2);
+		__m128 yz = _mm_mul_ps(qy, z2);
+		__m128 wx = _mm_mul_ps(qw, x2);
+		__m128 wy = _mm_mul_ps(qw, y2);
+		__m128 wz = _mm_mul_ps(qw, z2);
+
+		__m128 r0 = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sc);
+		__m128 r1 = _mm_mul_ps(_mm_sub_ps(xy, wz), sc);
+		__m128 r2 = _mm_mul_ps(_mm_add_ps(xz, wy), sc);
+		__m128 r3 = _mm_loadu_ps(&In.PosX[i]);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_storeu_ps(&Out[i + 0].m[0][0], r0);
+		_mm_storeu_ps(&Out[i + 1].m[0][0], r1);
+		_mm_storeu_ps(&Out[i + 2].m[0][0], r2);
+		_mm_storeu_ps(&Out[i + 3].m[0][0], r3);
+
+		r0 = _mm_mul_ps(_mm_add_ps(xy, wz), sc);
+		r1 = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sc);
+		r2 = _mm_mul_ps(_mm_sub_ps(yz, wx), sc);
+		r3 = _mm_loadu_ps(&In.PosY[i]);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_storeu_ps(&Out[i + 0].m[1][0], r0);
+		_mm_storeu_ps(&Out[i + 1].m[1][0], r1);
+		_mm_storeu_ps(&Out[i + 2].m[1][0], r2);
+		_mm_storeu_ps(&Out[i + 3].m[1][0], r3);
+
+		r0 = _mm_mul_ps(_mm_sub_ps(xz, wy), sc);
+		r1 = _mm_mul_ps(_mm_add_ps(yz, wx), sc);
+		r2 = _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sc);
+		r3 = _mm_loadu_ps(&In.PosZ[i]);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_storeu_ps(&Out[i + 0].m[2][0], r0);
+		_mm_storeu_ps(&Out[i + 1].m[2][0], r1);
+		_mm_storeu_ps(&Out[i + 2].m[2][0], r2);
+		_mm_storeu_ps(&Out[i + 3].m[2][0], r3);
+	}
+#endif
+
+	for (; i < Count; i++)
+	{
+		vec3f_t p = { In.PosX[i], In.PosY[i], In.PosZ[i] };
+		quatf_t q = { In.RotX[i], In.RotY[i], In.RotZ[i], In.RotW[i] };
+		ComposeAF(p, q, In.Scale[i], &Out[i]);
+	}
+}
+
+
+//-----------------------------------CULLING-----------------------------------
+
+
+// Gribb/Hartmann extraction from a combined clip matrix (Projection * View). A point is inside the
+// frustum when -w <= x, y, z <= w in clip space, and each of those six inequalities is a plane
+inline void ExtractFrustumPlanes(const mat4f_t &Clip, frustum_t *Out)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		vec4f_t *lo = &Out->Planes[i * 2];
+		vec4f_t *hi = &Out->Planes[(i * 2) + 1];
+
+		lo->x = Clip.m[3][0] + Clip.m[i][0];
+		lo->y = Clip.m[3][1] + Clip.m[i][1];
+		lo->z = Clip.m[3][2] + Clip.m[i][2];
+		lo->w = Clip.m[3][3] + Clip.m[i][3];
+
+		hi->x = Clip.m[3][0] - Clip.m[i][0];
+		hi->y = Clip.m[3][1] - Clip.m[i][1];
+		hi->z = Clip.m[3][2] - Clip.m[i][2];
+		hi->w = Clip.m[3][3] - Clip.m[i][3];
+	}
+
+	// Normalized so the plane distance is in world units and can be compared against a sphere radius
+	for (int i = 0; i < 6; i++)
+	{
+		vec4f_t *p = &Out->Planes[i];
+		float inv = 1.0f / sqrtf((p->x * p->x) + (p->y * p->y) + (p->z * p->z));
+		*p = Scalar(*p, inv);
+	}
+}
+
+
+// Writes the index of every sphere that touches the frustum to Visible, in order, and returns how many
+// there were. Visible must have room for Count entries, and every one of the Count spheres is tested - callers
+// pass only live slots (geometry_state_t::ChunkSlots). Four spheres per iteration on the SIMD path, with the
+// same per-plane add order as the scalar tail
+inline uint32_t CullSpheres(const frustum_t &Frustum, const sphere_soa_t &In, uint32_t Count, uint32_t *Visible)
+{
+	uint32_t n = 0;
+	uint32_t i = 0;
+
+#if UMATH_SIMD_SSE
+	const __m128 zero = _mm_setzero_ps();
+
+	for (; i + 4 <= Count; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&In.X[i]);
+		__m128 y = _mm_loadu_ps(&In.Y[i]);
+		__m128 z = _mm_loadu_ps(&In.Z[i]);
+		__m128 negr = _mm_sub_ps(zero, _mm_loadu_ps(&In.Radius[i]));
+		__m128 inside = _mm_cmpeq_ps(zero, zero);
+
+		for (int p = 0; p < 6; p++)
+		{
+			const vec4f_t &pl = Frustum.Planes[p];
+			__m128 d = _mm_mul_ps(_mm_set1_ps(pl.x), x);
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(pl.y), y));
+			d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(pl.z), z));
+			d = _mm_add_ps(d, _mm_set1_ps(pl.w));
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(d, negr));
+		}
+
+		// Branch-free compaction: every lane writes its index, but only passing lanes advance the cursor
+		int mask = _mm_movemask_ps(inside);
+		Visible[n] = i + 0;
+		n += mask & 1;
+		Visible[n] = i + 1;
+		n += (mask >> 1) & 1;
+		Visible[n] = i + 2;
+		n += (mask >> 2) & 1;
+		Visible[n] = i + 3;
+		n += (mask >> 3) & 1;
+	}
+#endif
+
+	for (; i < Count; i++)
+	{
+		float negr = 0.0f - In.Radius[i];
+		bool inside = true;
+
+		for (int p = 0; p < 6; p++)
+		{
+			const vec4f_t &pl = Frustum.Planes[p];
+			float d = (pl.x * In.X[i]) + (pl.y * In.Y[i]) + (pl.z * In.Z[i]) + pl.w;
+			inside = inside && (d >= negr);
+		}
+
+		Visible[n] = i;
+		n += inside ? 1 : 0;
+	}
+
+	return n;
+}
+
 }
 
 
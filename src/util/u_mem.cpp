@@ -1,131 +1,856 @@
 #include "u_mem.h"
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
-void geometry_create_info_t::DecomposeModelM4()
+
+mem_arena_t ProgramArena;
+mem_heap_t ProgramHeap;
+frame_scratch_t FrameScratch;
+
+
+int InitProgramMemory()
 {
-	Position = { Model.m[0][3], Model.m[1][3], Model.m[2][3] };
+	if (ProgramArena.Init(MEM_PROGRAM_RESERVE, MEM_PROGRAM_COMMIT) != 0)
+	{
+		return -1;
+	}
+
+	ProgramHeap.Init(&ProgramArena);
+	if (FrameScratch.Init(&ProgramArena, MEM_FRAME_SCRATCH_SIZE) != 0)
+	{
+		ProgramArena.Release();
+		return -1;
+	}
+
+	return 0;
+}
 
-	// We don't support non-uniform scaling, so we only need to check one axis to get the object's scale
-	uMATH::vec3f_t axis = {Model.m[0][0], Model.m[1][0], Model.m[2][0]};
-	Scale = sqrtf((axis.x * axis.x) + (axis.y * axis.y) + (axis.z * axis.z));
-	
-	// Orthogonalize 3x3 trace to obtain pure rotation matrix
-	Model.m[0][0] /= Scale;
-	Model.m[1][1] /= Scale;
-	Model.m[2][2] /= Scale;
 
-	uMATH::ExtractRotationM4(Model, &RotationAngle, &RotationAxis);
+void ReleaseProgramMemory()
+{
+	ProgramArena.Release();
+	memset(&ProgramHeap, 0, sizeof(ProgramHeap));
+	memset(&FrameScratch, 0, sizeof(FrameScratch));
 }
 
 
-void geometry_create_info_t::ComposeModelM4()
+// Reserve address space only - pages are committed as Push() reaches them, starting with CommitSize bytes
+int mem_arena_t::Init(uint64_t ReserveSize, uint64_t CommitSize)
 {
-	// Concatenate transforms to prevent scaling from being overwritten by complex rotations
-	uMATH::mat4f_t temp = {};
-	uMATH::SetTransform(&temp);
-	uMATH::Scale(&temp, Scale);
+	if (Base != 0x0)
+	{
+		printf("System: attempt to reinitialize existing arena. Call Release() first\n");
+		return -1;
+	}
 
-	uMATH::SetTransform(&Model);
-	uMATH::MatrixRotate(&Model, RotationAngle, RotationAxis);
-	Model *= temp;
+#ifdef _WIN32
+	Base = (uint8_t*)VirtualAlloc(0x0, ReserveSize, MEM_RESERVE, PAGE_NOACCESS);
+#else
+	void *mem = mmap(0x0, ReserveSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	Base = (mem == MAP_FAILED) ? 0x0 : (uint8_t*)mem;
+#endif
+	if (Base == 0x0)
+	{
+		printf("System: arena failed to reserve %llu bytes\n", (unsigned long long)ReserveSize);
+		return -1;
+	}
 
-	// Translation is unaffected, does not need to be concatenated
-	uMATH::Translate(&Model, Position);
+	Reserved = ReserveSize;
+	Committed = 0;
+	Used = 0;
+	Peak = 0;
+	AllocCount = 0;
+	OSReserveCount = 1;
+	OSCommitCount = 0;
+
+	if (CommitSize > 0 && Commit(CommitSize) != 0)
+	{
+		Release();
+		return -1;
+	}
+
+	return 0;
 }
 
 
-uint8_t free_list_t::Pop()
+// Hand out Size bytes of memory the caller owns and keeps alive. No OS calls are ever made for it
+int mem_arena_t::Init(void *Memory, uint64_t Size)
 {
-	NextFreePosition--;
+	if (Base != 0x0)
+	{
+		printf("System: attempt to reinitialize existing arena. Call Release() first\n");
+		return -1;
+	}
+	if (Memory == 0x0)
+	{
+		return -1;
+	}
+
+	Base = (uint8_t*)Memory;
+	Reserved = Size;
+	Committed = Size;
+	Used = 0;
+	Peak = 0;
+	AllocCount = 0;
+	OSReserveCount = 0;
+	OSCommitCount = 0;
+
+	return 0;
+}
+
+
+void mem_arena_t::Release()
+{
+	// Memory handed to Init() belongs to the caller
+	if (Base != 0x0 && OSReserveCount > 0)
+	{
+#ifdef _WIN32
+		VirtualFree(Base, 0, MEM_RELEASE);
+#else
+		munmap(Base, Reserved);
+#endif
+	}
+
+	Base = 0x0;
+	Reserved = 0;
+	Committed = 0;
+	Used = 0;
+}
+
 
-	uint8_t res = OpenPositions[NextFreePosition];
+// Back at least Bytes from the start of the arena with memory, rounding up to MEM_COMMIT_STEP
+int mem_arena_t::Commit(uint64_t Bytes)
+{
+	uint64_t target = ((Bytes + MEM_COMMIT_STEP - 1) / MEM_COMMIT_STEP) * MEM_COMMIT_STEP;
+	target = (target < Reserved) ? target : Reserved;
+	if (target <= Committed)
+	{
+		return 0;
+	}
+
+#ifdef _WIN32
+	bool ok = VirtualAlloc(Base + Committed, target - Committed, MEM_COMMIT, PAGE_READWRITE) != 0x0;
+#else
+	bool ok = mprotect(Base + Committed, target - Committed, PROT_READ | PROT_WRITE) == 0;
+#endif
+	if (!ok)
+	{
+		printf("System: arena failed to commit %llu bytes\n", (unsigned long long)(target - Committed));
+		return -1;
+	}
+
+	Committed = target;
+	OSCommitCount++;
+	return 0;
+}
+
+
+// Align must be a power of two. Returns 0x0 once the reservation is exhausted
+void *mem_arena_t::Push(uint64_t Bytes, uint64_t Align)
+{
+	uint64_t start = (Used + Align - 1) & ~(Align - 1);
+	uint64_t end = start + Bytes;
+	if (Base == 0x0 || end > Reserved)
+	{
+		printf("System: arena out of memory\n");
+		return 0x0;
+	}
+	if (end > Committed && Commit(end) != 0)
+	{
+		return 0x0;
+	}
+
+	Used = end;
+	Peak = (Used > Peak) ? Used : Peak;
+	AllocCount++;
+	return Base + start;
+}
+
+
+mem_marker_t mem_arena_t::Mark() const
+{
+	mem_marker_t res;
+	res.Used = Used;
 	return res;
 }
 
 
-void free_list_t::Push(uint8_t FreedIndex)
+// Free everything allocated since Marker was taken. Committed pages are kept for reuse
+void mem_arena_t::Rollback(mem_marker_t Marker)
 {
-	if(NextFreePosition == PROGRAM_MAX_OBJECTS)
+	if (Marker.Used > Used)
 	{
-		printf("FreeList: Object Limit Reached\n");
+		printf("System: arena rollback past the current position\n");
 		return;
 	}
 
-	OpenPositions[NextFreePosition] = FreedIndex;
-	NextFreePosition++;
+	Used = Marker.Used;
+}
+
+
+int frame_scratch_t::Init(mem_arena_t *Source, uint64_t Size)
+{
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		if (Buffers[i].Init(Source->Push(Size, MEM_BLOCK_ALIGN), Size) != 0)
+		{
+			printf("System: frame scratch failed to allocate\n");
+			return -1;
+		}
+	}
+
+	Current = 0;
+	return 0;
 }
 
 
-void geometry_state_t::Alloc()
+// Call once at the top of every frame
+void frame_scratch_t::BeginFrame()
 {
-	uint8_t index;
+	Current ^= 1;
+	mem_marker_t start = {};
+	Buffers[Current].Rollback(start);
+}
+
+
+void *frame_scratch_t::Push(uint64_t Bytes, uint64_t Align)
+{
+	return Buffers[Current].Push(Bytes, Align);
+}
+
+
+// Most any one frame has pushed - each buffer only ever holds a single frame, so its peak is a frame's peak
+uint64_t frame_scratch_t::HighWater() const
+{
+	return (Buffers[0].Peak > Buffers[1].Peak) ? Buffers[0].Peak : Buffers[1].Peak;
+}
 
-	if(FreeList.NextFreePosition > 0)
+
+void mem_pool_t::Init(mem_arena_t *Source, uint64_t Size)
+{
+	Arena = Source;
+	BlockSize = (Size > sizeof(void*)) ? Size : sizeof(void*);
+	FreeHead = 0x0;
+	Live = 0;
+	Blocks = 0;
+}
+
+
+void *mem_pool_t::Alloc()
+{
+	void *res = FreeHead;
+	if (res)
 	{
-		index = FreeList.Pop();
+		FreeHead = *(void**)res;
 	}
 	else
 	{
-		index = Position;
-		Position++;
+		res = Arena->Push(BlockSize, (BlockSize < MEM_BLOCK_ALIGN) ? MEM_DEFAULT_ALIGN : MEM_BLOCK_ALIGN);
+		if (!res)
+		{
+			return 0x0;
+		}
+		Blocks++;
 	}
 
-	if(index == PROGRAM_MAX_OBJECTS)
+	Live++;
+	return res;
+}
+
+
+void mem_pool_t::Free(void *Block)
+{
+	*(void**)Block = FreeHead;
+	FreeHead = Block;
+	Live--;
+}
+
+
+void mem_heap_t::Init(mem_arena_t *Source)
+{
+	Arena = Source;
+	for (uint32_t c = 0; c < MEM_HEAP_CLASSES; c++)
+	{
+		Classes[c].Init(Source, 1ull << (c + MEM_HEAP_MIN_SHIFT));
+	}
+
+	Live = 0;
+	PeakLive = 0;
+	AllocCount = 0;
+}
+
+
+// Smallest size class holding Bytes, or MEM_HEAP_CLASSES if none does
+static uint32_t HeapClass(uint64_t Bytes)
+{
+	uint32_t c = 0;
+	while (c < MEM_HEAP_CLASSES && (1ull << (c + MEM_HEAP_MIN_SHIFT)) < Bytes)
+	{
+		c++;
+	}
+	return c;
+}
+
+
+void *mem_heap_t::Alloc(uint64_t Bytes)
+{
+	uint32_t c = HeapClass(Bytes);
+	if (Arena == 0x0 || c == MEM_HEAP_CLASSES)
+	{
+		printf("System: heap can't allocate %llu bytes\n", (unsigned long long)Bytes);
+		return 0x0;
+	}
+
+	void *res = Classes[c].Alloc();
+	if (res)
+	{
+		Live += Classes[c].BlockSize;
+		PeakLive = (Live > PeakLive) ? Live : PeakLive;
+		AllocCount++;
+	}
+	return res;
+}
+
+
+// Blocks that already have room stay where they are. Block may be 0x0, like realloc()
+void *mem_heap_t::Realloc(void *Block, uint64_t OldBytes, uint64_t NewBytes)
+{
+	if (Block && HeapClass(OldBytes) == HeapClass(NewBytes))
+	{
+		return Block;
+	}
+
+	void *res = Alloc(NewBytes);
+	if (res && Block)
+	{
+		memcpy(res, Block, (OldBytes < NewBytes) ? OldBytes : NewBytes);
+		Free(Block, OldBytes);
+	}
+	return res;
+}
+
+
+void mem_heap_t::Free(void *Block, uint64_t Bytes)
+{
+	uint32_t c = HeapClass(Bytes);
+	if (Block == 0x0 || c == MEM_HEAP_CLASSES)
 	{
-		printf("System: Object Limit Reached\n");
 		return;
 	}
 
+	Classes[c].Free(Block);
+	Live -= Classes[c].BlockSize;
+}
+
+
+void geometry_create_info_t::DecomposeModel()
+{
+	Position = { Model.m[0][3], Model.m[1][3], Model.m[2][3] };
+
+	// We don't support non-uniform scaling, so we only need to check one axis to get the object's scale
+	uMATH::vec3f_t axis = {Model.m[0][0], Model.m[1][0], Model.m[2][0]};
+	Scale = sqrtf((axis.x * axis.x) + (axis.y * axis.y) + (axis.z * axis.z));
+	
+	// Divide scale out of the whole 3x3 to obtain pure rotation matrix
+	uMATH::aff3f_t rot = Model;
+	for (int i = 0; i < 3; i++)
+	{
+		rot.m[i][0] /= Scale;
+		rot.m[i][1] /= Scale;
+		rot.m[i][2] /= Scale;
+	}
+
+	Rotation = uMATH::QuatFromAF(rot);
+	uMATH::QuatToAxisAngle(Rotation, &RotationAngle, &RotationAxis);
+}
+
+
+void geometry_create_info_t::ComposeModel()
+{
+	uMATH::ComposeAF(Position, Rotation, Scale, &Model);
+}
+
+
+void geometry_create_info_t::SetRotationFromAxisAngle()
+{
+	Rotation = uMATH::QuatFromAxisAngle(RotationAngle, RotationAxis);
+}
+
+
+// Make sure the dense arrays have room for Objects objects and the sparse ones for IdSlots IDs
+int geometry_state_t::Grow(uint32_t Objects, uint32_t IdSlots)
+{
+	if (Visible.Reserve(Objects) != 0 || Scale.Reserve(Objects) != 0 || Intensity.Reserve(Objects) != 0 ||
+		PosX.Reserve(Objects) != 0 || PosY.Reserve(Objects) != 0 || PosZ.Reserve(Objects) != 0 ||
+		RotX.Reserve(Objects) != 0 || RotY.Reserve(Objects) != 0 || RotZ.Reserve(Objects) != 0 || RotW.Reserve(Objects) != 0 ||
+		BoundRadius.Reserve(Objects) != 0 || Color.Reserve(Objects) != 0 || Model.Reserve(Objects) != 0 || Mesh.Reserve(Objects) != 0 ||
+		Dynamic.Reserve(Objects) != 0 || Velocity.Reserve(Objects) != 0 || AngularVelocity.Reserve(Objects) != 0 ||
+		Ids.Reserve(Objects) != 0 || DenseOf.Reserve(IdSlots) != 0 || Generation.Reserve(IdSlots) != 0 || NextFree.Reserve(IdSlots) != 0 ||
+		Journal.Reserve(GEOMETRY_JOURNAL_MAX) != 0)
+	{
+		printf("System: object store failed to grow\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+// Make room for one more object at the end of the dense arrays and give it an ID - a freed one if there
+// is one, otherwise the next never-used one. Returns GEOMETRY_MAX_OBJECTS when no room can be had
+uint32_t geometry_state_t::NextIndex()
+{
+	if (Count >= GEOMETRY_MAX_OBJECTS || (FreeCount == 0 && IdCount >= GEOMETRY_MAX_OBJECTS))
+	{
+		printf("System: Object Limit Reached\n");
+		return GEOMETRY_MAX_OBJECTS;
+	}
+
+	if (Grow(Count + 1, (FreeCount > 0) ? IdCount : IdCount + 1) != 0)
+	{
+		return GEOMETRY_MAX_OBJECTS;
+	}
+
+	uint32_t id;
+	if (FreeCount > 0)
+	{
+		id = FreeHead;
+		FreeHead = NextFree[id];
+		FreeCount--;
+	}
+	else
+	{
+		id = IdCount;
+		Generation[id] = 1;
+		IdCount++;
+	}
+
+	uint32_t index = Count;
+	Ids[index] = id;
+	DenseOf[id] = index;
+	Count++;
+	return index;
+}
+
+
+geometry_handle_t geometry_state_t::Alloc()
+{
+	uint32_t index = NextIndex();
+	if (index == GEOMETRY_MAX_OBJECTS)
+	{
+		return GEOMETRY_HANDLE_NONE;
+	}
+
 	Visible[index] = 1;
 	Scale[index] = 1.0f;
 	Intensity[index] = 0.5f;
 	Color[index] = { 1.0f, 0.5f, 0.31f };
+	PosX[index] = 0.0f;
+	PosY[index] = 0.0f;
+	PosZ[index] = 0.0f;
+	RotX[index] = 0.0f;
+	RotY[index] = 0.0f;
+	RotZ[index] = 0.0f;
+	RotW[index] = 1.0f;
+	BoundRadius[index] = MESH_CUBE_RADIUS;
 	SetTransform(&Model[index]);
+	Mesh[index] = 0;
+	Dynamic[index] = 0;
+	Velocity[index] = { 0.0f, 0.0f, 0.0f };
+	AngularVelocity[index] = { 0.0f, 0.0f, 0.0f };
+	MarkChanged(index, 1);
+	Revision++;
+
+	return Handle(index);
 }
 
 
-void geometry_state_t::Alloc(const geometry_create_info_t &CreateInfo)
+geometry_handle_t geometry_state_t::Alloc(const geometry_create_info_t &CreateInfo)
 {
-	uint8_t index;
+	uint32_t index = NextIndex();
+	if (index == GEOMETRY_MAX_OBJECTS)
+	{
+		return GEOMETRY_HANDLE_NONE;
+	}
+
+	SetObject(index, CreateInfo);
+	MarkChanged(index, 1);
+	Revision++;
+
+	return Handle(index);
+}
+
 
-	if(FreeList.NextFreePosition > 0)
+// Put an object that was taken out for editing back under the handle it had, so anything that refers to it by
+// handle (selection, undo, the hierarchy) still does
+geometry_handle_t geometry_state_t::Restore(geometry_handle_t Handle, const geometry_create_info_t &CreateInfo)
+{
+	uint32_t index = Revive(Handle);
+	if (index == GEOMETRY_MAX_OBJECTS)
 	{
-		index = FreeList.Pop();
+		return GEOMETRY_HANDLE_NONE;
 	}
-	else
+
+	SetObject(index, CreateInfo);
+	return Handle;
+}
+
+
+void geometry_state_t::SetObject(uint32_t Index, const geometry_create_info_t &CreateInfo)
+{
+	Visible[Index] = VIS_STATUS_VISIBLE;
+	Scale[Index] = CreateInfo.Scale;
+	Intensity[Index] = CreateInfo.Intensity;
+	Color[Index] = CreateInfo.Color;
+	Model[Index] = CreateInfo.Model;
+	PosX[Index] = CreateInfo.Position.x;
+	PosY[Index] = CreateInfo.Position.y;
+	PosZ[Index] = CreateInfo.Position.z;
+	RotX[Index] = CreateInfo.Rotation.x;
+	RotY[Index] = CreateInfo.Rotation.y;
+	RotZ[Index] = CreateInfo.Rotation.z;
+	RotW[Index] = CreateInfo.Rotation.w;
+	BoundRadius[Index] = CreateInfo.Scale * MESH_CUBE_RADIUS;
+	Mesh[Index] = CreateInfo.Mesh;
+	Dynamic[Index] = CreateInfo.Dynamic;
+	Velocity[Index] = { 0.0f, 0.0f, 0.0f };
+	AngularVelocity[Index] = { 0.0f, 0.0f, 0.0f };
+}
+
+
+// Copy every dense field of one object over another, and point its ID at the new place
+void geometry_state_t::MoveObject(uint32_t From, uint32_t To)
+{
+	Visible[To] = Visible[From];
+	Scale[To] = Scale[From];
+	Intensity[To] = Intensity[From];
+	PosX[To] = PosX[From];
+	PosY[To] = PosY[From];
+	PosZ[To] = PosZ[From];
+	RotX[To] = RotX[From];
+	RotY[To] = RotY[From];
+	RotZ[To] = RotZ[From];
+	RotW[To] = RotW[From];
+	BoundRadius[To] = BoundRadius[From];
+	Color[To] = Color[From];
+	Model[To] = Model[From];
+	Mesh[To] = Mesh[From];
+	Dynamic[To] = Dynamic[From];
+	Velocity[To] = Velocity[From];
+	AngularVelocity[To] = AngularVelocity[From];
+	Ids[To] = Ids[From];
+	DenseOf[Ids[To]] = To;
+}
+
+
+// Free the object at a dense index. The last object moves into its place, so every dense index taken
+// before this call may now refer to something else
+void geometry_state_t::Free(uint32_t FreedIndex)
+{
+	if (Count == 0)
+	{
+		printf("System: Object array empty, nothing to free\n");
+		return;
+	}
+	if (FreedIndex >= Count)
+	{
+		printf("System: Out of bounds on free\n");
+		return;
+	}
+
+	uint32_t id = Ids[FreedIndex];
+	if (FreedIndex != Count - 1)
 	{
-		index = Position;
+		MoveObject(Count - 1, FreedIndex);
+		MarkChanged(FreedIndex, 1);
+	}
+	Count--;
+
+	NextFree[id] = FreeHead;
+	FreeHead = id;
+	FreeCount++;
+
+	uint32_t generation = Generation[id] + 1u;
+	Generation[id] = (uint16_t)((generation < GEOMETRY_HANDLE_GENERATIONS) ? generation : 1);
+	Revision++;
+}
+
 
-		if (index >= PROGRAM_MAX_OBJECTS)
+// Bring a freed object's ID back to life under the generation in Handle, at the end of the dense arrays, so
+// handles taken before it was freed resolve again. Only the ID comes back - the caller fills in the fields.
+// Used by undo, which revives objects in the reverse order they were freed, so the ID is normally at the head
+// of the free chain. Returns the new dense index, or GEOMETRY_MAX_OBJECTS if the ID is in use
+uint32_t geometry_state_t::Revive(geometry_handle_t Handle)
+{
+	uint32_t id = Handle & GEOMETRY_HANDLE_INDEX_MASK;
+	uint32_t generation = Handle >> GEOMETRY_HANDLE_INDEX_BITS;
+	if (id >= IdCount || generation == 0 || FreeCount == 0 || IdLive(id))
+	{
+		printf("System: Cannot revive an object that is still live\n");
+		return GEOMETRY_MAX_OBJECTS;
+	}
+
+	if (Grow(Count + 1, IdCount) != 0)
+	{
+		return GEOMETRY_MAX_OBJECTS;
+	}
+
+	if (FreeHead == id)
+	{
+		FreeHead = NextFree[id];
+	}
+	else
+	{
+		uint32_t prev = FreeHead;
+		for (uint32_t i = 1; i < FreeCount && NextFree[prev] != id; i++)
 		{
-			printf("System: Object Limit Reached\n");
-			return;
+			prev = NextFree[prev];
 		}
+		NextFree[prev] = NextFree[id];
+	}
+	FreeCount--;
+
+	uint32_t index = Count;
+	Generation[id] = (uint16_t)generation;
+	Ids[index] = id;
+	DenseOf[id] = index;
+	Velocity[index] = { 0.0f, 0.0f, 0.0f };
+	AngularVelocity[index] = { 0.0f, 0.0f, 0.0f };
+	Count++;
 
-		Position++;
+	MarkChanged(index, 1);
+	Revision++;
+	return index;
+}
+
+
+// Free every chunk. The store is empty and usable again afterwards
+void geometry_state_t::Release()
+{
+	Visible.Release();
+	Scale.Release();
+	Intensity.Release();
+	PosX.Release();
+	PosY.Release();
+	PosZ.Release();
+	RotX.Release();
+	RotY.Release();
+	RotZ.Release();
+	RotW.Release();
+	BoundRadius.Release();
+	Color.Release();
+	Model.Release();
+	Mesh.Release();
+	Dynamic.Release();
+	Velocity.Release();
+	AngularVelocity.Release();
+	Ids.Release();
+	DenseOf.Release();
+	Generation.Release();
+	NextFree.Release();
+	Journal.Release();
+
+	Count = 0;
+	JournalCount = 0;
+	ChangeStamp++;
+	ClearedStamp = ChangeStamp;
+	IdCount = 0;
+	FreeHead = 0;
+	FreeCount = 0;
+	Revision++;
+}
+
+
+geometry_handle_t geometry_state_t::Handle(uint32_t Index) const
+{
+	uint32_t id = Ids[Index];
+	return ((uint32_t)Generation[id] << GEOMETRY_HANDLE_INDEX_BITS) | id;
+}
+
+
+// Turn a handle into the object's current dense index. Fails for handles to objects that have since been
+// freed, even if their ID has been reused
+bool geometry_state_t::Resolve(geometry_handle_t Handle, uint32_t *Index) const
+{
+	uint32_t id = Handle & GEOMETRY_HANDLE_INDEX_MASK;
+	if (id >= IdCount || Generation[id] != (Handle >> GEOMETRY_HANDLE_INDEX_BITS))
+	{
+		return false;
 	}
 
-	Visible[index] = VIS_STATUS_VISIBLE;
-	Scale[index] = CreateInfo.Scale;
-	Intensity[index] = CreateInfo.Intensity;
-	Color[index] = CreateInfo.Color;
-	Model[index] = CreateInfo.Model;
+	*Index = DenseOf[id];
+	return true;
 }
 
 
-void geometry_state_t::Free(uint8_t FreedIndex)
+// Whether any object owns this ID right now, whatever its generation
+bool geometry_state_t::IdLive(uint32_t Id) const
 {
-	if (Position == 0)
+	return Id < IdCount && DenseOf[Id] < Count && Ids[DenseOf[Id]] == Id;
+}
+
+
+// Live objects in Chunk - how far a per-chunk loop has to go
+uint32_t geometry_state_t::ChunkSlots(uint32_t Chunk) const
+{
+	uint32_t first = Chunk << GEOMETRY_CHUNK_SHIFT;
+	if (first >= Count)
+	{
+		return 0;
+	}
+
+	return (Count - first < GEOMETRY_CHUNK_SIZE) ? Count - first : GEOMETRY_CHUNK_SIZE;
+}
+
+
+// Rebuild Model for a contiguous range of objects from their stored transform components, one chunk-sized
+// run at a time
+void geometry_state_t::ComposeModels(uint32_t First, uint32_t Length)
+{
+	if (First + Length > Count)
+	{
+		printf("System: Out of bounds on model compose\n");
+		return;
+	}
+
+	while (Length > 0)
+	{
+		uint32_t chunk = First >> GEOMETRY_CHUNK_SHIFT;
+		uint32_t offset = First & GEOMETRY_CHUNK_MASK;
+		uint32_t run = (Length < GEOMETRY_CHUNK_SIZE - offset) ? Length : GEOMETRY_CHUNK_SIZE - offset;
+
+		uMATH::transform_soa_t In;
+		In.PosX = &PosX.Chunks[chunk][offset];
+		In.PosY = &PosY.Chunks[chunk][offset];
+		In.PosZ = &PosZ.Chunks[chunk][offset];
+		In.RotX = &RotX.Chunks[chunk][offset];
+		In.RotY = &RotY.Chunks[chunk][offset];
+		In.RotZ = &RotZ.Chunks[chunk][offset];
+		In.RotW = &RotW.Chunks[chunk][offset];
+		In.Scale = &Scale.Chunks[chunk][offset];
+
+		uMATH::ComposeModelsAF(In, &Model.Chunks[chunk][offset], run);
+		MarkChanged(First, run);
+		First += run;
+		Length -= run;
+	}
+
+	TransformRevision++;
+}
+
+
+// Record that the objects in [First, First + Length) need to be mirrored again. A range that touches the
+// newest entry extends it, which keeps in-order runs (bulk loads, chunk-by-chunk composes) to one entry.
+// When the journal is full, everything in it is folded into one covering range - more gets copied than
+// changed, but the journal never grows past GEOMETRY_JOURNAL_MAX
+void geometry_state_t::MarkChanged(uint32_t First, uint32_t Length)
+{
+	if (Length == 0)
 	{
-		printf("System: Object array empty, nothing to free\n");
 		return;
 	}
-	if (FreedIndex >= Position || FreedIndex >= PROGRAM_MAX_OBJECTS)
+
+	// No journal to record it in, so treat it as cleared straight away
+	ChangeStamp++;
+	if (Journal.Capacity == 0)
 	{
-		printf("System: Out of bounds on free list\n");
+		ClearedStamp = ChangeStamp;
 		return;
 	}
 
-	FreeList.Push(FreedIndex);
-	Visible[FreedIndex] = VIS_STATUS_FREED;
+	uint32_t end = First + Length;
+	if (JournalCount > 0)
+	{
+		geometry_range_t &last = Journal[JournalCount - 1];
+		uint32_t lastend = last.First + last.Length;
+		if (First <= lastend && end >= last.First)
+		{
+			uint32_t lo = (First < last.First) ? First : last.First;
+			uint32_t hi = (end > lastend) ? end : lastend;
+			last.First = lo;
+			last.Length = hi - lo;
+			return;
+		}
+	}
+
+	if (JournalCount == GEOMETRY_JOURNAL_MAX)
+	{
+		uint32_t lo = First;
+		uint32_t hi = end;
+		for (uint32_t i = 0; i < JournalCount; i++)
+		{
+			lo = (Journal[i].First < lo) ? Journal[i].First : lo;
+			hi = (Journal[i].First + Journal[i].Length > hi) ? Journal[i].First + Journal[i].Length : hi;
+		}
+
+		Journal[0] = { lo, hi - lo };
+		JournalCount = 1;
+		return;
+	}
+
+	Journal[JournalCount] = { First, Length };
+	JournalCount++;
+}
+
+
+// Called by the mirror once it has copied every journaled range
+void geometry_state_t::ClearChanges()
+{
+	JournalCount = 0;
+	ClearedStamp = ChangeStamp;
+}
+
+
+// Copy an object's stored components out for editing - no matrix decomposition involved
+void geometry_state_t::GetCreateInfo(uint32_t Index, geometry_create_info_t *Out) const
+{
+	Out->Scale = Scale[Index];
+	Out->Intensity = Intensity[Index];
+	Out->Rotation = { RotX[Index], RotY[Index], RotZ[Index], RotW[Index] };
+	uMATH::QuatToAxisAngle(Out->Rotation, &Out->RotationAngle, &Out->RotationAxis);
+	Out->Position = { PosX[Index], PosY[Index], PosZ[Index] };
+	Out->Color = Color[Index];
+	Out->Model = Model[Index];
+	Out->Mesh = Mesh[Index];
+	Out->Dynamic = Dynamic[Index] != 0;
+}
+
+
+// Collect the dense index of every object whose bounding sphere touches the frustum, culling one chunk
+// at a time. VisibleOut needs room for Count entries
+uint32_t geometry_state_t::CullFrustum(const uMATH::frustum_t &Frustum, uint32_t *VisibleOut) const
+{
+	uint32_t n = 0;
+
+	for (uint32_t c = 0; c < Visible.ChunkCount; c++)
+	{
+		uint32_t slots = ChunkSlots(c);
+		if (slots == 0)
+		{
+			break;
+		}
+
+		uMATH::sphere_soa_t In;
+		In.X = PosX.Chunks[c];
+		In.Y = PosY.Chunks[c];
+		In.Z = PosZ.Chunks[c];
+		In.Radius = BoundRadius.Chunks[c];
+
+		uint32_t first = c << GEOMETRY_CHUNK_SHIFT;
+		uint32_t found = uMATH::CullSpheres(Frustum, In, slots, &VisibleOut[n]);
+		for (uint32_t i = n; i < n + found; i++)
+		{
+			VisibleOut[i] += first;
+		}
+		n += found;
+	}
+
+	return n;
 }
+
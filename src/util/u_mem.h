@@ -4,24 +4,288 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <float.h>
 
 #include "u_math.h"
 
 
-#define PROGRAM_MAX_OBJECTS 64
+// Address space reserved for the whole program at startup, and how much of it is backed right away. The
+// rest is committed MEM_COMMIT_STEP at a time as the arena fills - address space is never requested again
+#define MEM_PROGRAM_RESERVE (8ull << 30)
+#define MEM_PROGRAM_COMMIT (64ull << 20)
+#define MEM_COMMIT_STEP (4ull << 20)
+// Each of the two frame scratch buffers, and each thread's job scratch. A frame can take up to
+// MEM_FRAME_OBJECT_LISTS lists with 4 bytes per object (visible list, editor neighbours, handles for a bulk
+// edit), so frame scratch has room for those at GEOMETRY_MAX_OBJECTS plus a fixed amount for everything else
+#define MEM_FRAME_OBJECT_LISTS 3
+#define MEM_FRAME_SCRATCH_SIZE (MEM_FRAME_OBJECT_LISTS * GEOMETRY_MAX_OBJECTS * 4ull + (16ull << 20))
+#define MEM_THREAD_SCRATCH_SIZE (2ull << 20)
+#define MEM_DEFAULT_ALIGN 16
+#define MEM_BLOCK_ALIGN 64
+
+// Heap blocks come in power-of-two size classes, the smallest being 1 << MEM_HEAP_MIN_SHIFT bytes
+#define MEM_HEAP_MIN_SHIFT 6
+#define MEM_HEAP_CLASSES 28
+
+
+// Position of an arena at some point, to roll back to once everything allocated after it is dead
+struct mem_marker_t
+{
+	uint64_t Used;
+};
+
+
+// One OS reservation (or a block of memory owned by someone else), handed out front to back. Nothing is
+// freed individually - Rollback() releases everything allocated since a marker at once. Counters are totals
+// since Init(), for checking that steady-state frames never go back to the OS
+struct mem_arena_t
+{
+	uint8_t *Base;
+	uint64_t Reserved;
+	uint64_t Committed;
+	uint64_t Used;
+	uint64_t Peak;
+	uint64_t AllocCount;
+	uint32_t OSReserveCount;
+	uint32_t OSCommitCount;
+
+	int Init(uint64_t ReserveSize, uint64_t CommitSize);
+	int Init(void *Memory, uint64_t Size);
+	void Release();
+	void *Push(uint64_t Bytes, uint64_t Align);
+	mem_marker_t Mark() const;
+	void Rollback(mem_marker_t Marker);
+
+	// Zeroed, aligned for T
+	template <typename T>
+	T *PushArray(uint64_t Count)
+	{
+		uint64_t align = (alignof(T) > MEM_DEFAULT_ALIGN) ? alignof(T) : MEM_DEFAULT_ALIGN;
+		T *res = (T*)Push(Count * sizeof(T), align);
+		if (res)
+		{
+			memset((void*)res, 0, Count * sizeof(T));
+		}
+		return res;
+	}
+
+	private:
+
+	int Commit(uint64_t Bytes);
+};
+
+
+// Fixed-size blocks carved from an arena. Freed blocks are chained through their first bytes and handed
+// out again before the arena is touched
+struct mem_pool_t
+{
+	mem_arena_t *Arena;
+	uint64_t BlockSize;
+	void *FreeHead;
+	uint64_t Live;
+	uint64_t Blocks;
+
+	void Init(mem_arena_t *Source, uint64_t Size);
+	void *Alloc();
+	void Free(void *Block);
+};
+
+
+// General-purpose allocation on top of an arena: one pool per power-of-two size class. Callers pass the
+// size back to Free(), so blocks carry no header. Main thread only
+struct mem_heap_t
+{
+	mem_arena_t *Arena;
+	mem_pool_t Classes[MEM_HEAP_CLASSES];
+	uint64_t Live;
+	uint64_t PeakLive;
+	uint64_t AllocCount;
+
+	void Init(mem_arena_t *Source);
+	void *Alloc(uint64_t Bytes);
+	void *Realloc(void *Block, uint64_t OldBytes, uint64_t NewBytes);
+	void Free(void *Block, uint64_t Bytes);
+};
+
+
+// Transient allocations that only have to live until the end of the next frame. BeginFrame() switches to
+// the other buffer and empties it, so whatever the previous frame pushed is still readable this frame.
+// Main thread only - jobs on the thread pool use ThreadScratch() instead
+struct frame_scratch_t
+{
+	mem_arena_t Buffers[2];
+	uint32_t Current;
+
+	int Init(mem_arena_t *Source, uint64_t Size);
+	void BeginFrame();
+	void *Push(uint64_t Bytes, uint64_t Align);
+	uint64_t HighWater() const;
+
+	template <typename T>
+	T *PushArray(uint64_t Count)
+	{
+		return Buffers[Current].PushArray<T>(Count);
+	}
+};
+
+
+// Everything the program allocates at runtime comes from these, set up once by InitProgramMemory()
+extern mem_arena_t ProgramArena;
+extern mem_heap_t ProgramHeap;
+extern frame_scratch_t FrameScratch;
+
+int InitProgramMemory();
+void ReleaseProgramMemory();
+
+
+// Slot-indexed data lives in chunks of GEOMETRY_CHUNK_SIZE entries, allocated as the store grows
+#define GEOMETRY_CHUNK_SHIFT 12
+#define GEOMETRY_CHUNK_SIZE (1u << GEOMETRY_CHUNK_SHIFT)
+#define GEOMETRY_CHUNK_MASK (GEOMETRY_CHUNK_SIZE - 1)
+#define GEOMETRY_MAX_CHUNKS 1024
+#define GEOMETRY_MAX_OBJECTS (GEOMETRY_MAX_CHUNKS * GEOMETRY_CHUNK_SIZE)
+
+// Handles carry the object's ID in the low bits and the ID's generation above it. Generation 0 is never
+// issued, so a zero handle never resolves
+#define GEOMETRY_HANDLE_INDEX_BITS 22
+#define GEOMETRY_HANDLE_INDEX_MASK ((1u << GEOMETRY_HANDLE_INDEX_BITS) - 1)
+#define GEOMETRY_HANDLE_GENERATIONS (1u << (32 - GEOMETRY_HANDLE_INDEX_BITS))
+#define GEOMETRY_HANDLE_NONE 0
+
+// Change journal entries kept before every tracked range is folded into one that covers them all
+#define GEOMETRY_JOURNAL_MAX 4096
+
 #define VIS_STATUS_VISIBLE 1
 #define VIS_STATUS_INVISIBLE 0
-#define VIS_STATUS_FREED 2
 
+// Bounding sphere radius of the unit cube mesh (corners at +-0.5), before object scale. Every mesh objects draw fits
+// inside that cube, so this bounds all of them
+#define MESH_CUBE_RADIUS 0.8660254f
+
+
+// Object ID plus generation - see GEOMETRY_HANDLE_INDEX_BITS
+typedef uint32_t geometry_handle_t;
+
+
+// Slot-indexed array in fixed-size chunks from ProgramHeap. Chunks are never moved or shrunk once allocated,
+// so growing copies nothing and references into existing chunks stay valid. Each chunk is a plain array:
+// loops that walk one chunk at a time see the same contiguous layout a flat array would give them
+template <typename T>
+struct chunked_array_t
+{
+	T *Chunks[GEOMETRY_MAX_CHUNKS];
+	uint32_t ChunkCount;
+
+	T &operator[](uint32_t Index)
+	{
+		return Chunks[Index >> GEOMETRY_CHUNK_SHIFT][Index & GEOMETRY_CHUNK_MASK];
+	}
+
+	const T &operator[](uint32_t Index) const
+	{
+		return Chunks[Index >> GEOMETRY_CHUNK_SHIFT][Index & GEOMETRY_CHUNK_MASK];
+	}
+
+	// Make sure indices [0, Count) exist. New chunks start zeroed
+	int Reserve(uint32_t Count)
+	{
+		uint32_t needed = (uint32_t)(((uint64_t)Count + GEOMETRY_CHUNK_MASK) >> GEOMETRY_CHUNK_SHIFT);
+		if (needed > GEOMETRY_MAX_CHUNKS)
+		{
+			printf("System: chunked array limit reached\n");
+			return -1;
+		}
 
-// For internal use by geometry_state_t, never user-accessible
-struct free_list_t
+		while (ChunkCount < needed)
+		{
+			T *chunk = (T*)ProgramHeap.Alloc(GEOMETRY_CHUNK_SIZE * sizeof(T));
+			if (!chunk)
+			{
+				printf("System: chunked array failed to allocate\n");
+				return -1;
+			}
+			memset(chunk, 0, GEOMETRY_CHUNK_SIZE * sizeof(T));
+
+			Chunks[ChunkCount] = chunk;
+			ChunkCount++;
+		}
+
+		return 0;
+	}
+
+	void Release()
+	{
+		for (uint32_t c = 0; c < ChunkCount; c++)
+		{
+			ProgramHeap.Free(Chunks[c], GEOMETRY_CHUNK_SIZE * sizeof(T));
+			Chunks[c] = 0x0;
+		}
+		ChunkCount = 0;
+	}
+};
+
+
+// Contiguous ProgramHeap array that is reallocated as it grows, for packed lists that are rebuilt or appended to
+// rather than addressed by slot. Anything pointing into it is invalidated by a Reserve() that grows it
+template <typename T>
+struct packed_array_t
 {
-	uint8_t NextFreePosition = 0;
-	uint8_t OpenPositions[PROGRAM_MAX_OBJECTS];
+	T *Data;
+	uint32_t Capacity;
+
+	T &operator[](uint32_t Index)
+	{
+		return Data[Index];
+	}
+
+	const T &operator[](uint32_t Index) const
+	{
+		return Data[Index];
+	}
+
+	// Make room for Count entries, keeping the current contents. Grows by at least half again each time,
+	// so appending one entry at a time stays amortized O(1)
+	int Reserve(uint32_t Count)
+	{
+		if (Count <= Capacity)
+		{
+			return 0;
+		}
 
-	void Push(uint8_t Index);
-	uint8_t Pop();
+		uint32_t cap = Capacity + (Capacity / 2);
+		cap = (cap > Count) ? cap : Count;
+		cap = (cap > 16) ? cap : 16;
+
+		T *data = (T*)ProgramHeap.Realloc(Data, (uint64_t)Capacity * sizeof(T), (uint64_t)cap * sizeof(T));
+		if (!data)
+		{
+			printf("System: packed array failed to allocate\n");
+			return -1;
+		}
+
+		Data = data;
+		Capacity = cap;
+		return 0;
+	}
+
+	void Release()
+	{
+		if (Data)
+		{
+			ProgramHeap.Free(Data, (uint64_t)Capacity * sizeof(T));
+		}
+		Data = 0x0;
+		Capacity = 0;
+	}
+};
+
+
+// Run of dense indices [First, First + Length)
+struct geometry_range_t
+{
+	uint32_t First;
+	uint32_t Length;
 };
 
 
@@ -30,40 +294,120 @@ struct geometry_create_info_t
 {
 	bool New;
 	bool Deleted;
+	bool Dynamic;
+	uint32_t Mesh;
 	float Intensity;
 	float Scale;
+	// Rotation is the source of truth. Angle/Axis are only an editing view of it - set them, then call
+	// SetRotationFromAxisAngle(). Untouched rotations pass through select/commit bit-for-bit
+	uMATH::quatf_t Rotation;
 	float RotationAngle;
 	uMATH::vec3f_t RotationAxis;
 	uMATH::vec3f_t Position;
 	uMATH::vec3f_t Color;
-	uMATH::mat4f_t Model;
+	uMATH::aff3f_t Model;
 
-	void DecomposeModelM4();
-	void ComposeModelM4();
+	void DecomposeModel();
+	void ComposeModel();
+	void SetRotationFromAxisAngle();
 };
 
 
-//User accessible
+// User accessible. Live objects are kept densely packed in [0, Count) so bulk work never meets a hole:
+// freeing one moves the last object into its place. Dense indices therefore change whenever an object is
+// freed - anything that has to outlive that holds a geometry_handle_t, which goes through a sparse table
 struct geometry_state_t
 {
-	uint8_t Visible[PROGRAM_MAX_OBJECTS];
-	float Scale[PROGRAM_MAX_OBJECTS];
-	float Intensity[PROGRAM_MAX_OBJECTS];
+	chunked_array_t<uint8_t> Visible;
+	chunked_array_t<float> Scale;
+	chunked_array_t<float> Intensity;
+
+	// Transform components Model is built from, kept as parallel arrays so matrices can be rebuilt in bulk
+	// by ComposeModels(). Rot is a unit quaternion, stored as given
+	chunked_array_t<float> PosX;
+	chunked_array_t<float> PosY;
+	chunked_array_t<float> PosZ;
+	chunked_array_t<float> RotX;
+	chunked_array_t<float> RotY;
+	chunked_array_t<float> RotZ;
+	chunked_array_t<float> RotW;
+
+	// Culling bounds, centered on Pos
+	chunked_array_t<float> BoundRadius;
 
-	uMATH::vec3f_t Color[PROGRAM_MAX_OBJECTS];
-	uMATH::mat4f_t Model[PROGRAM_MAX_OBJECTS];
+	chunked_array_t<uMATH::vec3f_t> Color;
+	chunked_array_t<uMATH::aff3f_t> Model;
 
-	uint8_t Position;
+	// ID of the mesh each object draws, from the renderer's mesh registry. The store doesn't interpret it
+	chunked_array_t<uint32_t> Mesh;
 
-	void Alloc();
-	void Alloc(const geometry_create_info_t &CreateInfo);
-	void Free(uint8_t FreedIndex);
+	// Rigid-body state. Only Dynamic objects are moved by the simulation - everything else is an immovable
+	// obstacle. Velocities start at zero whenever an object is allocated
+	chunked_array_t<uint8_t> Dynamic;
+	chunked_array_t<uMATH::vec3f_t> Velocity;
+	chunked_array_t<uMATH::vec3f_t> AngularVelocity;
+
+	// Stable ID of the object at each dense index - the index half of its handle. IDs stay with an object
+	// for its whole life, so per-object state kept outside the store can be indexed by them
+	chunked_array_t<uint32_t> Ids;
+
+	// Live objects, all of them below this index
+	uint32_t Count;
+
+	// One past the highest ID ever handed out
+	uint32_t IdCount;
+
+	// Bumped whenever an object is allocated or freed, so cached views of the object set (including anything
+	// holding dense indices) can tell they are out of date
+	uint32_t Revision;
+
+	// Bumped whenever Model is rebuilt in place, so spatial structures know to refit
+	uint32_t TransformRevision;
+
+	// Dense ranges whose Model, Color or selection tint changed since the last ClearChanges(), unsorted and
+	// possibly overlapping - whoever mirrors the objects (the GPU instance buffer) merges them and copies only
+	// those. Filled by Alloc, Free and ComposeModels, and by MarkChanged for edits made outside the store
+	packed_array_t<geometry_range_t> Journal;
+	uint32_t JournalCount;
+
+	// Bumped by every MarkChanged(), and copied to ClearedStamp by ClearChanges(). Anything else that reads the
+	// journal keeps the stamp it last synced at: if that is older than ClearedStamp, changes it never saw were
+	// cleared, and it has to look at every object instead
+	uint32_t ChangeStamp;
+	uint32_t ClearedStamp;
+
+	geometry_handle_t Alloc();
+	geometry_handle_t Alloc(const geometry_create_info_t &CreateInfo);
+	void Free(uint32_t FreedIndex);
+	uint32_t Revive(geometry_handle_t Handle);
+	geometry_handle_t Restore(geometry_handle_t Handle, const geometry_create_info_t &CreateInfo);
+	void Release();
+	geometry_handle_t Handle(uint32_t Index) const;
+	bool Resolve(geometry_handle_t Handle, uint32_t *Index) const;
+	bool IdLive(uint32_t Id) const;
+	uint32_t ChunkSlots(uint32_t Chunk) const;
+	void ComposeModels(uint32_t First, uint32_t Length);
+	void MarkChanged(uint32_t First, uint32_t Length);
+	void ClearChanges();
+	void GetCreateInfo(uint32_t Index, geometry_create_info_t *Out) const;
+	uint32_t CullFrustum(const uMATH::frustum_t &Frustum, uint32_t *VisibleOut) const;
 	
 	private:
 	
-	// Prevent Push() or Pop() being called outside of provided Alloc(), Free() functions
-	free_list_t FreeList;
+	int Grow(uint32_t Objects, uint32_t IdSlots);
+	uint32_t NextIndex();
+	void MoveObject(uint32_t From, uint32_t To);
+	void SetObject(uint32_t Index, const geometry_create_info_t &CreateInfo);
+
+	// Sparse side, indexed by ID: where the object lives now, and a generation bumped every time the ID is
+	// freed so handles to the object that used to own it stop resolving. Freed IDs are chained through
+	// NextFree and handed out again most recently freed first
+	chunked_array_t<uint32_t> DenseOf;
+	chunked_array_t<uint16_t> Generation;
+	chunked_array_t<uint32_t> NextFree;
+	uint32_t FreeHead;
+	uint32_t FreeCount;
 };
 
 
-#endif
\ No newline at end of file
+#endif
@@ -2,6 +2,8 @@
 #define MBOX_PHYSICS_H
 
 
+#include <float.h>
+
 #include "u_math.h"
 #include "../window.h"
 
@@ -17,40 +19,117 @@ struct ray_info_t
 };
 
 
-inline uMATH::vec3f_t CastWorldRay(float MouseX, float MouseY, const window_handler_t& Window)
+// Unit cube OBBs as parallel arrays - the same components geometry_state_t stores, so no model matrix is
+// needed
+struct obb_soa_t
 {
-	uMATH::vec4f_t ray4f;
+	const float *PosX;
+	const float *PosY;
+	const float *PosZ;
+	const float *RotX;
+	const float *RotY;
+	const float *RotZ;
+	const float *RotW;
+	const float *Scale;
+};
+
 
+inline uMATH::vec3f_t CastWorldRay(float MouseX, float MouseY, const window_handler_t& Window)
+{
 	// Recover NDC from screenspace - this is a decomposition of the non-invertible projection matrix
-	// No need to undo perspective divide because the ray is a unit vector at the origin, translated to world space
+	// No need to undo perspective divide because the ray is a unit vector at the origin, translated to world space.
+	// The focal lengths are read back from the projection itself, so the ray always matches what was rendered
 	float xvp = (2.0f * MouseX / (float)Window.Width) - 1.0f;
 	float yvp = (2.0f * MouseY / (float)Window.Height) - 1.0f;
-	float d = 1.0f / tan(45.0f * RADIAN);
-	float ar = (float)Window.Height / (float)Window.Width;
-	float xview = xvp / d;
-	float yview = (yvp / d) * ar;
+	float xview = xvp / Window.Projection.m[0][0];
+	float yview = yvp / Window.Projection.m[1][1];
 	float z = -1.0f;
 
-	ray4f.x = xview;			
-	ray4f.y = yview;
-	ray4f.z = z;
-	ray4f.w = 1.0f;
-
-	// Multiply point by inverse view matrix to go from NDC to world space
-	uMATH::mat4f_t WorldSpace = uMATH::InverseM4(Window.View);
-	ray4f = uMATH::MultiplyV4_M4(ray4f, WorldSpace);
-	ray4f = Scalar(ray4f, (1.0f / ray4f.w));
+	uMATH::vec3f_t ray = { xview, yview, z };
 
-	uMATH::vec3f_t out = { ray4f.x, ray4f.y, ray4f.z };
-	uMATH::vec3f_t src = Window.Camera.Position;
-	out = out - src;
+	// The view transform is rigid, so going back to world space only needs the rotation - the ray is a
+	// direction from the camera, and translating it there and back again cancels out
+	uMATH::aff3f_t WorldSpace = uMATH::InverseRigidAF(Window.View);
+	uMATH::vec3f_t out = uMATH::TransformDirection(WorldSpace, ray);
 	out = uMATH::Normalize(out);
 
 	return out;
 }
 
 
-inline bool CheckRayOBBCollision(uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uMATH::vec3f_t MinAABB, uMATH::vec3f_t MaxAABB, uMATH::mat4f_t Model, float* Distance)
+// Frustum through the screen rectangle [X0, X1] x [Y0, Y1], in the same pixel coordinates CastWorldRay() takes.
+// The four side planes pass through the camera and the corner rays CastWorldRay() returns, so the region
+// matches the rendered image exactly. Near and far are the view frustum's own. The rectangle must have area
+inline void BuildRegionFrustum(float X0, float Y0, float X1, float Y1, const window_handler_t &Window, uMATH::frustum_t *Out)
+{
+	uMATH::ExtractFrustumPlanes(Window.Projection * uMATH::ToM4(Window.View), Out);
+
+	uMATH::vec3f_t corners[4];
+	corners[0] = CastWorldRay(X0, Y0, Window);
+	corners[1] = CastWorldRay(X1, Y0, Window);
+	corners[2] = CastWorldRay(X1, Y1, Window);
+	corners[3] = CastWorldRay(X0, Y1, Window);
+	uMATH::vec3f_t center = corners[0] + corners[1] + corners[2] + corners[3];
+
+	for (int i = 0; i < 4; i++)
+	{
+		uMATH::vec3f_t n = uMATH::Normalize(uMATH::Cross(corners[i], corners[(i + 1) % 4]));
+		// Point every plane in toward the middle of the rectangle, whichever way the corners wind
+		if (uMATH::Dot(n, center) < 0.0f)
+		{
+			n = uMATH::Scalar(n, -1.0f);
+		}
+
+		Out->Planes[i] = { n.x, n.y, n.z, -uMATH::Dot(n, Window.Camera.Position) };
+	}
+}
+
+
+// World AABB of the unit cube mesh under Model - the half extent on each world axis is the sum of the
+// absolute contributions from all three local axes
+inline void ComputeOBBBounds(const uMATH::aff3f_t &Model, uMATH::vec3f_t *Min, uMATH::vec3f_t *Max)
+{
+	uMATH::vec3f_t c = { Model.m[0][3], Model.m[1][3], Model.m[2][3] };
+	uMATH::vec3f_t e;
+	e.x = 0.5f * (fabsf(Model.m[0][0]) + fabsf(Model.m[0][1]) + fabsf(Model.m[0][2]));
+	e.y = 0.5f * (fabsf(Model.m[1][0]) + fabsf(Model.m[1][1]) + fabsf(Model.m[1][2]));
+	e.z = 0.5f * (fabsf(Model.m[2][0]) + fabsf(Model.m[2][1]) + fabsf(Model.m[2][2]));
+
+	*Min = c - e;
+	*Max = c + e;
+}
+
+
+// Plane-by-plane test of the unit cube mesh under Model against a frustum: false only when the box is
+// entirely behind one plane. Boxes just outside a frustum corner can still pass, as with any per-plane test
+inline bool CheckFrustumOBB(const uMATH::frustum_t &Frustum, const uMATH::aff3f_t &Model)
+{
+	uMATH::vec3f_t c = { Model.m[0][3], Model.m[1][3], Model.m[2][3] };
+
+	for (int p = 0; p < 6; p++)
+	{
+		const uMATH::vec4f_t &pl = Frustum.Planes[p];
+		float r = 0.0f;
+		for (int i = 0; i < 3; i++)
+		{
+			r += fabsf((pl.x * Model.m[0][i]) + (pl.y * Model.m[1][i]) + (pl.z * Model.m[2][i]));
+		}
+
+		float s = (pl.x * c.x) + (pl.y * c.y) + (pl.z * c.z) + pl.w;
+		if (s + (0.5f * r) < 0.0f)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+// Slab test against an oriented box given as a local AABB under Model. Model may carry (uniform or not) scale:
+// each axis is normalized and its slab widened by the axis length. Distance is along Direction, which must be
+// unit length, and is the exit distance when Origin is inside the box
+inline bool CheckRayOBBCollision(uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uMATH::vec3f_t MinAABB, uMATH::vec3f_t MaxAABB, const uMATH::aff3f_t &Model, float* Distance)
 {
 	float tmin = -100000.0f;
 	float tmax = 100000.0f;
@@ -59,19 +138,36 @@ inline bool CheckRayOBBCollision(uMATH::vec3f_t Origin, uMATH::vec3f_t Direction
 	// Translation required to place ray at OBB origin
 	uMATH::vec3f_t delta = OBBPosition - Origin;
 
-	// Per axis check - could be extracted into its own function at a later date
-	// X axis
-	uMATH::vec3f_t axis = { Model.m[0][0], Model.m[1][0], Model.m[2][0] };
-
-	// How well does translated ray align with the axis the OBB sits on
-	float e = uMATH::Dot(axis, delta);
-	// How close is ray's orientation to bounding axis' alignment
-	float f = 1 / uMATH::Dot(Direction, axis);
+	float lo[3] = { MinAABB.x, MinAABB.y, MinAABB.z };
+	float hi[3] = { MaxAABB.x, MaxAABB.y, MaxAABB.z };
 
-	if (fabs(f) > 0.001f)
+	for (int i = 0; i < 3; i++)
 	{
-		float t1 = (e + MinAABB.x) * f;
-		float t2 = (e + MaxAABB.x) * f;
+		uMATH::vec3f_t axis = { Model.m[0][i], Model.m[1][i], Model.m[2][i] };
+		float scale = sqrtf(uMATH::Dot(axis, axis));
+		axis = uMATH::Scalar(axis, 1.0f / scale);
+
+		// How well does translated ray align with the axis the OBB sits on
+		float e = uMATH::Dot(axis, delta);
+		// How close is ray's orientation to bounding axis' alignment
+		float f = uMATH::Dot(Direction, axis);
+
+		float slabmin = lo[i] * scale;
+		float slabmax = hi[i] * scale;
+
+		// Ray parallel to this slab: it either always or never lies between the two planes
+		if (fabsf(f) <= 0.001f)
+		{
+			if (-e + slabmin > 0.0f || -e + slabmax < 0.0f)
+			{
+				*Distance = 0.0f;
+				return false;
+			}
+			continue;
+		}
+
+		float t1 = (e + slabmin) / f;
+		float t2 = (e + slabmax) / f;
 
 		if (t1 > t2)
 		{
@@ -93,100 +189,222 @@ inline bool CheckRayOBBCollision(uMATH::vec3f_t Origin, uMATH::vec3f_t Direction
 			*Distance = 0.0f;
 			return false;
 		}
-
-	}
-	else if (-e + MinAABB.x > 0.0f || -e + MaxAABB.x < 0.0f)
-	{
-		*Distance = 0.0f;
-		return false;
 	}
 
-	// Y axis
-	axis = { Model.m[0][1], Model.m[1][1], Model.m[2][1] };
-	e = uMATH::Dot(axis, delta);
-	f = 1 / uMATH::Dot(Direction, axis);
+	*Distance = (tmin > 0.0f) ? tmin : tmax;
+	return true;
+}
 
-	if (fabs(f) > 0.001f)
-	{
-		float t1 = (e + MinAABB.y) * f;
-		float t2 = (e + MaxAABB.y) * f;
 
-		if (t1 > t2)
-		{
-			float temp = t1;
-			t1 = t2;
-			t2 = temp;
-		}
 
-		if (t1 > tmin)
+// Nearest hit of one ray against Count OBBs, four boxes per iteration on the SIMD path. Box axes come
+// straight from the quaternion, so they are unit length and the slab half-width is just half the scale.
+// Returns false with Index = 0xFFFFFFFF if nothing was hit. Direction must be unit length
+inline bool RaycastOBBs(const obb_soa_t &In, uint32_t Count, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Index, float *Distance)
+{
+	float best = FLT_MAX;
+	uint32_t bestindex = 0xFFFFFFFF;
+	uint32_t i = 0;
+
+#if UMATH_SIMD_SSE
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 eps = _mm_set1_ps(0.001f);
+	const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	const __m128 ox = _mm_set1_ps(Origin.x);
+	const __m128 oy = _mm_set1_ps(Origin.y);
+	const __m128 oz = _mm_set1_ps(Origin.z);
+	const __m128 rx = _mm_set1_ps(Direction.x);
+	const __m128 ry = _mm_set1_ps(Direction.y);
+	const __m128 rz = _mm_set1_ps(Direction.z);
+
+	__m128 lanebest = _mm_set1_ps(FLT_MAX);
+	__m128i laneindex = _mm_set1_epi32(-1);
+	__m128i index = _mm_setr_epi32(0, 1, 2, 3);
+
+	for (; i + 4 <= Count; i += 4)
+	{
+		__m128 qx = _mm_loadu_ps(&In.RotX[i]);
+		__m128 qy = _mm_loadu_ps(&In.RotY[i]);
+		__m128 qz = _mm_loadu_ps(&In.RotZ[i]);
+		__m128 qw = _mm_loadu_ps(&In.RotW[i]);
+		__m128 h = _mm_mul_ps(_mm_loadu_ps(&In.Scale[i]), half);
+
+		__m128 x2 = _mm_add_ps(qx, qx);
+		__m128 y2 = _mm_add_ps(qy, qy);
+		__m128 z2 = _mm_add_ps(qz, qz);
+		__m128 xx = _mm_mul_ps(qx, x2);
+		__m128 yy = _mm_mul_ps(qy, y2);
+		__m128 zz = _mm_mul_ps(qz, z2);
+		__m128 xy = _mm_mul_ps(qx, y2);
+		__m128 xz = _mm_mul_ps(qx, z2);
+		__m128 yz = _mm_mul_ps(qy, z2);
+		__m128 wx = _mm_mul_ps(qw, x2);
+		__m128 wy = _mm_mul_ps(qw, y2);
+		__m128 wz = _mm_mul_ps(qw, z2);
+
+		// Box axes are the columns of the rotation matrix
+		__m128 ax[3] = { _mm_sub_ps(one, _mm_add_ps(yy, zz)), _mm_sub_ps(xy, wz), _mm_add_ps(xz, wy) };
+		__m128 ay[3] = { _mm_add_ps(xy, wz), _mm_sub_ps(one, _mm_add_ps(xx, zz)), _mm_sub_ps(yz, wx) };
+		__m128 az[3] = { _mm_sub_ps(xz, wy), _mm_add_ps(yz, wx), _mm_sub_ps(one, _mm_add_ps(xx, yy)) };
+
+		__m128 dx = _mm_sub_ps(_mm_loadu_ps(&In.PosX[i]), ox);
+		__m128 dy = _mm_sub_ps(_mm_loadu_ps(&In.PosY[i]), oy);
+		__m128 dz = _mm_sub_ps(_mm_loadu_ps(&In.PosZ[i]), oz);
+
+		__m128 tmin = _mm_set1_ps(-100000.0f);
+		__m128 tmax = _mm_set1_ps(100000.0f);
+		__m128 miss = _mm_setzero_ps();
+
+		for (int a = 0; a < 3; a++)
 		{
-			tmin = t1;
+			__m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[a], dx), _mm_mul_ps(ay[a], dy)), _mm_mul_ps(az[a], dz));
+			__m128 f = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax[a], rx), _mm_mul_ps(ay[a], ry)), _mm_mul_ps(az[a], rz));
+
+			// Parallel lanes divide by 1 instead and keep their interval - they only hit if the origin is inside the slab
+			__m128 parallel = _mm_cmple_ps(_mm_and_ps(f, absmask), eps);
+			miss = _mm_or_ps(miss, _mm_and_ps(parallel, _mm_cmpgt_ps(_mm_and_ps(e, absmask), h)));
+			f = _mm_or_ps(_mm_and_ps(parallel, one), _mm_andnot_ps(parallel, f));
+
+			__m128 t1 = _mm_div_ps(_mm_sub_ps(e, h), f);
+			__m128 t2 = _mm_div_ps(_mm_add_ps(e, h), f);
+			__m128 lo = _mm_min_ps(t1, t2);
+			__m128 hi = _mm_max_ps(t1, t2);
+			tmin = _mm_or_ps(_mm_and_ps(parallel, tmin), _mm_andnot_ps(parallel, _mm_max_ps(tmin, lo)));
+			tmax = _mm_or_ps(_mm_and_ps(parallel, tmax), _mm_andnot_ps(parallel, _mm_min_ps(tmax, hi)));
 		}
-		if (t2 < tmax)
+
+		miss = _mm_or_ps(miss, _mm_cmpgt_ps(tmin, tmax));
+		miss = _mm_or_ps(miss, _mm_cmplt_ps(tmax, _mm_setzero_ps()));
+
+		// Exit distance when the origin is inside the box, same as CheckRayOBBCollision
+		__m128 inside = _mm_cmple_ps(tmin, _mm_setzero_ps());
+		__m128 t = _mm_or_ps(_mm_and_ps(inside, tmax), _mm_andnot_ps(inside, tmin));
+
+		__m128 closer = _mm_andnot_ps(miss, _mm_cmplt_ps(t, lanebest));
+		lanebest = _mm_or_ps(_mm_and_ps(closer, t), _mm_andnot_ps(closer, lanebest));
+		laneindex = _mm_or_si128(_mm_and_si128(_mm_castps_si128(closer), index), _mm_andnot_si128(_mm_castps_si128(closer), laneindex));
+		index = _mm_add_epi32(index, _mm_set1_epi32(4));
+	}
+
+	float lanet[4];
+	uint32_t lanei[4];
+	_mm_storeu_ps(lanet, lanebest);
+	_mm_storeu_si128((__m128i*)lanei, laneindex);
+	for (int l = 0; l < 4; l++)
+	{
+		if (lanei[l] != 0xFFFFFFFF && (lanet[l] < best || (lanet[l] == best && lanei[l] < bestindex)))
 		{
-			tmax = t2;
+			best = lanet[l];
+			bestindex = lanei[l];
 		}
-		if (tmin > tmax || tmax < 0)
+	}
+#endif
+
+	for (; i < Count; i++)
+	{
+		uMATH::quatf_t q = { In.RotX[i], In.RotY[i], In.RotZ[i], In.RotW[i] };
+		uMATH::aff3f_t m;
+		uMATH::ComposeAF({ In.PosX[i], In.PosY[i], In.PosZ[i] }, q, In.Scale[i], &m);
+
+		float t;
+		uMATH::vec3f_t boxmin = { -0.5f, -0.5f, -0.5f };
+		uMATH::vec3f_t boxmax = { 0.5f, 0.5f, 0.5f };
+		if (CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, m, &t) && t < best)
 		{
-			*Distance = 0.0f;
-			return false;
+			best = t;
+			bestindex = i;
 		}
-
 	}
-	else if (-e + MinAABB.y > 0.0f || -e + MaxAABB.y < 0.0f)
+
+	*Index = bestindex;
+	*Distance = best;
+
+	return bestindex != 0xFFFFFFFF;
+}
+
+
+
+// Exact separating axis test between two unit-cube OBBs under their model transforms: the three face normals
+// of each box plus the nine edge-edge cross products. On overlap, Normal receives the axis of least
+// penetration (pointing from A towards B) and Depth the overlap along it. Either may be 0x0
+inline bool CheckOBBOBBCollision(const uMATH::aff3f_t &A, const uMATH::aff3f_t &B, uMATH::vec3f_t *Normal, float *Depth)
+{
+	uMATH::vec3f_t ax[3];
+	uMATH::vec3f_t bx[3];
+	float ae[3];
+	float be[3];
+
+	for (int i = 0; i < 3; i++)
 	{
-		*Distance = 0.0f;
-		return false;
+		uMATH::vec3f_t ca = { A.m[0][i], A.m[1][i], A.m[2][i] };
+		uMATH::vec3f_t cb = { B.m[0][i], B.m[1][i], B.m[2][i] };
+		float la = sqrtf(uMATH::Dot(ca, ca));
+		float lb = sqrtf(uMATH::Dot(cb, cb));
+
+		ax[i] = uMATH::Scalar(ca, 1.0f / la);
+		bx[i] = uMATH::Scalar(cb, 1.0f / lb);
+		ae[i] = 0.5f * la;
+		be[i] = 0.5f * lb;
 	}
 
-	// Z axis
-	axis = { Model.m[0][2], Model.m[1][2], Model.m[2][2] };
-	e = uMATH::Dot(axis, delta);
-	f = 1 / uMATH::Dot(Direction, axis);
+	uMATH::vec3f_t t = { B.m[0][3] - A.m[0][3], B.m[1][3] - A.m[1][3], B.m[2][3] - A.m[2][3] };
 
-	if (fabs(f) > 0.001f)
+	uMATH::vec3f_t axes[15];
+	for (int i = 0; i < 3; i++)
 	{
-		float t1 = (e + MinAABB.z) * f;
-		float t2 = (e + MaxAABB.z) * f;
-
-		if (t1 > t2)
+		axes[i] = ax[i];
+		axes[3 + i] = bx[i];
+		for (int j = 0; j < 3; j++)
 		{
-			float temp = t1;
-			t1 = t2;
-			t2 = temp;
+			axes[6 + (i * 3) + j] = uMATH::Cross(ax[i], bx[j]);
 		}
+	}
 
-		if (t1 > tmin)
+	float best = FLT_MAX;
+	uMATH::vec3f_t bestaxis = { 0.0f, 1.0f, 0.0f };
+
+	for (int k = 0; k < 15; k++)
+	{
+		uMATH::vec3f_t L = axes[k];
+
+		// Edge pairs that are (nearly) parallel span no plane - the face axes already cover that case
+		if (k >= 6)
 		{
-			tmin = t1;
+			float len = uMATH::Dot(L, L);
+			if (len < 0.000001f)
+			{
+				continue;
+			}
+			L = uMATH::Scalar(L, 1.0f / sqrtf(len));
 		}
-		if (t2 < tmax)
+
+		float ra = (ae[0] * fabsf(uMATH::Dot(ax[0], L))) + (ae[1] * fabsf(uMATH::Dot(ax[1], L))) + (ae[2] * fabsf(uMATH::Dot(ax[2], L)));
+		float rb = (be[0] * fabsf(uMATH::Dot(bx[0], L))) + (be[1] * fabsf(uMATH::Dot(bx[1], L))) + (be[2] * fabsf(uMATH::Dot(bx[2], L)));
+		float d = uMATH::Dot(t, L);
+		float overlap = ra + rb - fabsf(d);
+
+		if (overlap < 0.0f)
 		{
-			tmax = t2;
+			return false;
 		}
-		if (tmin > tmax || tmax < 0)
+		if (overlap < best)
 		{
-			*Distance = 0.0f;
-			return false;
+			best = overlap;
+			bestaxis = (d < 0.0f) ? uMATH::Scalar(L, -1.0f) : L;
 		}
-
-	}
-	else if (-e + MinAABB.z > 0.0f || -e + MaxAABB.z < 0.0f)
-	{
-		*Distance = 0.0f;
-		return false;
 	}
 
-	if (tmin > 0)
+	if (Normal)
 	{
-		*Distance = tmin;
-		return tmin;
+		*Normal = bestaxis;
 	}
-	else
+	if (Depth)
 	{
-		*Distance = tmax;
-		return true;
+		*Depth = best;
 	}
+
+	return true;
 }
 
 
@@ -0,0 +1,795 @@
+#include "u_rigid.h"
+#include "u_phys.h"
+
+#include <float.h>
+
+
+namespace uPHYS
+{
+
+
+// Center, unit axes and half extents of an object's box
+struct rigid_box_t
+{
+	uMATH::vec3f_t Center;
+	uMATH::vec3f_t Axis[3];
+	float Extent[3];
+};
+
+
+// Shared by every island job of one step
+struct rigid_job_t
+{
+	rigid_world_t *World;
+	geometry_state_t *State;
+};
+
+
+static void GetBox(const uMATH::aff3f_t &M, rigid_box_t *Out)
+{
+	Out->Center = { M.m[0][3], M.m[1][3], M.m[2][3] };
+
+	for (int i = 0; i < 3; i++)
+	{
+		uMATH::vec3f_t col = { M.m[0][i], M.m[1][i], M.m[2][i] };
+		float len = sqrtf(uMATH::Dot(col, col));
+
+		Out->Axis[i] = uMATH::Scalar(col, 1.0f / len);
+		Out->Extent[i] = 0.5f * len;
+	}
+}
+
+
+// Axis of Box closest to parallel with Dir. Sign flips it to point along Dir, Align is how parallel they are
+static int MostAlignedAxis(const rigid_box_t &Box, const uMATH::vec3f_t &Dir, float *Sign, float *Align)
+{
+	int best = 0;
+	*Align = -1.0f;
+
+	for (int i = 0; i < 3; i++)
+	{
+		float d = uMATH::Dot(Box.Axis[i], Dir);
+		if (fabsf(d) > *Align)
+		{
+			best = i;
+			*Align = fabsf(d);
+			*Sign = (d < 0.0f) ? -1.0f : 1.0f;
+		}
+	}
+
+	return best;
+}
+
+
+// Corners of the face of Box on the Sign side of Axis, in winding order
+static void FaceVertices(const rigid_box_t &Box, int Axis, float Sign, uMATH::vec3f_t *Out)
+{
+	int u = (Axis + 1) % 3;
+	int v = (Axis + 2) % 3;
+
+	uMATH::vec3f_t c = Box.Center + uMATH::Scalar(Box.Axis[Axis], Sign * Box.Extent[Axis]);
+	uMATH::vec3f_t du = uMATH::Scalar(Box.Axis[u], Box.Extent[u]);
+	uMATH::vec3f_t dv = uMATH::Scalar(Box.Axis[v], Box.Extent[v]);
+
+	Out[0] = c + du + dv;
+	Out[1] = c - du + dv;
+	Out[2] = c - du - dv;
+	Out[3] = c + du - dv;
+}
+
+
+// Sutherland-Hodgman: keep the part of a convex polygon where Dot(Normal, p) <= Offset. Out needs room for
+// Count + 1 points
+static uint32_t ClipPolygon(const uMATH::vec3f_t *In, uint32_t Count, const uMATH::vec3f_t &Normal, float Offset, uMATH::vec3f_t *Out)
+{
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		const uMATH::vec3f_t &a = In[i];
+		const uMATH::vec3f_t &b = In[(i + 1) % Count];
+		float da = uMATH::Dot(Normal, a) - Offset;
+		float db = uMATH::Dot(Normal, b) - Offset;
+
+		if (da <= 0.0f)
+		{
+			Out[n] = a;
+			n++;
+		}
+		if ((da <= 0.0f) != (db <= 0.0f))
+		{
+			Out[n] = a + uMATH::Scalar(b - a, da / (da - db));
+			n++;
+		}
+	}
+
+	return n;
+}
+
+
+// Face contact: clip the face of Inc that faces the reference face against the reference face's side planes,
+// and keep what ended up below it. Each point is placed halfway between the two surfaces. Points and Depths
+// need room for 8 entries
+static uint32_t ClipFaces(const rigid_box_t &Ref, int RefAxis, float RefSign, const rigid_box_t &Inc, uMATH::vec3f_t *Points, float *Depths)
+{
+	uMATH::vec3f_t n = uMATH::Scalar(Ref.Axis[RefAxis], RefSign);
+
+	float incsign;
+	float align;
+	int incaxis = MostAlignedAxis(Inc, uMATH::Scalar(n, -1.0f), &incsign, &align);
+
+	uMATH::vec3f_t poly[8];
+	uMATH::vec3f_t clipped[8];
+	uint32_t count = 4;
+	FaceVertices(Inc, incaxis, incsign, poly);
+
+	for (int k = 1; k < 3; k++)
+	{
+		int side = (RefAxis + k) % 3;
+		for (int s = 0; s < 2; s++)
+		{
+			uMATH::vec3f_t sn = uMATH::Scalar(Ref.Axis[side], (s == 0) ? 1.0f : -1.0f);
+			float offset = uMATH::Dot(sn, Ref.Center) + Ref.Extent[side];
+
+			count = ClipPolygon(poly, count, sn, offset, clipped);
+			if (count == 0)
+			{
+				return 0;
+			}
+
+			memcpy(poly, clipped, count * sizeof(uMATH::vec3f_t));
+		}
+	}
+
+	float face = uMATH::Dot(n, Ref.Center) + Ref.Extent[RefAxis];
+	uint32_t res = 0;
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		float sep = uMATH::Dot(n, poly[i]) - face;
+		if (sep < 0.0f)
+		{
+			Points[res] = poly[i] - uMATH::Scalar(n, 0.5f * sep);
+			Depths[res] = -sep;
+			res++;
+		}
+	}
+
+	return res;
+}
+
+
+// Edge contact: a single point halfway between the closest points of the two edges that cross along Normal
+static uint32_t ClipEdges(const rigid_box_t &A, const rigid_box_t &B, const uMATH::vec3f_t &Normal, float Depth, uMATH::vec3f_t *Points, float *Depths)
+{
+	int ea = 0;
+	int eb = 0;
+	float best = -1.0f;
+
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+		{
+			uMATH::vec3f_t c = uMATH::Cross(A.Axis[i], B.Axis[j]);
+			float len = uMATH::Dot(c, c);
+			if (len < 0.000001f)
+			{
+				continue;
+			}
+
+			float d = fabsf(uMATH::Dot(c, Normal)) / sqrtf(len);
+			if (d > best)
+			{
+				best = d;
+				ea = i;
+				eb = j;
+			}
+		}
+	}
+
+	// The edge of A furthest along Normal, and the edge of B furthest against it
+	uMATH::vec3f_t pa = A.Center;
+	uMATH::vec3f_t pb = B.Center;
+	for (int k = 0; k < 3; k++)
+	{
+		if (k != ea)
+		{
+			pa += uMATH::Scalar(A.Axis[k], (uMATH::Dot(A.Axis[k], Normal) > 0.0f) ? A.Extent[k] : -A.Extent[k]);
+		}
+		if (k != eb)
+		{
+			pb += uMATH::Scalar(B.Axis[k], (uMATH::Dot(B.Axis[k], Normal) < 0.0f) ? B.Extent[k] : -B.Extent[k]);
+		}
+	}
+
+	// Closest points of the two lines, clamped to the edges. The chosen axes are never parallel
+	const uMATH::vec3f_t &da = A.Axis[ea];
+	const uMATH::vec3f_t &db = B.Axis[eb];
+	uMATH::vec3f_t r = pa - pb;
+	float b = uMATH::Dot(da, db);
+	float d = uMATH::Dot(da, r);
+	float e = uMATH::Dot(db, r);
+
+	float s = ((b * e) - d) / (1.0f - (b * b));
+	s = fminf(fmaxf(s, -A.Extent[ea]), A.Extent[ea]);
+	float t = e + (s * b);
+	t = fminf(fmaxf(t, -B.Extent[eb]), B.Extent[eb]);
+
+	uMATH::vec3f_t ca = pa + uMATH::Scalar(da, s);
+	uMATH::vec3f_t cb = pb + uMATH::Scalar(db, t);
+
+	Points[0] = uMATH::Scalar(ca + cb, 0.5f);
+	Depths[0] = Depth;
+
+	return 1;
+}
+
+
+// Contact points between two overlapping boxes, given the SAT normal (A to B) and depth
+static uint32_t BoxContacts(const rigid_box_t &A, const rigid_box_t &B, const uMATH::vec3f_t &Normal, float Depth, uMATH::vec3f_t *Points, float *Depths)
+{
+	float signa;
+	float signb;
+	float aligna;
+	float alignb;
+	int axisa = MostAlignedAxis(A, Normal, &signa, &aligna);
+	int axisb = MostAlignedAxis(B, uMATH::Scalar(Normal, -1.0f), &signb, &alignb);
+
+	// Neither box has a face along the normal, so SAT picked an edge-edge axis
+	if (aligna < RIGID_FACE_ALIGN && alignb < RIGID_FACE_ALIGN)
+	{
+		return ClipEdges(A, B, Normal, Depth, Points, Depths);
+	}
+
+	// Prefer A on near-ties, so the reference face doesn't flip back and forth between steps
+	if (aligna + 0.001f >= alignb)
+	{
+		return ClipFaces(A, axisa, signa, B, Points, Depths);
+	}
+
+	return ClipFaces(B, axisb, signb, A, Points, Depths);
+}
+
+
+// Cut a manifold down to RIGID_MANIFOLD_POINTS: the deepest point, the point furthest from it, then the
+// points furthest to either side of the line between those two - which keeps most of the contact area
+static uint32_t ReduceManifold(uMATH::vec3f_t *Points, float *Depths, uint32_t Count, const uMATH::vec3f_t &Normal)
+{
+	if (Count <= RIGID_MANIFOLD_POINTS)
+	{
+		return Count;
+	}
+
+	uint32_t keep[RIGID_MANIFOLD_POINTS] = {};
+
+	for (uint32_t i = 1; i < Count; i++)
+	{
+		if (Depths[i] > Depths[keep[0]])
+		{
+			keep[0] = i;
+		}
+	}
+
+	float furthest = -1.0f;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		uMATH::vec3f_t d = Points[i] - Points[keep[0]];
+		if (uMATH::Dot(d, d) > furthest)
+		{
+			furthest = uMATH::Dot(d, d);
+			keep[1] = i;
+		}
+	}
+
+	uMATH::vec3f_t edge = Points[keep[1]] - Points[keep[0]];
+	float most = -FLT_MAX;
+	float least = FLT_MAX;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		float side = uMATH::Dot(uMATH::Cross(edge, Points[i] - Points[keep[0]]), Normal);
+		if (side > most)
+		{
+			most = side;
+			keep[2] = i;
+		}
+		if (side < least)
+		{
+			least = side;
+			keep[3] = i;
+		}
+	}
+
+	uMATH::vec3f_t points[RIGID_MANIFOLD_POINTS];
+	float depths[RIGID_MANIFOLD_POINTS];
+	for (int k = 0; k < RIGID_MANIFOLD_POINTS; k++)
+	{
+		points[k] = Points[keep[k]];
+		depths[k] = Depths[keep[k]];
+	}
+
+	// Collinear points can pick the same index twice - only keep each one once
+	uint32_t res = 0;
+	for (int k = 0; k < RIGID_MANIFOLD_POINTS; k++)
+	{
+		bool repeat = false;
+		for (int j = 0; j < k; j++)
+		{
+			repeat |= keep[j] == keep[k];
+		}
+		if (repeat)
+		{
+			continue;
+		}
+
+		Points[res] = points[k];
+		Depths[res] = depths[k];
+		res++;
+	}
+
+	return res;
+}
+
+
+static uMATH::vec3f_t RelativeVelocity(const geometry_state_t &State, const rigid_contact_t &c)
+{
+	uMATH::vec3f_t va = State.Velocity[c.A] + uMATH::Cross(State.AngularVelocity[c.A], c.RA);
+	uMATH::vec3f_t vb = { 0.0f, 0.0f, 0.0f };
+	if (c.B != RIGID_NO_BODY)
+	{
+		vb = State.Velocity[c.B] + uMATH::Cross(State.AngularVelocity[c.B], c.RB);
+	}
+
+	return vb - va;
+}
+
+
+// Impulse P acts on B along its direction, and on A against it
+static void ApplyImpulse(const rigid_world_t &World, geometry_state_t *State, const rigid_contact_t &c, const uMATH::vec3f_t &P)
+{
+	State->Velocity[c.A] -= uMATH::Scalar(P, World.InvMass[c.A]);
+	State->AngularVelocity[c.A] -= uMATH::Scalar(uMATH::Cross(c.RA, P), World.InvInertia[c.A]);
+
+	if (c.B != RIGID_NO_BODY)
+	{
+		State->Velocity[c.B] += uMATH::Scalar(P, World.InvMass[c.B]);
+		State->AngularVelocity[c.B] += uMATH::Scalar(uMATH::Cross(c.RB, P), World.InvInertia[c.B]);
+	}
+}
+
+
+// Effective mass of a contact along Dir. Inertia is a scalar per body, so (I^-1 (r x d)) x r . d = I^-1 |r x d|^2
+static float ContactMass(const rigid_world_t &World, const rigid_contact_t &c, const uMATH::vec3f_t &Dir)
+{
+	uMATH::vec3f_t ra = uMATH::Cross(c.RA, Dir);
+	float k = World.InvMass[c.A] + (World.InvInertia[c.A] * uMATH::Dot(ra, ra));
+
+	if (c.B != RIGID_NO_BODY)
+	{
+		uMATH::vec3f_t rb = uMATH::Cross(c.RB, Dir);
+		k += World.InvMass[c.B] + (World.InvInertia[c.B] * uMATH::Dot(rb, rb));
+	}
+
+	return 1.0f / k;
+}
+
+
+// Island job: set up every contact of the island, warm start it, then run the velocity iterations. Islands
+// share no dynamic bodies, so jobs only ever write velocities nobody else touches
+static void SolveIsland(void *Data, uint32_t Island)
+{
+	rigid_job_t *job = (rigid_job_t*)Data;
+	rigid_world_t *w = job->World;
+	geometry_state_t *s = job->State;
+	rigid_contact_t *contacts = w->Contacts[w->Current].Data;
+	uint32_t first = w->IslandStart[Island];
+	uint32_t last = w->IslandStart[Island + 1];
+
+	for (uint32_t k = first; k < last; k++)
+	{
+		rigid_contact_t &c = contacts[w->IslandContacts[k]];
+
+		uMATH::vec3f_t pa = { s->PosX[c.A], s->PosY[c.A], s->PosZ[c.A] };
+		c.RA = c.Point - pa;
+		c.RB = { 0.0f, 0.0f, 0.0f };
+		if (c.B != RIGID_NO_BODY)
+		{
+			uMATH::vec3f_t pb = { s->PosX[c.B], s->PosY[c.B], s->PosZ[c.B] };
+			c.RB = c.Point - pb;
+		}
+
+		// Any two directions perpendicular to the normal will do for friction
+		const uMATH::vec3f_t &n = c.Normal;
+		if (fabsf(n.x) >= 0.57735f)
+		{
+			c.Tangent[0] = uMATH::Normalize(uMATH::vec3f_t{ n.y, -n.x, 0.0f });
+		}
+		else
+		{
+			c.Tangent[0] = uMATH::Normalize(uMATH::vec3f_t{ 0.0f, n.z, -n.y });
+		}
+		c.Tangent[1] = uMATH::Cross(n, c.Tangent[0]);
+
+		c.NormalMass = ContactMass(*w, c, n);
+		c.TangentMass[0] = ContactMass(*w, c, c.Tangent[0]);
+		c.TangentMass[1] = ContactMass(*w, c, c.Tangent[1]);
+		c.Bias = (RIGID_BAUMGARTE / RIGID_TIMESTEP) * fmaxf(c.Depth - RIGID_SLOP, 0.0f);
+
+		uMATH::vec3f_t p = uMATH::Scalar(n, c.NormalImpulse);
+		p += uMATH::Scalar(c.Tangent[0], c.TangentImpulse[0]);
+		p += uMATH::Scalar(c.Tangent[1], c.TangentImpulse[1]);
+		ApplyImpulse(*w, s, c, p);
+	}
+
+	for (int it = 0; it < RIGID_ITERATIONS; it++)
+	{
+		for (uint32_t k = first; k < last; k++)
+		{
+			rigid_contact_t &c = contacts[w->IslandContacts[k]];
+
+			// Friction first, bounded by the normal impulse found so far
+			float limit = RIGID_FRICTION * c.NormalImpulse;
+			for (int t = 0; t < 2; t++)
+			{
+				float vt = uMATH::Dot(RelativeVelocity(*s, c), c.Tangent[t]);
+				float prev = c.TangentImpulse[t];
+				c.TangentImpulse[t] = fminf(fmaxf(prev - (c.TangentMass[t] * vt), -limit), limit);
+				ApplyImpulse(*w, s, c, uMATH::Scalar(c.Tangent[t], c.TangentImpulse[t] - prev));
+			}
+
+			// Accumulated normal impulse may only push bodies apart
+			float vn = uMATH::Dot(RelativeVelocity(*s, c), c.Normal);
+			float prev = c.NormalImpulse;
+			c.NormalImpulse = fmaxf(prev + (c.NormalMass * (c.Bias - vn)), 0.0f);
+			ApplyImpulse(*w, s, c, uMATH::Scalar(c.Normal, c.NormalImpulse - prev));
+		}
+	}
+}
+
+
+void rigid_world_t::AddContact(uint32_t A, uint32_t B, const uMATH::vec3f_t &Point, const uMATH::vec3f_t &Normal, float Depth)
+{
+	uint32_t &count = ContactCount[Current];
+	if (Contacts[Current].Reserve(count + 1) != 0)
+	{
+		return;
+	}
+
+	rigid_contact_t &c = Contacts[Current][count];
+	c.A = A;
+	c.B = B;
+	c.Point = Point;
+	c.Normal = Normal;
+	c.Depth = Depth;
+	c.NormalImpulse = 0.0f;
+	c.TangentImpulse[0] = 0.0f;
+	c.TangentImpulse[1] = 0.0f;
+
+	// Resting contacts barely move between steps - starting from last step's impulses lets stacks settle
+	// in a handful of iterations instead of sinking into each other
+	const rigid_contact_t *prev = Contacts[Current ^ 1].Data;
+	for (uint32_t i = PrevHead[A]; i != RIGID_NO_BODY; i = PrevNext[i])
+	{
+		uMATH::vec3f_t d = prev[i].Point - Point;
+		if (prev[i].B == B && uMATH::Dot(d, d) < RIGID_WARM_DISTANCE * RIGID_WARM_DISTANCE)
+		{
+			c.NormalImpulse = prev[i].NormalImpulse;
+			c.TangentImpulse[0] = prev[i].TangentImpulse[0];
+			c.TangentImpulse[1] = prev[i].TangentImpulse[1];
+			break;
+		}
+	}
+
+	count++;
+}
+
+
+void rigid_world_t::FindContacts(const geometry_state_t &State, const sap_t &Broadphase)
+{
+	uMATH::vec3f_t points[8];
+	float depths[8];
+
+	for (uint32_t i = 0; i < Broadphase.PairCount; i++)
+	{
+		uint32_t a = Broadphase.Pairs[i].A;
+		uint32_t b = Broadphase.Pairs[i].B;
+		if (!State.Dynamic[a] && !State.Dynamic[b])
+		{
+			continue;
+		}
+
+		// Contacts always name a dynamic body as A, and the lower slot when both are - the broadphase doesn't
+		// keep pairs in the same order from step to step, and warm starting matches on (A, B)
+		if (!State.Dynamic[a] || (State.Dynamic[b] && b < a))
+		{
+			uint32_t t = a;
+			a = b;
+			b = t;
+		}
+
+		uMATH::vec3f_t normal;
+		float depth;
+		if (!CheckOBBOBBCollision(State.Model[a], State.Model[b], &normal, &depth))
+		{
+			continue;
+		}
+
+		rigid_box_t boxa;
+		rigid_box_t boxb;
+		GetBox(State.Model[a], &boxa);
+		GetBox(State.Model[b], &boxb);
+
+		uint32_t count = BoxContacts(boxa, boxb, normal, depth, points, depths);
+		count = ReduceManifold(points, depths, count, normal);
+
+		uint32_t body = State.Dynamic[b] ? b : RIGID_NO_BODY;
+		for (uint32_t k = 0; k < count; k++)
+		{
+			AddContact(a, body, points[k], normal, depths[k]);
+		}
+	}
+
+	// The floor only needs the corners that have sunk below it
+	uMATH::vec3f_t down = { 0.0f, -1.0f, 0.0f };
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		if (!State.Dynamic[i])
+		{
+			continue;
+		}
+
+		uint32_t count = 0;
+		for (int k = 0; k < 8; k++)
+		{
+			uMATH::vec3f_t corner = { (k & 1) ? 0.5f : -0.5f, (k & 2) ? 0.5f : -0.5f, (k & 4) ? 0.5f : -0.5f };
+			uMATH::vec3f_t p = uMATH::TransformPoint(State.Model[i], corner);
+
+			float depth = RIGID_FLOOR_HEIGHT - p.y;
+			if (depth > 0.0f)
+			{
+				points[count] = { p.x, p.y + (0.5f * depth), p.z };
+				depths[count] = depth;
+				count++;
+			}
+		}
+
+		count = ReduceManifold(points, depths, count, down);
+		for (uint32_t k = 0; k < count; k++)
+		{
+			AddContact(i, RIGID_NO_BODY, points[k], down, depths[k]);
+		}
+	}
+}
+
+
+uint32_t rigid_world_t::FindRoot(uint32_t Slot)
+{
+	while (Parent[Slot] != Slot)
+	{
+		Parent[Slot] = Parent[Parent[Slot]];
+		Slot = Parent[Slot];
+	}
+
+	return Slot;
+}
+
+
+// Join every pair of dynamic bodies that share a contact, then group contact indices by the island they fall in
+void rigid_world_t::BuildIslands(uint32_t Count)
+{
+	const rigid_contact_t *contacts = Contacts[Current].Data;
+	uint32_t n = ContactCount[Current];
+
+	IslandCount = 0;
+	if (IslandStart.Reserve(n + 1) != 0 || IslandContacts.Reserve(n) != 0)
+	{
+		return;
+	}
+
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Parent[i] = i;
+		IslandOf[i] = RIGID_NO_BODY;
+	}
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		if (contacts[i].B == RIGID_NO_BODY)
+		{
+			continue;
+		}
+
+		uint32_t ra = FindRoot(contacts[i].A);
+		uint32_t rb = FindRoot(contacts[i].B);
+		if (ra != rb)
+		{
+			Parent[ra] = rb;
+		}
+	}
+
+	// Count contacts per island, turn the counts into start offsets, then scatter
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint32_t root = FindRoot(contacts[i].A);
+		if (IslandOf[root] == RIGID_NO_BODY)
+		{
+			IslandOf[root] = IslandCount;
+			IslandStart[IslandCount] = 0;
+			IslandCount++;
+		}
+
+		IslandStart[IslandOf[root]]++;
+	}
+
+	uint32_t sum = 0;
+	for (uint32_t k = 0; k < IslandCount; k++)
+	{
+		uint32_t c = IslandStart[k];
+		IslandStart[k] = sum;
+		sum += c;
+	}
+	IslandStart[IslandCount] = sum;
+
+	for (uint32_t i = 0; i < n; i++)
+	{
+		uint32_t island = IslandOf[FindRoot(contacts[i].A)];
+		IslandContacts[IslandStart[island]] = i;
+		IslandStart[island]++;
+	}
+
+	// Every start was advanced to the next island's start by the scatter - shift them back
+	for (uint32_t k = IslandCount; k > 0; k--)
+	{
+		IslandStart[k] = IslandStart[k - 1];
+	}
+	IslandStart[0] = 0;
+}
+
+
+// Run as many fixed steps as fit in the time since the last call, and return how many were taken. Leftover
+// time carries over to the next call
+uint32_t rigid_world_t::Advance(geometry_state_t *State, sap_t *Broadphase, thread_pool_t *Pool, float FrameTime)
+{
+	Accumulator += FrameTime;
+	if (Accumulator > RIGID_MAX_STEPS * RIGID_TIMESTEP)
+	{
+		Accumulator = RIGID_MAX_STEPS * RIGID_TIMESTEP;
+	}
+
+	uint32_t steps = 0;
+	while (Accumulator >= RIGID_TIMESTEP)
+	{
+		Step(State, Broadphase, Pool);
+		Accumulator -= RIGID_TIMESTEP;
+		steps++;
+	}
+
+	return steps;
+}
+
+
+void rigid_world_t::Step(geometry_state_t *State, sap_t *Broadphase, thread_pool_t *Pool)
+{
+	uint32_t count = State->Count;
+	if (ContactRevision != State->Revision)
+	{
+		ContactCount[Current] = 0;
+		ContactRevision = State->Revision;
+	}
+	if (InvMass.Reserve(count) != 0 || InvInertia.Reserve(count) != 0 || PrevHead.Reserve(count) != 0 ||
+		Parent.Reserve(count) != 0 || IslandOf.Reserve(count) != 0 || PrevNext.Reserve(ContactCount[Current]) != 0)
+	{
+		printf("System: rigid-body world failed to allocate\n");
+		return;
+	}
+
+	// Unit density. A solid cube of side s has I = m * s^2 / 6 about every axis
+	for (uint32_t i = 0; i < count; i++)
+	{
+		InvMass[i] = 0.0f;
+		InvInertia[i] = 0.0f;
+		if (State->Dynamic[i])
+		{
+			float s = State->Scale[i];
+			float m = s * s * s;
+			InvMass[i] = 1.0f / m;
+			InvInertia[i] = 6.0f / (m * s * s);
+		}
+	}
+
+	// Last step's contacts become the previous set, chained by body so AddContact() can find them
+	Current ^= 1;
+	const rigid_contact_t *prev = Contacts[Current ^ 1].Data;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		PrevHead[i] = RIGID_NO_BODY;
+	}
+	for (uint32_t i = ContactCount[Current ^ 1]; i > 0; i--)
+	{
+		uint32_t a = prev[i - 1].A;
+		PrevNext[i - 1] = PrevHead[a];
+		PrevHead[a] = i - 1;
+	}
+
+	ContactCount[Current] = 0;
+	Broadphase->Update(*State);
+	FindContacts(*State, *Broadphase);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (State->Dynamic[i])
+		{
+			State->Velocity[i].y += RIGID_GRAVITY * RIGID_TIMESTEP;
+		}
+	}
+
+	BuildIslands(count);
+
+	rigid_job_t job;
+	job.World = this;
+	job.State = State;
+	Pool->Run(SolveIsland, &job, IslandCount);
+
+	// Integrate the solved velocities. The quaternion derivative is 0.5 * w * q, with w as a pure quaternion
+	for (uint32_t i = 0; i < count; i++)
+	{
+		if (!State->Dynamic[i])
+		{
+			continue;
+		}
+
+		const uMATH::vec3f_t &v = State->Velocity[i];
+		const uMATH::vec3f_t &av = State->AngularVelocity[i];
+		State->PosX[i] += v.x * RIGID_TIMESTEP;
+		State->PosY[i] += v.y * RIGID_TIMESTEP;
+		State->PosZ[i] += v.z * RIGID_TIMESTEP;
+
+		uMATH::quatf_t q = { State->RotX[i], State->RotY[i], State->RotZ[i], State->RotW[i] };
+		uMATH::quatf_t dq = uMATH::quatf_t{ av.x, av.y, av.z, 0.0f } * q;
+		float h = 0.5f * RIGID_TIMESTEP;
+		q = uMATH::Normalize(uMATH::quatf_t{ q.x + (dq.x * h), q.y + (dq.y * h), q.z + (dq.z * h), q.w + (dq.w * h) });
+
+		State->RotX[i] = q.x;
+		State->RotY[i] = q.y;
+		State->RotZ[i] = q.z;
+		State->RotW[i] = q.w;
+	}
+
+	// Only dynamic bodies moved, so only their matrices are rebuilt - one compose per run of consecutive
+	// dynamic bodies, which also keeps the change journal down to the objects that actually moved
+	uint32_t run = 0;
+	for (uint32_t i = 0; i <= count; i++)
+	{
+		if (i < count && State->Dynamic[i])
+		{
+			run++;
+			continue;
+		}
+
+		if (run > 0)
+		{
+			State->ComposeModels(i - run, run);
+			run = 0;
+		}
+	}
+}
+
+
+void rigid_world_t::Release()
+{
+	Contacts[0].Release();
+	Contacts[1].Release();
+	ContactCount[0] = 0;
+	ContactCount[1] = 0;
+	PrevHead.Release();
+	PrevNext.Release();
+	InvMass.Release();
+	InvInertia.Release();
+	Parent.Release();
+	IslandOf.Release();
+	IslandStart.Release();
+	IslandContacts.Release();
+	IslandCount = 0;
+}
+
+
+}
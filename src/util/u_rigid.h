@@ -0,0 +1,113 @@
+#ifndef MBOX_RIGID_H
+#define MBOX_RIGID_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_math.h"
+#include "u_mem.h"
+#include "u_sap.h"
+#include "u_thread.h"
+
+
+#define RIGID_TIMESTEP (1.0f / 60.0f)
+// Most steps taken in one frame - after a longer stall the simulation slows down instead of stalling further
+#define RIGID_MAX_STEPS 4
+#define RIGID_ITERATIONS 10
+
+#define RIGID_GRAVITY -9.81f
+#define RIGID_FRICTION 0.5f
+// Fraction of the penetration (beyond RIGID_SLOP) corrected per step
+#define RIGID_BAUMGARTE 0.2f
+#define RIGID_SLOP 0.01f
+// Contacts closer than this to one from the previous step take over its impulses
+#define RIGID_WARM_DISTANCE 0.05f
+
+// Everything sits on an invisible floor at the bottom of the editor's position range
+#define RIGID_FLOOR_HEIGHT -15.0f
+
+#define RIGID_MANIFOLD_POINTS 4
+// A box face within this cosine of the contact normal is clipped as a face contact, otherwise the boxes
+// meet edge to edge
+#define RIGID_FACE_ALIGN 0.99f
+#define RIGID_NO_BODY 0xFFFFFFFF
+
+
+namespace uPHYS
+{
+
+
+// One contact point between dynamic body A and B, which is another dynamic body or RIGID_NO_BODY for the
+// floor and non-dynamic objects. Normal points from A to B
+struct rigid_contact_t
+{
+	uint32_t A;
+	uint32_t B;
+	uMATH::vec3f_t Point;
+	uMATH::vec3f_t Normal;
+	float Depth;
+
+	// Filled in by the solver before iterating
+	uMATH::vec3f_t RA;
+	uMATH::vec3f_t RB;
+	uMATH::vec3f_t Tangent[2];
+	float NormalMass;
+	float TangentMass[2];
+	float Bias;
+
+	// Accumulated over the iterations, and carried to the next step to warm start it
+	float NormalImpulse;
+	float TangentImpulse[2];
+};
+
+
+// Rigid-body simulation of the Dynamic objects in a geometry_state_t: gravity, box-box and box-floor
+// contacts, and a sequential impulse solver on a fixed timestep. Bodies that touch form an island, and
+// islands are solved in parallel since they share no dynamic bodies. Results are written straight back
+// into the state's transform components and model matrices after every step
+struct rigid_world_t
+{
+	// Current and previous step's contacts, swapped every step
+	packed_array_t<rigid_contact_t> Contacts[2];
+	uint32_t ContactCount[2];
+	uint32_t Current;
+
+	// Object set the current contacts were found against. Contacts name bodies by dense index, which a free
+	// can hand to a different object, so warm starting only uses contacts from the same object set
+	uint32_t ContactRevision;
+
+	// Previous step's contacts chained per body A, for warm starting
+	chunked_array_t<uint32_t> PrevHead;
+	packed_array_t<uint32_t> PrevNext;
+
+	chunked_array_t<float> InvMass;
+	// A uniformly scaled cube has the same inertia about every axis, so one scalar covers any orientation
+	chunked_array_t<float> InvInertia;
+
+	// Union-find over body slots, then contact indices grouped by island
+	chunked_array_t<uint32_t> Parent;
+	chunked_array_t<uint32_t> IslandOf;
+	packed_array_t<uint32_t> IslandStart;
+	packed_array_t<uint32_t> IslandContacts;
+	uint32_t IslandCount;
+
+	float Accumulator;
+
+	uint32_t Advance(geometry_state_t *State, sap_t *Broadphase, thread_pool_t *Pool, float FrameTime);
+	void Step(geometry_state_t *State, sap_t *Broadphase, thread_pool_t *Pool);
+	void Release();
+
+	private:
+
+	void AddContact(uint32_t A, uint32_t B, const uMATH::vec3f_t &Point, const uMATH::vec3f_t &Normal, float Depth);
+	void FindContacts(const geometry_state_t &State, const sap_t &Broadphase);
+	void BuildIslands(uint32_t Count);
+	uint32_t FindRoot(uint32_t Slot);
+};
+
+
+}
+
+
+#endif
@@ -0,0 +1,565 @@
+#include "u_sap.h"
+#include "u_phys.h"
+
+#include <stdlib.h>
+#include <float.h>
+
+
+namespace uPHYS
+{
+
+
+static int CompareBoxMinX(const void *a, const void *b)
+{
+	float fa = ((const sap_box_t*)a)->MinX;
+	float fb = ((const sap_box_t*)b)->MinX;
+
+	return (fa > fb) - (fa < fb);
+}
+
+
+// Full sort, for when the set of boxes has changed and the previous order means nothing
+void SortBoxes(sap_box_t *Boxes, uint32_t Count)
+{
+	qsort(Boxes, Count, sizeof(sap_box_t), CompareBoxMinX);
+}
+
+
+// Insertion sort - objects move a little between frames, so each box only shifts a few places and this
+// runs in close to linear time, where a full sort would start over every frame
+void ResortBoxes(sap_box_t *Boxes, uint32_t Count)
+{
+	for (uint32_t i = 1; i < Count; i++)
+	{
+		sap_box_t key = Boxes[i];
+		uint32_t j = i;
+
+		while (j > 0 && Boxes[j - 1].MinX > key.MinX)
+		{
+			Boxes[j] = Boxes[j - 1];
+			j--;
+		}
+
+		Boxes[j] = key;
+	}
+}
+
+
+// Transpose the sorted boxes into Out, then pad the end with boxes that start at +infinity on X, which
+// always end a sweep
+void SplitBoxes(const sap_box_t *Boxes, uint32_t Count, const sap_soa_t &Out)
+{
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		Out.MinX[i] = Boxes[i].MinX;
+		Out.MaxX[i] = Boxes[i].MaxX;
+		Out.MinY[i] = Boxes[i].MinY;
+		Out.MaxY[i] = Boxes[i].MaxY;
+		Out.MinZ[i] = Boxes[i].MinZ;
+		Out.MaxZ[i] = Boxes[i].MaxZ;
+		Out.Slot[i] = Boxes[i].Slot;
+	}
+
+	for (uint32_t i = Count; i < Count + SAP_PAD; i++)
+	{
+		Out.MinX[i] = FLT_MAX;
+		Out.MaxX[i] = FLT_MAX;
+		Out.MinY[i] = FLT_MAX;
+		Out.MaxY[i] = FLT_MAX;
+		Out.MinZ[i] = FLT_MAX;
+		Out.MaxZ[i] = FLT_MAX;
+		Out.Slot[i] = 0xFFFFFFFF;
+	}
+}
+
+
+// Boxes must be sorted by MinX. Each box is compared only against the boxes that start before it ends on X,
+// and those are confirmed on Y and Z - four candidates per step on the SIMD path. Since MinX is sorted, the
+// first candidate that starts past the current box ends the sweep for it. Writes at most MaxPairs pairs and
+// returns how many were written
+uint32_t SweepBoxes(const sap_soa_t &In, uint32_t Count, sap_pair_t *Pairs, uint32_t MaxPairs)
+{
+	uint32_t n = 0;
+
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		uint32_t j = i + 1;
+
+#if UMATH_SIMD_SSE
+		__m128 amaxx = _mm_set1_ps(In.MaxX[i]);
+		__m128 aminy = _mm_set1_ps(In.MinY[i]);
+		__m128 amaxy = _mm_set1_ps(In.MaxY[i]);
+		__m128 aminz = _mm_set1_ps(In.MinZ[i]);
+		__m128 amaxz = _mm_set1_ps(In.MaxZ[i]);
+
+		for (;; j += 4)
+		{
+			__m128 inx = _mm_cmple_ps(_mm_loadu_ps(&In.MinX[j]), amaxx);
+			int xmask = _mm_movemask_ps(inx);
+			if (xmask == 0)
+			{
+				break;
+			}
+
+			__m128 overlap = _mm_and_ps(inx, _mm_cmple_ps(_mm_loadu_ps(&In.MinY[j]), amaxy));
+			overlap = _mm_and_ps(overlap, _mm_cmple_ps(aminy, _mm_loadu_ps(&In.MaxY[j])));
+			overlap = _mm_and_ps(overlap, _mm_cmple_ps(_mm_loadu_ps(&In.MinZ[j]), amaxz));
+			overlap = _mm_and_ps(overlap, _mm_cmple_ps(aminz, _mm_loadu_ps(&In.MaxZ[j])));
+
+			// Hits are rare, so the per-lane work only happens when at least one lane overlaps
+			int mask = _mm_movemask_ps(overlap);
+			for (int l = 0; mask != 0 && l < 4; l++)
+			{
+				if ((mask >> l) & 1)
+				{
+					if (n == MaxPairs)
+					{
+						return n;
+					}
+
+					Pairs[n].A = In.Slot[i];
+					Pairs[n].B = In.Slot[j + l];
+					n++;
+				}
+			}
+
+			if (xmask != 0xF)
+			{
+				break;
+			}
+		}
+#else
+		for (; j < Count && In.MinX[j] <= In.MaxX[i]; j++)
+		{
+			if (In.MinY[i] > In.MaxY[j] || In.MinY[j] > In.MaxY[i] || In.MinZ[i] > In.MaxZ[j] || In.MinZ[j] > In.MaxZ[i])
+			{
+				continue;
+			}
+
+			if (n == MaxPairs)
+			{
+				return n;
+			}
+
+			Pairs[n].A = In.Slot[i];
+			Pairs[n].B = In.Slot[j];
+			n++;
+		}
+#endif
+	}
+
+	return n;
+}
+
+
+// Largest-variance axis of the object centers
+static uint32_t SweepAxis(const geometry_state_t &State)
+{
+	double sum[3] = { 0.0, 0.0, 0.0 };
+	double sumsq[3] = { 0.0, 0.0, 0.0 };
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		double p[3] = { State.PosX[i], State.PosY[i], State.PosZ[i] };
+		for (int a = 0; a < 3; a++)
+		{
+			sum[a] += p[a];
+			sumsq[a] += p[a] * p[a];
+		}
+	}
+
+	uint32_t axis = 0;
+	double best = -1.0;
+	for (uint32_t a = 0; a < 3; a++)
+	{
+		double var = sumsq[a] - (sum[a] * sum[a]) / ((State.Count > 0) ? State.Count : 1);
+		if (var > best)
+		{
+			best = var;
+			axis = a;
+		}
+	}
+
+	return axis;
+}
+
+
+// Binary search over sorted Keys in [First, End) for the first key at or above Value, or past it if Strict
+static uint32_t FirstPast(const float *Keys, uint32_t First, uint32_t End, float Value, bool Strict)
+{
+	while (First < End)
+	{
+		uint32_t mid = First + ((End - First) / 2);
+		if (Keys[mid] < Value || (Strict && Keys[mid] == Value))
+		{
+			First = mid + 1;
+		}
+		else
+		{
+			End = mid;
+		}
+	}
+
+	return First;
+}
+
+
+// Non-short-circuit ands - which side a neighbour falls on is close to random, and a branch per axis costs
+// more in mispredictions than the comparisons themselves
+static inline bool OverlapBoxes(const sap_box_t &A, const sap_box_t &B)
+{
+	return (A.MinX <= B.MaxX) & (B.MinX <= A.MaxX) & (A.MinY <= B.MaxY) & (B.MinY <= A.MaxY) & (A.MinZ <= B.MaxZ) & (B.MinZ <= A.MaxZ);
+}
+
+
+// Recompute one box from its object's model, with the sweep axis in X
+void sap_t::SyncBox(const geometry_state_t &State, uint32_t Index)
+{
+	uMATH::vec3f_t min;
+	uMATH::vec3f_t max;
+	ComputeOBBBounds(State.Model[Boxes[Index].Slot], &min, &max);
+
+	const float *lo = &min.x;
+	const float *hi = &max.x;
+	uint32_t y = (Axis + 1) % 3;
+	uint32_t z = (Axis + 2) % 3;
+	Boxes[Index].MinX = lo[Axis];
+	Boxes[Index].MaxX = hi[Axis];
+	Boxes[Index].MinY = lo[y];
+	Boxes[Index].MaxY = hi[y];
+	Boxes[Index].MinZ = lo[z];
+	Boxes[Index].MaxZ = hi[z];
+
+	float width = hi[Axis] - lo[Axis];
+	MaxWidth = (width > MaxWidth) ? width : MaxWidth;
+}
+
+
+// Shift one box left or right until the order by MinX holds again, keeping BoxOf and the split arrays in step
+void sap_t::Relocate(uint32_t Index)
+{
+	uint32_t i = Index;
+	while (i > 0 && Boxes[i - 1].MinX > Boxes[i].MinX)
+	{
+		sap_box_t t = Boxes[i - 1];
+		Boxes[i - 1] = Boxes[i];
+		Boxes[i] = t;
+		BoxOf[Boxes[i].Slot] = i;
+		i--;
+	}
+	while (i + 1 < BoxCount && Boxes[i + 1].MinX < Boxes[i].MinX)
+	{
+		sap_box_t t = Boxes[i + 1];
+		Boxes[i + 1] = Boxes[i];
+		Boxes[i] = t;
+		BoxOf[Boxes[i].Slot] = i;
+		i++;
+	}
+	BoxOf[Boxes[i].Slot] = i;
+
+	uint32_t lo = (i < Index) ? i : Index;
+	uint32_t hi = (i < Index) ? Index : i;
+	for (uint32_t k = lo; k <= hi; k++)
+	{
+		MinX[k] = Boxes[k].MinX;
+		MaxX[k] = Boxes[k].MaxX;
+		MinY[k] = Boxes[k].MinY;
+		MaxY[k] = Boxes[k].MaxY;
+		MinZ[k] = Boxes[k].MinZ;
+		MaxZ[k] = Boxes[k].MaxZ;
+		Slot[k] = Boxes[k].Slot;
+	}
+}
+
+
+// Add a candidate, and the pair too if the OBBs intersect. Both lists grow as needed
+int sap_t::AddCandidate(const geometry_state_t &State, uint32_t A, uint32_t B)
+{
+	if (Candidates.Reserve(CandidateCount + 1) != 0 || Pairs.Reserve(PairCount + 1) != 0)
+	{
+		return -1;
+	}
+
+	Candidates[CandidateCount].A = A;
+	Candidates[CandidateCount].B = B;
+	CandidateCount++;
+	if (CheckOBBOBBCollision(State.Model[A], State.Model[B], 0x0, 0x0))
+	{
+		Pairs[PairCount].A = A;
+		Pairs[PairCount].B = B;
+		PairCount++;
+	}
+
+	return 0;
+}
+
+
+// Test box Index against the boxes in [First, End) of the split arrays - four at a time on the SIMD path, where
+// the padding past BoxCount covers the last group - and add whatever overlaps. A pair of two moved objects is
+// only added by the lower slot
+int sap_t::QueryRange(const geometry_state_t &State, uint32_t Index, uint32_t First, uint32_t End)
+{
+	uint32_t s = Slot[Index];
+
+#if UMATH_SIMD_SSE
+	__m128 aminx = _mm_set1_ps(MinX[Index]);
+	__m128 amaxx = _mm_set1_ps(MaxX[Index]);
+	__m128 aminy = _mm_set1_ps(MinY[Index]);
+	__m128 amaxy = _mm_set1_ps(MaxY[Index]);
+	__m128 aminz = _mm_set1_ps(MinZ[Index]);
+	__m128 amaxz = _mm_set1_ps(MaxZ[Index]);
+
+	for (uint32_t j = First; j < End; j += 4)
+	{
+		__m128 overlap = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&MinX[j]), amaxx), _mm_cmple_ps(aminx, _mm_loadu_ps(&MaxX[j])));
+		overlap = _mm_and_ps(overlap, _mm_cmple_ps(_mm_loadu_ps(&MinY[j]), amaxy));
+		overlap = _mm_and_ps(overlap, _mm_cmple_ps(aminy, _mm_loadu_ps(&MaxY[j])));
+		overlap = _mm_and_ps(overlap, _mm_cmple_ps(_mm_loadu_ps(&MinZ[j]), amaxz));
+		overlap = _mm_and_ps(overlap, _mm_cmple_ps(aminz, _mm_loadu_ps(&MaxZ[j])));
+
+		int mask = _mm_movemask_ps(overlap);
+		if (End - j < 4)
+		{
+			mask &= (1 << (End - j)) - 1;
+		}
+		for (int l = 0; mask != 0 && l < 4; l++)
+		{
+			uint32_t o = Slot[j + l];
+			if (((mask >> l) & 1) && (Moved[o] != MoveStamp || s < o) && AddCandidate(State, s, o) != 0)
+			{
+				return -1;
+			}
+		}
+	}
+#else
+	for (uint32_t j = First; j < End; j++)
+	{
+		if (!OverlapBoxes(Boxes[Index], Boxes[j]))
+		{
+			continue;
+		}
+		uint32_t o = Slot[j];
+		if ((Moved[o] != MoveStamp || s < o) && AddCandidate(State, s, o) != 0)
+		{
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+
+// Incremental update for when only objects the journal names moved: their boxes are recomputed and shifted
+// back into order, every pair involving them is dropped, and each is tested again against the boxes around
+// it. Everything else keeps its pairs without another narrowphase. Returns -1 when so much moved that a full
+// sweep is cheaper, or storage ran out - the caller sweeps instead
+int sap_t::Requery(const geometry_state_t &State)
+{
+	uint32_t journaled = 0;
+	for (uint32_t r = 0; r < State.JournalCount; r++)
+	{
+		journaled += State.Journal[r].Length;
+	}
+	if (journaled > BoxCount / SAP_REQUERY_DIVISOR || Moved.Reserve(BoxCount) != 0 || MovedList.Reserve(journaled) != 0)
+	{
+		return -1;
+	}
+
+	MoveStamp++;
+	if (MoveStamp == 0)
+	{
+		for (uint32_t c = 0; c < Moved.ChunkCount; c++)
+		{
+			memset(Moved.Chunks[c], 0, GEOMETRY_CHUNK_SIZE * sizeof(uint32_t));
+		}
+		MoveStamp = 1;
+	}
+
+	// Ranges journaled before a free can reach past the objects that are left, and may overlap
+	uint32_t moved = 0;
+	for (uint32_t r = 0; r < State.JournalCount; r++)
+	{
+		const geometry_range_t &range = State.Journal[r];
+		uint32_t end = (range.First + range.Length < BoxCount) ? range.First + range.Length : BoxCount;
+		for (uint32_t s = range.First; s < end; s++)
+		{
+			if (Moved[s] != MoveStamp)
+			{
+				Moved[s] = MoveStamp;
+				MovedList[moved++] = s;
+				SyncBox(State, BoxOf[s]);
+			}
+		}
+	}
+	for (uint32_t m = 0; m < moved; m++)
+	{
+		Relocate(BoxOf[MovedList[m]]);
+	}
+
+	uint32_t kept = 0;
+	for (uint32_t i = 0; i < CandidateCount; i++)
+	{
+		if (Moved[Candidates[i].A] != MoveStamp && Moved[Candidates[i].B] != MoveStamp)
+		{
+			Candidates[kept++] = Candidates[i];
+		}
+	}
+	CandidateCount = kept;
+	kept = 0;
+	for (uint32_t i = 0; i < PairCount; i++)
+	{
+		if (Moved[Pairs[i].A] != MoveStamp && Moved[Pairs[i].B] != MoveStamp)
+		{
+			Pairs[kept++] = Pairs[i];
+		}
+	}
+	PairCount = kept;
+
+	// Any box that overlaps this one starts within MaxWidth before it on X, or before it ends
+	for (uint32_t m = 0; m < moved; m++)
+	{
+		uint32_t p = BoxOf[MovedList[m]];
+		uint32_t first = FirstPast(MinX.Data, 0, p, MinX[p] - MaxWidth, false);
+		uint32_t end = FirstPast(MinX.Data, p + 1, BoxCount, MaxX[p], true);
+
+		if (QueryRange(State, p, first, p) != 0 || QueryRange(State, p, p + 1, end) != 0)
+		{
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+// Bring the overlapping pairs up to date with State. Pairs stay as they are while neither revision moved, and
+// only objects the journal names are tested again while the object set stays the same
+void sap_t::Update(const geometry_state_t &State)
+{
+	if (Built && Revision == State.Revision && TransformRevision == State.TransformRevision)
+	{
+		ChangeStamp = State.ChangeStamp;
+		return;
+	}
+
+	if (Built && Revision == State.Revision && ChangeStamp >= State.ClearedStamp && Requery(State) == 0)
+	{
+		TransformRevision = State.TransformRevision;
+		ChangeStamp = State.ChangeStamp;
+		return;
+	}
+
+	// A changed object set invalidates the order - rebuild the box list and fully sort it once
+	bool rebuild = !Built || Revision != State.Revision;
+	MaxWidth = 0.0f;
+	if (rebuild)
+	{
+		uint32_t live = State.Count;
+		if (Boxes.Reserve(live) != 0 || MinX.Reserve(live + SAP_PAD) != 0 || MaxX.Reserve(live + SAP_PAD) != 0 ||
+			MinY.Reserve(live + SAP_PAD) != 0 || MaxY.Reserve(live + SAP_PAD) != 0 || MinZ.Reserve(live + SAP_PAD) != 0 ||
+			MaxZ.Reserve(live + SAP_PAD) != 0 || Slot.Reserve(live + SAP_PAD) != 0 || BoxOf.Reserve(live) != 0)
+		{
+			printf("System: broadphase failed to allocate\n");
+			Built = false;
+			BoxCount = 0;
+			CandidateCount = 0;
+			PairCount = 0;
+			return;
+		}
+
+		Axis = SweepAxis(State);
+		for (uint32_t i = 0; i < live; i++)
+		{
+			Boxes[i].Slot = i;
+			SyncBox(State, i);
+		}
+		BoxCount = live;
+		SortBoxes(Boxes.Data, BoxCount);
+
+		Revision = State.Revision;
+		Built = true;
+	}
+	else
+	{
+		for (uint32_t i = 0; i < BoxCount; i++)
+		{
+			SyncBox(State, i);
+		}
+		ResortBoxes(Boxes.Data, BoxCount);
+	}
+
+	for (uint32_t i = 0; i < BoxCount; i++)
+	{
+		BoxOf[Boxes[i].Slot] = i;
+	}
+	TransformRevision = State.TransformRevision;
+	ChangeStamp = State.ChangeStamp;
+
+	sap_soa_t Sorted;
+	Sorted.MinX = MinX.Data;
+	Sorted.MaxX = MaxX.Data;
+	Sorted.MinY = MinY.Data;
+	Sorted.MaxY = MaxY.Data;
+	Sorted.MinZ = MinZ.Data;
+	Sorted.MaxZ = MaxZ.Data;
+	Sorted.Slot = Slot.Data;
+	SplitBoxes(Boxes.Data, BoxCount, Sorted);
+
+	// A sweep that fills the candidate list may have stopped early - grow it and sweep again. The list keeps
+	// its size between frames, so this only happens when the scene gets more crowded than it has been
+	for (;;)
+	{
+		CandidateCount = SweepBoxes(Sorted, BoxCount, Candidates.Data, Candidates.Capacity);
+		if (CandidateCount < Candidates.Capacity)
+		{
+			break;
+		}
+		if (Candidates.Reserve(Candidates.Capacity + 1) != 0)
+		{
+			printf("System: broadphase candidate list failed to grow\n");
+			break;
+		}
+	}
+
+	if (Pairs.Reserve(CandidateCount) != 0)
+	{
+		CandidateCount = Pairs.Capacity;
+	}
+
+	PairCount = 0;
+	for (uint32_t i = 0; i < CandidateCount; i++)
+	{
+		const sap_pair_t &p = Candidates[i];
+		if (CheckOBBOBBCollision(State.Model[p.A], State.Model[p.B], 0x0, 0x0))
+		{
+			Pairs[PairCount] = p;
+			PairCount++;
+		}
+	}
+}
+
+
+void sap_t::Release()
+{
+	Boxes.Release();
+	BoxOf.Release();
+	Moved.Release();
+	MovedList.Release();
+	MinX.Release();
+	MaxX.Release();
+	MinY.Release();
+	MaxY.Release();
+	MinZ.Release();
+	MaxZ.Release();
+	Slot.Release();
+	Candidates.Release();
+	Pairs.Release();
+	BoxCount = 0;
+	CandidateCount = 0;
+	PairCount = 0;
+	MoveStamp = 0;
+	Built = false;
+}
+
+
+}
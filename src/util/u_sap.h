@@ -0,0 +1,128 @@
+#ifndef MBOX_SAP_H
+#define MBOX_SAP_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_math.h"
+#include "u_mem.h"
+
+
+// Sentinel entries past the end of the sorted arrays, so the sweep can always read whole SIMD groups
+#define SAP_PAD 4
+
+// Past 1 / SAP_REQUERY_DIVISOR of the boxes moving in one update, a full sweep is cheaper than testing each
+// moved box again
+#define SAP_REQUERY_DIVISOR 4
+
+
+namespace uPHYS
+{
+
+
+// World AABB of one object, kept in an array sorted by MinX. Bounds live next to the sort key so sorting
+// moves everything together. X here is the sweep axis, which sap_t picks per build - Y and Z are the world
+// axes after it, in order
+struct sap_box_t
+{
+	float MinX;
+	float MaxX;
+	float MinY;
+	float MaxY;
+	float MinZ;
+	float MaxZ;
+	uint32_t Slot;
+};
+
+
+struct sap_pair_t
+{
+	uint32_t A;
+	uint32_t B;
+};
+
+
+// The sorted boxes split into parallel arrays for the sweep. Every array needs SAP_PAD entries past Count,
+// filled by SplitBoxes()
+struct sap_soa_t
+{
+	float *MinX;
+	float *MaxX;
+	float *MinY;
+	float *MaxY;
+	float *MinZ;
+	float *MaxZ;
+	uint32_t *Slot;
+};
+
+
+void SortBoxes(sap_box_t *Boxes, uint32_t Count);
+void ResortBoxes(sap_box_t *Boxes, uint32_t Count);
+void SplitBoxes(const sap_box_t *Boxes, uint32_t Count, const sap_soa_t &Out);
+uint32_t SweepBoxes(const sap_soa_t &In, uint32_t Count, sap_pair_t *Pairs, uint32_t MaxPairs);
+
+
+// Sort-and-sweep broadphase over every live object in a geometry_state_t, with an exact OBB narrowphase.
+// The box order persists between frames, so re-sorting after small movements is close to linear. Only boxes
+// of objects the store's change journal names are recomputed, and nothing at all happens while the store
+// doesn't change
+struct sap_t
+{
+	packed_array_t<sap_box_t> Boxes;
+	uint32_t BoxCount;
+
+	// Per slot, where its box sits in Boxes
+	chunked_array_t<uint32_t> BoxOf;
+
+	// World axis the boxes are sorted along (0 = X, 1 = Y, 2 = Z) - whichever the object centers spread
+	// furthest along at the last build, so the fewest boxes overlap on it
+	uint32_t Axis;
+
+	// Widest box on the sweep axis since the last full sweep, which bounds how far back an overlap can start
+	float MaxWidth;
+
+	// Slots moved in the current update, marked with MoveStamp in Moved, and listed once each
+	chunked_array_t<uint32_t> Moved;
+	packed_array_t<uint32_t> MovedList;
+	uint32_t MoveStamp;
+
+	// Boxes in the same order, one array per bound, for the SIMD sweep. Each holds BoxCount + SAP_PAD entries
+	packed_array_t<float> MinX;
+	packed_array_t<float> MaxX;
+	packed_array_t<float> MinY;
+	packed_array_t<float> MaxY;
+	packed_array_t<float> MinZ;
+	packed_array_t<float> MaxZ;
+	packed_array_t<uint32_t> Slot;
+
+	// Pairs whose AABBs overlap, and the subset whose OBBs actually intersect. Grown whenever a sweep fills them.
+	// Neither is in any particular order
+	packed_array_t<sap_pair_t> Candidates;
+	uint32_t CandidateCount;
+	packed_array_t<sap_pair_t> Pairs;
+	uint32_t PairCount;
+
+	// geometry_state_t revisions and change stamp the boxes were last synced against
+	uint32_t Revision;
+	uint32_t TransformRevision;
+	uint32_t ChangeStamp;
+	bool Built;
+
+	void Update(const geometry_state_t &State);
+	void Release();
+
+	private:
+
+	void SyncBox(const geometry_state_t &State, uint32_t Index);
+	void Relocate(uint32_t Index);
+	int AddCandidate(const geometry_state_t &State, uint32_t A, uint32_t B);
+	int QueryRange(const geometry_state_t &State, uint32_t Index, uint32_t First, uint32_t End);
+	int Requery(const geometry_state_t &State);
+};
+
+
+}
+
+
+#endif
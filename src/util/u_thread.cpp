@@ -0,0 +1,344 @@
+#include "u_thread.h"
+#include "u_mem.h"
+
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+
+// What a worker thread starts with: the pool, and which of the scratch arenas is its own
+struct thread_worker_t
+{
+	thread_shared_t *Shared;
+	uint32_t Index;
+};
+
+
+struct thread_shared_t
+{
+#ifdef _WIN32
+	CRITICAL_SECTION Lock;
+	CONDITION_VARIABLE WorkReady;
+	CONDITION_VARIABLE WorkDone;
+	HANDLE Threads[THREAD_MAX_WORKERS];
+#else
+	pthread_mutex_t Lock;
+	pthread_cond_t WorkReady;
+	pthread_cond_t WorkDone;
+	pthread_t Threads[THREAD_MAX_WORKERS];
+#endif
+
+	// Current batch. Only touched with Lock held. Generation changes once per Run(), so a worker that
+	// wakes up late can tell whether the batch it sees is new
+	thread_job_t Job;
+	void *Data;
+	uint32_t JobCount;
+	uint32_t NextJob;
+	uint32_t Pending;
+	uint32_t Generation;
+	bool Quit;
+
+	thread_worker_t Workers[THREAD_MAX_WORKERS];
+
+	// Job scratch for every thread. The thread calling Run() uses Scratch[0], worker i uses Scratch[i + 1]
+	mem_arena_t Scratch[THREAD_MAX_WORKERS + 1];
+	void *ScratchMemory[THREAD_MAX_WORKERS + 1];
+};
+
+
+static thread_local mem_arena_t *LocalScratch = 0x0;
+
+
+mem_arena_t *ThreadScratch()
+{
+	return LocalScratch;
+}
+
+
+// Empty the calling thread's scratch, so every job starts with all of it
+static void ResetScratch()
+{
+	if (LocalScratch)
+	{
+		mem_marker_t start = {};
+		LocalScratch->Rollback(start);
+	}
+}
+
+
+#ifdef _WIN32
+
+static void LockShared(thread_shared_t *s) { EnterCriticalSection(&s->Lock); }
+static void UnlockShared(thread_shared_t *s) { LeaveCriticalSection(&s->Lock); }
+static void WaitShared(thread_shared_t *s, CONDITION_VARIABLE *c) { SleepConditionVariableCS(c, &s->Lock, INFINITE); }
+static void WakeAll(CONDITION_VARIABLE *c) { WakeAllConditionVariable(c); }
+
+#else
+
+static void LockShared(thread_shared_t *s) { pthread_mutex_lock(&s->Lock); }
+static void UnlockShared(thread_shared_t *s) { pthread_mutex_unlock(&s->Lock); }
+static void WaitShared(thread_shared_t *s, pthread_cond_t *c) { pthread_cond_wait(c, &s->Lock); }
+static void WakeAll(pthread_cond_t *c) { pthread_cond_broadcast(c); }
+
+#endif
+
+
+// Take jobs from the current batch until none are left. Called with Lock held, which is dropped while
+// each job runs
+static void RunJobs(thread_shared_t *s)
+{
+	while (s->NextJob < s->JobCount)
+	{
+		uint32_t index = s->NextJob;
+		s->NextJob++;
+
+		UnlockShared(s);
+		ResetScratch();
+		s->Job(s->Data, index);
+		LockShared(s);
+
+		s->Pending--;
+		if (s->Pending == 0)
+		{
+			WakeAll(&s->WorkDone);
+		}
+	}
+}
+
+
+static void WorkerLoop(thread_worker_t *w)
+{
+	thread_shared_t *s = w->Shared;
+	uint32_t seen = 0;
+	LocalScratch = &s->Scratch[w->Index + 1];
+
+	LockShared(s);
+	for (;;)
+	{
+		while (!s->Quit && s->Generation == seen)
+		{
+			WaitShared(s, &s->WorkReady);
+		}
+		if (s->Quit)
+		{
+			break;
+		}
+
+		seen = s->Generation;
+		RunJobs(s);
+	}
+	UnlockShared(s);
+}
+
+
+#ifdef _WIN32
+
+static DWORD WINAPI WorkerMain(LPVOID Param)
+{
+	WorkerLoop((thread_worker_t*)Param);
+	return 0;
+}
+
+#else
+
+static void* WorkerMain(void *Param)
+{
+	WorkerLoop((thread_worker_t*)Param);
+	return 0x0;
+}
+
+#endif
+
+
+int thread_pool_t::Init(uint32_t Workers)
+{
+	if (Shared != 0x0)
+	{
+		printf("System: attempt to reinitialize existing thread pool. Call Release() first\n");
+		return -1;
+	}
+
+	if (Workers > THREAD_MAX_WORKERS)
+	{
+		Workers = THREAD_MAX_WORKERS;
+	}
+
+	Shared = (thread_shared_t*)ProgramHeap.Alloc(sizeof(thread_shared_t));
+	if (!Shared)
+	{
+		printf("System: thread pool failed to allocate\n");
+		return -1;
+	}
+	memset(Shared, 0, sizeof(thread_shared_t));
+
+	// Scratch for every thread that could run jobs, the caller of Run() included
+	for (uint32_t i = 0; i <= Workers; i++)
+	{
+		Shared->ScratchMemory[i] = ProgramHeap.Alloc(MEM_THREAD_SCRATCH_SIZE);
+		if (Shared->Scratch[i].Init(Shared->ScratchMemory[i], MEM_THREAD_SCRATCH_SIZE) != 0)
+		{
+			printf("System: thread pool scratch failed to allocate\n");
+			Workers = i > 0 ? i - 1 : 0;
+			break;
+		}
+	}
+	if (Shared->ScratchMemory[0] == 0x0)
+	{
+		ProgramHeap.Free(Shared, sizeof(thread_shared_t));
+		Shared = 0x0;
+		return -1;
+	}
+
+#ifdef _WIN32
+	InitializeCriticalSection(&Shared->Lock);
+	InitializeConditionVariable(&Shared->WorkReady);
+	InitializeConditionVariable(&Shared->WorkDone);
+#else
+	pthread_mutex_init(&Shared->Lock, 0x0);
+	pthread_cond_init(&Shared->WorkReady, 0x0);
+	pthread_cond_init(&Shared->WorkDone, 0x0);
+#endif
+
+	// Keep whatever threads did start - fewer workers only means less parallelism, never wrong results
+	WorkerCount = 0;
+	for (uint32_t i = 0; i < Workers; i++)
+	{
+		Shared->Workers[i].Shared = Shared;
+		Shared->Workers[i].Index = i;
+#ifdef _WIN32
+		Shared->Threads[i] = CreateThread(0x0, 0, WorkerMain, &Shared->Workers[i], 0, 0x0);
+		if (Shared->Threads[i] == 0x0)
+#else
+		if (pthread_create(&Shared->Threads[i], 0x0, WorkerMain, &Shared->Workers[i]) != 0)
+#endif
+		{
+			printf("System: could only start %u of %u worker threads\n", i, Workers);
+			break;
+		}
+
+		WorkerCount++;
+	}
+
+	return 0;
+}
+
+
+void thread_pool_t::Release()
+{
+	if (Shared == 0x0)
+	{
+		return;
+	}
+
+	LockShared(Shared);
+	Shared->Quit = true;
+	WakeAll(&Shared->WorkReady);
+	UnlockShared(Shared);
+
+	for (uint32_t i = 0; i < WorkerCount; i++)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(Shared->Threads[i], INFINITE);
+		CloseHandle(Shared->Threads[i]);
+#else
+		pthread_join(Shared->Threads[i], 0x0);
+#endif
+	}
+
+#ifdef _WIN32
+	DeleteCriticalSection(&Shared->Lock);
+#else
+	pthread_cond_destroy(&Shared->WorkDone);
+	pthread_cond_destroy(&Shared->WorkReady);
+	pthread_mutex_destroy(&Shared->Lock);
+#endif
+
+	for (uint32_t i = 0; i <= THREAD_MAX_WORKERS; i++)
+	{
+		if (Shared->ScratchMemory[i])
+		{
+			ProgramHeap.Free(Shared->ScratchMemory[i], MEM_THREAD_SCRATCH_SIZE);
+		}
+	}
+
+	ProgramHeap.Free(Shared, sizeof(thread_shared_t));
+	Shared = 0x0;
+	WorkerCount = 0;
+}
+
+
+// Run Job for every index in [0, Count) and return once all of them have finished
+void thread_pool_t::Run(thread_job_t Job, void *Data, uint32_t Count)
+{
+	// The calling thread runs jobs too, on its own scratch
+	mem_arena_t *prevscratch = LocalScratch;
+	LocalScratch = (Shared != 0x0) ? &Shared->Scratch[0] : 0x0;
+
+	// Waking workers costs more than a single job is likely to
+	if (Shared == 0x0 || WorkerCount == 0 || Count < 2)
+	{
+		for (uint32_t i = 0; i < Count; i++)
+		{
+			ResetScratch();
+			Job(Data, i);
+		}
+		LocalScratch = prevscratch;
+		return;
+	}
+
+	LockShared(Shared);
+
+	Shared->Job = Job;
+	Shared->Data = Data;
+	Shared->JobCount = Count;
+	Shared->NextJob = 0;
+	Shared->Pending = Count;
+	Shared->Generation++;
+	WakeAll(&Shared->WorkReady);
+
+	RunJobs(Shared);
+	while (Shared->Pending > 0)
+	{
+		WaitShared(Shared, &Shared->WorkDone);
+	}
+
+	UnlockShared(Shared);
+	LocalScratch = prevscratch;
+}
+
+
+// Most scratch any single job has used, on any thread
+uint64_t thread_pool_t::ScratchHighWater() const
+{
+	uint64_t res = 0;
+	if (Shared == 0x0)
+	{
+		return 0;
+	}
+
+	for (uint32_t i = 0; i <= WorkerCount; i++)
+	{
+		res = (Shared->Scratch[i].Peak > res) ? Shared->Scratch[i].Peak : res;
+	}
+	return res;
+}
+
+
+uint32_t HardwareThreadCount()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (uint32_t)info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? (uint32_t)count : 1;
+#endif
+}
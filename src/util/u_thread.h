@@ -0,0 +1,46 @@
+#ifndef MBOX_UTHREAD_H
+#define MBOX_UTHREAD_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_mem.h"
+
+
+#define THREAD_MAX_WORKERS 16
+
+
+// Runs job Index of a batch. Jobs in one batch may run concurrently, so they must not write shared data.
+// Temporary memory a job needs comes from ThreadScratch(), which is emptied before every job
+typedef void (*thread_job_t)(void *Data, uint32_t Index);
+
+
+// Platform thread/lock handles, kept out of this header so <windows.h> doesn't leak into every includer
+struct thread_shared_t;
+
+
+// Fixed set of worker threads that sleep until a batch of jobs is handed to Run(). The calling thread
+// works through the batch alongside them, so a pool with zero workers simply runs everything inline
+struct thread_pool_t
+{
+	uint32_t WorkerCount;
+
+	int Init(uint32_t Workers);
+	void Release();
+	void Run(thread_job_t Job, void *Data, uint32_t Count);
+	uint64_t ScratchHighWater() const;
+
+	private:
+
+	thread_shared_t *Shared;
+};
+
+
+uint32_t HardwareThreadCount();
+
+// The calling thread's job scratch while it runs a thread_pool_t job, 0x0 anywhere else
+mem_arena_t *ThreadScratch();
+
+
+#endif
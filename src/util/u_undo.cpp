@@ -0,0 +1,502 @@
+#include "u_undo.h"
+
+
+static uint32_t Align16(uint64_t Bytes)
+{
+	return (uint32_t)((Bytes + 15) & ~15ull);
+}
+
+
+static uint32_t FieldSize(uint16_t Field)
+{
+	switch (Field)
+	{
+		case UNDO_FIELD_OBJECT: return sizeof(undo_object_t);
+		case UNDO_FIELD_POSITION: return 3 * sizeof(float);
+		case UNDO_FIELD_DYNAMIC: return sizeof(uint8_t);
+	}
+
+	return 0;
+}
+
+
+// Copy one field of every listed object into a packed block. Objects that no longer resolve read as zero
+static void ReadField(const geometry_state_t &State, uint16_t Field, const geometry_handle_t *Handles, uint32_t Count, uint8_t *Out)
+{
+	uint32_t size = FieldSize(Field);
+	memset(Out, 0, (uint64_t)size * Count);
+
+	for (uint32_t k = 0; k < Count; k++)
+	{
+		uint32_t i;
+		if (!State.Resolve(Handles[k], &i))
+		{
+			continue;
+		}
+
+		if (Field == UNDO_FIELD_OBJECT)
+		{
+			undo_object_t *o = (undo_object_t*)Out + k;
+			o->Pos[0] = State.PosX[i];
+			o->Pos[1] = State.PosY[i];
+			o->Pos[2] = State.PosZ[i];
+			o->Rot[0] = State.RotX[i];
+			o->Rot[1] = State.RotY[i];
+			o->Rot[2] = State.RotZ[i];
+			o->Rot[3] = State.RotW[i];
+			o->Color[0] = State.Color[i].x;
+			o->Color[1] = State.Color[i].y;
+			o->Color[2] = State.Color[i].z;
+			o->Scale = State.Scale[i];
+			o->Intensity = State.Intensity[i];
+			o->Dynamic = State.Dynamic[i];
+			o->Mesh = State.Mesh[i];
+		}
+		else if (Field == UNDO_FIELD_POSITION)
+		{
+			float *p = (float*)Out + (3 * k);
+			p[0] = State.PosX[i];
+			p[1] = State.PosY[i];
+			p[2] = State.PosZ[i];
+		}
+		else
+		{
+			Out[k] = State.Dynamic[i];
+		}
+	}
+}
+
+
+// Write a packed block back over the listed objects, skipping any that don't resolve. Returns the dense range
+// that was written through First/Last, First > Last when nothing was
+static void WriteField(geometry_state_t *State, uint16_t Field, const geometry_handle_t *Handles, uint32_t Count, const uint8_t *In,
+	uint32_t *First, uint32_t *Last)
+{
+	*First = UNDO_NONE;
+	*Last = 0;
+
+	for (uint32_t k = 0; k < Count; k++)
+	{
+		uint32_t i;
+		if (!State->Resolve(Handles[k], &i))
+		{
+			continue;
+		}
+		*First = (i < *First) ? i : *First;
+		*Last = (i > *Last) ? i : *Last;
+
+		if (Field == UNDO_FIELD_OBJECT)
+		{
+			const undo_object_t *o = (const undo_object_t*)In + k;
+			State->Visible[i] = VIS_STATUS_VISIBLE;
+			State->PosX[i] = o->Pos[0];
+			State->PosY[i] = o->Pos[1];
+			State->PosZ[i] = o->Pos[2];
+			State->RotX[i] = o->Rot[0];
+			State->RotY[i] = o->Rot[1];
+			State->RotZ[i] = o->Rot[2];
+			State->RotW[i] = o->Rot[3];
+			State->Color[i] = { o->Color[0], o->Color[1], o->Color[2] };
+			State->Scale[i] = o->Scale;
+			State->Intensity[i] = o->Intensity;
+			State->BoundRadius[i] = o->Scale * MESH_CUBE_RADIUS;
+			State->Dynamic[i] = (uint8_t)o->Dynamic;
+			State->Mesh[i] = o->Mesh;
+		}
+		else if (Field == UNDO_FIELD_POSITION)
+		{
+			const float *p = (const float*)In + (3 * k);
+			State->PosX[i] = p[0];
+			State->PosY[i] = p[1];
+			State->PosZ[i] = p[2];
+		}
+		else
+		{
+			State->Dynamic[i] = In[k];
+		}
+	}
+}
+
+
+int undo_journal_t::Init(uint64_t Bytes)
+{
+	if (Ring)
+	{
+		printf("System: attempt to reinitialize existing undo journal\n");
+		return -1;
+	}
+
+	Ring = (uint8_t*)ProgramArena.Push(Bytes, MEM_BLOCK_ALIGN);
+	if (!Ring)
+	{
+		printf("System: undo journal failed to allocate\n");
+		return -1;
+	}
+
+	Size = (uint32_t)Bytes;
+	Clear();
+	return 0;
+}
+
+
+// Forget all history. The ring itself stays
+void undo_journal_t::Clear()
+{
+	Oldest = UNDO_NONE;
+	Newest = UNDO_NONE;
+	Top = UNDO_NONE;
+	OpenEdit = UNDO_NONE;
+	StepOpen = false;
+	Step++;
+}
+
+
+void undo_journal_t::EndStep()
+{
+	if (StepOpen)
+	{
+		Step++;
+		StepOpen = false;
+	}
+}
+
+
+undo_record_t *undo_journal_t::Record(uint32_t Offset) const
+{
+	return (undo_record_t*)(Ring + Offset);
+}
+
+
+// Drop every record of the oldest step. Returns false if that was the step still being recorded
+bool undo_journal_t::DropOldestStep()
+{
+	uint32_t step = Record(Oldest)->Step;
+	bool current = StepOpen && step == Step;
+
+	while (Oldest != UNDO_NONE && Record(Oldest)->Step == step)
+	{
+		if (Oldest == OpenEdit)
+		{
+			OpenEdit = UNDO_NONE;
+		}
+		if (Oldest == Newest)
+		{
+			Oldest = UNDO_NONE;
+			Newest = UNDO_NONE;
+			Top = UNDO_NONE;
+			break;
+		}
+
+		Oldest = Record(Oldest)->Next;
+		Record(Oldest)->Prev = UNDO_NONE;
+	}
+
+	return !current;
+}
+
+
+// Start a record for Count objects in the current step, right after the last applied record - whatever was
+// left to redo is discarded. Records never straddle the end of the ring: one that doesn't fit before the end
+// starts over at the front, and the oldest steps are dropped until it no longer overlaps them. Returns the
+// header, with the payload still to be filled in
+undo_record_t *undo_journal_t::Append(uint16_t Op, uint16_t Field, uint32_t Count)
+{
+	uint32_t blocks = (Op == UNDO_OP_EDIT) ? 2 : 1;
+	uint64_t bytes = sizeof(undo_record_t) + Align16((uint64_t)Count * sizeof(geometry_handle_t)) +
+		(uint64_t)blocks * Align16((uint64_t)Count * FieldSize(Field));
+	if (!Ring || bytes > Size)
+	{
+		// Older records can't be undone correctly past an edit that wasn't recorded
+		printf("System: edit too large for the undo history, history cleared\n");
+		Clear();
+		return 0x0;
+	}
+
+	uint32_t at = 0;
+	if (Top == UNDO_NONE)
+	{
+		Oldest = UNDO_NONE;
+	}
+	else
+	{
+		at = Top + Record(Top)->Size;
+	}
+	Newest = Top;
+
+	// History runs from Oldest up to at. When it doesn't wrap, the free space is after it and before Oldest at the
+	// front; when it does, the free space is the gap between at and Oldest
+	while (Oldest != UNDO_NONE)
+	{
+		if (Oldest < at)
+		{
+			if (at + bytes <= Size)
+			{
+				break;
+			}
+			at = 0;
+			continue;
+		}
+
+		if (at + bytes <= Oldest)
+		{
+			break;
+		}
+		if (!DropOldestStep())
+		{
+			printf("System: edit too large for the undo history, history cleared\n");
+			Clear();
+			return 0x0;
+		}
+	}
+	if (Oldest == UNDO_NONE)
+	{
+		at = 0;
+	}
+
+	undo_record_t *rec = Record(at);
+	rec->Prev = Top;
+	rec->Next = UNDO_NONE;
+	rec->Size = (uint32_t)bytes;
+	rec->Step = Step;
+	rec->Op = Op;
+	rec->Field = Field;
+	rec->Count = Count;
+
+	if (Top != UNDO_NONE)
+	{
+		Record(Top)->Next = at;
+	}
+	if (Oldest == UNDO_NONE)
+	{
+		Oldest = at;
+	}
+	Newest = at;
+	Top = at;
+	StepOpen = true;
+
+	return rec;
+}
+
+
+// Snapshot the listed objects that are still live. A handle that is already dead must not be recorded - reviving
+// it later would bring back an object that was never there
+int undo_journal_t::RecordObjects(uint16_t Op, const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count)
+{
+	uint32_t live = 0;
+	for (uint32_t k = 0; k < Count; k++)
+	{
+		uint32_t i;
+		live += State.Resolve(Handles[k], &i) ? 1 : 0;
+	}
+	if (live == 0)
+	{
+		return 0;
+	}
+
+	undo_record_t *rec = Append(Op, UNDO_FIELD_OBJECT, live);
+	if (!rec)
+	{
+		return -1;
+	}
+
+	geometry_handle_t *handles = (geometry_handle_t*)(rec + 1);
+	uint32_t n = 0;
+	for (uint32_t k = 0; k < Count; k++)
+	{
+		uint32_t i;
+		if (State.Resolve(Handles[k], &i))
+		{
+			handles[n++] = Handles[k];
+		}
+	}
+
+	ReadField(State, UNDO_FIELD_OBJECT, handles, live, (uint8_t*)handles + Align16((uint64_t)live * sizeof(geometry_handle_t)));
+	return 0;
+}
+
+
+// Record objects that were just allocated, so undo can free them and redo bring them back
+int undo_journal_t::RecordCreate(const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count)
+{
+	return RecordObjects(UNDO_OP_CREATE, State, Handles, Count);
+}
+
+
+// Record objects that are about to be freed, in the order they will be freed. Call before freeing them
+int undo_journal_t::RecordDelete(const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count)
+{
+	return RecordObjects(UNDO_OP_DELETE, State, Handles, Count);
+}
+
+
+// Record one field of the listed objects before they are edited. The after values start out as a copy, and
+// FinishEdit() takes them once the edit is done - so an edit spread over many frames (a drag) is one record.
+// On failure there is no open edit, and the history has been cleared
+int undo_journal_t::BeginEdit(const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count, uint16_t Field)
+{
+	OpenEdit = UNDO_NONE;
+	undo_record_t *rec = Append(UNDO_OP_EDIT, Field, Count);
+	if (!rec)
+	{
+		return -1;
+	}
+	OpenEdit = Top;
+
+	uint8_t *payload = (uint8_t*)(rec + 1);
+	uint8_t *before = payload + Align16((uint64_t)Count * sizeof(geometry_handle_t));
+	uint32_t block = Align16((uint64_t)Count * FieldSize(Field));
+	memcpy(payload, Handles, Count * sizeof(geometry_handle_t));
+	ReadField(State, Field, Handles, Count, before);
+	memcpy(before + block, before, block);
+	return 0;
+}
+
+
+// Take the after values for the edit the last BeginEdit() started, if it is still open
+void undo_journal_t::FinishEdit(const geometry_state_t &State)
+{
+	if (OpenEdit == UNDO_NONE)
+	{
+		return;
+	}
+
+	undo_record_t *rec = Record(OpenEdit);
+	OpenEdit = UNDO_NONE;
+	uint8_t *payload = (uint8_t*)(rec + 1);
+	uint8_t *after = payload + Align16((uint64_t)rec->Count * sizeof(geometry_handle_t)) + Align16((uint64_t)rec->Count * FieldSize(rec->Field));
+	ReadField(State, rec->Field, (const geometry_handle_t*)payload, rec->Count, after);
+}
+
+
+// Play one record forward (redo) or backward (undo). Frees and revives go in the order that leaves each ID at
+// the head of the store's free chain when it is needed again
+void undo_journal_t::Apply(geometry_state_t *State, const undo_record_t *Rec, bool Forward)
+{
+	const geometry_handle_t *handles = (const geometry_handle_t*)(Rec + 1);
+	const uint8_t *values = (const uint8_t*)(Rec + 1) + Align16((uint64_t)Rec->Count * sizeof(geometry_handle_t));
+	uint32_t n = Rec->Count;
+	uint32_t first;
+	uint32_t last;
+
+	if (Rec->Op == UNDO_OP_EDIT)
+	{
+		const uint8_t *in = Forward ? values + Align16((uint64_t)n * FieldSize(Rec->Field)) : values;
+		WriteField(State, Rec->Field, handles, n, in, &first, &last);
+		if (Rec->Field == UNDO_FIELD_POSITION && first <= last)
+		{
+			State->ComposeModels(first, last - first + 1);
+		}
+		return;
+	}
+
+	// Redoing a create or undoing a delete brings the objects back, anything else frees them
+	bool revive = (Rec->Op == UNDO_OP_CREATE) == Forward;
+	if (revive)
+	{
+		uint32_t start = State->Count;
+		bool reverse = Rec->Op == UNDO_OP_DELETE;
+		for (uint32_t k = 0; k < n; k++)
+		{
+			State->Revive(handles[reverse ? n - 1 - k : k]);
+		}
+
+		WriteField(State, UNDO_FIELD_OBJECT, handles, n, values, &first, &last);
+		State->ComposeModels(start, State->Count - start);
+		return;
+	}
+
+	bool reverse = Rec->Op == UNDO_OP_CREATE;
+	for (uint32_t k = 0; k < n; k++)
+	{
+		uint32_t i;
+		if (State->Resolve(handles[reverse ? n - 1 - k : k], &i))
+		{
+			State->Free(i);
+		}
+	}
+}
+
+
+// Undo the newest step. Returns false if there was nothing to undo
+bool undo_journal_t::Undo(geometry_state_t *State)
+{
+	EndStep();
+	OpenEdit = UNDO_NONE;
+	if (Top == UNDO_NONE)
+	{
+		return false;
+	}
+
+	uint32_t step = Record(Top)->Step;
+	while (Top != UNDO_NONE && Record(Top)->Step == step)
+	{
+		Apply(State, Record(Top), false);
+		Top = Record(Top)->Prev;
+	}
+
+	return true;
+}
+
+
+// Redo the step after the last one applied. Returns false if there was nothing to redo
+bool undo_journal_t::Redo(geometry_state_t *State)
+{
+	EndStep();
+	OpenEdit = UNDO_NONE;
+	uint32_t next = (Top == UNDO_NONE) ? Oldest : Record(Top)->Next;
+	if (next == UNDO_NONE)
+	{
+		return false;
+	}
+
+	uint32_t step = Record(next)->Step;
+	while (next != UNDO_NONE && Record(next)->Step == step)
+	{
+		Apply(State, Record(next), true);
+		Top = next;
+		next = Record(next)->Next;
+	}
+
+	return true;
+}
+
+
+// Undo the step still being recorded and forget it, leaving nothing to redo
+void undo_journal_t::Cancel(geometry_state_t *State)
+{
+	if (!StepOpen)
+	{
+		return;
+	}
+
+	OpenEdit = UNDO_NONE;
+	while (Top != UNDO_NONE && Record(Top)->Step == Step)
+	{
+		Apply(State, Record(Top), false);
+		Top = Record(Top)->Prev;
+	}
+
+	Newest = Top;
+	if (Top == UNDO_NONE)
+	{
+		Oldest = UNDO_NONE;
+	}
+	else
+	{
+		Record(Top)->Next = UNDO_NONE;
+	}
+	EndStep();
+}
+
+
+// Bytes of the ring holding history, counting the gap left when a record started over at the front
+uint32_t undo_journal_t::Used() const
+{
+	if (Oldest == UNDO_NONE)
+	{
+		return 0;
+	}
+
+	uint32_t end = Newest + Record(Newest)->Size;
+	return (end > Oldest) ? end - Oldest : (Size - Oldest) + end;
+}
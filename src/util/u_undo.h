@@ -0,0 +1,100 @@
+#ifndef MBOX_UNDO_H
+#define MBOX_UNDO_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "u_mem.h"
+
+
+// Bytes of edit history kept. Once full, the oldest steps are overwritten
+#define UNDO_RING_SIZE (64ull * 1024ull * 1024ull)
+#define UNDO_NONE 0xFFFFFFFF
+
+// Record operations. Create and delete carry a snapshot of each object, edits carry one field's value before
+// and after
+#define UNDO_OP_CREATE 0
+#define UNDO_OP_DELETE 1
+#define UNDO_OP_EDIT 2
+
+#define UNDO_FIELD_OBJECT 0
+#define UNDO_FIELD_POSITION 1
+#define UNDO_FIELD_DYNAMIC 2
+
+
+// Everything needed to bring a freed object back. The model matrix is rebuilt from the components and
+// velocities restart at zero, as they do for any newly allocated object
+struct undo_object_t
+{
+	float Pos[3];
+	float Rot[4];
+	float Color[3];
+	float Scale;
+	float Intensity;
+	uint32_t Dynamic;
+	uint32_t Mesh;
+};
+
+
+// Header in front of each record's payload: Count handles, then the field values - one block of snapshots for
+// create/delete, or a before block and an after block for edits. Every block starts 16-byte aligned
+struct undo_record_t
+{
+	uint32_t Prev;
+	uint32_t Next;
+	uint32_t Size;
+	uint32_t Step;
+	uint16_t Op;
+	uint16_t Field;
+	uint32_t Count;
+	uint32_t Pad[2];
+};
+
+
+// Undo/redo history of object edits, as compact records in a fixed ring carved out of ProgramArena once - nothing
+// is allocated per operation. Records name objects by handle, and undoing a delete revives the object under its old
+// handle, so records further back (and the selection) keep pointing at the right objects. Records that belong to
+// one user action share a Step and are undone and redone together; EndStep() closes the current one. A bulk edit is
+// one record, applied in a single pass over its value block
+struct undo_journal_t
+{
+	uint8_t *Ring;
+	uint32_t Size;
+
+	// Oldest and newest records in the ring, and the last one applied - records after Top are there to redo
+	uint32_t Oldest;
+	uint32_t Newest;
+	uint32_t Top;
+
+	// Step new records join, and whether any have joined it yet
+	uint32_t Step;
+	bool StepOpen;
+
+	// Edit record the last BeginEdit() started, until FinishEdit() completes it. Forgotten if the record is undone,
+	// redone or dropped first, so a late FinishEdit() can't write into some other record
+	uint32_t OpenEdit;
+
+	int Init(uint64_t Bytes);
+	void Clear();
+	void EndStep();
+	int RecordCreate(const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count);
+	int RecordDelete(const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count);
+	int BeginEdit(const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count, uint16_t Field);
+	void FinishEdit(const geometry_state_t &State);
+	bool Undo(geometry_state_t *State);
+	bool Redo(geometry_state_t *State);
+	void Cancel(geometry_state_t *State);
+	uint32_t Used() const;
+
+	private:
+
+	undo_record_t *Record(uint32_t Offset) const;
+	undo_record_t *Append(uint16_t Op, uint16_t Field, uint32_t Count);
+	int RecordObjects(uint16_t Op, const geometry_state_t &State, const geometry_handle_t *Handles, uint32_t Count);
+	bool DropOldestStep();
+	void Apply(geometry_state_t *State, const undo_record_t *Rec, bool Forward);
+};
+
+
+#endif
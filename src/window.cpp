@@ -3,7 +3,8 @@
 
 window_handler_t* InitWindowHandler(float ScreenX, float ScreenY)
 {
-	window_handler_t *res = (window_handler_t*)calloc(1, sizeof(window_handler_t));
+	// Lives as long as the program, so it never needs to go back to the heap
+	window_handler_t *res = ProgramArena.PushArray<window_handler_t>(1);
 	if (!res)
 	{
 		printf("System: window handler failed to allocate\n");
@@ -20,8 +21,14 @@ window_handler_t* InitWindowHandler(float ScreenX, float ScreenY)
 	res->ActiveSelection = false;
 	res->ReloadShaders = false;
 	res->ShouldExit = false;
+	res->InstancedRender = true;
+	res->Simulate = false;
+	res->Marquee = false;
+	res->PickMethod = PICK_METHOD_PASS;
 	res->PrevMouseX = ScreenX / 2.0f;
 	res->PrevMouseY = ScreenY / 2.0f;
+	res->HoverSlot = INSTANCE_NONE;
+	res->Grid.CellSize = GRID_CELL_AUTO;
 
 	res->Camera.Sensitivity = 0.1f;
 	res->Camera.Speed = 0.0f;
@@ -33,8 +40,42 @@ window_handler_t* InitWindowHandler(float ScreenX, float ScreenY)
 
 	res->Active.Deleted = false;
 	res->Active.Scale = 1.0f;
+	res->Active.Rotation = { 0.0f, 0.0f, 0.0f, 1.0f };
 	res->Active.Intensity = 0.5f;
 	res->Active.Color = {1.0f, 0.5f, 0.31f};
 
 	return res;
+}
+
+
+// Exponential moving average - a window of roughly 20 frames is enough to smooth out frame pacing noise
+void render_stats_t::Record(float *Average, float Sample)
+{
+	if (*Average == 0.0f)
+	{
+		*Average = Sample;
+		return;
+	}
+
+	*Average += (Sample - *Average) * 0.05f;
+}
+
+
+void render_stats_t::CountFrame(float Now, bool PickPassRan)
+{
+	Frames++;
+	if (PickPassRan)
+	{
+		PickPasses++;
+		PickPassesTotal++;
+	}
+
+	if (Now - WindowStart >= 1.0f)
+	{
+		PickPassesLastSecond = PickPasses;
+		FramesLastSecond = Frames;
+		PickPasses = 0;
+		Frames = 0;
+		WindowStart = Now;
+	}
 }
\ No newline at end of file
@@ -7,6 +7,15 @@
 #include "u_mem.h"
 #include "shader.h"
 #include "picking.h"
+#include "instances.h"
+#include "meshes.h"
+#include "u_bvh.h"
+#include "u_sap.h"
+#include "u_grid.h"
+#include "u_rigid.h"
+#include "u_thread.h"
+#include "u_undo.h"
+#include "u_hier.h"
 #include "camera.h"
 
 
@@ -14,6 +23,81 @@
 #define EMODE_GEOMETRY 1
 #define EMODE_LIGHTS 2
 
+#define RPATH_PER_OBJECT 0
+#define RPATH_INSTANCED 1
+#define RPATH_COUNT 2
+
+// How pick requests are answered: a separate region-sized pick pass, IDs written by the main pass into a
+// second target, or a ray cast entirely on the CPU - through the BVH, brute force over every object with
+// the SIMD OBB kernel, or marched cell by cell through the spatial hash grid
+#define PICK_METHOD_PASS 0
+#define PICK_METHOD_SINGLE_PASS 1
+#define PICK_METHOD_CPU_BVH 2
+#define PICK_METHOD_CPU_SIMD 3
+#define PICK_METHOD_CPU_GRID 4
+
+// Objects whose bounds come within this distance of the one being edited are counted as its neighbours
+#define NEIGHBOUR_RADIUS 1.0f
+
+// Left-dragging further than this many pixels draws a selection marquee instead of picking on release
+#define MARQUEE_MIN_DRAG 4.0
+
+
+// Smoothed timings for each object render path, so they can be compared side by side from the UI
+struct render_stats_t
+{
+	float ObjectPassTime[RPATH_COUNT];
+	float FrameTime[RPATH_COUNT];
+	uint32_t DrawCalls;
+	// Meshes the instanced path's multi-draw covered
+	uint32_t DrawnMeshes;
+
+	// Frustum culling results for the current frame
+	uint32_t Visible;
+	uint32_t Culled;
+	float CullTime;
+
+	// Ray cast (plus BVH update, in BVH mode) for frames that picked on the CPU
+	float CPUPickTime;
+
+	// Broadphase sort/sweep plus narrowphase, every frame
+	float OverlapTime;
+
+	// All fixed simulation steps taken in a frame, for frames that took at least one
+	float SimTime;
+	uint32_t SimSteps;
+
+	// Last marquee selection from the button release on - committing an edited object, frustum setup, BVH update
+	// and query - and the BVH update's share of it
+	float SelectTime;
+	float SelectUpdateTime;
+
+	// Moving children after their parents, and how many objects that touched, every frame
+	float HierarchyTime;
+	uint32_t HierarchyUpdated;
+
+	// Instance data sent to the GPU this frame - journaled mirror ranges plus the visible list - and how many
+	// transfers it took
+	uint64_t UploadBytes;
+	uint32_t UploadRanges;
+
+	// Program arena OS calls (reservation plus commits) made before the first frame, and the total as of the
+	// last frame that made any
+	uint32_t StartupOSCalls;
+	uint32_t OSCalls;
+
+	// Pick pass counters, rolled over once per second so the UI shows a steady rate
+	uint32_t PickPasses;
+	uint32_t Frames;
+	uint32_t PickPassesLastSecond;
+	uint32_t FramesLastSecond;
+	uint64_t PickPassesTotal;
+	float WindowStart;
+
+	void Record(float *Average, float Sample);
+	void CountFrame(float Now, bool PickPassRan);
+};
+
 
 // Monolithic object an unfortunate consequence of using GLFW - future improvements could write a better base layer
 // for cross-platform windowing and simplify this object
@@ -28,15 +112,55 @@ struct window_handler_t
 	bool ActiveSelection;
 	bool ReloadShaders;
 	bool ShouldExit;
+	bool InstancedRender;
+	bool Simulate;
+	bool Marquee;
+	int PickMethod;
 	double PrevMouseX;
 	double PrevMouseY;
+	double MarqueeStartX;
+	double MarqueeStartY;
+	uint32_t HoverSlot;
+	uint32_t VisibleCount;
+	// Frame scratch, rebuilt every frame
+	uint32_t *VisibleList;
+
+	// Marquee selection, as a list of handles plus a flag per object ID for drawing. Handles to objects freed since
+	// are pruned whenever the object set changes (SelectionRevision), so the rest of the selection survives
+	uint32_t SelectionCount;
+	uint32_t SelectionRevision;
+	packed_array_t<geometry_handle_t> SelectionList;
+	chunked_array_t<uint8_t> Selected;
+
+	// Neighbour query results for the object being edited, in frame scratch
+	uint32_t NeighbourCount;
+	uint32_t *NeighbourList;
 
 	shader_program_t MainShader;
 	shader_program_t PickShader;
 	fb_mpick_t PickPass;
+	fb_scene_t ScenePass;
+	pick_request_t PickRequest;
+	pick_readback_t PickReads;
+	// Instance layout each in-flight select readback was drawn with, as handles, indexed by ring entry. The
+	// layout is rebuilt every frame, so a click has to be resolved against the one it was actually drawn with
+	packed_array_t<geometry_handle_t> PickLayout[PICK_QUERY_RING_SIZE];
+	uint32_t PickLayoutCount[PICK_QUERY_RING_SIZE];
+	instance_buffer_t Instances;
+	mesh_registry_t Meshes;
+	uPHYS::bvh_t Bvh;
+	uPHYS::grid_t Grid;
+	uPHYS::sap_t Overlaps;
+	uPHYS::rigid_world_t Rigid;
+	thread_pool_t Workers;
+	undo_journal_t Undo;
+	hierarchy_t Hierarchy;
+	render_stats_t Stats;
 	mbox_camera_t Camera;
-	uMATH::mat4f_t View;
+	uMATH::aff3f_t View;
 	uMATH::mat4f_t Projection;
+	// Handle the object being edited was picked from, GEOMETRY_HANDLE_NONE for a new object
+	geometry_handle_t ActiveHandle;
 	geometry_create_info_t Active;
 	geometry_state_t GeometryObjects;
 	ImGuiIO ImIO;
@@ -0,0 +1,195 @@
+#include "t_common.h"
+
+#include "u_math.h"
+#include "u_mem.h"
+#include "u_bvh.h"
+#include "u_phys.h"
+
+
+// BVH checks: ray casts and frustum queries agree with a brute-force pass over every object, before and after
+// the object set changes under the tree. Picking an object out of the store and committing it back (a free, then
+// a restore under the same handle) must patch and refit the tree, never rebuild it; the timings of the two are
+// printed side by side. Objects are scattered through a 200-unit cube
+
+
+static bool RefRaycast(const geometry_state_t &State, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Slot, float *Distance)
+{
+	uMATH::vec3f_t boxmin = { -0.5f, -0.5f, -0.5f };
+	uMATH::vec3f_t boxmax = { 0.5f, 0.5f, 0.5f };
+	*Slot = BVH_NONE;
+	*Distance = FLT_MAX;
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		float t;
+		if (uPHYS::CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, State.Model[i], &t) && t < *Distance)
+		{
+			*Distance = t;
+			*Slot = i;
+		}
+	}
+
+	return *Slot != BVH_NONE;
+}
+
+
+// Rays aimed at random objects, plus one frustum query, against brute force. Returns how many disagreed
+static uint32_t Agreement(const geometry_state_t &State, const uPHYS::bvh_t &Bvh, test_rng_t *Rng, uint32_t Rays, uint32_t *Scratch, uint8_t *Seen)
+{
+	uint32_t bad = 0;
+	for (uint32_t r = 0; r < Rays; r++)
+	{
+		uint32_t aim = Rng->Next() % State.Count;
+		uMATH::vec3f_t origin = { Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f) };
+		uMATH::vec3f_t target = { State.PosX[aim], State.PosY[aim], State.PosZ[aim] };
+		uMATH::vec3f_t direction = uMATH::Normalize(target - origin);
+
+		uint32_t want, got;
+		float wantdist, gotdist;
+		bool wanthit = RefRaycast(State, origin, direction, &want, &wantdist);
+		bool gothit = Bvh.Raycast(State, origin, direction, &got, &gotdist);
+		bad += (wanthit != gothit) || (wanthit && wantdist != gotdist);
+	}
+
+	uMATH::mat4f_t projection = {};
+	uMATH::SetFrustumHFOV(&projection, 45.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+	uMATH::aff3f_t view;
+	uMATH::SetCameraView(&view, { 0.0f, 0.0f, 0.0f }, { Rng->Range(-1.0f, 1.0f), 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f });
+	uMATH::frustum_t frustum;
+	uMATH::ExtractFrustumPlanes(projection * uMATH::ToM4(view), &frustum);
+
+	memset(Seen, 0, State.Count);
+	uint32_t n = Bvh.QueryFrustum(State, frustum, Scratch);
+	for (uint32_t k = 0; k < n; k++)
+	{
+		bad += Seen[Scratch[k]] != 0;
+		Seen[Scratch[k]] = 1;
+	}
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		bad += (Seen[i] != 0) != uPHYS::CheckFrustumOBB(frustum, State.Model[i]);
+	}
+
+	return bad;
+}
+
+
+static void RandomObject(test_rng_t *Rng, geometry_create_info_t *Info)
+{
+	uMATH::vec3f_t axis = { Rng->Range(-1.0f, 1.0f), Rng->Range(-1.0f, 1.0f), Rng->Range(0.1f, 1.0f) };
+	Info->Rotation = uMATH::QuatFromAxisAngle(Rng->Range(0.0f, 180.0f), uMATH::Normalize(axis));
+	Info->Position = { Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f) };
+	Info->Scale = Rng->Range(0.1f, 2.5f);
+	uMATH::ComposeAF(Info->Position, Info->Rotation, Info->Scale, &Info->Model);
+}
+
+
+int main(int argc, char **argv)
+{
+	if (InitProgramMemory() != 0)
+	{
+		printf("FAIL: could not set up program memory\n");
+		return 1;
+	}
+
+	int failures = 0;
+	test_rng_t rng = { 0x165667B1u };
+	uint32_t objects = TestScale(argc, argv, 50000);
+
+	geometry_state_t state = {};
+	geometry_create_info_t info = {};
+	info.Intensity = 0.5f;
+	info.Color = { 1.0f, 1.0f, 1.0f };
+	for (uint32_t i = 0; i < objects; i++)
+	{
+		RandomObject(&rng, &info);
+		if (state.Alloc(info) == GEOMETRY_HANDLE_NONE)
+		{
+			printf("FAIL: could not allocate %u objects\n", objects);
+			return 1;
+		}
+	}
+
+	uint32_t *scratch = (uint32_t*)malloc(2 * (size_t)objects * sizeof(uint32_t));
+	uint8_t *seen = (uint8_t*)malloc(2 * (size_t)objects);
+	if (!scratch || !seen)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	uPHYS::bvh_t bvh = {};
+	double start = TestSeconds();
+	int res = bvh.Update(state);
+	double buildtime = TestSeconds() - start;
+	TEST_CHECK(failures, res == BVH_UPDATE_BUILD, "first update didn't build the tree");
+
+	const uint32_t rays = 64;
+	uint32_t bad = Agreement(state, bvh, &rng, rays, scratch, seen);
+	TEST_CHECK(failures, bad == 0, "freshly built tree disagrees with brute force on %u queries", bad);
+
+	// Pick and commit, the way the editor does it: the picked object is freed (the last one is swapped into its
+	// slot), edited, and restored under its old handle at the end of the store. The tree is updated in between,
+	// as a hover pick would
+	const uint32_t picks = 100;
+	uint32_t rebuilds = 0;
+	double picktime = 0.0;
+	double worstpick = 0.0;
+	for (uint32_t p = 0; p < picks; p++)
+	{
+		uint32_t slot = rng.Next() % state.Count;
+		geometry_handle_t picked = state.Handle(slot);
+		geometry_create_info_t active;
+		state.GetCreateInfo(slot, &active);
+		state.Free(slot);
+
+		start = TestSeconds();
+		rebuilds += bvh.Update(state) == BVH_UPDATE_BUILD;
+		double t = TestSeconds() - start;
+
+		active.Position = active.Position + uMATH::vec3f_t{ rng.Range(-5.0f, 5.0f), rng.Range(-5.0f, 5.0f), rng.Range(-5.0f, 5.0f) };
+		uMATH::ComposeAF(active.Position, active.Rotation, active.Scale, &active.Model);
+		state.Restore(picked, active);
+
+		start = TestSeconds();
+		rebuilds += bvh.Update(state) == BVH_UPDATE_BUILD;
+		t += TestSeconds() - start;
+
+		picktime += t;
+		worstpick = (t > worstpick) ? t : worstpick;
+	}
+
+	bad = Agreement(state, bvh, &rng, rays, scratch, seen);
+	TEST_CHECK(failures, rebuilds == 0, "%u of %u pick/commit updates rebuilt the tree", rebuilds, 2 * picks);
+	TEST_CHECK(failures, bad == 0, "tree disagrees with brute force on %u queries after %u pick/commit cycles", bad, picks);
+	printf("BVH: %u objects, build %.3f ms, pick + commit updates %.3f ms on average (worst %.3f ms), %u nodes\n", state.Count,
+		buildtime * 1000.0, picktime * 1000.0 / picks, worstpick * 1000.0, bvh.NodeCount);
+
+	// Churn within the patch limit - frees and new objects in one update - then enough to force a rebuild
+	for (uint32_t i = 0; i < objects / 20; i++)
+	{
+		state.Free(rng.Next() % state.Count);
+		RandomObject(&rng, &info);
+		state.Alloc(info);
+	}
+	res = bvh.Update(state);
+	bad = Agreement(state, bvh, &rng, rays, scratch, seen);
+	TEST_CHECK(failures, res == BVH_UPDATE_REFIT, "churning %u objects rebuilt the tree instead of patching it", objects / 20);
+	TEST_CHECK(failures, bad == 0, "patched tree disagrees with brute force on %u queries", bad);
+
+	for (uint32_t i = 0; i < objects / 2; i++)
+	{
+		RandomObject(&rng, &info);
+		state.Alloc(info);
+	}
+	res = bvh.Update(state);
+	bad = Agreement(state, bvh, &rng, rays, scratch, seen);
+	TEST_CHECK(failures, res == BVH_UPDATE_BUILD, "growing by half didn't rebuild the tree");
+	TEST_CHECK(failures, bad == 0, "rebuilt tree disagrees with brute force on %u queries", bad);
+
+	free(scratch);
+	free(seen);
+	bvh.Release();
+	state.Release();
+
+	return failures != 0;
+}
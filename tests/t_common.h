@@ -0,0 +1,71 @@
+#ifndef MBOX_TEST_COMMON_H
+#define MBOX_TEST_COMMON_H
+
+
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// Shared by the standalone checks and benchmarks under tests/. Each one is its own executable with its own main(),
+// returns nonzero when a check fails, and registers with ctest through build/CMakeLists.txt
+
+
+inline double TestSeconds()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// Small xorshift generator, so every run (and every backend) sees the same inputs
+struct test_rng_t
+{
+	uint32_t State;
+
+	uint32_t Next()
+	{
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return State;
+	}
+
+	// Uniform in [Lo, Hi)
+	float Range(float Lo, float Hi)
+	{
+		return Lo + (Hi - Lo) * ((Next() >> 8) * (1.0f / 16777216.0f));
+	}
+};
+
+
+// Benchmark sizes scale with the first command line argument, so ctest runs stay short and a manual run can go large
+inline uint32_t TestScale(int argc, char **argv, uint32_t Default)
+{
+	if (argc > 1)
+	{
+		long v = strtol(argv[1], 0x0, 10);
+		if (v > 0)
+		{
+			return (uint32_t)v;
+		}
+	}
+
+	return Default;
+}
+
+
+#define TEST_CHECK(Failures, Cond, ...) \
+	do \
+	{ \
+		if (!(Cond)) \
+		{ \
+			printf("FAIL: "); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+			(Failures)++; \
+		} \
+	} while (0)
+
+
+#endif
@@ -0,0 +1,128 @@
+#include "t_common.h"
+
+#include "u_math.h"
+#include "u_mem.h"
+
+
+// Frustum culling benchmark: the object store's chunked CullFrustum (CullSpheres, four spheres per iteration)
+// against a plain one-sphere-at-a-time loop over the same store, which also serves as the reference the visible
+// list has to match exactly. Objects are scattered through a 200-unit cube around the camera
+
+
+static uint32_t RefCull(const geometry_state_t &State, const uMATH::frustum_t &Frustum, uint32_t *Visible)
+{
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		float negr = 0.0f - State.BoundRadius[i];
+		bool inside = true;
+		for (int p = 0; p < 6; p++)
+		{
+			const uMATH::vec4f_t &pl = Frustum.Planes[p];
+			float d = (pl.x * State.PosX[i]) + (pl.y * State.PosY[i]) + (pl.z * State.PosZ[i]) + pl.w;
+			inside = inside && (d >= negr);
+		}
+		if (inside)
+		{
+			Visible[n++] = i;
+		}
+	}
+
+	return n;
+}
+
+
+int main(int argc, char **argv)
+{
+	if (InitProgramMemory() != 0)
+	{
+		printf("FAIL: could not set up program memory\n");
+		return 1;
+	}
+
+	int failures = 0;
+	test_rng_t rng = { 0x2545F491u };
+	uint32_t objects = TestScale(argc, argv, 100000);
+
+	geometry_state_t state = {};
+	geometry_create_info_t info = {};
+	info.Intensity = 0.5f;
+	info.Color = { 1.0f, 1.0f, 1.0f };
+
+	// A tenth extra, freed again below, so the store holds exactly as many as asked for
+	uint32_t extra = objects / 10;
+	for (uint32_t i = 0; i < objects + extra; i++)
+	{
+		uMATH::vec3f_t axis = { rng.Range(-1.0f, 1.0f), rng.Range(-1.0f, 1.0f), rng.Range(0.1f, 1.0f) };
+		info.Rotation = uMATH::QuatFromAxisAngle(rng.Range(0.0f, 180.0f), uMATH::Normalize(axis));
+		info.Position = { rng.Range(-100.0f, 100.0f), rng.Range(-100.0f, 100.0f), rng.Range(-100.0f, 100.0f) };
+		info.Scale = rng.Range(0.1f, 2.5f);
+		if (state.Alloc(info) == GEOMETRY_HANDLE_NONE)
+		{
+			printf("FAIL: could not allocate %u objects\n", objects + extra);
+			return 1;
+		}
+	}
+
+	// Some churn, so the swap-and-pop layout and the partly filled last chunk get exercised
+	for (uint32_t i = 0; i < extra; i++)
+	{
+		state.Free(rng.Next() % state.Count);
+	}
+
+	uint32_t *got = (uint32_t*)malloc(state.Count * sizeof(uint32_t));
+	uint32_t *want = (uint32_t*)malloc(state.Count * sizeof(uint32_t));
+	if (!got || !want)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	uMATH::mat4f_t projection = {};
+	uMATH::SetFrustumHFOV(&projection, 45.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+
+	// A handful of camera directions, each timed over several repeats
+	const uint32_t views = 8;
+	const uint32_t repeats = 20;
+	double reftime = 0.0;
+	double simdtime = 0.0;
+	uint64_t visible = 0;
+	uint32_t mismatched = 0;
+	for (uint32_t v = 0; v < views; v++)
+	{
+		uMATH::vec3f_t target = { rng.Range(-1.0f, 1.0f), rng.Range(-0.5f, 0.5f), rng.Range(-1.0f, 1.0f) };
+		uMATH::aff3f_t view;
+		uMATH::SetCameraView(&view, { 0.0f, 0.0f, 0.0f }, target, { 0.0f, 1.0f, 0.0f });
+		uMATH::frustum_t frustum;
+		uMATH::ExtractFrustumPlanes(projection * uMATH::ToM4(view), &frustum);
+
+		uint32_t nwant = 0;
+		uint32_t ngot = 0;
+		double start = TestSeconds();
+		for (uint32_t r = 0; r < repeats; r++)
+		{
+			nwant = RefCull(state, frustum, want);
+		}
+		reftime += TestSeconds() - start;
+
+		start = TestSeconds();
+		for (uint32_t r = 0; r < repeats; r++)
+		{
+			ngot = state.CullFrustum(frustum, got);
+		}
+		simdtime += TestSeconds() - start;
+
+		mismatched += (ngot != nwant || memcmp(got, want, ngot * sizeof(uint32_t)) != 0);
+		visible += ngot;
+	}
+
+	TEST_CHECK(failures, mismatched == 0, "CullFrustum's visible list differs from the reference for %u of %u views", mismatched, views);
+	printf("Cull: %u objects, %.0f visible on average, reference %.3f ms, CullFrustum %.3f ms per frame\n", state.Count,
+		(double)visible / views, reftime * 1000.0 / (views * repeats), simdtime * 1000.0 / (views * repeats));
+
+	free(got);
+	free(want);
+	state.Release();
+
+	return failures != 0;
+}
@@ -0,0 +1,197 @@
+#include "t_common.h"
+
+#include "u_math.h"
+#include "u_mem.h"
+#include "u_grid.h"
+#include "u_bvh.h"
+#include "u_phys.h"
+
+
+// Spatial index upkeep under motion: the grid follows the store's change journal and only touches objects
+// that crossed a cell boundary, where the BVH refits every node. Both are updated after the same simulated
+// frames (a twentieth of the objects nudged) and their times printed side by side. Then, with objects freed and
+// allocated between frames as well, the grid's AABB queries and ray casts have to match brute force over
+// every object. Objects are scattered through a 200-unit cube
+
+
+static bool RefRaycast(const geometry_state_t &State, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, float *Distance)
+{
+	uMATH::vec3f_t boxmin = { -0.5f, -0.5f, -0.5f };
+	uMATH::vec3f_t boxmax = { 0.5f, 0.5f, 0.5f };
+	bool hit = false;
+	*Distance = FLT_MAX;
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		float t;
+		if (uPHYS::CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, State.Model[i], &t) && t < *Distance)
+		{
+			*Distance = t;
+			hit = true;
+		}
+	}
+
+	return hit;
+}
+
+
+// Random boxes and rays against brute force. Returns how many disagreed
+static uint32_t Agreement(const geometry_state_t &State, uPHYS::grid_t *Grid, test_rng_t *Rng, uint32_t Queries, uint32_t *Scratch,
+	uint8_t *Seen)
+{
+	uint32_t bad = 0;
+	for (uint32_t q = 0; q < Queries; q++)
+	{
+		uMATH::vec3f_t center = { Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f) };
+		uMATH::vec3f_t half = { Rng->Range(1.0f, 10.0f), Rng->Range(1.0f, 10.0f), Rng->Range(1.0f, 10.0f) };
+		uMATH::vec3f_t qmin = center - half;
+		uMATH::vec3f_t qmax = center + half;
+
+		memset(Seen, 0, State.Count);
+		uint32_t n = Grid->QueryAABB(qmin, qmax, Scratch);
+		for (uint32_t k = 0; k < n; k++)
+		{
+			bad += Scratch[k] >= State.Count || Seen[Scratch[k]] != 0;
+			Seen[Scratch[k]] = 1;
+		}
+		for (uint32_t i = 0; i < State.Count; i++)
+		{
+			uMATH::vec3f_t bmin, bmax;
+			uPHYS::ComputeOBBBounds(State.Model[i], &bmin, &bmax);
+			bool want = bmin.x <= qmax.x && bmax.x >= qmin.x && bmin.y <= qmax.y && bmax.y >= qmin.y && bmin.z <= qmax.z && bmax.z >= qmin.z;
+			bad += want != (Seen[i] != 0);
+		}
+
+		uint32_t aim = Rng->Next() % State.Count;
+		uMATH::vec3f_t origin = { Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f) };
+		uMATH::vec3f_t target = { State.PosX[aim], State.PosY[aim], State.PosZ[aim] };
+		uMATH::vec3f_t direction = uMATH::Normalize(target - origin);
+
+		uint32_t slot;
+		float wantdist, gotdist;
+		bool wanthit = RefRaycast(State, origin, direction, &wantdist);
+		bool gothit = Grid->Raycast(State, origin, direction, &slot, &gotdist);
+		bad += (wanthit != gothit) || (wanthit && wantdist != gotdist);
+	}
+
+	return bad;
+}
+
+
+// One simulated frame: every Stride-th object drifts a little, and its model is recomposed
+static void Drift(geometry_state_t *State, test_rng_t *Rng, uint32_t Stride)
+{
+	for (uint32_t i = Rng->Next() % Stride; i < State->Count; i += Stride)
+	{
+		State->PosX[i] += Rng->Range(-0.2f, 0.2f);
+		State->PosY[i] += Rng->Range(-0.2f, 0.2f);
+		State->PosZ[i] += Rng->Range(-0.2f, 0.2f);
+		State->ComposeModels(i, 1);
+	}
+}
+
+
+static void RandomObject(test_rng_t *Rng, geometry_create_info_t *Info)
+{
+	uMATH::vec3f_t axis = { Rng->Range(-1.0f, 1.0f), Rng->Range(-1.0f, 1.0f), Rng->Range(0.1f, 1.0f) };
+	Info->Rotation = uMATH::QuatFromAxisAngle(Rng->Range(0.0f, 180.0f), uMATH::Normalize(axis));
+	Info->Position = { Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f) };
+	Info->Scale = Rng->Range(0.1f, 2.5f);
+	uMATH::ComposeAF(Info->Position, Info->Rotation, Info->Scale, &Info->Model);
+}
+
+
+int main(int argc, char **argv)
+{
+	if (InitProgramMemory() != 0)
+	{
+		printf("FAIL: could not set up program memory\n");
+		return 1;
+	}
+
+	int failures = 0;
+	test_rng_t rng = { 0x7FEB352Du };
+	uint32_t objects = TestScale(argc, argv, 50000);
+
+	geometry_state_t state = {};
+	geometry_create_info_t info = {};
+	info.Intensity = 0.5f;
+	info.Color = { 1.0f, 1.0f, 1.0f };
+	for (uint32_t i = 0; i < objects; i++)
+	{
+		RandomObject(&rng, &info);
+		if (state.Alloc(info) == GEOMETRY_HANDLE_NONE)
+		{
+			printf("FAIL: could not allocate %u objects\n", objects);
+			return 1;
+		}
+	}
+
+	uint32_t *scratch = (uint32_t*)malloc((size_t)objects * sizeof(uint32_t));
+	uint8_t *seen = (uint8_t*)malloc(objects);
+	if (!scratch || !seen)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	uPHYS::grid_t grid = {};
+	grid.CellSize = GRID_CELL_AUTO;
+	uPHYS::bvh_t bvh = {};
+	TEST_CHECK(failures, grid.Update(state) == GRID_UPDATE_BUILD, "first grid update didn't build it");
+	TEST_CHECK(failures, bvh.Update(state) == BVH_UPDATE_BUILD, "first BVH update didn't build it");
+	state.ClearChanges();
+
+	// The same motion for both, the journal cleared after each frame as the instance upload does
+	const uint32_t frames = 50;
+	const uint32_t stride = 20;
+	double gridtime = 0.0;
+	double bvhtime = 0.0;
+	uint32_t gridbuilds = 0;
+	for (uint32_t f = 0; f < frames; f++)
+	{
+		Drift(&state, &rng, stride);
+
+		double start = TestSeconds();
+		gridbuilds += grid.Update(state) != GRID_UPDATE_SYNC;
+		gridtime += TestSeconds() - start;
+
+		start = TestSeconds();
+		bvh.Update(state);
+		bvhtime += TestSeconds() - start;
+
+		state.ClearChanges();
+	}
+
+	TEST_CHECK(failures, gridbuilds == 0, "%u of %u grid updates after motion didn't sync from the journal", gridbuilds, frames);
+	printf("Index update: %u objects, %u moved per frame, grid %.3f ms, BVH refit %.3f ms per frame\n", state.Count, state.Count / stride,
+		gridtime * 1000.0 / frames, bvhtime * 1000.0 / frames);
+
+	// Motion plus churn - frees swap the last object into the freed slot, so slots change hands between syncs
+	const uint32_t queries = 16;
+	uint32_t bad = 0;
+	for (uint32_t f = 0; f < 10; f++)
+	{
+		Drift(&state, &rng, stride);
+		for (uint32_t i = 0; i < objects / 100; i++)
+		{
+			state.Free(rng.Next() % state.Count);
+		}
+		for (uint32_t i = 0; i < objects / 100; i++)
+		{
+			RandomObject(&rng, &info);
+			state.Alloc(info);
+		}
+		grid.Update(state);
+		state.ClearChanges();
+		bad += Agreement(state, &grid, &rng, queries, scratch, seen);
+	}
+	TEST_CHECK(failures, bad == 0, "grid disagrees with brute force on %u queries under churn", bad);
+
+	free(scratch);
+	free(seen);
+	grid.Release();
+	bvh.Release();
+	state.Release();
+
+	return failures != 0;
+}
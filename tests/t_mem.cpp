@@ -0,0 +1,124 @@
+#include "t_common.h"
+
+#include "u_math.h"
+#include "u_mem.h"
+
+
+// Steady-state frames must never go back to the OS. This runs the same per-frame pattern the editor does -
+// frame scratch lists sized to the object count, churn that frees and allocates the same number of objects,
+// a recompose, scratch heap blocks - and fails if the program arena reserves or commits anything once the
+// first few frames have warmed it up. Growing the scene afterwards has to show up in the counters, so the
+// check can't pass just because they never move
+
+
+static uint32_t OSCalls()
+{
+	return ProgramArena.OSReserveCount + ProgramArena.OSCommitCount;
+}
+
+
+static void Frame(geometry_state_t *State, test_rng_t *Rng, const uMATH::frustum_t &Frustum)
+{
+	FrameScratch.BeginFrame();
+
+	uint32_t *visible = FrameScratch.PushArray<uint32_t>(State->Count);
+	if (visible)
+	{
+		State->CullFrustum(Frustum, visible);
+	}
+
+	geometry_create_info_t info = {};
+	info.Rotation = { 0.0f, 0.0f, 0.0f, 1.0f };
+	info.Scale = 1.0f;
+	uint32_t churn = State->Count / 100;
+	for (uint32_t i = 0; i < churn; i++)
+	{
+		State->Free(Rng->Next() % State->Count);
+	}
+	for (uint32_t i = 0; i < churn; i++)
+	{
+		info.Position = { Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f), Rng->Range(-100.0f, 100.0f) };
+		State->Alloc(info);
+	}
+	State->ComposeModels(0, State->Count);
+	State->ClearChanges();
+
+	// Like shader source loading - a heap block of varying size that is given back right away
+	uint64_t bytes = 1024 + (Rng->Next() % (256 * 1024));
+	void *block = ProgramHeap.Alloc(bytes);
+	if (block)
+	{
+		memset(block, 0, bytes);
+		ProgramHeap.Free(block, bytes);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	if (InitProgramMemory() != 0)
+	{
+		printf("FAIL: could not set up program memory\n");
+		return 1;
+	}
+
+	int failures = 0;
+	test_rng_t rng = { 0x27D4EB2Fu };
+	uint32_t objects = TestScale(argc, argv, 100000);
+
+	geometry_state_t state = {};
+	geometry_create_info_t info = {};
+	info.Rotation = { 0.0f, 0.0f, 0.0f, 1.0f };
+	info.Scale = 1.0f;
+	for (uint32_t i = 0; i < objects; i++)
+	{
+		info.Position = { rng.Range(-100.0f, 100.0f), rng.Range(-100.0f, 100.0f), rng.Range(-100.0f, 100.0f) };
+		if (state.Alloc(info) == GEOMETRY_HANDLE_NONE)
+		{
+			printf("FAIL: could not allocate %u objects\n", objects);
+			return 1;
+		}
+	}
+
+	uMATH::mat4f_t projection = {};
+	uMATH::SetFrustumHFOV(&projection, 45.0f, 16.0f / 9.0f, 0.1f, 100.0f);
+	uMATH::aff3f_t view;
+	uMATH::SetCameraView(&view, { 0.0f, 0.0f, 0.0f }, { 0.0f, 0.0f, -1.0f }, { 0.0f, 1.0f, 0.0f });
+	uMATH::frustum_t frustum;
+	uMATH::ExtractFrustumPlanes(projection * uMATH::ToM4(view), &frustum);
+
+	const uint32_t warmup = 4;
+	const uint32_t frames = 200;
+	for (uint32_t f = 0; f < warmup; f++)
+	{
+		Frame(&state, &rng, frustum);
+	}
+
+	uint32_t startup = OSCalls();
+	double start = TestSeconds();
+	for (uint32_t f = 0; f < frames; f++)
+	{
+		Frame(&state, &rng, frustum);
+	}
+	double elapsed = TestSeconds() - start;
+	uint32_t steady = OSCalls() - startup;
+
+	TEST_CHECK(failures, steady == 0, "%u OS calls over %u steady-state frames with %u objects", steady, frames, state.Count);
+	printf("Steady state: %u frames over %u objects, %u OS calls, %.3f ms per frame, %.0f MB committed\n", frames, state.Count, steady,
+		elapsed * 1000.0 / frames, ProgramArena.Committed / 1048576.0);
+
+	// Ten times the objects can't fit in what is committed, so the counters have to move
+	for (uint32_t i = objects; i < 10 * objects && i < GEOMETRY_MAX_OBJECTS; i++)
+	{
+		info.Position = { rng.Range(-100.0f, 100.0f), rng.Range(-100.0f, 100.0f), rng.Range(-100.0f, 100.0f) };
+		state.Alloc(info);
+	}
+	uint32_t grown = OSCalls() - startup;
+	TEST_CHECK(failures, grown > 0, "growing to %u objects made no OS calls - the counters aren't tracking commits", state.Count);
+	printf("Growth: %u objects, %u OS calls, %.0f MB committed\n", state.Count, grown, ProgramArena.Committed / 1048576.0);
+
+	state.Release();
+	ReleaseProgramMemory();
+
+	return failures != 0;
+}
@@ -0,0 +1,121 @@
+#include "t_common.h"
+
+#include "u_math.h"
+#include "u_phys.h"
+
+
+// Ray vs OBB benchmark: RaycastOBBs over the parallel transform arrays (four boxes per iteration) against the
+// scalar CheckRayOBBCollision over composed model matrices, the way picking worked before the batched path.
+// Box counts step from 10k up to the first argument (1M by default) through a 1000-unit cube. The two paths
+// reach the box axes differently, so a nearest hit agrees if the index matches or the distances are a near-tie
+
+
+static bool RefRaycast(const uMATH::aff3f_t *Models, uint32_t Count, uMATH::vec3f_t Origin, uMATH::vec3f_t Direction, uint32_t *Index, float *Distance)
+{
+	uMATH::vec3f_t boxmin = { -0.5f, -0.5f, -0.5f };
+	uMATH::vec3f_t boxmax = { 0.5f, 0.5f, 0.5f };
+	float best = FLT_MAX;
+	uint32_t bestindex = 0xFFFFFFFF;
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		float t;
+		if (uPHYS::CheckRayOBBCollision(Origin, Direction, boxmin, boxmax, Models[i], &t) && t < best)
+		{
+			best = t;
+			bestindex = i;
+		}
+	}
+
+	*Index = bestindex;
+	*Distance = best;
+
+	return bestindex != 0xFFFFFFFF;
+}
+
+
+int main(int argc, char **argv)
+{
+	int failures = 0;
+	test_rng_t rng = { 0x85EBCA6Bu };
+	uint32_t maxboxes = TestScale(argc, argv, 1000000);
+
+	float *soa = (float*)malloc(8 * (size_t)maxboxes * sizeof(float));
+	uMATH::aff3f_t *models = (uMATH::aff3f_t*)malloc((size_t)maxboxes * sizeof(uMATH::aff3f_t));
+	if (!soa || !models)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	uMATH::transform_soa_t transforms = { soa, soa + maxboxes, soa + 2 * maxboxes, soa + 3 * maxboxes, soa + 4 * maxboxes,
+		soa + 5 * maxboxes, soa + 6 * maxboxes, soa + 7 * maxboxes };
+	uPHYS::obb_soa_t boxes = { soa, soa + maxboxes, soa + 2 * maxboxes, soa + 3 * maxboxes, soa + 4 * maxboxes,
+		soa + 5 * maxboxes, soa + 6 * maxboxes, soa + 7 * maxboxes };
+	for (uint32_t i = 0; i < maxboxes; i++)
+	{
+		uMATH::vec3f_t axis = { rng.Range(-1.0f, 1.0f), rng.Range(-1.0f, 1.0f), rng.Range(0.1f, 1.0f) };
+		uMATH::quatf_t q = uMATH::QuatFromAxisAngle(rng.Range(0.0f, 180.0f), uMATH::Normalize(axis));
+		float scale = rng.Range(0.1f, 2.5f);
+		soa[i] = rng.Range(-500.0f, 500.0f);
+		soa[maxboxes + i] = rng.Range(-500.0f, 500.0f);
+		soa[2 * maxboxes + i] = rng.Range(-500.0f, 500.0f);
+		soa[3 * maxboxes + i] = q.x;
+		soa[4 * maxboxes + i] = q.y;
+		soa[5 * maxboxes + i] = q.z;
+		soa[6 * maxboxes + i] = q.w;
+		soa[7 * maxboxes + i] = scale;
+	}
+	uMATH::ComposeModelsAF(transforms, models, maxboxes);
+
+	const uint32_t rays = 32;
+	uint32_t count = (maxboxes < 10000) ? maxboxes : 10000;
+	for (;;)
+	{
+		double reftime = 0.0;
+		double simdtime = 0.0;
+		uint32_t hits = 0;
+		uint32_t mismatched = 0;
+		for (uint32_t r = 0; r < rays; r++)
+		{
+			// Aim at a random box from somewhere in the cube, so most rays have something to hit
+			uint32_t aim = rng.Next() % count;
+			uMATH::vec3f_t origin = { rng.Range(-500.0f, 500.0f), rng.Range(-500.0f, 500.0f), rng.Range(-500.0f, 500.0f) };
+			uMATH::vec3f_t target = { boxes.PosX[aim], boxes.PosY[aim], boxes.PosZ[aim] };
+			uMATH::vec3f_t direction = uMATH::Normalize(target - origin);
+
+			uint32_t wantindex, gotindex;
+			float wantdist, gotdist;
+			double start = TestSeconds();
+			bool wanthit = RefRaycast(models, count, origin, direction, &wantindex, &wantdist);
+			reftime += TestSeconds() - start;
+
+			start = TestSeconds();
+			bool gothit = uPHYS::RaycastOBBs(boxes, count, origin, direction, &gotindex, &gotdist);
+			simdtime += TestSeconds() - start;
+
+			bool agree = (wanthit == gothit);
+			if (agree && wanthit && gotindex != wantindex)
+			{
+				agree = fabsf(gotdist - wantdist) <= 1e-3f * ((wantdist > 1.0f) ? wantdist : 1.0f);
+			}
+			mismatched += !agree;
+			hits += wanthit;
+		}
+
+		TEST_CHECK(failures, mismatched == 0, "RaycastOBBs disagrees with the scalar reference on %u of %u rays over %u boxes", mismatched,
+			rays, count);
+		printf("Raycast: %u boxes, %u of %u rays hit, CheckRayOBBCollision %.3f ms, RaycastOBBs %.3f ms per ray\n", count, hits, rays,
+			reftime * 1000.0 / rays, simdtime * 1000.0 / rays);
+
+		if (count == maxboxes)
+		{
+			break;
+		}
+		count = (count > maxboxes / 10) ? maxboxes : count * 10;
+	}
+
+	free(soa);
+	free(models);
+
+	return failures != 0;
+}
@@ -0,0 +1,208 @@
+#include "t_common.h"
+
+#include "u_math.h"
+#include "u_mem.h"
+#include "u_sap.h"
+#include "u_phys.h"
+
+
+// Broadphase checks: the overlapping pairs sap_t finds must be exactly those a brute-force test of every pair
+// finds, after the first build, after objects move, and in a scene spread along Y rather than X. An update
+// with nothing changed, and one after a small fraction of the objects moved, must each fit the per-frame
+// budget below (best of several runs). Objects are scattered through a 100-unit cube, so pairs are common
+
+
+// Idle and small-motion updates, in milliseconds
+#define SAP_BUDGET_MS 1.0
+
+
+static int ComparePairs(const void *a, const void *b)
+{
+	const uPHYS::sap_pair_t *pa = (const uPHYS::sap_pair_t*)a;
+	const uPHYS::sap_pair_t *pb = (const uPHYS::sap_pair_t*)b;
+	uint64_t ka = ((uint64_t)pa->A << 32) | pa->B;
+	uint64_t kb = ((uint64_t)pb->A << 32) | pb->B;
+
+	return (ka > kb) - (ka < kb);
+}
+
+
+// Lower slot first, then sorted, so two pair lists can be compared directly
+static void NormalizePairs(uPHYS::sap_pair_t *Pairs, uint32_t Count)
+{
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		if (Pairs[i].A > Pairs[i].B)
+		{
+			uint32_t t = Pairs[i].A;
+			Pairs[i].A = Pairs[i].B;
+			Pairs[i].B = t;
+		}
+	}
+	qsort(Pairs, Count, sizeof(uPHYS::sap_pair_t), ComparePairs);
+}
+
+
+// Every pair whose AABBs overlap and whose OBBs intersect. Writes at most MaxPairs
+static uint32_t RefPairs(const geometry_state_t &State, uMATH::vec3f_t *Min, uMATH::vec3f_t *Max, uPHYS::sap_pair_t *Pairs, uint32_t MaxPairs)
+{
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		uPHYS::ComputeOBBBounds(State.Model[i], &Min[i], &Max[i]);
+	}
+
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < State.Count; i++)
+	{
+		for (uint32_t j = i + 1; j < State.Count; j++)
+		{
+			if (Min[i].x > Max[j].x || Min[j].x > Max[i].x || Min[i].y > Max[j].y || Min[j].y > Max[i].y || Min[i].z > Max[j].z ||
+				Min[j].z > Max[i].z)
+			{
+				continue;
+			}
+			if (n < MaxPairs && uPHYS::CheckOBBOBBCollision(State.Model[i], State.Model[j], 0x0, 0x0))
+			{
+				Pairs[n].A = i;
+				Pairs[n].B = j;
+				n++;
+			}
+		}
+	}
+
+	return n;
+}
+
+
+// Whether the broadphase's pairs match brute force exactly
+static bool Agrees(const geometry_state_t &State, const uPHYS::sap_t &Sap, uMATH::vec3f_t *Min, uMATH::vec3f_t *Max, uPHYS::sap_pair_t *Want,
+	uPHYS::sap_pair_t *Got, uint32_t MaxPairs)
+{
+	uint32_t nwant = RefPairs(State, Min, Max, Want, MaxPairs);
+	uint32_t ngot = Sap.PairCount;
+	if (ngot != nwant || ngot > MaxPairs)
+	{
+		return false;
+	}
+
+	memcpy(Got, Sap.Pairs.Data, ngot * sizeof(uPHYS::sap_pair_t));
+	NormalizePairs(Got, ngot);
+	NormalizePairs(Want, nwant);
+
+	return memcmp(Got, Want, ngot * sizeof(uPHYS::sap_pair_t)) == 0;
+}
+
+
+static void Scatter(geometry_state_t *State, test_rng_t *Rng, uint32_t Count, uMATH::vec3f_t Extent)
+{
+	geometry_create_info_t info = {};
+	info.Intensity = 0.5f;
+	info.Color = { 1.0f, 1.0f, 1.0f };
+	for (uint32_t i = 0; i < Count; i++)
+	{
+		uMATH::vec3f_t axis = { Rng->Range(-1.0f, 1.0f), Rng->Range(-1.0f, 1.0f), Rng->Range(0.1f, 1.0f) };
+		info.Rotation = uMATH::QuatFromAxisAngle(Rng->Range(0.0f, 180.0f), uMATH::Normalize(axis));
+		info.Position = { Rng->Range(-Extent.x, Extent.x), Rng->Range(-Extent.y, Extent.y), Rng->Range(-Extent.z, Extent.z) };
+		info.Scale = Rng->Range(0.1f, 2.5f);
+		uMATH::ComposeAF(info.Position, info.Rotation, info.Scale, &info.Model);
+		State->Alloc(info);
+	}
+}
+
+
+// Nudge every Stride-th object, the way a simulation step moves the bodies that are awake
+static void Nudge(geometry_state_t *State, test_rng_t *Rng, uint32_t Stride)
+{
+	for (uint32_t i = 0; i < State->Count; i += Stride)
+	{
+		State->PosX[i] += Rng->Range(-0.05f, 0.05f);
+		State->PosY[i] += Rng->Range(-0.05f, 0.05f);
+		State->PosZ[i] += Rng->Range(-0.05f, 0.05f);
+		State->ComposeModels(i, 1);
+	}
+}
+
+
+int main(int argc, char **argv)
+{
+	if (InitProgramMemory() != 0)
+	{
+		printf("FAIL: could not set up program memory\n");
+		return 1;
+	}
+
+	int failures = 0;
+	test_rng_t rng = { 0x9E3779B9u };
+	uint32_t objects = TestScale(argc, argv, 20000);
+
+	geometry_state_t state = {};
+	Scatter(&state, &rng, objects, { 50.0f, 50.0f, 50.0f });
+	if (state.Count != objects)
+	{
+		printf("FAIL: could not allocate %u objects\n", objects);
+		return 1;
+	}
+	state.ClearChanges();
+
+	const uint32_t maxpairs = 8 * objects;
+	uMATH::vec3f_t *bmin = (uMATH::vec3f_t*)malloc((size_t)objects * sizeof(uMATH::vec3f_t));
+	uMATH::vec3f_t *bmax = (uMATH::vec3f_t*)malloc((size_t)objects * sizeof(uMATH::vec3f_t));
+	uPHYS::sap_pair_t *want = (uPHYS::sap_pair_t*)malloc((size_t)maxpairs * sizeof(uPHYS::sap_pair_t));
+	uPHYS::sap_pair_t *got = (uPHYS::sap_pair_t*)malloc((size_t)maxpairs * sizeof(uPHYS::sap_pair_t));
+	if (!bmin || !bmax || !want || !got)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	uPHYS::sap_t sap = {};
+	double start = TestSeconds();
+	sap.Update(state);
+	double buildtime = TestSeconds() - start;
+	TEST_CHECK(failures, Agrees(state, sap, bmin, bmax, want, got, maxpairs), "built broadphase disagrees with brute force (%u pairs)",
+		sap.PairCount);
+
+	// Nothing changed, then a hundredth of the objects moved - each the best of several frames
+	const uint32_t frames = 20;
+	double idle = 1e9;
+	double moving = 1e9;
+	for (uint32_t f = 0; f < frames; f++)
+	{
+		start = TestSeconds();
+		sap.Update(state);
+		double t = TestSeconds() - start;
+		idle = (t < idle) ? t : idle;
+
+		Nudge(&state, &rng, 100);
+		start = TestSeconds();
+		sap.Update(state);
+		t = TestSeconds() - start;
+		moving = (t < moving) ? t : moving;
+		state.ClearChanges();
+	}
+
+	TEST_CHECK(failures, Agrees(state, sap, bmin, bmax, want, got, maxpairs), "broadphase disagrees with brute force after %u frames of motion",
+		frames);
+	TEST_CHECK(failures, idle * 1000.0 < SAP_BUDGET_MS, "idle update took %.3f ms, over the %.1f ms budget", idle * 1000.0, SAP_BUDGET_MS);
+	TEST_CHECK(failures, moving * 1000.0 < SAP_BUDGET_MS, "update after moving %u objects took %.3f ms, over the %.1f ms budget",
+		objects / 100, moving * 1000.0, SAP_BUDGET_MS);
+	printf("Broadphase: %u objects, %u pairs of %u candidates, build %.3f ms, idle %.3f ms, %u moved %.3f ms\n", state.Count, sap.PairCount,
+		sap.CandidateCount, buildtime * 1000.0, idle * 1000.0, objects / 100, moving * 1000.0);
+
+	// A tall scene has to be swept along Y
+	state.Release();
+	state = {};
+	Scatter(&state, &rng, objects, { 5.0f, 500.0f, 5.0f });
+	sap.Update(state);
+	TEST_CHECK(failures, sap.Axis == 1, "sweeping a scene spread along Y on axis %u", sap.Axis);
+	TEST_CHECK(failures, Agrees(state, sap, bmin, bmax, want, got, maxpairs), "broadphase swept along Y disagrees with brute force");
+
+	free(bmin);
+	free(bmax);
+	free(want);
+	free(got);
+	sap.Release();
+	state.Release();
+
+	return failures != 0;
+}
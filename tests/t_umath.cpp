@@ -0,0 +1,287 @@
+#include "t_common.h"
+
+#include "u_math.h"
+
+
+// Agreement checks for the uMATH SIMD kernels against plain scalar references, then throughput for the same
+// kernels. The build compiles this file once per backend (scalar, SSE2, AVX) - whichever one uMATH picked
+// is what gets checked. Every kernel is meant to agree bit-for-bit with its reference except the inverse,
+// which only has to invert
+
+
+static void RefMultiplyM4(const uMATH::mat4f_t &a, const uMATH::mat4f_t &b, uMATH::mat4f_t *out)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			out->m[i][j] = (a.m[i][0] * b.m[0][j]) + (a.m[i][1] * b.m[1][j]) + (a.m[i][2] * b.m[2][j]) + (a.m[i][3] * b.m[3][j]);
+		}
+	}
+}
+
+
+static uMATH::vec4f_t RefMultiplyV4_M4(const uMATH::vec4f_t &v, const uMATH::mat4f_t &m)
+{
+	uMATH::vec4f_t res;
+	res.x = (m.m[0][0] * v.x) + (m.m[0][1] * v.y) + (m.m[0][2] * v.z) + (m.m[0][3] * v.w);
+	res.y = (m.m[1][0] * v.x) + (m.m[1][1] * v.y) + (m.m[1][2] * v.z) + (m.m[1][3] * v.w);
+	res.z = (m.m[2][0] * v.x) + (m.m[2][1] * v.y) + (m.m[2][2] * v.z) + (m.m[2][3] * v.w);
+	res.w = (m.m[3][0] * v.x) + (m.m[3][1] * v.y) + (m.m[3][2] * v.z) + (m.m[3][3] * v.w);
+
+	return res;
+}
+
+
+static void RefMultiplyAF(const uMATH::aff3f_t &a, const uMATH::aff3f_t &b, uMATH::aff3f_t *out)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			float w = (j == 3) ? 1.0f : 0.0f;
+			out->m[i][j] = (a.m[i][0] * b.m[0][j]) + (a.m[i][1] * b.m[1][j]) + (a.m[i][2] * b.m[2][j]) + (a.m[i][3] * w);
+		}
+	}
+}
+
+
+// Random matrix with a dominant diagonal, so it is comfortably invertible
+static void RandomM4(test_rng_t *Rng, uMATH::mat4f_t *Out)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			Out->m[i][j] = Rng->Range(-1.0f, 1.0f) + ((i == j) ? 4.0f : 0.0f);
+		}
+	}
+}
+
+
+static void RandomAF(test_rng_t *Rng, uMATH::aff3f_t *Out)
+{
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			Out->m[i][j] = Rng->Range(-2.0f, 2.0f);
+		}
+	}
+}
+
+
+// Seconds for Passes sweeps of MultiplyM4 (or the reference) over independent pairs
+static double TimeMultiply(bool Reference, const uMATH::mat4f_t *A, const uMATH::mat4f_t *B, uMATH::mat4f_t *Out, uint32_t Pairs,
+	uint32_t Passes, float *Sink)
+{
+	double start = TestSeconds();
+	for (uint32_t p = 0; p < Passes; p++)
+	{
+		if (Reference)
+		{
+			for (uint32_t n = 0; n < Pairs; n++)
+			{
+				RefMultiplyM4(A[n], B[n], &Out[n]);
+			}
+		}
+		else
+		{
+			for (uint32_t n = 0; n < Pairs; n++)
+			{
+				uMATH::MultiplyM4(A[n], B[n], &Out[n]);
+			}
+		}
+		*Sink += Out[p % Pairs].m[3][3];
+	}
+
+	return TestSeconds() - start;
+}
+
+
+// Seconds for Passes composes of every object, batched or through ComposeAF one at a time
+static double TimeCompose(bool Batch, const uMATH::transform_soa_t &In, uMATH::aff3f_t *Out, uint32_t Objects, uint32_t Passes, float *Sink)
+{
+	double start = TestSeconds();
+	for (uint32_t p = 0; p < Passes; p++)
+	{
+		if (Batch)
+		{
+			uMATH::ComposeModelsAF(In, Out, Objects);
+		}
+		else
+		{
+			for (uint32_t i = 0; i < Objects; i++)
+			{
+				uMATH::vec3f_t pos = { In.PosX[i], In.PosY[i], In.PosZ[i] };
+				uMATH::quatf_t q = { In.RotX[i], In.RotY[i], In.RotZ[i], In.RotW[i] };
+				uMATH::ComposeAF(pos, q, In.Scale[i], &Out[i]);
+			}
+		}
+		*Sink += Out[p % Objects].m[0][0];
+	}
+
+	return TestSeconds() - start;
+}
+
+
+int main(int argc, char **argv)
+{
+#if UMATH_SIMD_AVX && defined(__GNUC__)
+	if (!__builtin_cpu_supports("avx"))
+	{
+		printf("uMATH backend: AVX - skipped, this CPU has no AVX\n");
+		return 0;
+	}
+#endif
+
+	int failures = 0;
+	test_rng_t rng = { 0x9E3779B9u };
+
+#if UMATH_SIMD_AVX
+	const char *backend = "AVX";
+#elif UMATH_SIMD_SSE
+	const char *backend = "SSE2";
+#else
+	const char *backend = "scalar";
+#endif
+	printf("uMATH backend: %s\n", backend);
+
+	// Agreement
+
+	const uint32_t checks = 100000;
+	uint32_t mulbad = 0, vecbad = 0, affbad = 0, invbad = 0, composebad = 0;
+	float inverr = 0.0f;
+	for (uint32_t n = 0; n < checks; n++)
+	{
+		uMATH::mat4f_t a, b, got, want;
+		RandomM4(&rng, &a);
+		RandomM4(&rng, &b);
+
+		uMATH::MultiplyM4(a, b, &got);
+		RefMultiplyM4(a, b, &want);
+		mulbad += memcmp(&got, &want, sizeof(got)) != 0;
+
+		uMATH::vec4f_t v = { rng.Range(-5.0f, 5.0f), rng.Range(-5.0f, 5.0f), rng.Range(-5.0f, 5.0f), 1.0f };
+		uMATH::vec4f_t vgot = uMATH::MultiplyV4_M4(v, a);
+		uMATH::vec4f_t vwant = RefMultiplyV4_M4(v, a);
+		vecbad += memcmp(&vgot, &vwant, sizeof(vgot)) != 0;
+
+		uMATH::aff3f_t fa, fb, fgot, fwant;
+		RandomAF(&rng, &fa);
+		RandomAF(&rng, &fb);
+		uMATH::MultiplyAF(fa, fb, &fgot);
+		RefMultiplyAF(fa, fb, &fwant);
+		affbad += memcmp(&fgot, &fwant, sizeof(fgot)) != 0;
+
+		// m * m^-1 should come back as the identity
+		uMATH::mat4f_t inv = uMATH::InverseM4(a);
+		RefMultiplyM4(a, inv, &want);
+		float err = 0.0f;
+		for (int i = 0; i < 4; i++)
+		{
+			for (int j = 0; j < 4; j++)
+			{
+				float e = fabsf(want.m[i][j] - ((i == j) ? 1.0f : 0.0f));
+				err = (e > err) ? e : err;
+			}
+		}
+		invbad += err > 1e-4f;
+		inverr = (err > inverr) ? err : inverr;
+	}
+
+	// Batch compose against ComposeAF, its scalar reference. Odd count so the scalar tail runs too
+	const uint32_t objects = 10007;
+	float *soa = (float*)malloc(8 * objects * sizeof(float));
+	uMATH::aff3f_t *batch = (uMATH::aff3f_t*)malloc(objects * sizeof(uMATH::aff3f_t));
+	uMATH::aff3f_t *single = (uMATH::aff3f_t*)malloc(objects * sizeof(uMATH::aff3f_t));
+	if (!soa || !batch || !single)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+
+	uMATH::transform_soa_t in = { soa, soa + objects, soa + 2 * objects, soa + 3 * objects, soa + 4 * objects,
+		soa + 5 * objects, soa + 6 * objects, soa + 7 * objects };
+	for (uint32_t i = 0; i < objects; i++)
+	{
+		uMATH::vec3f_t axis = { rng.Range(-1.0f, 1.0f), rng.Range(-1.0f, 1.0f), rng.Range(0.1f, 1.0f) };
+		uMATH::quatf_t q = uMATH::QuatFromAxisAngle(rng.Range(0.0f, 180.0f), uMATH::Normalize(axis));
+		soa[i] = rng.Range(-50.0f, 50.0f);
+		soa[objects + i] = rng.Range(-50.0f, 50.0f);
+		soa[2 * objects + i] = rng.Range(-50.0f, 50.0f);
+		soa[3 * objects + i] = q.x;
+		soa[4 * objects + i] = q.y;
+		soa[5 * objects + i] = q.z;
+		soa[6 * objects + i] = q.w;
+		soa[7 * objects + i] = rng.Range(0.1f, 2.5f);
+	}
+
+	uMATH::ComposeModelsAF(in, batch, objects);
+	for (uint32_t i = 0; i < objects; i++)
+	{
+		uMATH::vec3f_t p = { in.PosX[i], in.PosY[i], in.PosZ[i] };
+		uMATH::quatf_t q = { in.RotX[i], in.RotY[i], in.RotZ[i], in.RotW[i] };
+		uMATH::ComposeAF(p, q, in.Scale[i], &single[i]);
+		composebad += memcmp(&batch[i], &single[i], sizeof(uMATH::aff3f_t)) != 0;
+	}
+
+	TEST_CHECK(failures, mulbad == 0, "MultiplyM4 differs from the scalar reference in %u of %u products", mulbad, checks);
+	TEST_CHECK(failures, vecbad == 0, "MultiplyV4_M4 differs from the scalar reference in %u of %u products", vecbad, checks);
+	TEST_CHECK(failures, affbad == 0, "MultiplyAF differs from the scalar reference in %u of %u products", affbad, checks);
+	TEST_CHECK(failures, invbad == 0, "InverseM4 is off by more than 1e-4 in %u of %u inverses (worst %g)", invbad, checks, inverr);
+	TEST_CHECK(failures, composebad == 0, "ComposeModelsAF differs from ComposeAF in %u of %u objects", composebad, objects);
+	printf("Agreement: %u products, %u inverses (worst error %g), %u composed objects checked\n", checks, checks, inverr, objects);
+
+	// Throughput over independent products, so it measures how many the backend gets through rather than the
+	// latency of a dependent chain. Each variant runs once untimed to warm up, then the runs are interleaved and
+	// the best of each kept. Results are folded into a checksum so the compiler can't drop the loops
+
+	const uint32_t pairs = 1024;
+	uMATH::mat4f_t *ma = (uMATH::mat4f_t*)malloc(3 * pairs * sizeof(uMATH::mat4f_t));
+	if (!ma)
+	{
+		printf("FAIL: out of memory\n");
+		return 1;
+	}
+	uMATH::mat4f_t *mb = ma + pairs;
+	uMATH::mat4f_t *mr = mb + pairs;
+	for (uint32_t n = 0; n < pairs; n++)
+	{
+		RandomM4(&rng, &ma[n]);
+		RandomM4(&rng, &mb[n]);
+	}
+
+	uint32_t products = TestScale(argc, argv, 1000000);
+	const uint32_t passes = (products / pairs > 0) ? products / pairs : 1;
+	const uint32_t composes = (products / objects > 0) ? products / objects : 1;
+	const uint32_t runs = 5;
+	double reftime = 1e30, simdtime = 1e30, singletime = 1e30, batchtime = 1e30;
+	float sink = 0.0f;
+	for (uint32_t run = 0; run <= runs; run++)
+	{
+		double t = TimeMultiply(true, ma, mb, mr, pairs, passes, &sink);
+		reftime = (run > 0 && t < reftime) ? t : reftime;
+		t = TimeMultiply(false, ma, mb, mr, pairs, passes, &sink);
+		simdtime = (run > 0 && t < simdtime) ? t : simdtime;
+		t = TimeCompose(false, in, single, objects, composes, &sink);
+		singletime = (run > 0 && t < singletime) ? t : singletime;
+		t = TimeCompose(true, in, batch, objects, composes, &sink);
+		batchtime = (run > 0 && t < batchtime) ? t : batchtime;
+	}
+
+	uint64_t multiplied = (uint64_t)passes * pairs;
+	printf("MultiplyM4: %llu products, best of %u, scalar reference %.1f M/s, %s %.1f M/s\n", (unsigned long long)multiplied, runs,
+		multiplied / reftime * 1e-6, backend, multiplied / simdtime * 1e-6);
+
+	uint64_t composed = (uint64_t)composes * objects;
+	printf("Compose: %llu models, best of %u, ComposeAF one at a time %.1f M/s, ComposeModelsAF %.1f M/s (checksum %g)\n",
+		(unsigned long long)composed, runs, composed / singletime * 1e-6, composed / batchtime * 1e-6, sink);
+
+	free(ma);
+	free(soa);
+	free(batch);
+	free(single);
+
+	return failures != 0;
+}